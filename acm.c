@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+
+#include "usb.h"
+
+#include <sys/stat.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define USB_CLASS_COMM 0x02
+#define USB_CLASS_CDC_DATA 0x0a
+#define USB_CDC_SUBCLASS_ACM 0x02
+#define USB_CDC_PROTO_AT 0x01
+#define USB_DT_CS_INTERFACE 0x24
+
+#define ACM_EP_OUT 1
+#define ACM_EP_IN 2
+#define ACM_EP_NOTIFY 3
+
+/* How many queued URBs a single readv()/writev() may span. */
+#define ACM_BATCH 16
+
+enum {
+    CDC_REQ_SET_LINE_CODING = 0x20,
+    CDC_REQ_GET_LINE_CODING = 0x21,
+    CDC_REQ_SET_CONTROL_LINE_STATE = 0x22,
+    CDC_REQ_SEND_BREAK = 0x23,
+};
+
+struct cdc_line_coding {
+    uint32_t dwDTERate;
+    uint8_t bCharFormat;                 /* 0: 1, 1: 1.5, 2: 2 stop bits */
+    uint8_t bParityType;                 /* none, odd, even, mark, space */
+    uint8_t bDataBits;
+} __attribute__((packed));
+
+struct acm_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor comm;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint16_t bcdCDC;
+    } __attribute__((packed)) header;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint8_t bmCapabilities;
+        uint8_t bDataInterface;
+    } __attribute__((packed)) call;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint8_t bmCapabilities;
+    } __attribute__((packed)) acm;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint8_t bMasterInterface0;
+        uint8_t bSlaveInterface0;
+    } __attribute__((packed)) unio;
+    struct usb_endpoint_descriptor notify;
+    struct usb_interface_descriptor data;
+    struct usb_endpoint_descriptor out;
+    struct usb_endpoint_descriptor in;
+} __attribute__((packed));
+
+/*
+ * Bulk OUT payloads are written to the pty master straight from the URB
+ * they arrived in and bulk IN URBs are filled by reading the master
+ * directly into their buffers, batching every queued URB into one call.
+ */
+struct acm {
+    struct usb_function func;
+    struct loop_watch pty;
+    uint32_t events;
+    int slave;
+    char *link;
+
+    struct cdc_line_coding coding;
+    uint16_t lines;                      /* DTR and RTS */
+};
+
+static void
+acm_poll(struct acm *a)
+{
+    uint32_t events = 0;
+
+    if (!TAILQ_EMPTY(&usb_function_ep(&a->func, USBIP_DIR_IN, ACM_EP_IN)->queue))
+        events |= EPOLLIN;
+    if (!TAILQ_EMPTY(&usb_function_ep(&a->func, USBIP_DIR_OUT, ACM_EP_OUT)->queue))
+        events |= EPOLLOUT;
+
+    if (events != a->events && loop_mod(&a->pty, events) == 0)
+        a->events = events;
+}
+
+static void
+acm_read(struct acm *a)
+{
+    struct usb_ep *ep = usb_function_ep(&a->func, USBIP_DIR_IN, ACM_EP_IN);
+    struct iovec iov[ACM_BATCH];
+    struct urb *urb;
+    int cnt = 0;
+    ssize_t n;
+
+    TAILQ_FOREACH(urb, &ep->queue, entry) {
+        if (cnt == ACM_BATCH)
+            break;
+        iov[cnt++] = (struct iovec) { urb->buf, urb->length };
+    }
+
+    if (cnt == 0)
+        return;
+
+    n = readv(a->pty.fd, iov, cnt);
+    if (n <= 0)
+        return;
+
+    while (n > 0 && (urb = usb_ep_dequeue(ep))) {
+        urb->actual = (size_t) n < urb->length ? (size_t) n : urb->length;
+        n -= urb->actual;
+        usb_urb_done(urb, 0);
+    }
+}
+
+static void
+acm_write(struct acm *a)
+{
+    struct usb_ep *ep = usb_function_ep(&a->func, USBIP_DIR_OUT, ACM_EP_OUT);
+    struct iovec iov[ACM_BATCH];
+    struct urb *urb;
+    int cnt = 0;
+    ssize_t n;
+
+    TAILQ_FOREACH(urb, &ep->queue, entry) {
+        if (cnt == ACM_BATCH)
+            break;
+        iov[cnt++] = (struct iovec) {
+            urb->buf + urb->actual, urb->length - urb->actual
+        };
+    }
+
+    if (cnt == 0)
+        return;
+
+    n = writev(a->pty.fd, iov, cnt);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            usb_ep_flush(ep, EPIPE);
+        return;
+    }
+
+    while ((urb = TAILQ_FIRST(&ep->queue))) {
+        size_t left = urb->length - urb->actual;
+
+        if ((size_t) n < left) {
+            urb->actual += n;
+            break;
+        }
+
+        n -= left;
+        urb->actual = urb->length;
+        usb_urb_done(urb, 0);
+    }
+}
+
+static void
+acm_io(struct loop_watch *w, uint32_t events)
+{
+    struct acm *a = container_of(w, struct acm, pty);
+
+    if (events & EPOLLOUT)
+        acm_write(a);
+    if (events & (EPOLLIN | EPOLLHUP))
+        acm_read(a);
+
+    acm_poll(a);
+}
+
+static void
+acm_submit(struct usb_function *f, struct urb *urb)
+{
+    struct acm *a = (struct acm *) f;
+    bool idle = TAILQ_EMPTY(&urb->ep->queue);
+
+    usb_ep_queue(urb);
+
+    /* The notification endpoint never has anything to say. */
+    if (urb->ep == usb_function_ep(f, USBIP_DIR_IN, ACM_EP_NOTIFY))
+        return;
+
+    /* Try right away; a full or empty pty falls back to polling. */
+    if (idle && urb->dir == USBIP_DIR_OUT)
+        acm_write(a);
+    else if (idle)
+        acm_read(a);
+
+    acm_poll(a);
+}
+
+static void
+acm_termios(struct acm *a)
+{
+    static const struct {
+        uint32_t rate;
+        speed_t speed;
+    } rates[] = {
+        { 300, B300 }, { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 },
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+        { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+        { 460800, B460800 }, { 921600, B921600 }, { 1000000, B1000000 },
+        { 2000000, B2000000 }, { 4000000, B4000000 },
+    };
+    static const tcflag_t sizes[] = { CS5, CS6, CS7, CS8 };
+    uint32_t rate = le32toh(a->coding.dwDTERate);
+    struct termios tio;
+
+    if (tcgetattr(a->slave, &tio) != 0)
+        return;
+
+    for (size_t i = 0; i < sizeof(rates) / sizeof(*rates); i++) {
+        if (rates[i].rate == rate)
+            cfsetspeed(&tio, rates[i].speed);
+    }
+
+    tio.c_cflag &= ~(CSIZE | CSTOPB | PARENB | PARODD | CMSPAR);
+    if (a->coding.bDataBits >= 5 && a->coding.bDataBits <= 8)
+        tio.c_cflag |= sizes[a->coding.bDataBits - 5];
+    if (a->coding.bCharFormat != 0)
+        tio.c_cflag |= CSTOPB;
+
+    switch (a->coding.bParityType) {
+    case 1: tio.c_cflag |= PARENB | PARODD; break;
+    case 2: tio.c_cflag |= PARENB; break;
+    case 3: tio.c_cflag |= PARENB | PARODD | CMSPAR; break;
+    case 4: tio.c_cflag |= PARENB | CMSPAR; break;
+    }
+
+    tcsetattr(a->slave, TCSANOW, &tio);
+}
+
+static int
+acm_setup(struct usb_function *f, struct urb *urb)
+{
+    struct acm *a = (struct acm *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case CDC_REQ_SET_LINE_CODING:
+        if (urb->length < sizeof(a->coding))
+            return EPIPE;
+        memcpy(&a->coding, urb->buf, sizeof(a->coding));
+        urb->actual = sizeof(a->coding);
+        acm_termios(a);
+        return 0;
+
+    case CDC_REQ_GET_LINE_CODING:
+        urb->actual = urb->length < sizeof(a->coding) ? urb->length : sizeof(a->coding);
+        memcpy(urb->buf, &a->coding, urb->actual);
+        return 0;
+
+    case CDC_REQ_SET_CONTROL_LINE_STATE:
+        a->lines = s->wValue & 0x3;
+        return 0;
+
+    case CDC_REQ_SEND_BREAK:
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+acm_destroy(struct usb_function *f)
+{
+    struct acm *a = (struct acm *) f;
+
+    if (a->pty.fd >= 0) {
+        loop_del(&a->pty);
+        close(a->pty.fd);
+    }
+
+    if (a->slave >= 0)
+        close(a->slave);
+
+    if (a->link) {
+        unlink(a->link);
+        free(a->link);
+    }
+
+    free(a);
+}
+
+static const struct usb_function_ops acm_ops = {
+    .setup = acm_setup,
+    .submit = acm_submit,
+    .destroy = acm_destroy,
+};
+
+static int
+acm_pty(struct acm *a, const char *link)
+{
+    struct termios tio;
+    char *name;
+
+    a->pty.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (a->pty.fd < 0)
+        return errno;
+
+    if (grantpt(a->pty.fd) != 0 || unlockpt(a->pty.fd) != 0)
+        return errno;
+
+    name = ptsname(a->pty.fd);
+    if (!name)
+        return errno;
+
+    /* Holding the slave open keeps the master from reporting a hangup. */
+    a->slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (a->slave < 0)
+        return errno;
+
+    if (tcgetattr(a->slave, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(a->slave, TCSANOW, &tio);
+    }
+
+    if (link) {
+        unlink(link);
+        if (symlink(name, link) != 0)
+            return errno;
+
+        a->link = strdup(link);
+        if (!a->link)
+            return ENOMEM;
+    }
+
+    fprintf(stderr, "acm: %s\n", name);
+
+    a->pty.func = acm_io;
+    return loop_add(&a->pty, 0);
+}
+
+static int
+acm_descriptors(struct usb_device *dev, const char *serial)
+{
+    uint16_t mps = dev->speed == USB_SPEED_HIGH ? 512 : 64;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bDeviceClass = USB_CLASS_COMM,
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x0005),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 1,
+    };
+    struct acm_config c = {
+        .config = {
+            .bLength = sizeof(c.config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(c)),
+            .bNumInterfaces = 2,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE,
+            .bMaxPower = 50,
+        },
+        .comm = {
+            .bLength = sizeof(c.comm),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = 0,
+            .bNumEndpoints = 1,
+            .bInterfaceClass = USB_CLASS_COMM,
+            .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
+            .bInterfaceProtocol = USB_CDC_PROTO_AT,
+        },
+        .header = { sizeof(c.header), USB_DT_CS_INTERFACE, 0x00, htole16(0x0110) },
+        .call = { sizeof(c.call), USB_DT_CS_INTERFACE, 0x01, 0x00, 1 },
+        .acm = { sizeof(c.acm), USB_DT_CS_INTERFACE, 0x02, 0x06 },
+        .unio = { sizeof(c.unio), USB_DT_CS_INTERFACE, 0x06, 0, 1 },
+        .notify = {
+            .bLength = sizeof(c.notify),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | ACM_EP_NOTIFY,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = htole16(16),
+            .bInterval = dev->speed == USB_SPEED_HIGH ? 9 : 32,
+        },
+        .data = {
+            .bLength = sizeof(c.data),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = 1,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_CDC_DATA,
+        },
+        .out = {
+            .bLength = sizeof(c.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = ACM_EP_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+        .in = {
+            .bLength = sizeof(c.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | ACM_EP_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+    };
+    int r;
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu CDC-ACM serial");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+static int
+acm_create(struct usb_device *dev, char *opts)
+{
+    enum { LINK, SPEED, SERIAL };
+    char *const tokens[] = {
+        [LINK] = "link", [SPEED] = "speed", [SERIAL] = "serial", NULL
+    };
+    const char *link = NULL, *serial = NULL;
+    struct acm *a;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_HIGH;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case LINK:   link = value; break;
+        case SERIAL: serial = value; break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed != USB_SPEED_FULL && dev->speed != USB_SPEED_HIGH)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return ENOMEM;
+
+    a->pty.fd = -1;
+    a->slave = -1;
+    a->coding = (struct cdc_line_coding) { htole32(115200), 0, 0, 8 };
+    usb_device_function(dev, &a->func, &acm_ops);
+
+    r = acm_descriptors(dev, serial);
+    if (r != 0)
+        return r;
+
+    return acm_pty(a, link);
+}
+
+const struct usb_model usb_model_acm = {
+    .name = "acm",
+    .create = acm_create,
+};
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+
+#include "blk.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The whole image mapped shared, so writes land in the page cache. */
+struct blk_mmap {
+    struct blk blk;
+    int fd;
+    uint8_t *map;
+};
+
+static uint8_t *
+blk_mmap_map(struct blk *b, uint64_t off, size_t len)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    (void) len;
+
+    return m->map + off;
+}
+
+static int
+blk_mmap_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    memcpy(buf, m->map + off, len);
+    return 0;
+}
+
+static int
+blk_mmap_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    memcpy(m->map + off, buf, len);
+    return 0;
+}
+
+static int
+blk_mmap_flush(struct blk *b)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    return msync(m->map, b->size, MS_SYNC) == 0 ? 0 : errno;
+}
+
+/* The map sees the hole at once; its pages read as zeros from then on. */
+static int
+blk_mmap_discard(struct blk *b, uint64_t off, uint64_t len)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) != 0)
+        return errno;
+
+    return 0;
+}
+
+/* The kernel reads the pages in behind our back; faults then find them. */
+static void
+blk_mmap_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+    uint64_t start = off & ~(uint64_t) (sysconf(_SC_PAGESIZE) - 1);
+
+    madvise(m->map + start, off + len - start, MADV_WILLNEED);
+}
+
+/* Stores through the map are in the page cache, which is what gets sent. */
+static int
+blk_mmap_file(struct blk *b, uint64_t off, size_t len, uint64_t *pos)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    (void) len;
+
+    *pos = off;
+    return m->fd;
+}
+
+static void
+blk_mmap_close(struct blk *b)
+{
+    struct blk_mmap *m = (struct blk_mmap *) b;
+
+    munmap(m->map, b->size);
+    close(m->fd);
+    free(m);
+}
+
+static const struct blk_ops blk_mmap_ops = {
+    .map = blk_mmap_map,
+    .read = blk_mmap_read,
+    .write = blk_mmap_write,
+    .flush = blk_mmap_flush,
+    .discard = blk_mmap_discard,
+    .readahead = blk_mmap_readahead,
+    .file = blk_mmap_file,
+    .close = blk_mmap_close,
+};
+
+int
+blk_size(int fd, uint64_t *size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+        return errno;
+
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKGETSIZE64, size) == 0 ? 0 : errno;
+
+    if (!S_ISREG(st.st_mode))
+        return EINVAL;
+
+    *size = st.st_size;
+    return 0;
+}
+
+int
+blk_zero(struct blk *b, uint64_t off, uint64_t len)
+{
+    static const uint8_t zero[64 * 1024];
+    uint64_t n;
+    int e;
+
+    e = blk_discard(b, off, len);
+    if (e != EOPNOTSUPP)
+        return e;
+
+    for (e = 0; e == 0 && len > 0; off += n, len -= n) {
+        n = len < sizeof(zero) ? len : sizeof(zero);
+        e = blk_write(b, zero, off, n);
+    }
+
+    return e;
+}
+
+static int
+blk_mmap_open(int fd, uint64_t size, bool readonly, struct blk **blk)
+{
+    struct blk_mmap *m;
+    int prot = PROT_READ | (readonly ? 0 : PROT_WRITE);
+
+    m = calloc(1, sizeof(*m));
+    if (!m)
+        return ENOMEM;
+
+    m->map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (m->map == MAP_FAILED) {
+        free(m);
+        return errno;
+    }
+
+    m->fd = fd;
+    m->blk.ops = &blk_mmap_ops;
+    m->blk.size = size;
+    m->blk.readonly = readonly;
+    *blk = &m->blk;
+    return 0;
+}
+
+int
+blk_open(const char *path, unsigned int flags, struct blk **blk)
+{
+    bool readonly = flags & BLK_RDONLY;
+    uint64_t size;
+    int fd;
+    int e;
+
+    fd = open(path, (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    e = blk_size(fd, &size);
+    if (e == 0 && size == 0)
+        e = EINVAL;
+
+    /* Compressed images carry their own size, and are never written. */
+    if (e == 0 && blk_zimg_probe(fd))
+        e = blk_zimg_open(fd, size, blk);
+    else if (e == 0 && (flags & BLK_ASYNC))
+        e = blk_uring_open(fd, size, readonly, blk);
+    else if (e == 0)
+        e = blk_mmap_open(fd, size, readonly, blk);
+
+    if (e != 0)
+        close(fd);
+
+    return e;
+}
+
+void
+blk_close(struct blk *b)
+{
+    if (b)
+        b->ops->close(b);
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A disk image behind the SCSI layer. Backends that can expose the image
+ * as memory implement map(), which lets transports hand URB buffers to the
+ * socket straight from (and receive straight into) the image. read() and
+ * write() are the copying fallback for everything else.
+ *
+ * Backends that implement submit() do their I/O asynchronously, so a slow
+ * disk never stalls the event loop: submit() returns EINPROGRESS and calls
+ * done() on the loop thread once the request is over.
+ *
+ * readahead() is told about ranges the host is about to read, so it can
+ * start bringing them into memory without waiting for them.
+ *
+ * file() names the file that holds a range as it stands, as a descriptor
+ * and an offset, for transports to splice it to the socket without
+ * copying it through memory; -1 if there is no such file.
+ *
+ * discard() gives a range's storage back, after which it reads as zeros.
+ * A BLK_DISCARD request zeros its range whichever way the image can: a
+ * hole if discard() makes one, written zeros if not.
+ */
+struct blk;
+
+enum {
+    BLK_READ,
+    BLK_WRITE,
+    BLK_FLUSH,
+    BLK_DISCARD,
+};
+
+#define BLK_RDONLY 0x01
+#define BLK_ASYNC 0x02                   /* io_uring rather than mmap */
+
+struct blk_io {
+    uint8_t op;                          /* BLK_* */
+    void *buf;
+    uint64_t off;
+    size_t len;
+    void (*done)(struct blk_io *io, int err);
+
+    /* Owned by the backend while the request is in flight. */
+    size_t moved;
+    struct blk_io *next;
+};
+
+struct blk_ops {
+    uint8_t *(*map)(struct blk *b, uint64_t off, size_t len);
+    int (*read)(struct blk *b, void *buf, uint64_t off, size_t len);
+    int (*write)(struct blk *b, const void *buf, uint64_t off, size_t len);
+    int (*flush)(struct blk *b);
+    int (*submit)(struct blk *b, struct blk_io *io);
+    void (*readahead)(struct blk *b, uint64_t off, size_t len);
+    int (*file)(struct blk *b, uint64_t off, size_t len, uint64_t *pos);
+    int (*discard)(struct blk *b, uint64_t off, uint64_t len);
+    void (*close)(struct blk *b);
+};
+
+struct blk {
+    const struct blk_ops *ops;
+    uint64_t size;
+    bool readonly;
+};
+
+/* flags are BLK_RDONLY and BLK_ASYNC. */
+int
+blk_open(const char *path, unsigned int flags, struct blk **blk);
+
+/* Bytes in the image file or block device behind fd. */
+int
+blk_size(int fd, uint64_t *size);
+
+/*
+ * cow.c: base, read-only and mapped once for all its users, with writes
+ * going to the overlay file, which is set up if it is empty or missing.
+ */
+int
+blk_cow_open(const char *base, const char *overlay, unsigned int flags,
+             struct blk **blk);
+
+/*
+ * zimg.c: images packed from raw ones with blk_zimg_pack(), read-only and
+ * read through a cache of decompressed chunks. blk_zimg_open() takes fd,
+ * of file bytes, over on success.
+ */
+bool
+blk_zimg_probe(int fd);
+
+int
+blk_zimg_open(int fd, uint64_t file, struct blk **blk);
+
+int
+blk_zimg_pack(const char *raw, const char *path);
+
+/* uring.c, which takes fd over on success. */
+int
+blk_uring_open(int fd, uint64_t size, bool readonly, struct blk **blk);
+
+/*
+ * cache.c: a write-back cache over lower, which it takes over on success.
+ * Write-back starts at background dirty bytes; writes wait beyond max.
+ */
+int
+blk_cache_open(struct blk *lower, size_t max, size_t background,
+               struct blk **blk);
+
+/*
+ * thread.c: a synchronous image, which it takes over on success, run on a
+ * thread of its own, without a mapping and without file().
+ */
+int
+blk_thread_open(struct blk *lower, struct blk **blk);
+
+static inline uint8_t *
+blk_map(struct blk *b, uint64_t off, size_t len)
+{
+    return b->ops->map ? b->ops->map(b, off, len) : NULL;
+}
+
+static inline int
+blk_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    return b->ops->read(b, buf, off, len);
+}
+
+static inline int
+blk_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    return b->readonly ? EROFS : b->ops->write(b, buf, off, len);
+}
+
+static inline int
+blk_flush(struct blk *b)
+{
+    return b->ops->flush ? b->ops->flush(b) : 0;
+}
+
+/* EOPNOTSUPP leaves the range as it was, for the caller to zero. */
+static inline int
+blk_discard(struct blk *b, uint64_t off, uint64_t len)
+{
+    if (b->readonly)
+        return EROFS;
+
+    return b->ops->discard ? b->ops->discard(b, off, len) : EOPNOTSUPP;
+}
+
+/* A hole where the image can make one, zeros written where not. */
+int
+blk_zero(struct blk *b, uint64_t off, uint64_t len);
+
+static inline void
+blk_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    if (b->ops->readahead)
+        b->ops->readahead(b, off, len);
+}
+
+static inline int
+blk_file(struct blk *b, uint64_t off, size_t len, uint64_t *pos)
+{
+    return b->ops->file ? b->ops->file(b, off, len, pos) : -1;
+}
+
+/* Whether discard() can leave holes, for thin provisioning to be offered. */
+static inline bool
+blk_thin(const struct blk *b)
+{
+    return b->ops->discard != NULL && !b->readonly;
+}
+
+static inline bool
+blk_async(const struct blk *b)
+{
+    return b->ops->submit != NULL;
+}
+
+/*
+ * Starts io. Returns EINPROGRESS if done() will be called, otherwise the
+ * result of a request that was carried out on the spot.
+ */
+static inline int
+blk_submit(struct blk *b, struct blk_io *io)
+{
+    if ((io->op == BLK_WRITE || io->op == BLK_DISCARD) && b->readonly)
+        return EROFS;
+
+    if (b->ops->submit)
+        return b->ops->submit(b, io);
+
+    switch (io->op) {
+    case BLK_READ:
+        return blk_read(b, io->buf, io->off, io->len);
+    case BLK_WRITE:
+        return blk_write(b, io->buf, io->off, io->len);
+    case BLK_DISCARD:
+        return blk_zero(b, io->off, io->len);
+    default:
+        return blk_flush(b);
+    }
+}
+
+/* Waits for requests in flight, which complete first. */
+void
+blk_close(struct blk *b);
@@ -0,0 +1,733 @@
+#include "blk.h"
+#include "loop.h"
+
+#include <sys/queue.h>
+#include <sys/timerfd.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_EXTENT_MAX (1024 * 1024)   /* bytes per write-back */
+#define CACHE_EXPIRE_MS 1000             /* dirty data left alone this long */
+
+struct cache;
+
+/* A range of the image newer than what the image holds, or is being sent. */
+struct cache_extent {
+    struct blk_io io;                    /* its write-back */
+    TAILQ_ENTRY(cache_extent) entry;
+    struct cache *c;
+    uint8_t *buf;
+    size_t size;                         /* of buf */
+    uint64_t seq;                        /* oldest write it holds */
+    uint64_t stamp;                      /* once written back */
+};
+
+TAILQ_HEAD(cache_extents, cache_extent);
+
+/* A read that went to the image, to be patched up from the cache. */
+struct cache_read {
+    struct blk_io io;                    /* to the image */
+    TAILQ_ENTRY(cache_read) entry;
+    struct cache *c;
+    struct blk_io *orig;
+    uint64_t stamp;
+};
+
+/*
+ * A write-back cache in front of another image. Writes are copied into
+ * extents and done at once; adjacent writes grow the same extent, so small
+ * ones reach the image as large merged writes. Write-back starts once
+ * background bytes are dirty, once dirty data is CACHE_EXPIRE_MS old, or
+ * for a flush, which completes once every write before it is on the image
+ * and the image itself has been flushed. Writes beyond max dirty bytes
+ * wait for write-back to make room.
+ *
+ * Dirty extents never overlap one another, but may overlap extents being
+ * written back, which they are newer than; those have to land first, so
+ * an extent only goes out once nothing under it is in flight. Extents
+ * that have been written back stay around as long as reads that may have
+ * missed them are in flight, and reads are patched up from all of them,
+ * oldest first.
+ */
+struct cache {
+    struct blk blk;
+    struct blk *lower;
+    struct loop_watch timer;
+    size_t max, background;
+    size_t dirty, busy;                  /* bytes not yet, and being, written */
+    uint64_t seq;                        /* of the last write */
+    uint64_t stamp;
+    int err;                             /* of a write-back, for the next flush */
+    bool armed, expired, closing;
+    bool running, again;
+
+    struct cache_extents dirtyq;         /* by offset */
+    struct cache_extents busyq;
+    struct cache_extents cleanq;         /* in the order they were written */
+    TAILQ_HEAD(, cache_read) reads;      /* in the order they were issued */
+
+    struct blk_io *waiting, **waiting_tail;  /* writes over the limit */
+    struct blk_io *flushes, **flushes_tail;
+};
+
+static void
+cache_run(struct cache *c);
+
+static int
+cache_zero(struct cache *c, uint64_t off, uint64_t len);
+
+static uint64_t
+cache_end(const struct cache_extent *e)
+{
+    return e->io.off + e->io.len;
+}
+
+static bool
+cache_overlaps(const struct cache_extent *e, uint64_t off, uint64_t end)
+{
+    return e->io.off < end && off < cache_end(e);
+}
+
+static void
+cache_extent_free(struct cache_extent *e)
+{
+    free(e->buf);
+    free(e);
+}
+
+static int
+cache_grow(struct cache_extent *e, size_t len)
+{
+    size_t size = e->size ? e->size : 4096;
+    uint8_t *buf;
+
+    if (len <= e->size)
+        return 0;
+
+    while (size < len)
+        size *= 2;
+    if (size > CACHE_EXTENT_MAX && len <= CACHE_EXTENT_MAX)
+        size = CACHE_EXTENT_MAX;
+
+    buf = realloc(e->buf, size);
+    if (!buf)
+        return ENOMEM;
+
+    e->buf = buf;
+    e->size = size;
+    return 0;
+}
+
+static void
+cache_arm(struct cache *c)
+{
+    struct itimerspec its = {
+        .it_value.tv_sec = CACHE_EXPIRE_MS / 1000,
+        .it_value.tv_nsec = CACHE_EXPIRE_MS % 1000 * 1000000,
+    };
+
+    if (c->armed || c->closing)
+        return;
+
+    c->armed = true;
+    timerfd_settime(c->timer.fd, 0, &its, NULL);
+}
+
+/*
+ * Copies a write into the dirty extents: over those it overlaps, at the
+ * end of one it follows while that stays under CACHE_EXTENT_MAX, and into
+ * new ones in the gaps between them.
+ */
+static int
+cache_insert(struct cache *c, const void *buf, uint64_t off, size_t len)
+{
+    const uint8_t *src = buf;
+    uint64_t pos = off, end = off + len;
+    struct cache_extent *e, *n;
+    uint64_t seq = ++c->seq;
+    size_t k;
+
+    e = TAILQ_FIRST(&c->dirtyq);
+    while (e && cache_end(e) < pos)
+        e = TAILQ_NEXT(e, entry);
+
+    while (pos < end) {
+        while (e && cache_end(e) < pos)
+            e = TAILQ_NEXT(e, entry);
+
+        if (e && e->io.off <= pos && pos < cache_end(e)) {
+            k = (end < cache_end(e) ? end : cache_end(e)) - pos;
+            memcpy(e->buf + (pos - e->io.off), src + (pos - off), k);
+            pos += k;
+            continue;
+        }
+
+        /* A gap, up to the next extent or the end of the write. */
+        n = e && e->io.off <= pos ? TAILQ_NEXT(e, entry) : e;
+        if (n && n->io.off == pos) {
+            e = n;
+            continue;
+        }
+        k = (n && n->io.off < end ? n->io.off : end) - pos;
+
+        if (e && cache_end(e) == pos && e->io.len < CACHE_EXTENT_MAX) {
+            if (k > CACHE_EXTENT_MAX - e->io.len)
+                k = CACHE_EXTENT_MAX - e->io.len;
+            if (cache_grow(e, e->io.len + k) != 0)
+                return ENOMEM;
+        } else {
+            if (k > CACHE_EXTENT_MAX)
+                k = CACHE_EXTENT_MAX;
+
+            n = calloc(1, sizeof(*n));
+            if (!n || cache_grow(n, k) != 0) {
+                free(n);
+                return ENOMEM;
+            }
+
+            n->io.op = BLK_WRITE;
+            n->io.off = pos;
+            n->c = c;
+            n->seq = seq;
+            if (e && e->io.off <= pos)
+                TAILQ_INSERT_AFTER(&c->dirtyq, e, n, entry);
+            else if (e)
+                TAILQ_INSERT_BEFORE(e, n, entry);
+            else
+                TAILQ_INSERT_TAIL(&c->dirtyq, n, entry);
+            e = n;
+        }
+
+        memcpy(e->buf + e->io.len, src + (pos - off), k);
+        e->io.len += k;
+        c->dirty += k;
+        pos += k;
+    }
+
+    cache_arm(c);
+    return 0;
+}
+
+/* Copies whatever the cache holds of [off, off + len) over buf. */
+static void
+cache_patch_from(struct cache_extents *q, void *buf, uint64_t off, size_t len)
+{
+    uint64_t end = off + len, from, to;
+    struct cache_extent *e;
+
+    TAILQ_FOREACH(e, q, entry) {
+        if (!cache_overlaps(e, off, end))
+            continue;
+
+        from = e->io.off > off ? e->io.off : off;
+        to = cache_end(e) < end ? cache_end(e) : end;
+        memcpy((uint8_t *) buf + (from - off), e->buf + (from - e->io.off), to - from);
+    }
+}
+
+static void
+cache_patch(struct cache *c, void *buf, uint64_t off, size_t len)
+{
+    cache_patch_from(&c->cleanq, buf, off, len);
+    cache_patch_from(&c->busyq, buf, off, len);
+    cache_patch_from(&c->dirtyq, buf, off, len);
+}
+
+/* Frees written extents that no read in flight can have missed. */
+static void
+cache_prune(struct cache *c)
+{
+    struct cache_read *r = TAILQ_FIRST(&c->reads);
+    struct cache_extent *e;
+
+    while ((e = TAILQ_FIRST(&c->cleanq)) && (!r || e->stamp < r->stamp)) {
+        TAILQ_REMOVE(&c->cleanq, e, entry);
+        cache_extent_free(e);
+    }
+}
+
+static void
+cache_written(struct blk_io *io, int err)
+{
+    struct cache_extent *e = (struct cache_extent *) io;
+    struct cache *c = e->c;
+
+    TAILQ_REMOVE(&c->busyq, e, entry);
+    c->busy -= e->io.len;
+    if (err != 0)
+        c->err = err;
+
+    e->stamp = ++c->stamp;
+    TAILQ_INSERT_TAIL(&c->cleanq, e, entry);
+    cache_prune(c);
+    cache_run(c);
+}
+
+static bool
+cache_blocked(struct cache *c, const struct cache_extent *e)
+{
+    struct cache_extent *b;
+
+    TAILQ_FOREACH(b, &c->busyq, entry) {
+        if (cache_overlaps(b, e->io.off, cache_end(e)))
+            return true;
+    }
+
+    return false;
+}
+
+/* Sends every dirty extent that is not waiting on one in flight. */
+static void
+cache_writeback(struct cache *c)
+{
+    struct cache_extent *e, *next;
+    int r;
+
+    for (e = TAILQ_FIRST(&c->dirtyq); e; e = next) {
+        next = TAILQ_NEXT(e, entry);
+        if (cache_blocked(c, e))
+            continue;
+
+        TAILQ_REMOVE(&c->dirtyq, e, entry);
+        TAILQ_INSERT_TAIL(&c->busyq, e, entry);
+        c->dirty -= e->io.len;
+        c->busy += e->io.len;
+
+        e->io.buf = e->buf;
+        e->io.done = cache_written;
+        r = blk_submit(c->lower, &e->io);
+        if (r != EINPROGRESS)
+            cache_written(&e->io, r);
+    }
+}
+
+/* Whether a write can go into the cache now. */
+static bool
+cache_room(const struct cache *c, size_t len)
+{
+    return c->closing || c->dirty + c->busy == 0 ||
+           c->dirty + c->busy + len <= c->max;
+}
+
+static bool
+cache_synced(const struct cache *c, uint64_t seq)
+{
+    const struct cache_extent *e;
+
+    TAILQ_FOREACH(e, &c->dirtyq, entry) {
+        if (e->seq <= seq)
+            return false;
+    }
+
+    TAILQ_FOREACH(e, &c->busyq, entry) {
+        if (e->seq <= seq)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * A flush whose writes are all on the image goes on to flush the image,
+ * unless a write-back failed since the last one.
+ */
+static int
+cache_flush_start(struct cache *c, struct blk_io *io)
+{
+    int err = c->err;
+
+    c->err = 0;
+    return err != 0 ? err : blk_submit(c->lower, io);
+}
+
+/*
+ * Lets waiting writes in, starts write-back and passes on flushes. done()
+ * callbacks may queue more requests, so it goes round again rather than
+ * nesting.
+ */
+static void
+cache_run(struct cache *c)
+{
+    struct blk_io *io;
+    int err;
+
+    if (c->running) {
+        c->again = true;
+        return;
+    }
+
+    c->running = true;
+    do {
+        c->again = false;
+
+        while ((io = c->waiting) && cache_room(c, io->len)) {
+            c->waiting = io->next;
+            if (!c->waiting)
+                c->waiting_tail = &c->waiting;
+
+            err = cache_insert(c, io->buf, io->off, io->len);
+            io->done(io, err);
+        }
+
+        if (c->flushes || c->waiting || c->expired || c->closing ||
+            c->dirty >= c->background)
+            cache_writeback(c);
+        if (!c->dirty)
+            c->expired = false;
+
+        while ((io = c->flushes) && cache_synced(c, io->moved)) {
+            c->flushes = io->next;
+            if (!c->flushes)
+                c->flushes_tail = &c->flushes;
+
+            err = cache_flush_start(c, io);
+            if (err != EINPROGRESS)
+                io->done(io, err);
+        }
+    } while (c->again);
+    c->running = false;
+}
+
+static void
+cache_expire(struct loop_watch *w, uint32_t events)
+{
+    struct cache *c = (struct cache *) ((char *) w - offsetof(struct cache, timer));
+    uint64_t expirations;
+
+    (void) events;
+
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    c->armed = false;
+    if (c->dirty > 0) {
+        c->expired = true;
+        cache_run(c);
+    }
+    if (c->dirty > 0)
+        cache_arm(c);
+}
+
+static void
+cache_read_done(struct blk_io *io, int err)
+{
+    struct cache_read *r = (struct cache_read *) io;
+    struct cache *c = r->c;
+    struct blk_io *orig = r->orig;
+
+    if (err == 0)
+        cache_patch(c, orig->buf, orig->off, orig->len);
+
+    TAILQ_REMOVE(&c->reads, r, entry);
+    free(r);
+    cache_prune(c);
+    orig->done(orig, err);
+}
+
+static int
+cache_submit(struct blk *b, struct blk_io *io)
+{
+    struct cache *c = (struct cache *) b;
+    struct cache_extent *e;
+    struct cache_read *r;
+    int err;
+
+    switch (io->op) {
+    case BLK_READ:
+        /* All of it in one dirty extent: nothing older can matter. */
+        TAILQ_FOREACH(e, &c->dirtyq, entry) {
+            if (e->io.off <= io->off && io->off + io->len <= cache_end(e)) {
+                memcpy(io->buf, e->buf + (io->off - e->io.off), io->len);
+                return 0;
+            }
+        }
+
+        r = calloc(1, sizeof(*r));
+        if (!r)
+            return ENOMEM;
+
+        r->io = (struct blk_io) {
+            .op = BLK_READ,
+            .buf = io->buf,
+            .off = io->off,
+            .len = io->len,
+            .done = cache_read_done,
+        };
+        r->c = c;
+        r->orig = io;
+        r->stamp = ++c->stamp;
+        TAILQ_INSERT_TAIL(&c->reads, r, entry);
+
+        err = blk_submit(c->lower, &r->io);
+        if (err == EINPROGRESS)
+            return EINPROGRESS;
+
+        if (err == 0)
+            cache_patch(c, io->buf, io->off, io->len);
+        TAILQ_REMOVE(&c->reads, r, entry);
+        free(r);
+        cache_prune(c);
+        return err;
+
+    case BLK_WRITE:
+        if (!c->waiting && cache_room(c, io->len)) {
+            err = cache_insert(c, io->buf, io->off, io->len);
+            cache_run(c);
+            return err;
+        }
+
+        io->next = NULL;
+        *c->waiting_tail = io;
+        c->waiting_tail = &io->next;
+        cache_run(c);
+        return EINPROGRESS;
+
+    case BLK_DISCARD:
+        err = cache_zero(c, io->off, io->len);
+        if (err != 0)
+            return err;
+
+        return blk_submit(c->lower, io);
+
+    default:
+        cache_writeback(c);
+        if (!c->flushes && cache_synced(c, c->seq))
+            return cache_flush_start(c, io);
+
+        io->moved = c->seq;
+        io->next = NULL;
+        *c->flushes_tail = io;
+        c->flushes_tail = &io->next;
+        cache_run(c);
+        return EINPROGRESS;
+    }
+}
+
+static int
+cache_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    struct cache *c = (struct cache *) b;
+    int err;
+
+    err = blk_read(c->lower, buf, off, len);
+    if (err == 0)
+        cache_patch(c, buf, off, len);
+
+    return err;
+}
+
+static int
+cache_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    struct cache *c = (struct cache *) b;
+    int err;
+
+    err = cache_insert(c, buf, off, len);
+    cache_run(c);
+    return err;
+}
+
+/*
+ * Writes the dirty extents straight through. Those behind a write-back
+ * still in flight cannot overtake it; they go out when it is done.
+ */
+static int
+cache_flush(struct blk *b)
+{
+    struct cache *c = (struct cache *) b;
+    struct cache_extent *e, *next;
+    int err = c->err;
+    int r;
+
+    for (e = TAILQ_FIRST(&c->dirtyq); e; e = next) {
+        next = TAILQ_NEXT(e, entry);
+        if (cache_blocked(c, e))
+            continue;
+
+        r = blk_write(c->lower, e->buf, e->io.off, e->io.len);
+        if (err == 0)
+            err = r;
+
+        TAILQ_REMOVE(&c->dirtyq, e, entry);
+        c->dirty -= e->io.len;
+        cache_extent_free(e);
+    }
+
+    c->err = 0;
+    return err != 0 ? err : blk_flush(c->lower);
+}
+
+static void
+cache_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    struct cache *c = (struct cache *) b;
+
+    blk_readahead(c->lower, off, len);
+}
+
+/*
+ * Finds the first stretch of [off, end) the cache holds newer data for
+ * than the image, up to the end of the extent holding it.
+ */
+static bool
+cache_held(const struct cache *c, uint64_t off, uint64_t end, uint64_t *from,
+           uint64_t *to)
+{
+    const struct cache_extents *queues[] = { &c->dirtyq, &c->busyq };
+    struct cache_extent *e;
+    bool found = false;
+
+    for (size_t i = 0; i < 2; i++) {
+        TAILQ_FOREACH(e, queues[i], entry) {
+            uint64_t start = e->io.off > off ? e->io.off : off;
+
+            if (!cache_overlaps(e, off, end) || (found && start >= *from))
+                continue;
+
+            *from = start;
+            *to = cache_end(e) < end ? cache_end(e) : end;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+static int
+cache_file(struct blk *b, uint64_t off, size_t len, uint64_t *pos)
+{
+    struct cache *c = (struct cache *) b;
+    uint64_t from, to;
+
+    if (cache_held(c, off, off + len, &from, &to))
+        return -1;
+
+    return blk_file(c->lower, off, len, pos);
+}
+
+/*
+ * What the cache holds of a range the image is giving back would come
+ * back over it on write-back, so that is overwritten with zeros, which
+ * queue behind any write-back in flight as writes do.
+ */
+static int
+cache_zero(struct cache *c, uint64_t off, uint64_t len)
+{
+    static const uint8_t zero[64 * 1024];
+    uint64_t end = off + len, from, to, n;
+    int err = 0;
+
+    while (err == 0 && off < end && cache_held(c, off, end, &from, &to)) {
+        for (; err == 0 && from < to; from += n) {
+            n = to - from < sizeof(zero) ? to - from : sizeof(zero);
+            err = cache_insert(c, zero, from, n);
+        }
+        off = to;
+    }
+
+    cache_run(c);
+    return err;
+}
+
+static int
+cache_discard(struct blk *b, uint64_t off, uint64_t len)
+{
+    struct cache *c = (struct cache *) b;
+    int err;
+
+    err = blk_discard(c->lower, off, len);
+    if (err == 0)
+        err = cache_zero(c, off, len);
+
+    return err;
+}
+
+static void
+cache_free_queue(struct cache_extents *q)
+{
+    struct cache_extent *e;
+
+    while ((e = TAILQ_FIRST(q))) {
+        TAILQ_REMOVE(q, e, entry);
+        cache_extent_free(e);
+    }
+}
+
+/* Everything still dirty goes out while the image drains. */
+static void
+cache_close(struct blk *b)
+{
+    struct cache *c = (struct cache *) b;
+
+    c->closing = true;
+    cache_run(c);
+    blk_close(c->lower);
+
+    loop_del(&c->timer);
+    close(c->timer.fd);
+    cache_free_queue(&c->dirtyq);
+    cache_free_queue(&c->busyq);
+    cache_free_queue(&c->cleanq);
+    free(c);
+}
+
+static const struct blk_ops cache_ops = {
+    .read = cache_read,
+    .write = cache_write,
+    .flush = cache_flush,
+    .discard = cache_discard,
+    .submit = cache_submit,
+    .readahead = cache_readahead,
+    .file = cache_file,
+    .close = cache_close,
+};
+
+int
+blk_cache_open(struct blk *lower, size_t max, size_t background,
+               struct blk **blk)
+{
+    struct cache *c;
+    int e;
+
+    if (max == 0 || background == 0 || background > max)
+        return EINVAL;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return ENOMEM;
+
+    c->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (c->timer.fd < 0) {
+        e = errno;
+        free(c);
+        return e;
+    }
+
+    c->timer.func = cache_expire;
+    e = loop_add(&c->timer, EPOLLIN);
+    if (e != 0) {
+        close(c->timer.fd);
+        free(c);
+        return e;
+    }
+
+    c->lower = lower;
+    c->max = max;
+    c->background = background;
+    TAILQ_INIT(&c->dirtyq);
+    TAILQ_INIT(&c->busyq);
+    TAILQ_INIT(&c->cleanq);
+    TAILQ_INIT(&c->reads);
+    c->waiting_tail = &c->waiting;
+    c->flushes_tail = &c->flushes;
+
+    c->blk.ops = &cache_ops;
+    c->blk.size = lower->size;
+    c->blk.readonly = lower->readonly;
+    *blk = &c->blk;
+    return 0;
+}
@@ -0,0 +1,739 @@
+#include "token.h"
+#include "usb.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define USB_CLASS_CSCID 0x0b
+#define USB_DT_CCID 0x21
+
+#define CCID_EP_OUT 1
+#define CCID_EP_IN 2
+#define CCID_EP_NOTIFY 3
+
+#define CCID_HDR 10
+#define CCID_MAX_MSG 271                 /* a short APDU and the header */
+#define CCID_MAX_DATA (CCID_MAX_MSG - CCID_HDR)
+#define CCID_MAX_APDU (4 + 3 + 65535 + 2)
+
+#define CCID_CLOCK 3580                  /* kHz */
+#define CCID_RATE 9600                   /* bps */
+
+/* dwFeatures: automatic everything, extended APDU level exchanges. */
+#define CCID_FEATURES 0x000400fe
+
+enum {
+    PC_TO_RDR_SET_PARAMETERS = 0x61,
+    PC_TO_RDR_ICC_POWER_ON = 0x62,
+    PC_TO_RDR_ICC_POWER_OFF = 0x63,
+    PC_TO_RDR_GET_SLOT_STATUS = 0x65,
+    PC_TO_RDR_SECURE = 0x69,
+    PC_TO_RDR_T0_APDU = 0x6a,
+    PC_TO_RDR_ESCAPE = 0x6b,
+    PC_TO_RDR_GET_PARAMETERS = 0x6c,
+    PC_TO_RDR_RESET_PARAMETERS = 0x6d,
+    PC_TO_RDR_ICC_CLOCK = 0x6e,
+    PC_TO_RDR_XFR_BLOCK = 0x6f,
+    PC_TO_RDR_MECHANICAL = 0x71,
+    PC_TO_RDR_ABORT = 0x72,
+    PC_TO_RDR_SET_DATA_RATE = 0x73,
+};
+
+enum {
+    RDR_TO_PC_NOTIFY_SLOT_CHANGE = 0x50,
+    RDR_TO_PC_DATA_BLOCK = 0x80,
+    RDR_TO_PC_SLOT_STATUS = 0x81,
+    RDR_TO_PC_PARAMETERS = 0x82,
+    RDR_TO_PC_ESCAPE = 0x83,
+    RDR_TO_PC_DATA_RATE = 0x84,
+};
+
+enum {
+    CCID_REQ_ABORT = 0x01,
+    CCID_REQ_GET_CLOCK_FREQUENCIES = 0x02,
+    CCID_REQ_GET_DATA_RATES = 0x03,
+};
+
+/* bStatus */
+#define CCID_ICC_ACTIVE 0x00
+#define CCID_ICC_INACTIVE 0x01
+#define CCID_ICC_ABSENT 0x02
+#define CCID_FAILED 0x40
+
+/* bError: an offset into the command, or one of these. */
+#define CCID_ERR_NOT_SUPPORTED 0x00
+#define CCID_ERR_LENGTH 1
+#define CCID_ERR_SLOT 5
+#define CCID_ERR_LEVEL 7
+#define CCID_ERR_XFR_OVERRUN 0xfc
+#define CCID_ERR_ICC_MUTE 0xfe
+
+/* wLevelParameter and bChainParameter */
+enum {
+    CCID_CHAIN_NONE = 0x00,
+    CCID_CHAIN_BEGIN = 0x01,
+    CCID_CHAIN_END = 0x02,
+    CCID_CHAIN_MIDDLE = 0x03,
+    CCID_CHAIN_MORE = 0x10,
+};
+
+struct ccid_class_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdCCID;
+    uint8_t bMaxSlotIndex;
+    uint8_t bVoltageSupport;
+    uint32_t dwProtocols;
+    uint32_t dwDefaultClock;
+    uint32_t dwMaximumClock;
+    uint8_t bNumClockSupported;
+    uint32_t dwDataRate;
+    uint32_t dwMaxDataRate;
+    uint8_t bNumDataRatesSupported;
+    uint32_t dwMaxIFSD;
+    uint32_t dwSynchProtocols;
+    uint32_t dwMechanical;
+    uint32_t dwFeatures;
+    uint32_t dwMaxCCIDMessageLength;
+    uint8_t bClassGetResponse;
+    uint8_t bClassEnvelope;
+    uint16_t wLcdLayout;
+    uint8_t bPINSupport;
+    uint8_t bMaxCCIDBusySlots;
+} __attribute__((packed));
+
+struct ccid_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor intf;
+    struct ccid_class_descriptor ccid;
+    struct usb_endpoint_descriptor out;
+    struct usb_endpoint_descriptor in;
+    struct usb_endpoint_descriptor notify;
+} __attribute__((packed));
+
+/* T=1, no historical bytes. */
+static const uint8_t ccid_atr[] = { 0x3b, 0x80, 0x80, 0x01, 0x01 };
+
+/* bmFindexDindex, bmTCCKST1, bGuardTimeT1, bWaitingIntegerT1, bClockStop,
+ * bIFSC, bNadValue */
+static const uint8_t ccid_t1[] = { 0x11, 0x10, 0x00, 0x45, 0x00, 0xfe, 0x00 };
+
+struct ccid_stats {
+    uint64_t apdus;
+    uint64_t chained;                    /* spanning several messages */
+    uint64_t ns_sum;                     /* command in to response out */
+    uint64_t ns_max;
+    uint32_t chain_peak;                 /* bytes */
+};
+
+/*
+ * A single slot reader with a token always inserted. The exchange level is
+ * the extended APDU: an APDU that fits in one message is handed to the
+ * token straight from the bulk OUT URB it arrived in, and the response is
+ * sent from wherever the token left it, behind a header built here, with
+ * no copy. Only a command APDU chained over several messages is gathered
+ * in chain, which is allocated for it and freed once it has run; a long
+ * response is sent in slices, one per continuation the host asks for.
+ *
+ * Each command's response waits in hdr, data and sw until the host reads
+ * bulk IN, so a reader with nothing in flight costs only this structure.
+ */
+struct ccid {
+    struct usb_function func;
+    struct token token;
+
+    bool powered;
+    bool notified;                       /* slot state sent on the interrupt ep */
+
+    bool pending;                        /* a response is waiting for bulk IN */
+    uint8_t hdr[CCID_HDR];
+    const uint8_t *data;
+    uint32_t len;
+    uint8_t sw[2];
+    uint8_t swlen;
+    uint32_t pos;                        /* bytes of data and sw sent */
+    uint8_t rate[8];
+    uint8_t change[2];
+
+    uint8_t *chain;
+    uint32_t chainlen;
+    uint32_t chainsize;
+    bool chaining;                       /* the APDU spans messages */
+
+    uint64_t start;                      /* ns, the APDU arrived */
+    struct ccid_stats stats;
+};
+
+static uint64_t
+ccid_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint8_t
+ccid_reply_type(uint8_t cmd)
+{
+    switch (cmd) {
+    case PC_TO_RDR_ICC_POWER_ON:
+    case PC_TO_RDR_XFR_BLOCK:
+    case PC_TO_RDR_SECURE:
+        return RDR_TO_PC_DATA_BLOCK;
+    case PC_TO_RDR_GET_PARAMETERS:
+    case PC_TO_RDR_RESET_PARAMETERS:
+    case PC_TO_RDR_SET_PARAMETERS:
+        return RDR_TO_PC_PARAMETERS;
+    case PC_TO_RDR_ESCAPE:
+        return RDR_TO_PC_ESCAPE;
+    case PC_TO_RDR_SET_DATA_RATE:
+        return RDR_TO_PC_DATA_RATE;
+    default:
+        return RDR_TO_PC_SLOT_STATUS;
+    }
+}
+
+/* Starts the response to cmd, without a body. */
+static void
+ccid_reply(struct ccid *c, const uint8_t *cmd)
+{
+    memset(c->hdr, 0, sizeof(c->hdr));
+    c->hdr[0] = ccid_reply_type(cmd[0]);
+    c->hdr[5] = cmd[5];
+    c->hdr[6] = cmd[6];
+    c->hdr[7] = c->powered ? CCID_ICC_ACTIVE : CCID_ICC_INACTIVE;
+
+    c->pending = true;
+    c->data = NULL;
+    c->len = 0;
+    c->swlen = 0;
+    c->pos = 0;
+}
+
+static void
+ccid_fail(struct ccid *c, const uint8_t *cmd, uint8_t error)
+{
+    ccid_reply(c, cmd);
+    c->hdr[7] |= CCID_FAILED;
+    c->hdr[8] = error;
+}
+
+static void
+ccid_body(struct ccid *c, const void *data, uint32_t len)
+{
+    c->data = data;
+    c->len = len;
+}
+
+static void
+ccid_unchain(struct ccid *c)
+{
+    free(c->chain);
+    c->chain = NULL;
+    c->chainlen = c->chainsize = 0;
+    c->chaining = false;
+}
+
+static int
+ccid_append(struct ccid *c, const uint8_t *data, uint32_t len)
+{
+    uint32_t size = c->chainsize ? c->chainsize : 512;
+    uint8_t *p;
+
+    if (c->chainlen + len > CCID_MAX_APDU)
+        return EOVERFLOW;
+
+    while (size < c->chainlen + len)
+        size *= 2;
+
+    if (size != c->chainsize) {
+        p = realloc(c->chain, size);
+        if (!p)
+            return ENOMEM;
+        c->chain = p;
+        c->chainsize = size;
+        if (size > c->stats.chain_peak)
+            c->stats.chain_peak = size;
+    }
+
+    memcpy(c->chain + c->chainlen, data, len);
+    c->chainlen += len;
+    return 0;
+}
+
+static void
+ccid_apdu(struct ccid *c, const uint8_t *cmd, const uint8_t *apdu,
+          uint32_t len)
+{
+    struct token_resp resp;
+
+    token_apdu(&c->token, apdu, len, &resp);
+
+    ccid_reply(c, cmd);
+    ccid_body(c, resp.data, resp.len);
+    c->sw[0] = resp.sw >> 8;
+    c->sw[1] = resp.sw;
+    c->swlen = 2;
+
+    c->stats.apdus++;
+    if (c->chaining || resp.len + 2 > CCID_MAX_DATA)
+        c->stats.chained++;
+}
+
+/* An APDU, a piece of one, or the host asking for more of a response. */
+static void
+ccid_xfr(struct ccid *c, const uint8_t *cmd, const uint8_t *data,
+         uint32_t len)
+{
+    uint16_t level = cmd[7] | cmd[8] << 8;
+    uint32_t total = c->len + c->swlen;
+
+    if (!c->powered) {
+        ccid_fail(c, cmd, CCID_ERR_ICC_MUTE);
+        return;
+    }
+
+    if (level == CCID_CHAIN_MORE) {
+        if (c->pos == 0 || c->pos >= total || c->chaining) {
+            ccid_fail(c, cmd, CCID_ERR_LEVEL);
+            return;
+        }
+
+        c->hdr[6] = cmd[6];
+        c->pending = true;
+        return;
+    }
+
+    if (level == CCID_CHAIN_NONE || level == CCID_CHAIN_BEGIN)
+        c->start = ccid_now();
+
+    switch (level) {
+    case CCID_CHAIN_NONE:
+        ccid_unchain(c);
+        ccid_apdu(c, cmd, data, len);
+        return;
+
+    case CCID_CHAIN_BEGIN:
+        ccid_unchain(c);
+        c->chaining = true;
+        /* fall through */
+    case CCID_CHAIN_MIDDLE:
+    case CCID_CHAIN_END:
+        if (!c->chaining) {
+            ccid_fail(c, cmd, CCID_ERR_LEVEL);
+            return;
+        }
+
+        if (ccid_append(c, data, len) != 0) {
+            ccid_unchain(c);
+            ccid_fail(c, cmd, CCID_ERR_XFR_OVERRUN);
+            return;
+        }
+
+        if (level != CCID_CHAIN_END) {
+            ccid_reply(c, cmd);
+            c->hdr[9] = CCID_CHAIN_MORE;
+            return;
+        }
+
+        ccid_apdu(c, cmd, c->chain, c->chainlen);
+        ccid_unchain(c);
+        return;
+
+    default:
+        ccid_fail(c, cmd, CCID_ERR_LEVEL);
+        return;
+    }
+}
+
+static void
+ccid_command(struct ccid *c, const uint8_t *cmd, uint32_t len)
+{
+    uint32_t dwlen = cmd[1] | cmd[2] << 8 | cmd[3] << 16 | (uint32_t) cmd[4] << 24;
+    const uint8_t *data = cmd + CCID_HDR;
+
+    if (dwlen > len - CCID_HDR) {
+        ccid_fail(c, cmd, CCID_ERR_LENGTH);
+        return;
+    }
+
+    if (cmd[5] != 0) {
+        ccid_fail(c, cmd, CCID_ERR_SLOT);
+        c->hdr[7] = CCID_FAILED | CCID_ICC_ABSENT;
+        return;
+    }
+
+    switch (cmd[0]) {
+    case PC_TO_RDR_ICC_POWER_ON:
+        c->powered = true;
+        token_reset(&c->token);
+        ccid_unchain(c);
+        ccid_reply(c, cmd);
+        ccid_body(c, ccid_atr, sizeof(ccid_atr));
+        break;
+
+    case PC_TO_RDR_ICC_POWER_OFF:
+        c->powered = false;
+        token_reset(&c->token);
+        ccid_unchain(c);
+        ccid_reply(c, cmd);
+        break;
+
+    case PC_TO_RDR_XFR_BLOCK:
+        ccid_xfr(c, cmd, data, dwlen);
+        break;
+
+    case PC_TO_RDR_SET_PARAMETERS:
+        if (cmd[7] != 1) {
+            ccid_fail(c, cmd, CCID_ERR_LEVEL);
+            break;
+        }
+        /* fall through */
+    case PC_TO_RDR_GET_PARAMETERS:
+    case PC_TO_RDR_RESET_PARAMETERS:
+        ccid_reply(c, cmd);
+        ccid_body(c, ccid_t1, sizeof(ccid_t1));
+        c->hdr[9] = 1;                   /* T=1 */
+        break;
+
+    case PC_TO_RDR_SET_DATA_RATE:
+        ccid_reply(c, cmd);
+        c->rate[0] = CCID_CLOCK & 0xff;
+        c->rate[1] = CCID_CLOCK >> 8;
+        c->rate[2] = c->rate[3] = 0;
+        c->rate[4] = CCID_RATE & 0xff;
+        c->rate[5] = CCID_RATE >> 8;
+        c->rate[6] = c->rate[7] = 0;
+        ccid_body(c, c->rate, sizeof(c->rate));
+        break;
+
+    case PC_TO_RDR_ABORT:
+        ccid_unchain(c);
+        /* fall through */
+    case PC_TO_RDR_GET_SLOT_STATUS:
+    case PC_TO_RDR_ICC_CLOCK:
+        ccid_reply(c, cmd);
+        break;
+
+    default:
+        ccid_fail(c, cmd, CCID_ERR_NOT_SUPPORTED);
+        break;
+    }
+}
+
+/* The waiting response, or the next slice of it, into a bulk IN URB. */
+static void
+ccid_flush(struct ccid *c)
+{
+    struct usb_ep *ep = usb_function_ep(&c->func, USBIP_DIR_IN, CCID_EP_IN);
+    uint32_t total = c->len + c->swlen, n, d;
+    struct urb *urb;
+    bool first, last;
+
+    if (!c->pending || !(urb = usb_ep_dequeue(ep)))
+        return;
+
+    if (urb->length < CCID_HDR) {
+        usb_urb_done(urb, EOVERFLOW);
+        return;
+    }
+
+    n = total - c->pos;
+    if (n > CCID_MAX_DATA)
+        n = CCID_MAX_DATA;
+    if (n > urb->length - CCID_HDR)
+        n = urb->length - CCID_HDR;
+
+    first = c->pos == 0;
+    last = c->pos + n == total;
+    if (!first || !last)
+        c->hdr[9] = first ? CCID_CHAIN_BEGIN : last ? CCID_CHAIN_END
+                                                    : CCID_CHAIN_MIDDLE;
+
+    c->hdr[1] = n;
+    c->hdr[2] = n >> 8;
+    c->hdr[3] = n >> 16;
+    c->hdr[4] = n >> 24;
+
+    urb->iov[urb->iovcnt++] = (struct iovec) { c->hdr, CCID_HDR };
+    d = c->pos < c->len ? c->len - c->pos : 0;
+    if (d > n)
+        d = n;
+    if (d > 0)
+        urb->iov[urb->iovcnt++] = (struct iovec) { (void *) (c->data + c->pos), d };
+    if (n > d)
+        urb->iov[urb->iovcnt++] = (struct iovec) {
+            c->sw + (c->pos + d - c->len), n - d
+        };
+
+    urb->actual = CCID_HDR + n;
+    c->pos += n;
+    c->pending = false;
+
+    if (last && c->swlen) {
+        uint64_t ns = ccid_now() - c->start;
+
+        c->stats.ns_sum += ns;
+        if (ns > c->stats.ns_max)
+            c->stats.ns_max = ns;
+    }
+
+    usb_urb_done(urb, 0);
+}
+
+/* The card is always in: say so once, then the interrupt ep stays quiet. */
+static void
+ccid_notify(struct ccid *c)
+{
+    struct usb_ep *ep = usb_function_ep(&c->func, USBIP_DIR_IN, CCID_EP_NOTIFY);
+    struct urb *urb;
+
+    if (c->notified || !(urb = usb_ep_dequeue(ep)))
+        return;
+
+    c->change[0] = RDR_TO_PC_NOTIFY_SLOT_CHANGE;
+    c->change[1] = 0x03;                 /* present, changed */
+    urb->actual = urb->length < sizeof(c->change) ? urb->length : sizeof(c->change);
+    urb->iov[urb->iovcnt++] = (struct iovec) { c->change, urb->actual };
+    c->notified = true;
+    usb_urb_done(urb, 0);
+}
+
+static void
+ccid_submit(struct usb_function *f, struct urb *urb)
+{
+    struct ccid *c = (struct ccid *) f;
+
+    if (urb->ep == usb_function_ep(f, USBIP_DIR_OUT, CCID_EP_OUT)) {
+        if (urb->length < CCID_HDR) {
+            usb_urb_done(urb, EPIPE);
+            return;
+        }
+
+        ccid_command(c, urb->buf, urb->length);
+        urb->actual = urb->length;
+        usb_urb_done(urb, 0);
+        ccid_flush(c);
+        return;
+    }
+
+    usb_ep_queue(urb);
+    if (urb->ep == usb_function_ep(f, USBIP_DIR_IN, CCID_EP_IN))
+        ccid_flush(c);
+    else
+        ccid_notify(c);
+}
+
+static int
+ccid_setup(struct usb_function *f, struct urb *urb)
+{
+    const struct usbip_submit_setup *s = &urb->setup;
+    uint32_t value;
+
+    (void) f;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case CCID_REQ_ABORT:
+        return 0;
+
+    case CCID_REQ_GET_CLOCK_FREQUENCIES:
+    case CCID_REQ_GET_DATA_RATES:
+        value = htole32(s->bRequest == CCID_REQ_GET_DATA_RATES ? CCID_RATE
+                                                               : CCID_CLOCK);
+        urb->actual = urb->length < sizeof(value) ? urb->length : sizeof(value);
+        memcpy(urb->buf, &value, urb->actual);
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+ccid_disable(struct usb_function *f)
+{
+    struct ccid *c = (struct ccid *) f;
+
+    c->powered = false;
+    c->notified = false;
+    c->pending = false;
+    token_reset(&c->token);
+    ccid_unchain(c);
+}
+
+static void
+ccid_destroy(struct usb_function *f)
+{
+    struct ccid *c = (struct ccid *) f;
+    const struct ccid_stats *st = &c->stats;
+
+    if (st->apdus > 0)
+        fprintf(stderr, "ccid: %llu apdus, %llu chained, latency mean %llu us "
+                "max %llu us, %zu bytes plus %u for chaining\n",
+                (unsigned long long) st->apdus, (unsigned long long) st->chained,
+                (unsigned long long) (st->ns_sum / st->apdus / 1000),
+                (unsigned long long) (st->ns_max / 1000), sizeof(*c),
+                st->chain_peak);
+
+    ccid_unchain(c);
+    token_destroy(&c->token);
+    free(c);
+}
+
+static const struct usb_function_ops ccid_ops = {
+    .setup = ccid_setup,
+    .submit = ccid_submit,
+    .disable = ccid_disable,
+    .destroy = ccid_destroy,
+};
+
+static int
+ccid_descriptors(struct usb_device *dev, const char *serial)
+{
+    uint16_t mps = dev->speed == USB_SPEED_HIGH ? 512 : 64;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x000b),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 1,
+    };
+    struct ccid_config c = {
+        .config = {
+            .bLength = sizeof(c.config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(c)),
+            .bNumInterfaces = 1,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE,
+            .bMaxPower = 50,
+        },
+        .intf = {
+            .bLength = sizeof(c.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 3,
+            .bInterfaceClass = USB_CLASS_CSCID,
+        },
+        .ccid = {
+            .bLength = sizeof(c.ccid),
+            .bDescriptorType = USB_DT_CCID,
+            .bcdCCID = htole16(0x0110),
+            .bVoltageSupport = 0x07,     /* 5, 3 and 1.8 V */
+            .dwProtocols = htole32(0x02),
+            .dwDefaultClock = htole32(CCID_CLOCK),
+            .dwMaximumClock = htole32(CCID_CLOCK),
+            .dwDataRate = htole32(CCID_RATE),
+            .dwMaxDataRate = htole32(CCID_RATE),
+            .dwMaxIFSD = htole32(254),
+            .dwFeatures = htole32(CCID_FEATURES),
+            .dwMaxCCIDMessageLength = htole32(CCID_MAX_MSG),
+            .bClassGetResponse = 0xff,
+            .bClassEnvelope = 0xff,
+            .bMaxCCIDBusySlots = 1,
+        },
+        .out = {
+            .bLength = sizeof(c.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = CCID_EP_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+        .in = {
+            .bLength = sizeof(c.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | CCID_EP_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+        .notify = {
+            .bLength = sizeof(c.notify),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | CCID_EP_NOTIFY,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = htole16(8),
+            .bInterval = dev->speed == USB_SPEED_HIGH ? 8 : 16,
+        },
+    };
+    int r;
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu CCID reader");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+static int
+ccid_create(struct usb_device *dev, char *opts)
+{
+    enum { KEY, PIN, DATA, SPEED, SERIAL };
+    char *const tokens[] = {
+        [KEY] = "key", [PIN] = "pin", [DATA] = "data", [SPEED] = "speed",
+        [SERIAL] = "serial", NULL
+    };
+    const char *key = NULL, *pin = "123456", *data = NULL, *serial = NULL;
+    struct ccid *c;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_FULL;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case KEY:    key = value; break;
+        case PIN:    pin = value; break;
+        case DATA:   data = value; break;
+        case SERIAL: serial = value; break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed != USB_SPEED_FULL && dev->speed != USB_SPEED_HIGH)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    if (!key || !pin)
+        return EINVAL;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return ENOMEM;
+
+    usb_device_function(dev, &c->func, &ccid_ops);
+
+    r = token_init(&c->token, key, pin, data);
+    if (r != 0)
+        return r;
+
+    return ccid_descriptors(dev, serial);
+}
+
+const struct usb_model usb_model_ccid = {
+    .name = "ccid",
+    .create = ccid_create,
+};
@@ -0,0 +1,338 @@
+#include "composite.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USB_CLASS_COMM 0x02
+#define USB_CLASS_VIDEO 0x0e
+#define USB_CLASS_MISC 0xef
+#define USB_DT_CS_INTERFACE 0x24
+
+#define COMPOSITE_MAX_CONFIG 4096
+
+/*
+ * A composite device lays the first configuration of each part out one
+ * after the other. Interface numbers are shifted past those of the parts
+ * before, endpoints renumbered in order of appearance and strings moved to
+ * free indices; a part with several interfaces and no association of its
+ * own gets an IAD so the host binds them to one driver.
+ *
+ * The functions keep their own numbering. The core routes ep0 requests by
+ * interface or endpoint and endpoints by number through per-device tables,
+ * and translates back through the map each function carries.
+ */
+struct composite {
+    struct usb_device *dev;
+    uint8_t buf[COMPOSITE_MAX_CONFIG];
+    size_t len;
+    uint8_t intfs;
+    uint8_t eps[2];                      /* last endpoint given out */
+    uint8_t strings;                     /* last string index given out */
+    bool iad;
+};
+
+/* Moves a part's string to the next free index. */
+static int
+composite_string(struct composite *c, struct usb_device *part, uint8_t *index)
+{
+    const struct usb_desc *s = part->strings[*index];
+    int r;
+
+    if (*index == 0)
+        return 0;
+    if (!s || !s->buf)
+        return EINVAL;
+    if (c->strings == USB_MAX_STRINGS - 1)
+        return ENOSPC;
+
+    r = usb_device_desc(c->dev, USB_DT_STRING, c->strings + 1, s->buf, s->len);
+    if (r != 0)
+        return r;
+
+    *index = ++c->strings;
+    return 0;
+}
+
+static int
+composite_ep(struct composite *c, struct usb_function *f, uint8_t *addr)
+{
+    uint8_t dir = *addr & USB_ENDPOINT_DIR_IN ? USBIP_DIR_IN : USBIP_DIR_OUT;
+    uint8_t num = *addr & 0x0f;
+
+    if (num == 0)
+        return EINVAL;
+
+    if (f->ep[dir][num] == 0) {
+        if (c->eps[dir] == USB_MAX_ENDPOINTS - 1)
+            return ENOSPC;
+        f->ep[dir][num] = ++c->eps[dir];
+    }
+
+    *addr = (*addr & ~0x0f) | f->ep[dir][num];
+    return 0;
+}
+
+/* Renumbers what class descriptors the built-in models use refer to. */
+static int
+composite_class(struct composite *c, struct usb_device *part,
+                struct usb_function *f,
+                const struct usb_interface_descriptor *id, uint8_t *d)
+{
+    if (!id || d[0] < 3)
+        return 0;
+
+    switch (id->bInterfaceClass << 8 | d[2]) {
+    case USB_CLASS_COMM << 8 | 0x01:     /* call management */
+        if (d[0] >= 5)
+            d[4] += f->intf;
+        return 0;
+
+    case USB_CLASS_COMM << 8 | 0x06:     /* union */
+        for (size_t i = 3; i < d[0]; i++)
+            d[i] += f->intf;
+        return 0;
+
+    case USB_CLASS_COMM << 8 | 0x0f:     /* ethernet networking */
+        return d[0] >= 4 ? composite_string(c, part, &d[3]) : 0;
+
+    case USB_CLASS_VIDEO << 8 | 0x01:
+        /* The control header lists its streaming interfaces, the input
+         * header names its endpoint. */
+        if (id->bInterfaceSubClass == 1) {
+            for (size_t i = 12; i < d[0]; i++)
+                d[i] += f->intf;
+        } else if (id->bInterfaceSubClass == 2 && d[0] >= 7 && d[6]) {
+            return composite_ep(c, f, &d[6]);
+        }
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+static int
+composite_add(struct composite *c, struct usb_device *part)
+{
+    const struct usb_device_descriptor *dd = (const void *) part->device.buf;
+    const struct usb_config_descriptor *cfg = (const void *) part->config[0].buf;
+    const struct usb_interface_descriptor *id = NULL;
+    struct usb_function *f = part->func;
+    size_t len, start = c->len;
+    bool iad = false;
+    uint8_t *d;
+    int r;
+
+    if (!dd || !cfg || !f)
+        return EINVAL;
+
+    len = part->config[0].len - cfg->bLength;
+    if (c->len + sizeof(struct usb_interface_assoc_descriptor) + len > sizeof(c->buf))
+        return ENOSPC;
+    if (c->intfs + cfg->bNumInterfaces > USB_MAX_INTERFACES)
+        return ENOSPC;
+
+    f->intf = c->intfs;
+    f->intfs = cfg->bNumInterfaces;
+    memset(f->ep, 0, sizeof(f->ep));
+
+    if (cfg->bNumInterfaces > 1) {
+        struct usb_interface_assoc_descriptor a = {
+            .bLength = sizeof(a),
+            .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+            .bFirstInterface = f->intf,
+            .bInterfaceCount = cfg->bNumInterfaces,
+            .iFunction = dd->iProduct,
+        };
+
+        memcpy(c->buf + c->len, &a, sizeof(a));
+        c->len += sizeof(a);
+    }
+
+    memcpy(c->buf + c->len, (const uint8_t *) cfg + cfg->bLength, len);
+    c->len += len;
+
+    for (size_t off = c->len - len; off < c->len; off += d[0]) {
+        d = c->buf + off;
+
+        switch (d[1]) {
+        case USB_DT_INTERFACE_ASSOCIATION: {
+            struct usb_interface_assoc_descriptor *a = (void *) d;
+
+            a->bFirstInterface += f->intf;
+            r = composite_string(c, part, &a->iFunction);
+            iad = true;
+            break;
+        }
+
+        case USB_DT_INTERFACE: {
+            struct usb_interface_descriptor *i = (void *) d;
+
+            /* Numbers past the part's count would belong to no function. */
+            if (i->bInterfaceNumber >= cfg->bNumInterfaces)
+                return EINVAL;
+            i->bInterfaceNumber += f->intf;
+            r = composite_string(c, part, &i->iInterface);
+            id = i;
+            break;
+        }
+
+        case USB_DT_ENDPOINT:
+            r = composite_ep(c, f, &d[2]);
+            if (r == 0 && d[0] >= 9 && d[8])
+                r = composite_ep(c, f, &d[8]);   /* bSynchAddress */
+            break;
+
+        case USB_DT_CS_INTERFACE:
+            r = composite_class(c, part, f, id, d);
+            break;
+
+        default:
+            r = 0;
+            break;
+        }
+
+        if (r != 0)
+            return r;
+    }
+
+    /* The part has its own association: drop the one made up above. */
+    if (cfg->bNumInterfaces > 1) {
+        struct usb_interface_assoc_descriptor *a = (void *) (c->buf + start);
+        const struct usb_interface_descriptor *first = (const void *) (a + 1);
+
+        if (iad) {
+            memmove(a, first, c->len - start - sizeof(*a));
+            c->len -= sizeof(*a);
+        } else {
+            while (first->bDescriptorType != USB_DT_INTERFACE)
+                first = (const void *) ((const uint8_t *) first + first->bLength);
+
+            a->bFunctionClass = first->bInterfaceClass;
+            a->bFunctionSubClass = first->bInterfaceSubClass;
+            a->bFunctionProtocol = first->bInterfaceProtocol;
+            r = composite_string(c, part, &a->iFunction);
+            if (r != 0)
+                return r;
+        }
+
+        c->iad = true;
+    }
+
+    c->intfs += cfg->bNumInterfaces;
+    return 0;
+}
+
+static int
+composite_build(struct usb_device *dev, struct usb_device **parts, size_t n)
+{
+    const struct usb_device_descriptor *first = (const void *) parts[0]->device.buf;
+    struct usb_device_descriptor dd;
+    struct usb_config_descriptor config = {
+        .bLength = sizeof(config),
+        .bDescriptorType = USB_DT_CONFIG,
+        .bConfigurationValue = 1,
+        .bmAttributes = USB_CONFIG_ATT_ONE,
+    };
+    struct usb_function **tail = &dev->func;
+    struct composite *c;
+    unsigned power = 0;
+    uint8_t serial = 0;
+    int r = 0;
+
+    if (!first)
+        return EINVAL;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return ENOMEM;
+
+    c->dev = dev;
+    c->len = sizeof(config);
+    c->strings = 3;                      /* manufacturer, product, serial */
+    dev->speed = parts[0]->speed;
+    dd = *first;
+
+    for (size_t i = 0; i < n && r == 0; i++) {
+        const struct usb_device_descriptor *pd = (const void *) parts[i]->device.buf;
+        const struct usb_config_descriptor *pc = (const void *) parts[i]->config[0].buf;
+
+        if (parts[i]->speed != dev->speed || !pd || !pc) {
+            r = EINVAL;
+            break;
+        }
+
+        r = composite_add(c, parts[i]);
+        if (r != 0)
+            break;
+
+        if (le16toh(pd->bcdUSB) > le16toh(dd.bcdUSB))
+            dd.bcdUSB = pd->bcdUSB;
+        config.bmAttributes |= pc->bmAttributes;
+        power += pc->bMaxPower;
+
+        if (pd->iSerialNumber && !serial) {
+            serial = pd->iSerialNumber;
+            r = usb_device_desc(dev, USB_DT_STRING, 3,
+                                parts[i]->strings[serial]->buf,
+                                parts[i]->strings[serial]->len);
+        }
+    }
+
+    if (r == 0) {
+        config.wTotalLength = htole16(c->len);
+        config.bNumInterfaces = c->intfs;
+        config.bMaxPower = power < 250 ? power : 250;
+        memcpy(c->buf, &config, sizeof(config));
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, c->buf, c->len);
+    }
+
+    if (r == 0) {
+        dd.bDeviceClass = c->iad ? USB_CLASS_MISC : 0;
+        dd.bDeviceSubClass = c->iad ? 0x02 : 0;
+        dd.bDeviceProtocol = c->iad ? 0x01 : 0;   /* interface association */
+        dd.idVendor = htole16(USBEMU_VID);
+        dd.idProduct = htole16(0x000e);
+        dd.bcdDevice = htole16(0x0100);
+        dd.iManufacturer = 1;
+        dd.iProduct = 2;
+        dd.iSerialNumber = serial ? 3 : 0;
+        dd.bNumConfigurations = 1;
+        r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    }
+
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu Composite");
+
+    free(c);
+    if (r != 0)
+        return r;
+
+    /* The descriptors are in place: take the functions over. */
+    for (size_t i = 0; i < n; i++) {
+        struct usb_function *f = parts[i]->func;
+
+        parts[i]->func = NULL;
+        f->dev = dev;
+        f->next = NULL;
+        *tail = f;
+        tail = &f->next;
+    }
+
+    return 0;
+}
+
+int
+composite_create(struct usb_device *dev, struct usb_device **parts, size_t n)
+{
+    int r = n > 0 ? composite_build(dev, parts, n) : EINVAL;
+
+    for (size_t i = 0; i < n; i++)
+        usb_device_free(parts[i]);
+
+    return r;
+}
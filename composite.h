@@ -0,0 +1,11 @@
+#pragma once
+
+#include "usb.h"
+
+/*
+ * Builds one device out of the functions of n devices already created by
+ * their models, which must agree on the speed. The parts are freed either
+ * way.
+ */
+int
+composite_create(struct usb_device *dev, struct usb_device **parts, size_t n);
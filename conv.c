@@ -0,0 +1,371 @@
+#include "conv.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_X86 1
+#endif
+
+/*
+ * One row. For RGB24, a is the row and b unused; for NV12, a is the luma
+ * row and b the chroma row it shares with its neighbour.
+ */
+typedef void conv_row(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                      uint32_t width);
+
+/* Fixed point BT.601: Y from one pixel, U and V from the sum of a pair. */
+static inline uint8_t
+conv_y(int r, int g, int b)
+{
+    return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static inline uint8_t
+conv_u(int r, int g, int b)
+{
+    return ((-38 * r - 74 * g + 112 * b + 256) >> 9) + 128;
+}
+
+static inline uint8_t
+conv_v(int r, int g, int b)
+{
+    return ((112 * r - 94 * g - 18 * b + 256) >> 9) + 128;
+}
+
+/* Pixels [x, width) of a row; the vector versions finish with these. */
+static void
+conv_rgb_tail(const uint8_t *s, uint8_t *d, uint32_t x, uint32_t width)
+{
+    for (s += x * 3, d += x * 2; x < width; x += 2, s += 6, d += 4) {
+        int r = s[0] + s[3], g = s[1] + s[4], b = s[2] + s[5];
+
+        d[0] = conv_y(s[0], s[1], s[2]);
+        d[1] = conv_u(r, g, b);
+        d[2] = conv_y(s[3], s[4], s[5]);
+        d[3] = conv_v(r, g, b);
+    }
+}
+
+static void
+conv_nv12_tail(const uint8_t *y, const uint8_t *uv, uint8_t *d, uint32_t x,
+               uint32_t width)
+{
+    for (; x < width; x += 2) {
+        d[x * 2 + 0] = y[x];
+        d[x * 2 + 1] = uv[x];
+        d[x * 2 + 2] = y[x + 1];
+        d[x * 2 + 3] = uv[x + 1];
+    }
+}
+
+static void
+conv_rgb_scalar(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                uint32_t width)
+{
+    (void) b;
+
+    conv_rgb_tail(a, dst, 0, width);
+}
+
+static void
+conv_nv12_scalar(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                 uint32_t width)
+{
+    conv_nv12_tail(a, b, dst, 0, width);
+}
+
+#ifdef CONV_X86
+
+/*
+ * Eight RGB24 pixels are 24 bytes: lo holds bytes 0-15 and hi bytes 16-23.
+ * These spread R, G and B into 16 bit lanes, each from both halves.
+ */
+#define X -1
+#define CONV_MASKS                                                            \
+    const __m128i r_lo = _mm_setr_epi8(0, X, 3, X, 6, X, 9, X, 12, X, 15, X,  \
+                                       X, X, X, X);                           \
+    const __m128i r_hi = _mm_setr_epi8(X, X, X, X, X, X, X, X, X, X, X, X,    \
+                                       2, X, 5, X);                           \
+    const __m128i g_lo = _mm_setr_epi8(1, X, 4, X, 7, X, 10, X, 13, X, X, X,  \
+                                       X, X, X, X);                           \
+    const __m128i g_hi = _mm_setr_epi8(X, X, X, X, X, X, X, X, X, X, 0, X,    \
+                                       3, X, 6, X);                           \
+    const __m128i b_lo = _mm_setr_epi8(2, X, 5, X, 8, X, 11, X, 14, X, X, X,  \
+                                       X, X, X, X);                           \
+    const __m128i b_hi = _mm_setr_epi8(X, X, X, X, X, X, X, X, X, X, 1, X,    \
+                                       4, X, 7, X)
+
+__attribute__((target("sse4.1")))
+static void
+conv_rgb_sse41(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+               uint32_t width)
+{
+    CONV_MASKS;
+    const __m128i one = _mm_set1_epi16(1);
+    uint32_t x = 0;
+
+    (void) b;
+
+    for (; x + 8 <= width; x += 8) {
+        const uint8_t *s = a + x * 3;
+        __m128i lo = _mm_loadu_si128((const __m128i *) s);
+        __m128i hi = _mm_loadl_epi64((const __m128i *) (s + 16));
+        __m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi));
+        __m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi));
+        __m128i bl = _mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi));
+        __m128i y, rs, gs, bs, u, v, uv;
+
+        /* The products and their sum stay below 2^16. */
+        y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                          _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+        y = _mm_add_epi16(y, _mm_mullo_epi16(bl, _mm_set1_epi16(25)));
+        y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+        y = _mm_add_epi16(y, _mm_set1_epi16(16));
+
+        rs = _mm_madd_epi16(r, one);
+        gs = _mm_madd_epi16(g, one);
+        bs = _mm_madd_epi16(bl, one);
+
+        u = _mm_sub_epi32(_mm_mullo_epi32(bs, _mm_set1_epi32(112)),
+                          _mm_mullo_epi32(rs, _mm_set1_epi32(38)));
+        u = _mm_sub_epi32(u, _mm_mullo_epi32(gs, _mm_set1_epi32(74)));
+        u = _mm_srai_epi32(_mm_add_epi32(u, _mm_set1_epi32(256)), 9);
+        u = _mm_add_epi32(u, _mm_set1_epi32(128));
+
+        v = _mm_sub_epi32(_mm_mullo_epi32(rs, _mm_set1_epi32(112)),
+                          _mm_mullo_epi32(gs, _mm_set1_epi32(94)));
+        v = _mm_sub_epi32(v, _mm_mullo_epi32(bs, _mm_set1_epi32(18)));
+        v = _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(256)), 9);
+        v = _mm_add_epi32(v, _mm_set1_epi32(128));
+
+        uv = _mm_packs_epi32(u, v);
+        uv = _mm_unpacklo_epi16(uv, _mm_srli_si128(uv, 8));
+
+        _mm_storeu_si128((__m128i *) (dst + x * 2),
+                         _mm_unpacklo_epi8(_mm_packus_epi16(y, y),
+                                           _mm_packus_epi16(uv, uv)));
+    }
+
+    conv_rgb_tail(a, dst, x, width);
+}
+
+/* The same, eight pixels in each 128 bit lane. */
+__attribute__((target("avx2")))
+static void
+conv_rgb_avx2(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+              uint32_t width)
+{
+    CONV_MASKS;
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i rl = _mm256_broadcastsi128_si256(r_lo);
+    const __m256i rh = _mm256_broadcastsi128_si256(r_hi);
+    const __m256i gl = _mm256_broadcastsi128_si256(g_lo);
+    const __m256i gh = _mm256_broadcastsi128_si256(g_hi);
+    const __m256i bl = _mm256_broadcastsi128_si256(b_lo);
+    const __m256i bh = _mm256_broadcastsi128_si256(b_hi);
+    uint32_t x = 0;
+
+    (void) b;
+
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t *s = a + x * 3;
+        __m256i lo = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) s)),
+            _mm_loadu_si128((const __m128i *) (s + 24)), 1);
+        __m256i hi = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *) (s + 16))),
+            _mm_loadl_epi64((const __m128i *) (s + 40)), 1);
+        __m256i r = _mm256_or_si256(_mm256_shuffle_epi8(lo, rl), _mm256_shuffle_epi8(hi, rh));
+        __m256i g = _mm256_or_si256(_mm256_shuffle_epi8(lo, gl), _mm256_shuffle_epi8(hi, gh));
+        __m256i bb = _mm256_or_si256(_mm256_shuffle_epi8(lo, bl), _mm256_shuffle_epi8(hi, bh));
+        __m256i y, rs, gs, bs, u, v, uv;
+
+        y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                             _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+        y = _mm256_add_epi16(y, _mm256_mullo_epi16(bb, _mm256_set1_epi16(25)));
+        y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+        y = _mm256_add_epi16(y, _mm256_set1_epi16(16));
+
+        rs = _mm256_madd_epi16(r, one);
+        gs = _mm256_madd_epi16(g, one);
+        bs = _mm256_madd_epi16(bb, one);
+
+        u = _mm256_sub_epi32(_mm256_mullo_epi32(bs, _mm256_set1_epi32(112)),
+                             _mm256_mullo_epi32(rs, _mm256_set1_epi32(38)));
+        u = _mm256_sub_epi32(u, _mm256_mullo_epi32(gs, _mm256_set1_epi32(74)));
+        u = _mm256_srai_epi32(_mm256_add_epi32(u, _mm256_set1_epi32(256)), 9);
+        u = _mm256_add_epi32(u, _mm256_set1_epi32(128));
+
+        v = _mm256_sub_epi32(_mm256_mullo_epi32(rs, _mm256_set1_epi32(112)),
+                             _mm256_mullo_epi32(gs, _mm256_set1_epi32(94)));
+        v = _mm256_sub_epi32(v, _mm256_mullo_epi32(bs, _mm256_set1_epi32(18)));
+        v = _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(256)), 9);
+        v = _mm256_add_epi32(v, _mm256_set1_epi32(128));
+
+        uv = _mm256_packs_epi32(u, v);
+        uv = _mm256_unpacklo_epi16(uv, _mm256_srli_si256(uv, 8));
+
+        _mm256_storeu_si256((__m256i *) (dst + x * 2),
+                            _mm256_unpacklo_epi8(_mm256_packus_epi16(y, y),
+                                                 _mm256_packus_epi16(uv, uv)));
+    }
+
+    conv_rgb_tail(a, dst, x, width);
+}
+
+#undef CONV_MASKS
+#undef X
+
+/* NV12 to YUY2 is a byte interleave of the luma and chroma rows. */
+__attribute__((target("sse4.1")))
+static void
+conv_nv12_sse41(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i y = _mm_loadu_si128((const __m128i *) (a + x));
+        __m128i uv = _mm_loadu_si128((const __m128i *) (b + x));
+
+        _mm_storeu_si128((__m128i *) (dst + x * 2), _mm_unpacklo_epi8(y, uv));
+        _mm_storeu_si128((__m128i *) (dst + x * 2 + 16), _mm_unpackhi_epi8(y, uv));
+    }
+
+    conv_nv12_tail(a, b, dst, x, width);
+}
+
+__attribute__((target("avx2")))
+static void
+conv_nv12_avx2(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+               uint32_t width)
+{
+    uint32_t x = 0;
+
+    /* Unpacking works within lanes, so lay the quadwords out 0, 2, 1, 3. */
+    for (; x + 32 <= width; x += 32) {
+        __m256i y = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *) (a + x)), 0xd8);
+        __m256i uv = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *) (b + x)), 0xd8);
+
+        _mm256_storeu_si256((__m256i *) (dst + x * 2), _mm256_unpacklo_epi8(y, uv));
+        _mm256_storeu_si256((__m256i *) (dst + x * 2 + 32), _mm256_unpackhi_epi8(y, uv));
+    }
+
+    conv_nv12_tail(a, b, dst, x, width);
+}
+
+#endif
+
+static struct {
+    conv_row *rgb;
+    conv_row *nv12;
+    const char *isa;
+} conv = { conv_rgb_scalar, conv_nv12_scalar, "scalar" };
+
+static pthread_once_t conv_once = PTHREAD_ONCE_INIT;
+
+static void
+conv_init(void)
+{
+#ifdef CONV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        conv.rgb = conv_rgb_avx2;
+        conv.nv12 = conv_nv12_avx2;
+        conv.isa = "avx2";
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        conv.rgb = conv_rgb_sse41;
+        conv.nv12 = conv_nv12_sse41;
+        conv.isa = "sse4.1";
+    }
+#endif
+}
+
+size_t
+conv_size(enum conv_format format, uint32_t width, uint32_t height)
+{
+    size_t pixels = (size_t) width * height;
+
+    switch (format) {
+    case CONV_RGB24:
+        return pixels * 3;
+    case CONV_NV12:
+        return pixels + pixels / 2;
+    default:
+        return pixels * 2;
+    }
+}
+
+void
+conv_yuy2(enum conv_format format, const uint8_t *src, uint8_t *dst,
+          uint32_t width, uint32_t height, uint32_t y0, uint32_t y1)
+{
+    const uint8_t *chroma = src + (size_t) width * height;
+
+    pthread_once(&conv_once, conv_init);
+
+    for (uint32_t y = y0; y < y1; y++) {
+        uint8_t *d = dst + (size_t) y * width * 2;
+
+        switch (format) {
+        case CONV_RGB24:
+            conv.rgb(src + (size_t) y * width * 3, NULL, d, width);
+            break;
+        case CONV_NV12:
+            conv.nv12(src + (size_t) y * width,
+                      chroma + (size_t) (y / 2) * width, d, width);
+            break;
+        default:
+            memcpy(d, src + (size_t) y * width * 2, (size_t) width * 2);
+            break;
+        }
+    }
+}
+
+/* Four independent multiply-xorshift lanes over 32 byte blocks. */
+static void
+conv_mix(uint64_t h[4], const uint8_t *p, size_t len)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t w;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            memcpy(&w, p + i + j * 8, sizeof(w));
+            h[j] = (h[j] ^ w) * k;
+            h[j] ^= h[j] >> 29;
+        }
+    }
+
+    for (; i < len; i++)
+        h[0] = (h[0] ^ p[i]) * k;
+}
+
+uint64_t
+conv_hash(enum conv_format format, const uint8_t *src,
+          uint32_t width, uint32_t height, uint32_t y0, uint32_t y1)
+{
+    size_t stride = format == CONV_RGB24 ? width * 3
+                    : format == CONV_NV12 ? width : width * 2;
+    uint64_t h[4] = { 1, 2, 3, 4 };
+
+    conv_mix(h, src + y0 * stride, (y1 - y0) * stride);
+    if (format == CONV_NV12 && y1 > y0)
+        conv_mix(h, src + (size_t) width * height + (y0 / 2) * stride,
+                 ((y1 - 1) / 2 - y0 / 2 + 1) * stride);
+
+    return (h[0] ^ (h[1] << 1 | h[1] >> 63)) * 0x9e3779b97f4a7c15ull ^
+           (h[2] << 2 | h[2] >> 62) ^ (h[3] << 3 | h[3] >> 61);
+}
+
+const char *
+conv_isa(void)
+{
+    pthread_once(&conv_once, conv_init);
+    return conv.isa;
+}
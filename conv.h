@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pixel format conversion into packed YUY2 (BT.601, limited range). Rows
+ * are converted independently so a frame can be split into bands across
+ * threads. Widths are even; RGB24 is R, G, B in memory and NV12 is a Y
+ * plane followed by an interleaved half-height U, V plane.
+ *
+ * SSE4.1 and AVX2 versions are picked at run time when the CPU has them.
+ */
+
+enum conv_format {
+    CONV_YUY2,
+    CONV_RGB24,
+    CONV_NV12,
+};
+
+size_t
+conv_size(enum conv_format format, uint32_t width, uint32_t height);
+
+/* Rows [y0, y1) of a width x height frame in src to the same rows of dst. */
+void
+conv_yuy2(enum conv_format format, const uint8_t *src, uint8_t *dst,
+          uint32_t width, uint32_t height, uint32_t y0, uint32_t y1);
+
+/* The source bytes behind rows [y0, y1), for spotting unchanged bands. */
+uint64_t
+conv_hash(enum conv_format format, const uint8_t *src,
+          uint32_t width, uint32_t height, uint32_t y0, uint32_t y1);
+
+/* "avx2", "sse4.1" or "scalar". */
+const char *
+conv_isa(void);
@@ -0,0 +1,394 @@
+#include "blk.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COW_MAGIC "usbemcow"
+#define COW_VERSION 1
+#define COW_BLOCK 4096
+#define COW_ALIGN 4096                   /* of the bitmap and the data */
+
+/* The start of an overlay file, little endian. */
+struct cow_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t size;                       /* of the base */
+    uint64_t bitmap;                     /* offsets within the file */
+    uint64_t data;
+} __attribute__((packed));
+
+/* A base image, mapped once however many overlays sit on it. */
+struct cow_base {
+    struct cow_base *next;
+    unsigned int refs;
+    dev_t dev;
+    ino_t ino;
+    uint8_t *map;
+    uint64_t size;
+};
+
+static struct cow_base *cow_bases;
+
+/*
+ * A read-only base image with the device's writes in an overlay file of
+ * its own. The overlay holds a bitmap of the blocks written so far and,
+ * at data + offset, their contents; the rest of it is a hole. Reads of
+ * blocks the device never wrote come from the base mapping, which every
+ * overlay on the same base shares, so the base is in the page cache once.
+ * The first write to a block copies it up from the base.
+ *
+ * map() only hands out ranges that are wholly in the overlay, which is
+ * where writes must land.
+ */
+struct cow {
+    struct blk blk;
+    struct cow_base *base;
+    uint8_t *map;                        /* the overlay */
+    size_t map_len;
+    uint8_t *bitmap;
+    uint8_t *data;
+    uint32_t block_size;
+};
+
+static uint64_t
+cow_align(uint64_t n)
+{
+    return (n + COW_ALIGN - 1) & ~(uint64_t) (COW_ALIGN - 1);
+}
+
+static bool
+cow_present(const struct cow *c, uint64_t block)
+{
+    return c->bitmap[block / 8] & 1 << block % 8;
+}
+
+/* Bytes from off on that are all in the overlay, or all not. */
+static uint64_t
+cow_run(const struct cow *c, uint64_t off, uint64_t len, bool *present)
+{
+    uint64_t block = off / c->block_size;
+    uint64_t end = off + len;
+    uint64_t next = (block + 1) * c->block_size;
+
+    *present = cow_present(c, block);
+    while (next < end && cow_present(c, next / c->block_size) == *present)
+        next += c->block_size;
+
+    return (next < end ? next : end) - off;
+}
+
+static uint8_t *
+cow_map(struct blk *b, uint64_t off, size_t len)
+{
+    struct cow *c = (struct cow *) b;
+    bool present;
+
+    if (cow_run(c, off, len, &present) < len || !present)
+        return NULL;
+
+    return c->data + off;
+}
+
+static int
+cow_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    struct cow *c = (struct cow *) b;
+    uint8_t *dst = buf;
+    bool present;
+    uint64_t n;
+
+    for (; len > 0; off += n, dst += n, len -= n) {
+        n = cow_run(c, off, len, &present);
+        memcpy(dst, (present ? c->data : c->base->map) + off, n);
+    }
+
+    return 0;
+}
+
+static int
+cow_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    struct cow *c = (struct cow *) b;
+    uint64_t block, start, n;
+
+    for (block = off / c->block_size; off + len > block * c->block_size; block++) {
+        if (cow_present(c, block))
+            continue;
+
+        /* Copy up whatever part of the block the write leaves alone. */
+        start = block * c->block_size;
+        n = b->size - start < c->block_size ? b->size - start : c->block_size;
+        if (start < off || start + n > off + len)
+            memcpy(c->data + start, c->base->map + start, n);
+
+        c->bitmap[block / 8] |= 1 << block % 8;
+    }
+
+    memcpy(c->data + off, buf, len);
+    return 0;
+}
+
+static int
+cow_flush(struct blk *b)
+{
+    struct cow *c = (struct cow *) b;
+
+    return msync(c->map, c->map_len, MS_SYNC) == 0 ? 0 : errno;
+}
+
+static void
+cow_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    struct cow *c = (struct cow *) b;
+    uint64_t mask = sysconf(_SC_PAGESIZE) - 1;
+    bool present;
+    uint64_t n;
+
+    /* Blocks already in the overlay are the device's own business. */
+    for (; len > 0; off += n, len -= n) {
+        n = cow_run(c, off, len, &present);
+        if (!present)
+            madvise(c->base->map + (off & ~mask), off + n - (off & ~mask),
+                    MADV_WILLNEED);
+    }
+}
+
+static void
+cow_base_put(struct cow_base *base)
+{
+    struct cow_base **p;
+
+    if (--base->refs > 0)
+        return;
+
+    for (p = &cow_bases; *p != base; p = &(*p)->next)
+        ;
+    *p = base->next;
+
+    munmap(base->map, base->size);
+    free(base);
+}
+
+static int
+cow_base_get(const char *path, struct cow_base **base)
+{
+    struct cow_base *b;
+    struct stat st;
+    int fd;
+    int e;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    if (fstat(fd, &st) != 0) {
+        e = errno;
+        close(fd);
+        return e;
+    }
+
+    /* It is mapped as it is, so it has to be raw. */
+    if (blk_zimg_probe(fd)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    for (b = cow_bases; b; b = b->next) {
+        if (b->dev == st.st_dev && b->ino == st.st_ino) {
+            close(fd);
+            b->refs++;
+            *base = b;
+            return 0;
+        }
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        close(fd);
+        return ENOMEM;
+    }
+
+    e = blk_size(fd, &b->size);
+    if (e == 0 && b->size == 0)
+        e = EINVAL;
+
+    if (e == 0) {
+        b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (b->map == MAP_FAILED)
+            e = errno;
+    }
+
+    close(fd);
+    if (e != 0) {
+        free(b);
+        return e;
+    }
+
+    b->refs = 1;
+    b->dev = st.st_dev;
+    b->ino = st.st_ino;
+    b->next = cow_bases;
+    cow_bases = b;
+    *base = b;
+    return 0;
+}
+
+/* Lays out an empty overlay for a base of size bytes in fd. */
+static int
+cow_format(int fd, uint64_t size)
+{
+    uint64_t blocks = (size + COW_BLOCK - 1) / COW_BLOCK;
+    struct cow_header h = {
+        .magic = COW_MAGIC,
+        .version = htole32(COW_VERSION),
+        .block_size = htole32(COW_BLOCK),
+        .size = htole64(size),
+        .bitmap = htole64(COW_ALIGN),
+        .data = htole64(COW_ALIGN + cow_align((blocks + 7) / 8)),
+    };
+
+    if (ftruncate(fd, le64toh(h.data) + blocks * COW_BLOCK) != 0)
+        return errno;
+
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+        return errno ? errno : EIO;
+
+    return 0;
+}
+
+static int
+cow_check(const struct cow_header *h, uint64_t size, uint64_t file)
+{
+    uint32_t bs = le32toh(h->block_size);
+    uint64_t blocks;
+
+    if (memcmp(h->magic, COW_MAGIC, sizeof(h->magic)) != 0 ||
+        le32toh(h->version) != COW_VERSION ||
+        bs < 512 || (bs & (bs - 1)) != 0)
+        return EINVAL;
+
+    /* An overlay only makes sense on the base it was made for. */
+    if (le64toh(h->size) != size)
+        return EINVAL;
+
+    blocks = (size + bs - 1) / bs;
+    if (le64toh(h->bitmap) < sizeof(*h) ||
+        le64toh(h->data) < le64toh(h->bitmap) + (blocks + 7) / 8 ||
+        le64toh(h->data) % COW_ALIGN != 0 ||
+        file < le64toh(h->data) + blocks * bs)
+        return EINVAL;
+
+    return 0;
+}
+
+static void
+cow_close(struct blk *b)
+{
+    struct cow *c = (struct cow *) b;
+
+    if (c->map)
+        munmap(c->map, c->map_len);
+    if (c->base)
+        cow_base_put(c->base);
+    free(c);
+}
+
+static const struct blk_ops cow_ops = {
+    .map = cow_map,
+    .read = cow_read,
+    .write = cow_write,
+    .flush = cow_flush,
+    .readahead = cow_readahead,
+    .close = cow_close,
+};
+
+static int
+cow_overlay(struct cow *c, int fd)
+{
+    struct cow_header h;
+    struct stat st;
+    int e;
+
+    if (fstat(fd, &st) != 0)
+        return errno;
+
+    if (st.st_size == 0) {
+        e = cow_format(fd, c->blk.size);
+        if (e != 0)
+            return e;
+        if (fstat(fd, &st) != 0)
+            return errno;
+    }
+
+    if ((uint64_t) st.st_size < sizeof(h) ||
+        pread(fd, &h, sizeof(h), 0) != sizeof(h))
+        return EINVAL;
+
+    e = cow_check(&h, c->blk.size, st.st_size);
+    if (e != 0)
+        return e;
+
+    c->map_len = st.st_size;
+    c->map = mmap(NULL, c->map_len, PROT_READ | (c->blk.readonly ? 0 : PROT_WRITE),
+                  MAP_SHARED, fd, 0);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        return errno;
+    }
+
+    c->block_size = le32toh(h.block_size);
+    c->bitmap = c->map + le64toh(h.bitmap);
+    c->data = c->map + le64toh(h.data);
+    return 0;
+}
+
+int
+blk_cow_open(const char *base, const char *overlay, unsigned int flags,
+             struct blk **blk)
+{
+    bool readonly = flags & BLK_RDONLY;
+    struct cow *c;
+    int fd;
+    int e;
+
+    if (flags & BLK_ASYNC)
+        return EINVAL;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return ENOMEM;
+
+    c->blk.ops = &cow_ops;
+    c->blk.readonly = readonly;
+
+    e = cow_base_get(base, &c->base);
+    if (e != 0) {
+        free(c);
+        return e;
+    }
+    c->blk.size = c->base->size;
+
+    fd = open(overlay, (readonly ? O_RDONLY : O_RDWR | O_CREAT) | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        e = errno;
+    } else {
+        e = cow_overlay(c, fd);
+        close(fd);
+    }
+
+    if (e != 0) {
+        cow_close(&c->blk);
+        return e;
+    }
+
+    *blk = &c->blk;
+    return 0;
+}
@@ -0,0 +1,536 @@
+#include "ring.h"
+#include "usb.h"
+
+#include <sys/timerfd.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USB_CLASS_HID 3
+#define USB_DT_HID 0x21
+#define USB_DT_HID_REPORT 0x22
+
+#define HID_REPORT_MAX 64
+
+enum {
+    HID_REQ_GET_REPORT = 0x01,
+    HID_REQ_GET_IDLE = 0x02,
+    HID_REQ_GET_PROTOCOL = 0x03,
+    HID_REQ_SET_REPORT = 0x09,
+    HID_REQ_SET_IDLE = 0x0a,
+    HID_REQ_SET_PROTOCOL = 0x0b,
+};
+
+struct hid_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdHID;
+    uint8_t bCountryCode;
+    uint8_t bNumDescriptors;
+    uint8_t bReportDescriptorType;
+    uint16_t wReportDescriptorLength;
+} __attribute__((packed));
+
+struct hid_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor intf;
+    struct hid_descriptor hid;
+    struct usb_endpoint_descriptor in;
+} __attribute__((packed));
+
+static const uint8_t hid_keyboard[] = {
+    0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7,
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+    0x75, 0x08, 0x81, 0x03, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+    0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x03, 0x95, 0x06,
+    0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+    0x81, 0x00, 0xc0,
+};
+
+static const uint8_t hid_mouse[] = {
+    0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09,
+    0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03, 0x05, 0x01, 0x09, 0x30,
+    0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03,
+    0x81, 0x06, 0xc0, 0xc0,
+};
+
+static const uint8_t hid_gamepad[] = {
+    0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x05, 0x09, 0x19, 0x01, 0x29, 0x10,
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x10, 0x81, 0x02, 0x05, 0x01,
+    0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x15, 0x81, 0x25, 0x7f,
+    0x75, 0x08, 0x95, 0x04, 0x81, 0x02, 0xc0,
+};
+
+static const struct {
+    const char *name;
+    const uint8_t *report;
+    size_t rlen;
+    uint8_t size;                        /* input report bytes */
+    uint8_t subclass;                    /* 1: boot interface */
+    uint8_t protocol;                    /* 1: keyboard, 2: mouse */
+    uint16_t pid;
+} hid_kinds[] = {
+    { "keyboard", hid_keyboard, sizeof(hid_keyboard), 8, 1, 1, 0x0001 },
+    { "mouse",    hid_mouse,    sizeof(hid_mouse),    4, 1, 2, 0x0002 },
+    { "gamepad",  hid_gamepad,  sizeof(hid_gamepad),  6, 0, 0, 0x0003 },
+    { "generic",  NULL,         0,                    0, 0, 0, 0x0004 },
+};
+
+/*
+ * Interrupt IN reports come from a shared memory ring. A URB the host
+ * submits is parked until a report is available and the endpoint interval
+ * since the previous report has elapsed, then completed at once.
+ */
+struct hid {
+    struct usb_function func;
+    struct usb_desc report;
+    struct hid_config config;
+
+    char *name;
+    struct ring_reader *ring;
+    struct loop_watch bell;
+    struct loop_watch timer;
+    bool armed;
+
+    uint64_t last;                       /* ns of the last completion */
+    uint8_t idle;
+    uint8_t protocol;
+    uint8_t input[HID_REPORT_MAX];
+    uint32_t ilen;
+};
+
+static uint64_t
+hid_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* urb->interval is in (micro)frames, as the host computed it. */
+static uint64_t
+hid_period(struct hid *h, const struct urb *urb)
+{
+    uint64_t unit = h->func.dev->speed >= USB_SPEED_HIGH ? 125000 : 1000000;
+    return (urb->interval ? urb->interval : 1) * unit;
+}
+
+static void
+hid_arm(struct hid *h, uint64_t when)
+{
+    struct itimerspec its = {
+        .it_value.tv_sec = when / 1000000000,
+        .it_value.tv_nsec = when % 1000000000,
+    };
+
+    timerfd_settime(h->timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+    h->armed = true;
+}
+
+static void
+hid_pump(struct hid *h)
+{
+    struct usb_ep *ep = usb_function_ep(&h->func, USBIP_DIR_IN, 1);
+    struct urb *urb;
+
+    while ((urb = TAILQ_FIRST(&ep->queue))) {
+        const uint8_t *report;
+        uint64_t now, next;
+        uint32_t len;
+
+        report = ring_peek(h->ring, &len);
+        if (!report) {
+            if (ring_wait(h->ring))
+                continue;
+            return;
+        }
+
+        now = hid_now();
+        next = h->last + hid_period(h, urb);
+        if (now < next) {
+            if (!h->armed)
+                hid_arm(h, next);
+            return;
+        }
+
+        if (len > urb->length)
+            len = urb->length;
+        if (len > sizeof(h->input))
+            len = sizeof(h->input);
+
+        memcpy(urb->buf, report, len);
+        memcpy(h->input, report, len);
+        h->ilen = len;
+        ring_pop(h->ring);
+
+        h->last = now;
+        urb->actual = len;
+        usb_urb_done(urb, 0);
+    }
+
+    ring_unwait(h->ring);
+}
+
+static void
+hid_bell(struct loop_watch *w, uint32_t events)
+{
+    struct hid *h = container_of(w, struct hid, bell);
+    uint8_t buf[64];
+
+    (void) events;
+
+    while (read(w->fd, buf, sizeof(buf)) > 0)
+        continue;
+
+    hid_pump(h);
+}
+
+static void
+hid_timer(struct loop_watch *w, uint32_t events)
+{
+    struct hid *h = container_of(w, struct hid, timer);
+    uint64_t expirations;
+
+    (void) events;
+
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    h->armed = false;
+    hid_pump(h);
+}
+
+static int
+hid_setup(struct usb_function *f, struct urb *urb)
+{
+    struct hid *h = (struct hid *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+
+    if (SETUP_TYP(s->bmRequestType) == USB_TYPE_STANDARD) {
+        if (s->bRequest != USB_REQ_GET_DESCRIPTOR)
+            return EPIPE;
+
+        switch (s->wValue >> 8) {
+        case USB_DT_HID:
+            urb->actual = sizeof(h->config.hid) < urb->length
+                        ? sizeof(h->config.hid) : urb->length;
+            memcpy(urb->buf, &h->config.hid, urb->actual);
+            return 0;
+
+        case USB_DT_HID_REPORT:
+            return usb_urb_blob(urb, &h->report);
+
+        default:
+            return EPIPE;
+        }
+    }
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case HID_REQ_GET_REPORT:
+        urb->actual = h->ilen < urb->length ? h->ilen : urb->length;
+        memcpy(urb->buf, h->input, urb->actual);
+        return 0;
+
+    case HID_REQ_SET_REPORT:
+        urb->actual = urb->length;
+        return 0;
+
+    case HID_REQ_GET_IDLE:
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = h->idle;
+        urb->actual = 1;
+        return 0;
+
+    case HID_REQ_SET_IDLE:
+        h->idle = s->wValue >> 8;
+        return 0;
+
+    case HID_REQ_GET_PROTOCOL:
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = h->protocol;
+        urb->actual = 1;
+        return 0;
+
+    case HID_REQ_SET_PROTOCOL:
+        h->protocol = s->wValue & 1;
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+hid_submit(struct usb_function *f, struct urb *urb)
+{
+    struct hid *h = (struct hid *) f;
+
+    if (urb->dir != USBIP_DIR_IN) {
+        usb_urb_done(urb, EPIPE);
+        return;
+    }
+
+    usb_ep_queue(urb);
+    hid_pump(h);
+}
+
+static void
+hid_set_alt(struct usb_function *f, uint8_t intf, uint8_t alt)
+{
+    struct hid *h = (struct hid *) f;
+
+    (void) intf;
+    (void) alt;
+
+    h->protocol = 1;
+}
+
+static void
+hid_destroy(struct usb_function *f)
+{
+    struct hid *h = (struct hid *) f;
+
+    if (h->timer.fd >= 0) {
+        loop_del(&h->timer);
+        close(h->timer.fd);
+    }
+
+    if (h->ring) {
+        loop_del(&h->bell);
+        ring_destroy(h->name, h->ring, h->bell.fd);
+    }
+
+    free(h->report.buf);
+    free(h->name);
+    free(h);
+}
+
+static const struct usb_function_ops hid_ops = {
+    .setup = hid_setup,
+    .submit = hid_submit,
+    .set_alt = hid_set_alt,
+    .destroy = hid_destroy,
+};
+
+static int
+hid_report_file(struct hid *h, const char *path)
+{
+    uint8_t buf[4096];
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0)
+        return n < 0 ? errno : EINVAL;
+
+    h->report.buf = malloc(n);
+    if (!h->report.buf)
+        return ENOMEM;
+
+    memcpy(h->report.buf, buf, n);
+    h->report.len = n;
+    return 0;
+}
+
+static int
+hid_descriptors(struct hid *h, struct usb_device *dev, size_t kind,
+                uint8_t size, const char *serial)
+{
+    uint8_t mps0 = dev->speed == USB_SPEED_LOW ? 8 : 64;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(dev->speed >= USB_SPEED_HIGH ? 0x0200 : 0x0110),
+        .bMaxPacketSize0 = mps0,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(hid_kinds[kind].pid),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = 3,
+        .bNumConfigurations = 1,
+    };
+    struct hid_config *c = &h->config;
+    char product[64];
+    int r;
+
+    *c = (struct hid_config) {
+        .config = {
+            .bLength = sizeof(c->config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(*c)),
+            .bNumInterfaces = 1,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_WAKEUP,
+            .bMaxPower = 50,
+        },
+        .intf = {
+            .bLength = sizeof(c->intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 1,
+            .bInterfaceClass = USB_CLASS_HID,
+            .bInterfaceSubClass = hid_kinds[kind].subclass,
+            .bInterfaceProtocol = hid_kinds[kind].protocol,
+        },
+        .hid = {
+            .bLength = sizeof(c->hid),
+            .bDescriptorType = USB_DT_HID,
+            .bcdHID = htole16(0x0111),
+            .bNumDescriptors = 1,
+            .bReportDescriptorType = USB_DT_HID_REPORT,
+            .wReportDescriptorLength = htole16(h->report.len),
+        },
+        .in = {
+            .bLength = sizeof(c->in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | 1,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = htole16(size),
+            .bInterval = 1,
+        },
+    };
+
+    snprintf(product, sizeof(product), "usbemu HID %s", hid_kinds[kind].name);
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, c, sizeof(*c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, product);
+    if (r == 0)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+static int
+hid_create(struct usb_device *dev, char *opts)
+{
+    enum { KIND, RING, SLOTS, REPORT, SIZE, SPEED, SERIAL };
+    char *const tokens[] = {
+        [KIND] = "kind", [RING] = "ring", [SLOTS] = "slots",
+        [REPORT] = "report", [SIZE] = "size", [SPEED] = "speed",
+        [SERIAL] = "serial", NULL
+    };
+    const char *ring = NULL, *report = NULL, *serial = NULL;
+    unsigned long slots = 256, size = 0;
+    size_t kind = 0;
+    struct hid *h;
+    char *value;
+    int r;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case KIND:
+            for (kind = 0; kind < sizeof(hid_kinds) / sizeof(*hid_kinds); kind++) {
+                if (value && strcmp(value, hid_kinds[kind].name) == 0)
+                    break;
+            }
+            if (kind == sizeof(hid_kinds) / sizeof(*hid_kinds))
+                return EINVAL;
+            break;
+
+        case RING:   ring = value; break;
+        case REPORT: report = value; break;
+        case SERIAL: serial = value; break;
+
+        case SLOTS:
+            if (!value || (slots = strtoul(value, NULL, 0)) == 0)
+                return EINVAL;
+            break;
+
+        case SIZE:
+            if (!value || (size = strtoul(value, NULL, 0)) == 0)
+                return EINVAL;
+            break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed > USB_SPEED_HIGH)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    if (!ring || (hid_kinds[kind].report == NULL) != (report != NULL))
+        return EINVAL;
+
+    if (size == 0)
+        size = hid_kinds[kind].size ? hid_kinds[kind].size : HID_REPORT_MAX;
+    if (size > HID_REPORT_MAX || (dev->speed == USB_SPEED_LOW && size > 8))
+        return EINVAL;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return ENOMEM;
+
+    h->timer.fd = -1;
+    h->bell.fd = -1;
+    h->protocol = 1;
+    usb_device_function(dev, &h->func, &hid_ops);
+
+    if (report) {
+        r = hid_report_file(h, report);
+    } else {
+        h->report.buf = malloc(hid_kinds[kind].rlen);
+        h->report.len = hid_kinds[kind].rlen;
+        r = h->report.buf ? 0 : ENOMEM;
+        if (r == 0)
+            memcpy(h->report.buf, hid_kinds[kind].report, h->report.len);
+    }
+    if (r != 0)
+        return r;
+
+    r = hid_descriptors(h, dev, kind, size, serial ? serial : ring + 1);
+    if (r != 0)
+        return r;
+
+    h->name = strdup(ring);
+    if (!h->name)
+        return ENOMEM;
+
+    r = ring_create(ring, size, slots, &h->ring, &h->bell.fd);
+    if (r != 0)
+        return r;
+
+    h->bell.func = hid_bell;
+    r = loop_add(&h->bell, EPOLLIN);
+    if (r != 0)
+        return r;
+
+    h->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (h->timer.fd < 0)
+        return errno;
+
+    h->timer.func = hid_timer;
+    return loop_add(&h->timer, EPOLLIN);
+}
+
+const struct usb_model usb_model_hid = {
+    .name = "hid",
+    .create = hid_create,
+};
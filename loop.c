@@ -0,0 +1,148 @@
+#include "loop.h"
+
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct loop_call {
+    struct loop_call *next;
+    void (*func)(void *arg);
+    void *arg;
+};
+
+static int epfd = -1;
+static bool done;
+
+/* Deferred calls may come from any thread; wake tells the loop. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct loop_call *calls;
+static struct loop_call **tail = &calls;
+static struct loop_watch wake = { .fd = -1 };
+
+static void
+loop_wake(struct loop_watch *w, uint32_t events)
+{
+    uint64_t n;
+
+    (void) events;
+
+    if (read(w->fd, &n, sizeof(n)) < 0)
+        return;
+}
+
+int
+loop_init(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return errno;
+
+    wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake.fd < 0)
+        return errno;
+
+    wake.func = loop_wake;
+    return loop_add(&wake, EPOLLIN);
+}
+
+int
+loop_add(struct loop_watch *w, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) != 0 ? errno : 0;
+}
+
+int
+loop_mod(struct loop_watch *w, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, w->fd, &ev) != 0 ? errno : 0;
+}
+
+void
+loop_del(struct loop_watch *w)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+/*
+ * Runs func(arg) on the loop thread once the current batch of events has
+ * been dispatched. Safe to call from any thread.
+ */
+int
+loop_defer(void (*func)(void *arg), void *arg)
+{
+    struct loop_call *c = malloc(sizeof(*c));
+    uint64_t one = 1;
+    bool first;
+
+    if (!c)
+        return ENOMEM;
+
+    *c = (struct loop_call) { .func = func, .arg = arg };
+
+    pthread_mutex_lock(&lock);
+    first = !calls;
+    *tail = c;
+    tail = &c->next;
+    pthread_mutex_unlock(&lock);
+
+    if (first && write(wake.fd, &one, sizeof(one)) < 0)
+        return errno;
+
+    return 0;
+}
+
+static void
+loop_calls(void)
+{
+    struct loop_call *c;
+
+    pthread_mutex_lock(&lock);
+    c = calls;
+    calls = NULL;
+    tail = &calls;
+    pthread_mutex_unlock(&lock);
+
+    while (c) {
+        struct loop_call *next = c->next;
+
+        c->func(c->arg);
+        free(c);
+        c = next;
+    }
+}
+
+int
+loop_run(void)
+{
+    struct epoll_event evs[64];
+
+    while (!done) {
+        int n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(*evs), -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct loop_watch *w = evs[i].data.ptr;
+            w->func(w, evs[i].events);
+        }
+
+        loop_calls();
+    }
+
+    return 0;
+}
+
+void
+loop_quit(void)
+{
+    done = true;
+}
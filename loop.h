@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct loop_watch {
+    int fd;
+    void (*func)(struct loop_watch *w, uint32_t events);
+};
+
+int
+loop_init(void);
+
+int
+loop_add(struct loop_watch *w, uint32_t events);
+
+int
+loop_mod(struct loop_watch *w, uint32_t events);
+
+void
+loop_del(struct loop_watch *w);
+
+int
+loop_defer(void (*func)(void *arg), void *arg);
+
+int
+loop_run(void);
+
+void
+loop_quit(void);
@@ -0,0 +1,295 @@
+#include "blk.h"
+#include "composite.h"
+#include "usb.h"
+#include "vhci.h"
+
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const struct usb_model *models[] = {
+    &usb_model_clone,
+    &usb_model_hid,
+    &usb_model_acm,
+    &usb_model_msc,
+    &usb_model_uas,
+    &usb_model_cdrom,
+    &usb_model_ncm,
+    &usb_model_uac,
+    &usb_model_uvc,
+    &usb_model_ccid,
+    &usb_model_printer,
+    &usb_model_zero,
+    NULL
+};
+
+static size_t live;
+
+static void
+usage(FILE *f, const char *argv0)
+{
+    fprintf(f, "Usage: %s [-v] MODEL[:OPTION=VALUE,...] [+ MODEL[:...]]... ...\n", argv0);
+    fprintf(f, "       %s -z RAW ZIMG   compress a disk image for msc and uas\n\n", argv0);
+    fprintf(f, "Models joined by + make one composite device; give them the same speed.\n\n");
+    fprintf(f, "Models:\n");
+    fprintf(f, "  clone:path=DIR     copy a device from sysfs (or a saved copy)\n");
+    fprintf(f, "  hid:ring=/NAME[,kind=keyboard|mouse|gamepad|generic][,report=FILE]\n");
+    fprintf(f, "     [,size=BYTES][,slots=N][,speed=low|full|high][,serial=STR]\n");
+    fprintf(f, "                     reports read from a shared memory ring\n");
+    fprintf(f, "  acm[:link=PATH][,speed=full|high][,serial=STR]\n");
+    fprintf(f, "                     CDC-ACM serial port backed by a pty\n");
+    fprintf(f, "  msc:image=FILE[,ro][,removable][,speed=full|high|super|super+]\n");
+    fprintf(f, "     [,io=mmap|uring][,readahead=KB][,serial=STR][,vendor=STR]\n");
+    fprintf(f, "     [,product=STR][,cache=KB[,cache_bg=KB]][,overlay=FILE][,cdrom]\n");
+    fprintf(f, "                     USB stick backed by a disk image; each further\n");
+    fprintf(f, "                     image=FILE[,...] adds a LUN with options of its own\n");
+    fprintf(f, "  uas:image=FILE[,...]  as msc, with USB Attached SCSI as alternate setting 1\n");
+    fprintf(f, "  cdrom:image=ISO[,...]  as msc, a DVD drive with each image as a disc\n");
+    fprintf(f, "  ncm[:tap=NAME][,mac=HEX12][,speed=full|high|super|super+][,serial=STR]\n");
+    fprintf(f, "                     CDC-NCM Ethernet bridged to a TAP device\n");
+    fprintf(f, "  uac[:play=/NAME][,capture=/NAME][,rate=HZ][,bits=16|24|32][,buffer=MS]\n");
+    fprintf(f, "     [,speed=full|high][,serial=STR]\n");
+    fprintf(f, "                     UAC2 headset streaming to and from shared memory\n");
+    fprintf(f, "  uvc:ring=/NAME[,format=mjpeg|yuy2][,width=N][,height=N][,fps=N]\n");
+    fprintf(f, "     [,source=yuy2|rgb24|nv12][,transport=bulk|iso][,slots=N]\n");
+    fprintf(f, "     [,speed=full|high][,serial=STR]\n");
+    fprintf(f, "                     camera streaming frames from a shared memory ring\n");
+    fprintf(f, "  ccid:key=HEX[,pin=STR][,data=FILE][,speed=full|high][,serial=STR]\n");
+    fprintf(f, "                     smart card reader with a software token inserted\n");
+    fprintf(f, "  printer:output=FILE|dir=DIR[,idle=MS][,id=IEEE1284][,speed=full|high]\n");
+    fprintf(f, "     [,serial=STR]\n");
+    fprintf(f, "                     printer writing jobs to a file, FIFO or a file per job\n");
+    fprintf(f, "  zero[:pattern=0|1|2][,qlen=N][,speed=low|full|high|wireless|super|super+]\n");
+    fprintf(f, "     [,serial=STR]\n");
+    fprintf(f, "                     gadget zero source/sink and loopback test device\n");
+}
+
+static void
+on_closed(struct usb_device *dev)
+{
+    dev->port = -1;
+    if (--live == 0)
+        loop_quit();
+}
+
+static void
+on_signal(struct loop_watch *w, uint32_t events)
+{
+    struct signalfd_siginfo ssi;
+
+    (void) events;
+
+    if (read(w->fd, &ssi, sizeof(ssi)) == sizeof(ssi))
+        loop_quit();
+}
+
+static struct usb_device *
+create(char *spec)
+{
+    const struct usb_model *model = NULL;
+    struct usb_device *dev;
+    char *opts;
+    int r;
+
+    opts = strchr(spec, ':');
+    if (opts)
+        *opts++ = '\0';
+
+    for (size_t i = 0; models[i]; i++) {
+        if (strcmp(models[i]->name, spec) == 0)
+            model = models[i];
+    }
+
+    if (!model) {
+        fprintf(stderr, "%s: unknown model\n", spec);
+        return NULL;
+    }
+
+    dev = usb_device_new();
+    if (!dev) {
+        fprintf(stderr, "%s: %s\n", spec, strerror(ENOMEM));
+        return NULL;
+    }
+
+    r = model->create(dev, opts ? opts : "");
+    if (r != 0) {
+        fprintf(stderr, "%s: %s\n", spec, strerror(r));
+        usb_device_free(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+/* Creates the n models in specs as one device. */
+static struct usb_device *
+create_composite(char **specs, int n)
+{
+    struct usb_device **parts;
+    struct usb_device *dev;
+    int r;
+
+    if (n == 1)
+        return create(specs[0]);
+
+    parts = calloc(n, sizeof(*parts));
+    dev = usb_device_new();
+    if (!parts || !dev) {
+        fprintf(stderr, "%s: %s\n", specs[0], strerror(ENOMEM));
+        goto fail;
+    }
+
+    for (int i = 0; i < n; i++) {
+        parts[i] = create(specs[i]);
+        if (!parts[i])
+            goto fail;
+    }
+
+    r = composite_create(dev, parts, n);
+    free(parts);
+    if (r == 0)
+        return dev;
+
+    fprintf(stderr, "composite: %s\n", strerror(r));
+    usb_device_free(dev);
+    return NULL;
+
+fail:
+    for (int i = 0; parts && i < n; i++)
+        usb_device_free(parts[i]);
+    free(parts);
+    usb_device_free(dev);
+    return NULL;
+}
+
+static int
+attach(struct usb_device *dev)
+{
+    int socks[2] = { -1, -1 };
+    int r;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks) != 0)
+        return errno;
+
+    r = vhci_attach(dev, socks[0]);
+    close(socks[0]);
+    if (r != 0) {
+        close(socks[1]);
+        return r;
+    }
+
+    r = usb_device_start(dev, socks[1]);
+    if (r != 0) {
+        vhci_detach(dev);
+        close(socks[1]);
+        dev->fd = -1;
+        return r;
+    }
+
+    dev->closed = on_closed;
+    live++;
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct loop_watch sig = { .fd = -1, .func = on_signal };
+    struct usb_device **devs = NULL;
+    int ndevs = 0;
+    sigset_t mask;
+    int ret = EXIT_FAILURE;
+    bool pack = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vhz")) != -1) {
+        switch (opt) {
+        case 'v':
+            usb_verbose = true;
+            break;
+
+        case 'z':
+            pack = true;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (pack && argc - optind == 2) {
+        int e = blk_zimg_pack(argv[optind], argv[optind + 1]);
+
+        if (e != 0)
+            fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(e));
+        return e == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (pack || optind == argc) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (loop_init() != 0)
+        return EXIT_FAILURE;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sig.fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sig.fd < 0 || loop_add(&sig, EPOLLIN) != 0)
+        return EXIT_FAILURE;
+
+    devs = calloc(argc - optind, sizeof(*devs));
+    if (!devs)
+        return EXIT_FAILURE;
+
+    for (int i = optind; i < argc; i++) {
+        char **specs = &argv[i];
+        struct usb_device *dev;
+        int n = 1;
+        int r;
+
+        /* Gather the specs of a composite in place, dropping the +s. */
+        while (i + 2 < argc && strcmp(argv[i + 1], "+") == 0) {
+            specs[n++] = argv[i + 2];
+            i += 2;
+        }
+
+        dev = create_composite(specs, n);
+        if (!dev)
+            goto egress;
+
+        devs[ndevs++] = dev;
+
+        r = attach(dev);
+        if (r != 0) {
+            fprintf(stderr, "%s: unable to attach: %s\n", specs[0], strerror(r));
+            goto egress;
+        }
+    }
+
+    ret = loop_run() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+egress:
+    for (int i = 0; i < ndevs; i++) {
+        vhci_detach(devs[i]);
+        usb_device_free(devs[i]);
+    }
+
+    free(devs);
+    close(sig.fd);
+    return ret;
+}
@@ -0,0 +1,848 @@
+#include "msc.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+    BOT_REQ_GET_MAX_LUN = 0xfe,
+    BOT_REQ_RESET = 0xff,
+};
+
+#define BOT_CBW_SIGNATURE 0x43425355     /* "USBC" */
+#define BOT_CSW_SIGNATURE 0x53425355     /* "USBS" */
+#define BOT_CBW_DATA_IN 0x80
+
+enum {
+    BOT_CSW_GOOD = 0,
+    BOT_CSW_FAILED = 1,
+    BOT_CSW_PHASE_ERROR = 2,
+};
+
+struct bot_cbw {
+    uint32_t dCBWSignature;
+    uint32_t dCBWTag;
+    uint32_t dCBWDataTransferLength;
+    uint8_t bmCBWFlags;
+    uint8_t bCBWLUN;
+    uint8_t bCBWCBLength;
+    uint8_t CBWCB[16];
+} __attribute__((packed));
+
+struct msc_io {
+    struct blk_io io;
+    TAILQ_ENTRY(msc_io) entry;
+    struct msc *m;
+    struct msc_pipe *pipe;
+    struct urb *urb;
+    void *owner;                         /* NULL once orphaned */
+    int err;
+    bool done;
+    uint8_t data[];                      /* a fill, block after block */
+};
+
+static void
+msc_io_done(struct blk_io *bio, int err)
+{
+    struct msc_io *io = container_of(bio, struct msc_io, io);
+    struct msc_pipe *p = io->pipe;
+
+    io->err = err;
+    io->done = true;
+
+    while ((io = TAILQ_FIRST(&p->ios)) && io->done) {
+        TAILQ_REMOVE(&p->ios, io, entry);
+
+        if (io->owner)
+            p->done(io->m, io->owner, io->urb, io->io.op, io->err);
+        else if (io->urb)
+            usb_urb_done(io->urb, 0);
+
+        free(io);
+    }
+}
+
+/* Writes of a fill carry len bytes of block repeated, for lack of a URB. */
+static void
+msc_io_start(struct msc *m, struct msc_pipe *p, struct msc_lun *l, void *owner,
+             struct urb *urb, uint8_t op, uint64_t off, uint64_t len,
+             const uint8_t *block)
+{
+    uint32_t size = l->scsi.block_size;
+    struct msc_io *io = calloc(1, sizeof(*io) + (block ? len : 0));
+    int r;
+
+    if (!io) {
+        p->done(m, owner, urb, op, ENOMEM);
+        return;
+    }
+
+    for (uint64_t i = 0; block && i < len; i += size)
+        memcpy(io->data + i, block, size);
+
+    io->io = (struct blk_io) {
+        .op = op,
+        .buf = block ? io->data : urb ? urb->buf : NULL,
+        .off = off,
+        .len = len,
+        .done = msc_io_done,
+    };
+    io->m = m;
+    io->pipe = p;
+    io->urb = urb;
+    io->owner = owner;
+    TAILQ_INSERT_TAIL(&p->ios, io, entry);
+
+    r = blk_submit(l->blk, &io->io);
+    if (r != EINPROGRESS)
+        msc_io_done(&io->io, r);
+}
+
+void
+msc_io(struct msc *m, struct msc_pipe *p, struct msc_lun *l, void *owner,
+       struct urb *urb, uint8_t op, uint64_t off, uint32_t len)
+{
+    msc_io_start(m, p, l, owner, urb, op, off, len, NULL);
+}
+
+void
+msc_provision(struct msc *m, struct msc_pipe *p, struct msc_lun *l,
+              void *owner, struct scsi_cmd *cmd, uint32_t *pending)
+{
+    uint8_t n = cmd->nreqs;
+
+    /* All are counted first: those done on the spot end as they go. */
+    cmd->nreqs = 0;
+    *pending += n;
+
+    for (uint8_t i = 0; i < n; i++) {
+        const struct scsi_req *r = &cmd->reqs[i];
+
+        msc_io_start(m, p, l, owner, NULL, r->op, r->off, r->len,
+                     r->op == BLK_WRITE ? cmd->buf : NULL);
+    }
+}
+
+void
+msc_io_orphan(struct msc_pipe *p, const void *owner)
+{
+    struct msc_io *io;
+
+    TAILQ_FOREACH(io, &p->ios, entry) {
+        if (!owner || io->owner == owner)
+            io->owner = NULL;
+    }
+}
+
+bool
+msc_file(struct msc_lun *l, struct msc_pipe *p, const struct scsi_cmd *cmd,
+         uint32_t pos, struct urb *urb, uint32_t n)
+{
+    uint64_t off;
+    int fd;
+
+    if (n == 0 || urb->buf != urb->data || !TAILQ_EMPTY(&p->ios))
+        return false;
+
+    fd = scsi_data_file(&l->scsi, cmd, pos, n, &off);
+    if (fd < 0)
+        return false;
+
+    urb->file = fd;
+    urb->file_off = off;
+    return true;
+}
+
+void
+msc_pipe_init(struct msc_pipe *p,
+              void (*done)(struct msc *m, void *owner, struct urb *urb,
+                           uint8_t op, int err))
+{
+    TAILQ_INIT(&p->ios);
+    p->done = done;
+}
+
+uint64_t
+msc_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+msc_account(struct msc_lun *l, uint64_t start)
+{
+    struct msc_stats *st = &l->stats;
+    uint64_t now = msc_now();
+
+    if (st->commands++ == 0)
+        st->first = start;
+    st->last = now;
+    st->ns_sum += now - start;
+    if (now - start > st->ns_max)
+        st->ns_max = now - start;
+}
+
+static void
+msc_reset(struct msc *m)
+{
+    msc_io_orphan(&m->pipe, NULL);
+    m->state = BOT_CBW;
+    m->length = m->pos = m->moved = m->pending = 0;
+}
+
+/* Posts the CSW once the image has caught up with the command. */
+static void
+msc_settle(struct msc *m)
+{
+    if (m->state != BOT_WAIT || m->pending > 0)
+        return;
+
+    if (m->cmd.nreqs > 0) {
+        msc_provision(m, &m->pipe, m->lun, m, &m->cmd, &m->pending);
+        return;
+    }
+
+    if (m->cmd.sync) {
+        m->cmd.sync = false;
+        m->pending++;
+        msc_io(m, &m->pipe, m->lun, m, NULL, BLK_FLUSH, 0, 0);
+        return;
+    }
+
+    m->csw.dCSWDataResidue = htole32(m->length - m->moved);
+    if (m->csw.bCSWStatus == BOT_CSW_GOOD && m->cmd.status != SCSI_GOOD)
+        m->csw.bCSWStatus = BOT_CSW_FAILED;
+    if (m->lun)
+        msc_account(m->lun, m->start);
+
+    m->state = BOT_CSW;
+}
+
+/* Ends the data phase, leaving the CSW for the next bulk IN URB. */
+static void
+msc_status(struct msc *m)
+{
+    if (m->lun && m->cmd.dir == SCSI_DIR_OUT)
+        scsi_done(&m->lun->scsi, &m->cmd);
+
+    m->state = BOT_WAIT;
+    msc_settle(m);
+}
+
+/* Whether urb moves block data through the backend rather than a map. */
+static bool
+msc_async(const struct msc_lun *l, const struct scsi_cmd *cmd,
+          const struct urb *urb)
+{
+    return cmd->block && urb->buf == urb->data && blk_async(l->blk);
+}
+
+static int
+msc_command(struct msc *m, struct urb *urb)
+{
+    struct scsi_cmd *cmd = &m->cmd;
+    struct bot_cbw cbw;
+    bool in;
+
+    if (urb->length != sizeof(cbw))
+        return EPIPE;
+
+    memcpy(&cbw, urb->buf, sizeof(cbw));
+    if (le32toh(cbw.dCBWSignature) != BOT_CBW_SIGNATURE ||
+        cbw.bCBWCBLength == 0 || cbw.bCBWCBLength > sizeof(cbw.CBWCB))
+        return EPIPE;
+
+    urb->actual = sizeof(cbw);
+    m->start = msc_now();
+
+    m->csw = (struct bot_csw) {
+        .dCSWSignature = htole32(BOT_CSW_SIGNATURE),
+        .dCSWTag = cbw.dCBWTag,
+    };
+    m->length = le32toh(cbw.dCBWDataTransferLength);
+    m->pos = m->moved = 0;
+    in = cbw.bmCBWFlags & BOT_CBW_DATA_IN;
+
+    memset(cmd->cdb, 0, sizeof(cmd->cdb));
+    memcpy(cmd->cdb, cbw.CBWCB, cbw.bCBWCBLength);
+
+    m->lun = cbw.bCBWLUN < m->nluns ? &m->luns[cbw.bCBWLUN] : NULL;
+    if (m->lun)
+        scsi_exec(&m->lun->scsi, cmd);
+    else
+        scsi_no_lun(cmd);
+
+    /*
+     * The host and the command disagreeing on the data phase is a phase
+     * error; the host recovers with a reset. A short allocation length is
+     * only truncation.
+     */
+    if (cmd->length > 0 &&
+        (m->length == 0 || in != (cmd->dir == SCSI_DIR_IN) ||
+         (cmd->block && cmd->length > m->length))) {
+        m->csw.bCSWStatus = BOT_CSW_PHASE_ERROR;
+        cmd->length = 0;
+    }
+
+    if (cmd->length > m->length)
+        cmd->length = m->length;
+
+    if (m->length == 0)
+        msc_status(m);
+    else
+        m->state = in ? BOT_DATA_IN : BOT_DATA_OUT;
+
+    return 0;
+}
+
+/*
+ * Completes a data URB, or hands it to the image, and ends the data phase
+ * after the last one. Either way the URB is off the queue before the CSW
+ * is posted.
+ */
+static void
+msc_data_urb(struct msc *m, struct urb *urb, bool async, uint8_t op,
+             uint64_t off, uint32_t n, bool last)
+{
+    if (async)
+        m->pending++;
+    else
+        usb_urb_done(urb, 0);
+
+    if (last)
+        msc_status(m);
+
+    if (async)
+        msc_io(m, &m->pipe, m->lun, m, urb, op, off, n);
+}
+
+static void
+msc_data_out(struct msc *m, struct urb *urb)
+{
+    uint64_t off = m->cmd.offset + m->pos;
+    uint32_t n = 0;
+    bool async;
+
+    if (m->pos < m->cmd.length)
+        n = m->cmd.length - m->pos < urb->length ? m->cmd.length - m->pos : urb->length;
+
+    /* Mapped buffers already hold the data in the image. */
+    async = n > 0 && msc_async(m->lun, &m->cmd, urb);
+    if (n > 0 && urb->buf == urb->data && !async)
+        scsi_data_write(&m->lun->scsi, &m->cmd, m->pos, urb->buf, n);
+
+    urb->actual = urb->length;
+    m->pos += urb->length;
+    m->moved += n;
+
+    msc_data_urb(m, urb, async, BLK_WRITE, off, n, m->pos >= m->length);
+}
+
+static void
+msc_pump(struct msc *m);
+
+static void
+msc_io_end(struct msc *m, void *owner, struct urb *urb, uint8_t op, int err)
+{
+    (void) owner;
+
+    m->pending--;
+    if (err != 0)
+        scsi_io_error(&m->lun->scsi, &m->cmd, op);
+
+    if (urb)
+        usb_urb_done(urb, 0);
+
+    msc_settle(m);
+    msc_pump(m);
+}
+
+static void
+msc_pump(struct msc *m)
+{
+    struct usb_ep *ep = usb_function_ep(&m->func, USBIP_DIR_IN, MSC_EP_IN);
+    struct urb *urb;
+    uint64_t off;
+    uint32_t n;
+    bool async, file;
+
+    while ((urb = TAILQ_FIRST(&ep->queue))) {
+        switch (m->state) {
+        case BOT_DATA_IN:
+            n = 0;
+            if (m->pos < m->cmd.length)
+                n = m->cmd.length - m->pos < urb->length ? m->cmd.length - m->pos : urb->length;
+
+            file = msc_file(m->lun, &m->pipe, &m->cmd, m->pos, urb, n);
+            async = n > 0 && !file && msc_async(m->lun, &m->cmd, urb);
+            if (n > 0 && urb->buf == urb->data && !async && !file)
+                scsi_data_read(&m->lun->scsi, &m->cmd, m->pos, urb->buf, n);
+
+            off = m->cmd.offset + m->pos;
+            urb->actual = n;
+            m->pos += n;
+            m->moved += n;
+
+            /* A short packet ends the data phase early. */
+            usb_ep_dequeue(ep);
+            msc_data_urb(m, urb, async, BLK_READ, off, n,
+                         n < urb->length || m->pos >= m->length);
+            continue;
+
+        case BOT_CSW:
+            if (urb->length < sizeof(m->csw)) {
+                usb_urb_done(urb, EOVERFLOW);
+                continue;
+            }
+
+            memcpy(urb->buf, &m->csw, sizeof(m->csw));
+            urb->actual = sizeof(m->csw);
+            m->state = BOT_CBW;
+            break;
+
+        default:
+            return;
+        }
+
+        usb_urb_done(urb, 0);
+    }
+}
+
+/*
+ * Only hand out the mapping to a URB that is processed on arrival: a bulk
+ * IN URB queued behind others would be pointed at the wrong offset. IN
+ * data the image file holds is better spliced than mapped.
+ */
+static void *
+msc_buffer(struct usb_function *f, struct usb_ep *ep, uint32_t len)
+{
+    struct msc *m = (struct msc *) f;
+    bool in = ep->desc->bEndpointAddress & USB_ENDPOINT_DIR_IN;
+    uint32_t left;
+    uint64_t off;
+
+    if (m->uas && f->dev->alt[ep->intf] == 1)
+        return uas_buffer(m, ep, len);
+
+    if (m->pos >= m->cmd.length || !m->cmd.block)
+        return NULL;
+
+    left = m->cmd.length - m->pos;
+
+    if (in) {
+        if (m->state != BOT_DATA_IN || !TAILQ_EMPTY(&ep->queue) ||
+            scsi_data_file(&m->lun->scsi, &m->cmd, m->pos, len < left ? len : left, &off) >= 0)
+            return NULL;
+        return scsi_data_map(&m->lun->scsi, &m->cmd, m->pos, len < left ? len : left);
+    }
+
+    if (m->state != BOT_DATA_OUT || len > left)
+        return NULL;
+    return scsi_data_map(&m->lun->scsi, &m->cmd, m->pos, len);
+}
+
+static void
+msc_submit(struct usb_function *f, struct urb *urb)
+{
+    struct msc *m = (struct msc *) f;
+
+    if (m->uas && f->dev->alt[urb->ep->intf] == 1) {
+        uas_submit(m, urb);
+        return;
+    }
+
+    if (urb->dir == USBIP_DIR_IN) {
+        usb_ep_queue(urb);
+        msc_pump(m);
+        return;
+    }
+
+    switch (m->state) {
+    case BOT_CBW:
+        usb_urb_done(urb, msc_command(m, urb));
+        break;
+
+    case BOT_DATA_OUT:
+        msc_data_out(m, urb);
+        break;
+
+    default:
+        usb_urb_done(urb, EPIPE);
+        return;
+    }
+
+    msc_pump(m);
+}
+
+static int
+msc_setup(struct usb_function *f, struct urb *urb)
+{
+    struct msc *m = (struct msc *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case BOT_REQ_RESET:
+        msc_reset(m);
+        return 0;
+
+    case BOT_REQ_GET_MAX_LUN:
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = m->nluns - 1;
+        urb->actual = 1;
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+msc_disable(struct usb_function *f)
+{
+    struct msc *m = (struct msc *) f;
+
+    msc_reset(m);
+    if (m->uas)
+        uas_reset(m);
+}
+
+static void
+msc_set_alt(struct usb_function *f, uint8_t intf, uint8_t alt)
+{
+    (void) intf;
+    (void) alt;
+
+    msc_disable(f);
+}
+
+static void
+msc_stats(const struct msc *m, uint8_t i)
+{
+    const struct msc_stats *st = &m->luns[i].stats;
+    uint64_t span = st->last - st->first;
+
+    if (st->commands == 0)
+        return;
+
+    fprintf(stderr, "msc: lun %u: %llu commands, %llu IOPS, latency mean %llu us "
+            "max %llu us\n", i, (unsigned long long) st->commands,
+            (unsigned long long) (span ? st->commands * 1000000000ull / span : 0),
+            (unsigned long long) (st->ns_sum / st->commands / 1000),
+            (unsigned long long) (st->ns_max / 1000));
+}
+
+static void
+msc_destroy(struct usb_function *f)
+{
+    struct msc *m = (struct msc *) f;
+
+    msc_disable(f);
+    for (uint8_t i = 0; i < MSC_MAX_LUNS; i++) {
+        if (!m->luns[i].blk)
+            continue;
+
+        msc_stats(m, i);
+        blk_flush(m->luns[i].blk);
+        blk_close(m->luns[i].blk);
+    }
+    uas_free(m->uas);
+    free(m);
+}
+
+static const struct usb_function_ops msc_ops = {
+    .setup = msc_setup,
+    .submit = msc_submit,
+    .buffer = msc_buffer,
+    .set_alt = msc_set_alt,
+    .disable = msc_disable,
+    .destroy = msc_destroy,
+};
+
+static int
+msc_descriptors(struct usb_device *dev, const char *serial, bool uas,
+                bool cdrom)
+{
+    uint16_t mps = dev->speed >= USB_SPEED_HIGH ? 512 : 64;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(cdrom ? 0x000f : uas ? 0x0007 : 0x0006),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = 3,
+        .bNumConfigurations = 1,
+    };
+    struct msc_config c = {
+        .config = {
+            .bLength = sizeof(c.config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(c)),
+            .bNumInterfaces = 1,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE,
+            .bMaxPower = 250,
+        },
+        .intf = {
+            .bLength = sizeof(c.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_MASS_STORAGE,
+            .bInterfaceSubClass = MSC_SUBCLASS_SCSI,
+            .bInterfaceProtocol = MSC_PROTO_BOT,
+        },
+        .in = {
+            .bLength = sizeof(c.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | MSC_EP_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+        .out = {
+            .bLength = sizeof(c.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = MSC_EP_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+    };
+    int r;
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0 && uas)
+        r = uas_descriptors(dev, &c);
+    else if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, cdrom ? "usbemu DVD Drive" :
+                              uas ? "usbemu UAS Storage" : "usbemu Mass Storage");
+    /* usb-storage wants a serial number of at least 12 characters. */
+    if (r == 0)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+/* What the options say about one LUN's image. */
+struct msc_image {
+    const char *path, *overlay;
+    const char *vendor, *product;
+    unsigned long readahead;             /* KB */
+    unsigned long cache, cache_bg;
+    unsigned int flags;
+    bool removable;
+    bool cdrom;
+};
+
+static int
+msc_lun_open(struct msc_lun *l, const struct msc_image *im, uint8_t i,
+             const char *serial, bool thread)
+{
+    int r;
+
+    if (im->overlay)
+        r = blk_cow_open(im->path, im->overlay, im->flags, &l->blk);
+    else
+        r = blk_open(im->path, im->flags, &l->blk);
+    if (r == 0 && thread && !blk_async(l->blk))
+        r = blk_thread_open(l->blk, &l->blk);
+    if (r == 0 && im->cache && !l->blk->readonly)
+        r = blk_cache_open(l->blk, im->cache * 1024, im->cache_bg * 1024, &l->blk);
+    if (r == 0)
+        r = scsi_lun_init(&l->scsi, l->blk, im->cdrom ? 2048 : 512);
+    if (r != 0)
+        return r;
+
+    l->scsi.mmc = im->cdrom;
+    l->scsi.removable = im->removable || im->cdrom;
+    if (im->cdrom)
+        snprintf(l->scsi.product, sizeof(l->scsi.product), "DVD-ROM");
+    l->scsi.readahead = im->readahead * 1024;
+    if (im->vendor)
+        snprintf(l->scsi.vendor, sizeof(l->scsi.vendor), "%s", im->vendor);
+    if (im->product)
+        snprintf(l->scsi.product, sizeof(l->scsi.product), "%s", im->product);
+
+    /* Each LUN is a disk of its own to the host, with a serial to match. */
+    if (i == 0)
+        snprintf(l->scsi.serial, sizeof(l->scsi.serial), "%s", serial);
+    else
+        snprintf(l->scsi.serial, sizeof(l->scsi.serial), "%s-%u", serial, i);
+
+    return 0;
+}
+
+/*
+ * Every image= option starts a LUN. The options about images apply to the
+ * last one before them, or to the first. An optical drive has every image
+ * as a disc; elsewhere, cdrom makes one.
+ */
+static int
+msc_init(struct usb_device *dev, char *opts, bool uas, bool cdrom)
+{
+    enum {
+        IMAGE, RO, REMOVABLE, SPEED, SERIAL, VENDOR, PRODUCT, IO, READAHEAD,
+        CACHE, CACHE_BG, OVERLAY, CDROM,
+    };
+    char *const tokens[] = {
+        [IMAGE] = "image", [RO] = "ro", [REMOVABLE] = "removable",
+        [SPEED] = "speed", [SERIAL] = "serial", [VENDOR] = "vendor",
+        [PRODUCT] = "product", [IO] = "io", [READAHEAD] = "readahead",
+        [CACHE] = "cache", [CACHE_BG] = "cache_bg", [OVERLAY] = "overlay",
+        [CDROM] = "cdrom",
+        NULL
+    };
+    struct msc_image images[MSC_MAX_LUNS] = {{ 0 }};
+    struct msc_image *im = images;
+    const char *serial = "000000000001";
+    uint8_t nluns = 0;
+    struct msc *m;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_HIGH;
+    for (uint8_t i = 0; i < MSC_MAX_LUNS; i++) {
+        images[i].readahead = SCSI_READAHEAD / 1024;
+        images[i].cdrom = cdrom;
+    }
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case RO:        im->flags |= BLK_RDONLY; break;
+        case REMOVABLE: im->removable = true; break;
+        case SERIAL:    serial = value; break;
+        case VENDOR:    im->vendor = value; break;
+        case PRODUCT:   im->product = value; break;
+        case OVERLAY:   im->overlay = value; break;
+        case CDROM:     im->cdrom = true; break;
+
+        case IMAGE:
+            if (nluns == MSC_MAX_LUNS)
+                return EINVAL;
+            im = &images[nluns++];
+            im->path = value;
+            break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed < USB_SPEED_FULL)
+                return EINVAL;
+            break;
+
+        case READAHEAD:
+            if (!value || (im->readahead = strtoul(value, NULL, 0)) > 65536)
+                return EINVAL;
+            break;
+
+        case CACHE:
+            if (!value || (im->cache = strtoul(value, NULL, 0)) > 4 * 1024 * 1024)
+                return EINVAL;
+            break;
+
+        case CACHE_BG:
+            if (!value || (im->cache_bg = strtoul(value, NULL, 0)) == 0)
+                return EINVAL;
+            break;
+
+        case IO:
+            if (value && strcmp(value, "uring") == 0)
+                im->flags |= BLK_ASYNC;
+            else if (!value || strcmp(value, "mmap") != 0)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    if (nluns == 0 || !serial)
+        return EINVAL;
+
+    for (uint8_t i = 0; i < nluns; i++) {
+        im = &images[i];
+        if (!im->path || (im->cache_bg && im->cache_bg > im->cache))
+            return EINVAL;
+
+        /* Discs are read-only, whatever the image file allows. */
+        if (im->cdrom)
+            im->flags |= BLK_RDONLY;
+
+        /* Write-back starts at a quarter of the dirty limit by default. */
+        if (im->cache && !im->cache_bg)
+            im->cache_bg = (im->cache + 3) / 4;
+    }
+
+    m = calloc(1, sizeof(*m));
+    if (!m)
+        return ENOMEM;
+
+    usb_device_function(dev, &m->func, &msc_ops);
+    msc_pipe_init(&m->pipe, msc_io_end);
+
+    if (uas) {
+        m->uas = uas_new();
+        if (!m->uas)
+            return ENOMEM;
+    }
+
+    for (uint8_t i = 0; i < nluns; i++) {
+        r = msc_lun_open(&m->luns[i], &images[i], i, serial, nluns > 1);
+        if (r != 0)
+            return r;
+
+        m->luns[i].scsi.nluns = nluns;
+    }
+    m->nluns = nluns;
+
+    return msc_descriptors(dev, serial, uas, cdrom);
+}
+
+static int
+msc_create(struct usb_device *dev, char *opts)
+{
+    return msc_init(dev, opts, false, false);
+}
+
+static int
+uas_create(struct usb_device *dev, char *opts)
+{
+    return msc_init(dev, opts, true, false);
+}
+
+static int
+cdrom_create(struct usb_device *dev, char *opts)
+{
+    return msc_init(dev, opts, false, true);
+}
+
+const struct usb_model usb_model_msc = {
+    .name = "msc",
+    .create = msc_create,
+};
+
+const struct usb_model usb_model_uas = {
+    .name = "uas",
+    .create = uas_create,
+};
+
+const struct usb_model usb_model_cdrom = {
+    .name = "cdrom",
+    .create = cdrom_create,
+};
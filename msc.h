@@ -0,0 +1,159 @@
+#pragma once
+
+#include "blk.h"
+#include "scsi.h"
+#include "usb.h"
+
+#define USB_CLASS_MASS_STORAGE 0x08
+#define MSC_SUBCLASS_SCSI 0x06
+#define MSC_PROTO_BOT 0x50
+
+#define MSC_EP_OUT 1
+#define MSC_EP_IN 2
+
+#define MSC_MAX_LUNS 16
+
+struct bot_csw {
+    uint32_t dCSWSignature;
+    uint32_t dCSWTag;
+    uint32_t dCSWDataResidue;
+    uint8_t bCSWStatus;
+} __attribute__((packed));
+
+struct msc_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor in;
+    struct usb_endpoint_descriptor out;
+} __attribute__((packed));
+
+enum bot_state {
+    BOT_CBW,
+    BOT_DATA_IN,
+    BOT_DATA_OUT,
+    BOT_WAIT,                            /* on the image, for the CSW */
+    BOT_CSW,
+};
+
+struct msc;
+struct msc_io;
+struct uas;
+
+TAILQ_HEAD(msc_io_list, msc_io);
+
+/*
+ * Image requests of a pipe, on an image that does its I/O asynchronously.
+ * They are issued as their URBs arrive but end in order, each through
+ * done() with the command that made it; urb is NULL for a flush.
+ */
+struct msc_pipe {
+    struct msc_io_list ios;
+    void (*done)(struct msc *m, void *owner, struct urb *urb, uint8_t op,
+                 int err);
+};
+
+struct msc_stats {
+    uint64_t commands;
+    uint64_t ns_sum;                     /* command in to status ready */
+    uint64_t ns_max;
+    uint64_t first, last;                /* ns, first command in, last out */
+};
+
+/*
+ * A logical unit and its image. On a device with several, a synchronous
+ * image runs on a thread of its own, and UAS queues each LUN's flushes,
+ * UNMAPs and WRITE SAMEs on a pipe of their own, so that a slow image only
+ * holds up its own LUN.
+ */
+struct msc_lun {
+    struct scsi_lun scsi;
+    struct blk *blk;
+    struct msc_stats stats;
+};
+
+/*
+ * Bulk-Only Transport in front of the SCSI layer, with UAS as alternate
+ * setting 1 when uas is set. IN data of READ commands is spliced from the
+ * image file to the socket. Other data phase URBs of READ and WRITE are
+ * given the image mapping as their buffer, so IN data goes from the page
+ * cache to the socket and OUT data is received straight into it. Only
+ * commands that answer from scsi_cmd.buf, and images that have neither,
+ * take a copy.
+ *
+ * An asynchronous image cannot be mapped: its data URBs are read into and
+ * written from their own buffers by the backend, and complete when it is
+ * done. The CSW waits for the last of them and for any flush.
+ */
+struct msc {
+    struct usb_function func;
+    struct msc_lun luns[MSC_MAX_LUNS];
+    uint8_t nluns;
+    struct uas *uas;
+
+    enum bot_state state;
+    struct msc_lun *lun;                 /* of cmd, NULL if there is none */
+    uint64_t start;                      /* ns, the CBW arrived */
+    struct scsi_cmd cmd;
+    struct bot_csw csw;
+    uint32_t length;                     /* dCBWDataTransferLength */
+    uint32_t pos;                        /* data phase bytes so far */
+    uint32_t moved;                      /* of which the command used */
+    uint32_t pending;                    /* image requests in flight */
+    struct msc_pipe pipe;
+};
+
+void
+msc_pipe_init(struct msc_pipe *p,
+              void (*done)(struct msc *m, void *owner, struct urb *urb,
+                           uint8_t op, int err));
+
+/* Starts op on len bytes at off of l's image for owner, through urb->buf. */
+void
+msc_io(struct msc *m, struct msc_pipe *p, struct msc_lun *l, void *owner,
+       struct urb *urb, uint8_t op, uint64_t off, uint32_t len);
+
+/*
+ * Issues the image requests UNMAP or WRITE SAME left in cmd on p for
+ * owner, counting them in pending.
+ */
+void
+msc_provision(struct msc *m, struct msc_pipe *p, struct msc_lun *l,
+              void *owner, struct scsi_cmd *cmd, uint32_t *pending);
+
+/*
+ * Has an IN urb send its n bytes at pos of cmd from l's image file, if
+ * there is one and no request on p has yet to end ahead of it.
+ */
+bool
+msc_file(struct msc_lun *l, struct msc_pipe *p, const struct scsi_cmd *cmd,
+         uint32_t pos, struct urb *urb, uint32_t n);
+
+/* Forgets owner's requests, or all with NULL; their URBs just complete. */
+void
+msc_io_orphan(struct msc_pipe *p, const void *owner);
+
+uint64_t
+msc_now(void);
+
+/* Counts a command that came in at start, once its status is ready. */
+void
+msc_account(struct msc_lun *l, uint64_t start);
+
+/* uas.c */
+struct uas *
+uas_new(void);
+
+void
+uas_free(struct uas *u);
+
+int
+uas_descriptors(struct usb_device *dev, struct msc_config *bot);
+
+void
+uas_submit(struct msc *m, struct urb *urb);
+
+void *
+uas_buffer(struct msc *m, struct usb_ep *ep, uint32_t len);
+
+void
+uas_reset(struct msc *m);
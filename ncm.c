@@ -0,0 +1,656 @@
+#include "usb.h"
+
+#include <sys/ioctl.h>
+
+#include <linux/if_tun.h>
+#include <net/if.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USB_CLASS_COMM 0x02
+#define USB_CLASS_CDC_DATA 0x0a
+#define USB_CDC_SUBCLASS_NCM 0x0d
+#define USB_CDC_PROTO_NTB 0x01
+#define USB_DT_CS_INTERFACE 0x24
+
+#define NCM_EP_OUT 1
+#define NCM_EP_IN 2
+#define NCM_EP_NOTIFY 3
+
+#define NCM_INTF_COMM 0
+#define NCM_INTF_DATA 1
+
+#define NCM_NTB_MAX 32768
+#define NCM_ALIGN 4
+#define NCM_FRAME_MAX 1514
+#define NCM_DATAGRAMS_MAX 40
+
+#define NCM_NTH16_SIGNATURE 0x484d434e   /* "NCMH" */
+#define NCM_NDP16_SIGNATURE 0x304d434e   /* "NCM0" */
+#define NCM_NDP16_CRC_SIGNATURE 0x314d434e
+
+enum {
+    CDC_REQ_SET_ETHERNET_PACKET_FILTER = 0x43,
+    NCM_REQ_GET_NTB_PARAMETERS = 0x80,
+    NCM_REQ_GET_NTB_FORMAT = 0x83,
+    NCM_REQ_SET_NTB_FORMAT = 0x84,
+    NCM_REQ_GET_NTB_INPUT_SIZE = 0x85,
+    NCM_REQ_SET_NTB_INPUT_SIZE = 0x86,
+};
+
+enum {
+    CDC_NOTIFY_NETWORK_CONNECTION = 0x00,
+    CDC_NOTIFY_SPEED_CHANGE = 0x2a,
+};
+
+struct ncm_ntb_parameters {
+    uint16_t wLength;
+    uint16_t bmNtbFormatsSupported;
+    uint32_t dwNtbInMaxSize;
+    uint16_t wNdpInDivisor;
+    uint16_t wNdpInPayloadRemainder;
+    uint16_t wNdpInAlignment;
+    uint16_t wPadding1;
+    uint32_t dwNtbOutMaxSize;
+    uint16_t wNdpOutDivisor;
+    uint16_t wNdpOutPayloadRemainder;
+    uint16_t wNdpOutAlignment;
+    uint16_t wNtbOutMaxDatagrams;
+} __attribute__((packed));
+
+struct ncm_nth16 {
+    uint32_t dwSignature;
+    uint16_t wHeaderLength;
+    uint16_t wSequence;
+    uint16_t wBlockLength;
+    uint16_t wNdpIndex;
+} __attribute__((packed));
+
+struct ncm_ndp16 {
+    uint32_t dwSignature;
+    uint16_t wLength;
+    uint16_t wNextNdpIndex;
+    struct {
+        uint16_t wDatagramIndex;
+        uint16_t wDatagramLength;
+    } __attribute__((packed)) dpe[];
+} __attribute__((packed));
+
+struct cdc_notification {
+    uint8_t bmRequestType;
+    uint8_t bNotificationType;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+    uint32_t data[2];
+} __attribute__((packed));
+
+struct ncm_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor comm;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint16_t bcdCDC;
+    } __attribute__((packed)) header;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint8_t bMasterInterface0;
+        uint8_t bSlaveInterface0;
+    } __attribute__((packed)) unio;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint8_t iMACAddress;
+        uint32_t bmEthernetStatistics;
+        uint16_t wMaxSegmentSize;
+        uint16_t wNumberMCFilters;
+        uint8_t bNumberPowerFilters;
+    } __attribute__((packed)) ether;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bDescriptorSubType;
+        uint16_t bcdNcmVersion;
+        uint8_t bmNetworkCapabilities;
+    } __attribute__((packed)) ncm;
+    struct usb_endpoint_descriptor notify;
+    struct usb_interface_descriptor data0;
+    struct usb_interface_descriptor data1;
+    struct usb_endpoint_descriptor in;
+    struct usb_endpoint_descriptor out;
+} __attribute__((packed));
+
+/*
+ * Frames are read from the TAP device straight into the datagram slots of
+ * the bulk IN URB, packing as many as are waiting into one NTB before the
+ * NDP is written after them. Bulk OUT NTBs are walked in place and every
+ * datagram is written to the TAP device from the URB buffer.
+ */
+struct ncm {
+    struct usb_function func;
+    struct loop_watch tap;
+    uint32_t events;
+
+    uint32_t in_max;                     /* dwNtbInMaxSize set by the host */
+    uint16_t sequence;
+    uint8_t notify;                      /* notifications still to send */
+    uint32_t bitrate;
+};
+
+#define NCM_NOTIFY_SPEED 0x01
+#define NCM_NOTIFY_CONNECT 0x02
+
+static size_t
+ncm_align(size_t off)
+{
+    return (off + NCM_ALIGN - 1) & ~(size_t) (NCM_ALIGN - 1);
+}
+
+static void
+ncm_poll(struct ncm *n)
+{
+    uint32_t events = 0;
+
+    if (!TAILQ_EMPTY(&usb_function_ep(&n->func, USBIP_DIR_IN, NCM_EP_IN)->queue))
+        events |= EPOLLIN;
+
+    if (events != n->events && loop_mod(&n->tap, events) == 0)
+        n->events = events;
+}
+
+/* Returns the NTB length, or 0 if no frame was waiting. */
+static size_t
+ncm_fill(struct ncm *n, struct urb *urb)
+{
+    uint32_t max = urb->length < n->in_max ? urb->length : n->in_max;
+    struct ncm_nth16 *nth = (void *) urb->buf;
+    struct ncm_ndp16 *ndp;
+    uint16_t index[NCM_DATAGRAMS_MAX];
+    uint16_t length[NCM_DATAGRAMS_MAX];
+    size_t off = ncm_align(sizeof(*nth));
+    size_t count = 0;
+    size_t ndplen;
+    ssize_t r;
+
+    while (count < NCM_DATAGRAMS_MAX) {
+        /* Room for one more frame and the NDP that will describe it. */
+        ndplen = sizeof(*ndp) + (count + 2) * sizeof(ndp->dpe[0]);
+        if (ncm_align(off + NCM_FRAME_MAX) + ndplen > max)
+            break;
+
+        r = read(n->tap.fd, urb->buf + off, NCM_FRAME_MAX);
+        if (r <= 0)
+            break;
+
+        index[count] = off;
+        length[count] = r;
+        count++;
+        off = ncm_align(off + r);
+    }
+
+    if (count == 0)
+        return 0;
+
+    ndplen = sizeof(*ndp) + (count + 1) * sizeof(ndp->dpe[0]);
+    ndp = (void *) (urb->buf + off);
+    ndp->dwSignature = htole32(NCM_NDP16_SIGNATURE);
+    ndp->wLength = htole16(ndplen);
+    ndp->wNextNdpIndex = 0;
+    for (size_t i = 0; i < count; i++) {
+        ndp->dpe[i].wDatagramIndex = htole16(index[i]);
+        ndp->dpe[i].wDatagramLength = htole16(length[i]);
+    }
+    ndp->dpe[count].wDatagramIndex = 0;
+    ndp->dpe[count].wDatagramLength = 0;
+
+    nth->dwSignature = htole32(NCM_NTH16_SIGNATURE);
+    nth->wHeaderLength = htole16(sizeof(*nth));
+    nth->wSequence = htole16(n->sequence++);
+    nth->wBlockLength = htole16(off + ndplen);
+    nth->wNdpIndex = htole16(off);
+
+    return off + ndplen;
+}
+
+static void
+ncm_read(struct ncm *n)
+{
+    struct usb_ep *ep = usb_function_ep(&n->func, USBIP_DIR_IN, NCM_EP_IN);
+    struct urb *urb;
+    size_t len;
+
+    while ((urb = TAILQ_FIRST(&ep->queue))) {
+        len = ncm_fill(n, urb);
+        if (len == 0)
+            break;
+
+        urb->actual = len;
+        usb_urb_done(urb, 0);
+    }
+}
+
+/* A malformed NTB is dropped whole, as a NIC drops a bad frame. */
+static void
+ncm_write(struct ncm *n, struct urb *urb)
+{
+    const struct ncm_nth16 *nth = (const void *) urb->buf;
+    const struct ncm_ndp16 *ndp;
+    size_t block, idx, len, entries;
+
+    if (urb->length < sizeof(*nth) ||
+        le32toh(nth->dwSignature) != NCM_NTH16_SIGNATURE ||
+        le16toh(nth->wHeaderLength) != sizeof(*nth))
+        return;
+
+    block = le16toh(nth->wBlockLength);
+    if (block == 0 || block > urb->length)
+        block = urb->length;
+
+    /* Each NDP must lie past the header, which bounds the chain. */
+    for (idx = le16toh(nth->wNdpIndex); idx >= sizeof(*nth);
+         idx = le16toh(ndp->wNextNdpIndex)) {
+        if (idx + sizeof(*ndp) > block)
+            return;
+
+        ndp = (const void *) (urb->buf + idx);
+        if (le32toh(ndp->dwSignature) != NCM_NDP16_SIGNATURE &&
+            le32toh(ndp->dwSignature) != NCM_NDP16_CRC_SIGNATURE)
+            return;
+
+        len = le16toh(ndp->wLength);
+        if (len < sizeof(*ndp) || idx + len > block)
+            return;
+
+        entries = (len - sizeof(*ndp)) / sizeof(ndp->dpe[0]);
+        for (size_t i = 0; i < entries; i++) {
+            size_t di = le16toh(ndp->dpe[i].wDatagramIndex);
+            size_t dl = le16toh(ndp->dpe[i].wDatagramLength);
+
+            if (di == 0 || dl == 0)
+                break;
+            if (di + dl > block)
+                return;
+
+            /* A full TAP queue drops the frame, as a busy link would. */
+            if (write(n->tap.fd, urb->buf + di, dl) < 0 && errno != EAGAIN)
+                return;
+        }
+
+        if (le16toh(ndp->wNextNdpIndex) <= idx)
+            break;
+    }
+}
+
+static void
+ncm_notify(struct ncm *n)
+{
+    struct usb_ep *ep = usb_function_ep(&n->func, USBIP_DIR_IN, NCM_EP_NOTIFY);
+    struct cdc_notification note = {
+        .bmRequestType = 0xa1,
+        .wIndex = htole16(n->func.intf + NCM_INTF_COMM),
+    };
+    struct urb *urb;
+    size_t len = 8;
+
+    while (n->notify && (urb = TAILQ_FIRST(&ep->queue))) {
+        if (n->notify & NCM_NOTIFY_SPEED) {
+            note.bNotificationType = CDC_NOTIFY_SPEED_CHANGE;
+            note.wValue = 0;
+            note.wLength = htole16(sizeof(note.data));
+            note.data[0] = note.data[1] = htole32(n->bitrate);
+            len = sizeof(note);
+            n->notify &= ~NCM_NOTIFY_SPEED;
+        } else {
+            note.bNotificationType = CDC_NOTIFY_NETWORK_CONNECTION;
+            note.wValue = htole16(1);
+            note.wLength = 0;
+            len = 8;
+            n->notify &= ~NCM_NOTIFY_CONNECT;
+        }
+
+        urb->actual = len < urb->length ? len : urb->length;
+        memcpy(urb->buf, &note, urb->actual);
+        usb_urb_done(urb, 0);
+    }
+}
+
+static void
+ncm_io(struct loop_watch *w, uint32_t events)
+{
+    struct ncm *n = container_of(w, struct ncm, tap);
+
+    if (events & EPOLLIN)
+        ncm_read(n);
+
+    ncm_poll(n);
+}
+
+static void
+ncm_submit(struct usb_function *f, struct urb *urb)
+{
+    struct ncm *n = (struct ncm *) f;
+
+    if (urb->dir == USBIP_DIR_OUT) {
+        ncm_write(n, urb);
+        urb->actual = urb->length;
+        usb_urb_done(urb, 0);
+        return;
+    }
+
+    usb_ep_queue(urb);
+
+    if (urb->ep == usb_function_ep(f, USBIP_DIR_IN, NCM_EP_NOTIFY)) {
+        ncm_notify(n);
+        return;
+    }
+
+    ncm_read(n);
+    ncm_poll(n);
+}
+
+static int
+ncm_setup(struct usb_function *f, struct urb *urb)
+{
+    struct ncm *n = (struct ncm *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+    struct ncm_ntb_parameters p = {
+        .wLength = htole16(sizeof(p)),
+        .bmNtbFormatsSupported = htole16(0x0001),     /* NTB16 */
+        .dwNtbInMaxSize = htole32(NCM_NTB_MAX),
+        .wNdpInDivisor = htole16(NCM_ALIGN),
+        .wNdpInAlignment = htole16(NCM_ALIGN),
+        .dwNtbOutMaxSize = htole32(NCM_NTB_MAX),
+        .wNdpOutDivisor = htole16(NCM_ALIGN),
+        .wNdpOutAlignment = htole16(NCM_ALIGN),
+    };
+    uint32_t size;
+    uint16_t format = 0;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case NCM_REQ_GET_NTB_PARAMETERS:
+        urb->actual = urb->length < sizeof(p) ? urb->length : sizeof(p);
+        memcpy(urb->buf, &p, urb->actual);
+        return 0;
+
+    case NCM_REQ_GET_NTB_INPUT_SIZE:
+        size = htole32(n->in_max);
+        urb->actual = urb->length < sizeof(size) ? urb->length : sizeof(size);
+        memcpy(urb->buf, &size, urb->actual);
+        return 0;
+
+    case NCM_REQ_SET_NTB_INPUT_SIZE:
+        if (urb->length < sizeof(size))
+            return EPIPE;
+        memcpy(&size, urb->buf, sizeof(size));
+        size = le32toh(size);
+        if (size < 2048 || size > NCM_NTB_MAX)
+            return EPIPE;
+        n->in_max = size;
+        urb->actual = urb->length;
+        return 0;
+
+    case NCM_REQ_GET_NTB_FORMAT:
+        urb->actual = urb->length < sizeof(format) ? urb->length : sizeof(format);
+        memcpy(urb->buf, &format, urb->actual);
+        return 0;
+
+    case NCM_REQ_SET_NTB_FORMAT:
+        return s->wValue == 0 ? 0 : EPIPE;
+
+    case CDC_REQ_SET_ETHERNET_PACKET_FILTER:
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+ncm_set_alt(struct usb_function *f, uint8_t intf, uint8_t alt)
+{
+    struct ncm *n = (struct ncm *) f;
+
+    if (intf != NCM_INTF_DATA)
+        return;
+
+    /* The data interface going live is the link coming up. */
+    n->in_max = NCM_NTB_MAX;
+    n->sequence = 0;
+    n->notify = alt == 1 ? NCM_NOTIFY_SPEED | NCM_NOTIFY_CONNECT : 0;
+    ncm_notify(n);
+}
+
+static void
+ncm_disable(struct usb_function *f)
+{
+    struct ncm *n = (struct ncm *) f;
+
+    n->notify = 0;
+    ncm_poll(n);
+}
+
+static void
+ncm_destroy(struct usb_function *f)
+{
+    struct ncm *n = (struct ncm *) f;
+
+    if (n->tap.fd >= 0) {
+        loop_del(&n->tap);
+        close(n->tap.fd);
+    }
+
+    free(n);
+}
+
+static const struct usb_function_ops ncm_ops = {
+    .setup = ncm_setup,
+    .submit = ncm_submit,
+    .set_alt = ncm_set_alt,
+    .disable = ncm_disable,
+    .destroy = ncm_destroy,
+};
+
+static int
+ncm_tap(struct ncm *n, const char *name, unsigned int *ifindex)
+{
+    struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
+
+    if (name && strlen(name) >= sizeof(ifr.ifr_name))
+        return EINVAL;
+    if (name)
+        strcpy(ifr.ifr_name, name);
+
+    n->tap.fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (n->tap.fd < 0)
+        return errno;
+
+    if (ioctl(n->tap.fd, TUNSETIFF, &ifr) != 0)
+        return errno;
+
+    *ifindex = if_nametoindex(ifr.ifr_name);
+    fprintf(stderr, "ncm: %s\n", ifr.ifr_name);
+
+    n->tap.func = ncm_io;
+    return loop_add(&n->tap, 0);
+}
+
+static int
+ncm_descriptors(struct usb_device *dev, const char *mac, const char *serial)
+{
+    uint16_t mps = dev->speed >= USB_SPEED_HIGH ? 512 : 64;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bDeviceClass = USB_CLASS_COMM,
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x0008),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 1,
+    };
+    struct ncm_config c = {
+        .config = {
+            .bLength = sizeof(c.config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(c)),
+            .bNumInterfaces = 2,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE,
+            .bMaxPower = 50,
+        },
+        .comm = {
+            .bLength = sizeof(c.comm),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = NCM_INTF_COMM,
+            .bNumEndpoints = 1,
+            .bInterfaceClass = USB_CLASS_COMM,
+            .bInterfaceSubClass = USB_CDC_SUBCLASS_NCM,
+        },
+        .header = { sizeof(c.header), USB_DT_CS_INTERFACE, 0x00, htole16(0x0110) },
+        .unio = { sizeof(c.unio), USB_DT_CS_INTERFACE, 0x06, NCM_INTF_COMM, NCM_INTF_DATA },
+        .ether = {
+            sizeof(c.ether), USB_DT_CS_INTERFACE, 0x0f, 4, 0,
+            htole16(NCM_FRAME_MAX), 0, 0
+        },
+        .ncm = { sizeof(c.ncm), USB_DT_CS_INTERFACE, 0x1a, htole16(0x0100), 0 },
+        .notify = {
+            .bLength = sizeof(c.notify),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | NCM_EP_NOTIFY,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = htole16(sizeof(struct cdc_notification)),
+            .bInterval = dev->speed >= USB_SPEED_HIGH ? 9 : 32,
+        },
+        .data0 = {
+            .bLength = sizeof(c.data0),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = NCM_INTF_DATA,
+            .bInterfaceClass = USB_CLASS_CDC_DATA,
+            .bInterfaceProtocol = USB_CDC_PROTO_NTB,
+        },
+        .data1 = {
+            .bLength = sizeof(c.data1),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = NCM_INTF_DATA,
+            .bAlternateSetting = 1,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_CDC_DATA,
+            .bInterfaceProtocol = USB_CDC_PROTO_NTB,
+        },
+        .in = {
+            .bLength = sizeof(c.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | NCM_EP_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+        .out = {
+            .bLength = sizeof(c.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = NCM_EP_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+    };
+    int r;
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu CDC-NCM Ethernet");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+    if (r == 0)
+        r = usb_device_string(dev, 4, mac);
+
+    return r;
+}
+
+static int
+ncm_create(struct usb_device *dev, char *opts)
+{
+    enum { TAP, MAC, SPEED, SERIAL };
+    char *const tokens[] = {
+        [TAP] = "tap", [MAC] = "mac", [SPEED] = "speed", [SERIAL] = "serial",
+        NULL
+    };
+    const char *tap = NULL, *mac = NULL, *serial = NULL;
+    char macbuf[13];
+    unsigned int ifindex = 0;
+    struct ncm *n;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_HIGH;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case TAP:    tap = value; break;
+        case MAC:    mac = value; break;
+        case SERIAL: serial = value; break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed < USB_SPEED_FULL)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    /* iMACAddress is twelve hex digits, no separators. */
+    if (mac && (strlen(mac) != 12 || strspn(mac, "0123456789abcdefABCDEF") != 12))
+        return EINVAL;
+
+    n = calloc(1, sizeof(*n));
+    if (!n)
+        return ENOMEM;
+
+    n->tap.fd = -1;
+    n->in_max = NCM_NTB_MAX;
+    /* A 32 bit rate: SuperSpeed reads as the most it can say. */
+    n->bitrate = dev->speed >= USB_SPEED_SUPER ? UINT32_MAX
+               : dev->speed >= USB_SPEED_HIGH ? 480000000 : 12000000;
+    usb_device_function(dev, &n->func, &ncm_ops);
+
+    r = ncm_tap(n, tap, &ifindex);
+    if (r != 0)
+        return r;
+
+    /* The host side address, locally administered and unique per TAP. */
+    if (!mac) {
+        snprintf(macbuf, sizeof(macbuf), "027573%06x", ifindex & 0xffffff);
+        mac = macbuf;
+    }
+
+    return ncm_descriptors(dev, mac, serial);
+}
+
+const struct usb_model usb_model_ncm = {
+    .name = "ncm",
+    .create = ncm_create,
+};
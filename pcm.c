@@ -0,0 +1,104 @@
+#include "pcm.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static size_t
+pcm_size(uint32_t bytes)
+{
+    return sizeof(struct pcm) + bytes;
+}
+
+int
+pcm_create(const char *name, uint32_t rate, uint16_t channels,
+           uint16_t width, uint32_t bytes, struct pcm **pcm)
+{
+    uint32_t size = 4096;
+    struct pcm *p;
+    int fd;
+    int e;
+
+    if (rate == 0 || channels == 0 || width == 0 || bytes > 1u << 30)
+        return EINVAL;
+
+    while (size < bytes)
+        size <<= 1;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return errno;
+
+    if (ftruncate(fd, pcm_size(size)) != 0) {
+        e = errno;
+        close(fd);
+        shm_unlink(name);
+        return e;
+    }
+
+    p = mmap(NULL, pcm_size(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    e = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return e;
+    }
+
+    p->rate = rate;
+    p->channels = channels;
+    p->width = width;
+    p->size = size;
+
+    atomic_thread_fence(memory_order_release);
+    p->magic = PCM_MAGIC;
+    *pcm = p;
+    return 0;
+}
+
+int
+pcm_attach(const char *name, struct pcm **pcm)
+{
+    struct stat st;
+    struct pcm *p;
+    int fd;
+    int e;
+
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return errno;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*p)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    e = errno;
+    close(fd);
+    if (p == MAP_FAILED)
+        return e;
+
+    if (p->magic != PCM_MAGIC || (p->size & (p->size - 1)) != 0 ||
+        pcm_size(p->size) > (size_t) st.st_size) {
+        munmap(p, st.st_size);
+        return EINVAL;
+    }
+
+    *pcm = p;
+    return 0;
+}
+
+void
+pcm_destroy(const char *name, struct pcm *pcm)
+{
+    if (!pcm)
+        return;
+
+    if (name)
+        shm_unlink(name);
+
+    munmap(pcm, pcm_size(pcm->size));
+}
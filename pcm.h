@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A lock-free single-producer single-consumer byte ring of PCM frames in
+ * POSIX shared memory. The emulator creates it with pcm_create(), the
+ * process playing or recording the audio maps it with pcm_attach() and
+ * moves data on its own clock with pcm_read() or pcm_write().
+ *
+ * There is no doorbell: the emulator services the ring once per USB
+ * (micro)frame. It publishes the stream state, the host's mute and volume
+ * settings and its timing statistics in the header. Samples are passed
+ * through untouched.
+ */
+
+#define PCM_MAGIC 0x006d6370 /* "pcm" */
+
+struct pcm_stats {
+    _Atomic uint64_t urbs;               /* completed */
+    _Atomic uint64_t packets;
+    _Atomic uint64_t xruns;              /* packets short of data or room */
+    _Atomic uint64_t gaps;               /* host fell behind the schedule */
+    _Atomic uint64_t late_sum;           /* ns past due, over urbs */
+    _Atomic uint64_t late_sq;            /* ns^2 */
+    _Atomic uint64_t late_max;
+};
+
+struct pcm {
+    uint32_t magic;
+    uint32_t rate;
+    uint16_t channels;
+    uint16_t width;                      /* bytes per sample */
+    uint32_t size;                       /* bytes, a power of two */
+
+    _Atomic uint32_t active;             /* the host is streaming */
+    _Atomic uint32_t mute;
+    _Atomic int32_t volume;              /* 1/256 dB */
+    _Atomic uint32_t feedback;           /* last rate sent, 16.16 per ms */
+
+    _Alignas(64) _Atomic uint32_t head;  /* written by the producer */
+    _Alignas(64) _Atomic uint32_t tail;  /* written by the consumer */
+    _Alignas(64) struct pcm_stats stats;
+
+    _Alignas(64) uint8_t data[];
+};
+
+static inline uint32_t
+pcm_frame(const struct pcm *p)
+{
+    return p->channels * p->width;
+}
+
+/* Bytes queued, as seen from either side. */
+static inline uint32_t
+pcm_avail(struct pcm *p)
+{
+    return atomic_load_explicit(&p->head, memory_order_acquire) -
+           atomic_load_explicit(&p->tail, memory_order_acquire);
+}
+
+static inline uint32_t
+pcm_write(struct pcm *p, const void *buf, uint32_t len)
+{
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    uint32_t off = head & (p->size - 1);
+    uint32_t n;
+
+    if (len > p->size - (head - tail))
+        len = p->size - (head - tail);
+
+    n = len < p->size - off ? len : p->size - off;
+    memcpy(p->data + off, buf, n);
+    memcpy(p->data, (const uint8_t *) buf + n, len - n);
+
+    atomic_store_explicit(&p->head, head + len, memory_order_release);
+    return len;
+}
+
+static inline uint32_t
+pcm_read(struct pcm *p, void *buf, uint32_t len)
+{
+    uint32_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+    uint32_t off = tail & (p->size - 1);
+    uint32_t n;
+
+    if (len > head - tail)
+        len = head - tail;
+
+    n = len < p->size - off ? len : p->size - off;
+    memcpy(buf, p->data + off, n);
+    memcpy((uint8_t *) buf + n, p->data, len - n);
+
+    atomic_store_explicit(&p->tail, tail + len, memory_order_release);
+    return len;
+}
+
+/* bytes is rounded up to a power of two. */
+int
+pcm_create(const char *name, uint32_t rate, uint16_t channels,
+           uint16_t width, uint32_t bytes, struct pcm **pcm);
+
+int
+pcm_attach(const char *name, struct pcm **pcm);
+
+void
+pcm_destroy(const char *name, struct pcm *pcm);
@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+
+#include "usb.h"
+
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USB_CLASS_PRINTER 0x07
+#define USB_PRINTER_SUBCLASS 0x01
+#define USB_PRINTER_PROTO_BIDIR 0x02
+
+#define PRINTER_EP_OUT 1
+#define PRINTER_EP_IN 2
+
+/* As large as an unprivileged process may make it by default. */
+#define PRINTER_PIPE (1 << 20)
+
+enum {
+    PRINTER_GET_DEVICE_ID = 0x00,
+    PRINTER_GET_PORT_STATUS = 0x01,
+    PRINTER_SOFT_RESET = 0x02,
+};
+
+/* GET_PORT_STATUS */
+#define PRINTER_NOT_ERROR (1 << 3)
+#define PRINTER_SELECTED (1 << 4)
+#define PRINTER_PAPER_EMPTY (1 << 5)
+
+struct printer_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor out;
+    struct usb_endpoint_descriptor in;
+} __attribute__((packed));
+
+/*
+ * Job data enters user space only behind a full FIFO: each bulk OUT
+ * payload is spliced off the USB/IP socket through pipe[] into the output.
+ * Either all of the output is one stream, or with a directory each job gets
+ * a file of its own, a job ending when the host goes idle for a while or
+ * resets the printer.
+ *
+ * A FIFO is written without blocking. What it has no room for is held
+ * in backlog[] and the URBs it came in wait on the endpoint, as acm's do,
+ * until the FIFO drains; only this device waits for a slow reader.
+ *
+ * A write that fails (a full disk, say) stalls the rest of the job; its
+ * data is drained from the socket and dropped.
+ */
+struct printer {
+    struct usb_function func;
+    struct usb_desc id;                  /* GET_DEVICE_ID response */
+    struct loop_watch idle;
+    uint64_t timeout;                    /* ms */
+
+    char *path;                          /* output file or FIFO */
+    char *dir;                           /* a file per job instead */
+    bool fifo;
+    int pipe[2];
+    int out;
+    int error;
+    struct loop_watch full;              /* the FIFO, for EPOLLOUT */
+
+    uint8_t *backlog;                    /* bytes the FIFO had no room for */
+    size_t sent, held, cap;
+
+    unsigned int jobs;
+    uint64_t bytes;                      /* this job */
+    uint64_t start;                      /* ns */
+};
+
+static uint64_t
+printer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+printer_end(struct printer *p)
+{
+    uint64_t ns = printer_now() - p->start;
+
+    if (p->bytes > 0)
+        fprintf(stderr, "printer: job %u: %llu bytes in %llu ms%s\n", p->jobs,
+                (unsigned long long) p->bytes,
+                (unsigned long long) (ns / 1000000), p->error ? ", failed" : "");
+
+    if (p->dir && p->out >= 0) {
+        close(p->out);
+        p->out = -1;
+    }
+
+    if (p->dir)
+        p->error = 0;
+
+    p->bytes = 0;
+}
+
+static void
+printer_begin(struct printer *p)
+{
+    char path[PATH_MAX];
+
+    p->jobs++;
+    p->start = printer_now();
+
+    if (!p->dir || p->error)
+        return;
+
+    snprintf(path, sizeof(path), "%s/job-%04u.prn", p->dir, p->jobs);
+    p->out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (p->out < 0)
+        p->error = errno;
+}
+
+/* Appends *n bytes from pipe[] to the backlog, counting them off *n. */
+static int
+printer_hold(struct printer *p, size_t *n)
+{
+    ssize_t m;
+
+    if (p->held == 0)
+        p->sent = 0;
+
+    if (p->sent + p->held + *n > p->cap) {
+        size_t cap = p->cap ? p->cap : 65536;
+        uint8_t *b;
+
+        while (cap < p->sent + p->held + *n)
+            cap *= 2;
+
+        b = realloc(p->backlog, cap);
+        if (!b)
+            return ENOMEM;
+
+        p->backlog = b;
+        p->cap = cap;
+    }
+
+    while (*n > 0) {
+        m = read(p->pipe[0], p->backlog + p->sent + p->held, *n);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0)
+            return m < 0 ? errno : EIO;
+
+        p->held += m;
+        *n -= m;
+    }
+
+    return 0;
+}
+
+/*
+ * Moves n bytes from pipe[] to the output, or to the backlog behind a full
+ * FIFO, or drops them once it fails.
+ */
+static void
+printer_drain(struct printer *p, size_t n)
+{
+    char scrap[4096];
+    ssize_t m;
+
+    while (n > 0 && !p->error && p->held == 0) {
+        m = splice(p->pipe[0], NULL, p->out, NULL, n,
+                   SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0 && errno == EAGAIN)
+            break;
+        if (m <= 0)
+            p->error = m < 0 ? errno : EIO;
+        else
+            n -= m;
+    }
+
+    if (n > 0 && !p->error) {
+        p->error = printer_hold(p, &n);
+        if (!p->error)
+            return;
+
+        /* The job fails; so do the URBs waiting on the backlog. */
+        p->held = 0;
+        usb_ep_flush(usb_function_ep(&p->func, USBIP_DIR_OUT, PRINTER_EP_OUT), EPIPE);
+    }
+
+    while (n > 0 && (m = read(p->pipe[0], scrap, n < sizeof(scrap) ? n : sizeof(scrap))) > 0)
+        n -= m;
+}
+
+static int
+printer_recv(struct usb_function *f, struct urb *urb, int fd)
+{
+    struct printer *p = (struct printer *) f;
+    uint32_t left = urb->length;
+    size_t held = p->held;
+    ssize_t n;
+
+    if (p->bytes == 0)
+        printer_begin(p);
+
+    while (left > 0) {
+        n = splice(fd, NULL, p->pipe[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EPROTO;
+
+        printer_drain(p, n);
+        left -= n;
+    }
+
+    /* What went to the backlog is still owed: the URB waits for it. */
+    p->bytes += urb->length;
+    urb->actual = p->error ? 0 : urb->length - (p->held - held);
+    return 0;
+}
+
+/* Writes out the backlog and completes the URBs whose data has left. */
+static void
+printer_write(struct printer *p)
+{
+    struct usb_ep *ep = usb_function_ep(&p->func, USBIP_DIR_OUT, PRINTER_EP_OUT);
+    struct urb *urb;
+    ssize_t n;
+
+    while (p->held > 0) {
+        n = write(p->out, p->backlog + p->sent, p->held);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            p->error = n < 0 ? errno : EIO;
+            p->held = 0;
+            usb_ep_flush(ep, EPIPE);
+            break;
+        }
+
+        p->sent += n;
+        p->held -= n;
+
+        while ((urb = TAILQ_FIRST(&ep->queue))) {
+            size_t left = urb->length - urb->actual;
+
+            if ((size_t) n < left) {
+                urb->actual += n;
+                break;
+            }
+
+            n -= left;
+            urb->actual = urb->length;
+            usb_ep_dequeue(ep);
+            usb_urb_done(urb, 0);
+        }
+    }
+
+    loop_mod(&p->full, p->held > 0 ? EPOLLOUT : 0);
+}
+
+static void
+printer_ready(struct loop_watch *w, uint32_t events)
+{
+    (void) events;
+
+    printer_write(container_of(w, struct printer, full));
+}
+
+static void
+printer_arm(struct printer *p)
+{
+    struct itimerspec its = {
+        .it_value.tv_sec = p->timeout / 1000,
+        .it_value.tv_nsec = p->timeout % 1000 * 1000000,
+    };
+
+    timerfd_settime(p->idle.fd, 0, &its, NULL);
+}
+
+static void
+printer_idle(struct loop_watch *w, uint32_t events)
+{
+    struct printer *p = container_of(w, struct printer, idle);
+    uint64_t expirations;
+
+    (void) events;
+
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    /* A host waiting on a full FIFO is not idle. */
+    if (p->held > 0) {
+        printer_arm(p);
+        return;
+    }
+
+    printer_end(p);
+}
+
+static void
+printer_submit(struct usb_function *f, struct urb *urb)
+{
+    struct printer *p = (struct printer *) f;
+
+    /* There is no back channel: status reads wait forever. */
+    if (urb->dir == USBIP_DIR_IN) {
+        usb_ep_queue(urb);
+        return;
+    }
+
+    printer_arm(p);
+
+    if (!p->error && urb->actual < urb->length) {
+        usb_ep_queue(urb);
+        printer_write(p);
+        return;
+    }
+
+    usb_urb_done(urb, p->error ? EPIPE : 0);
+}
+
+static int
+printer_setup(struct usb_function *f, struct urb *urb)
+{
+    struct printer *p = (struct printer *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case PRINTER_GET_DEVICE_ID:
+        return usb_urb_blob(urb, &p->id);
+
+    case PRINTER_GET_PORT_STATUS:
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = p->error ? PRINTER_SELECTED | PRINTER_PAPER_EMPTY
+                               : PRINTER_SELECTED | PRINTER_NOT_ERROR;
+        urb->actual = 1;
+        return 0;
+
+    case PRINTER_SOFT_RESET:
+        printer_end(p);
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+printer_disable(struct usb_function *f)
+{
+    printer_end((struct printer *) f);
+}
+
+static void
+printer_destroy(struct usb_function *f)
+{
+    struct printer *p = (struct printer *) f;
+
+    printer_end(p);
+
+    if (p->idle.fd >= 0) {
+        loop_del(&p->idle);
+        close(p->idle.fd);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (p->pipe[i] >= 0)
+            close(p->pipe[i]);
+    }
+
+    if (p->full.fd >= 0)
+        loop_del(&p->full);
+
+    if (p->out >= 0)
+        close(p->out);
+
+    free(p->backlog);
+    free(p->id.buf);
+    free(p->path);
+    free(p->dir);
+    free(p);
+}
+
+static const struct usb_function_ops printer_ops = {
+    .setup = printer_setup,
+    .submit = printer_submit,
+    .recv = printer_recv,
+    .disable = printer_disable,
+    .destroy = printer_destroy,
+};
+
+/*
+ * A FIFO is held open for reading as well, so opening it does not wait for
+ * a reader and a reader may come and go; with none, the job's URBs wait as
+ * on a printer out of paper.
+ */
+static int
+printer_output(struct printer *p)
+{
+    struct stat st;
+    int r;
+
+    if (p->path) {
+        p->fifo = stat(p->path, &st) == 0 && S_ISFIFO(st.st_mode);
+        p->out = open(p->path, p->fifo ? O_RDWR | O_NONBLOCK | O_CLOEXEC
+                                       : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+        if (p->out < 0)
+            return errno;
+    }
+
+    if (p->fifo) {
+        p->full.fd = p->out;
+        p->full.func = printer_ready;
+        r = loop_add(&p->full, 0);
+        if (r != 0) {
+            p->full.fd = -1;
+            return r;
+        }
+    }
+
+    if (pipe2(p->pipe, O_CLOEXEC) != 0)
+        return errno;
+
+    fcntl(p->pipe[1], F_SETPIPE_SZ, PRINTER_PIPE);
+    return 0;
+}
+
+/* The IEEE 1284 device ID, behind its big endian length. */
+static int
+printer_id(struct printer *p, const char *id)
+{
+    size_t len = strlen(id) + 2;
+
+    if (len > UINT16_MAX)
+        return EINVAL;
+
+    p->id.buf = malloc(len);
+    if (!p->id.buf)
+        return ENOMEM;
+
+    p->id.buf[0] = len >> 8;
+    p->id.buf[1] = len;
+    memcpy(p->id.buf + 2, id, len - 2);
+    p->id.len = len;
+    return 0;
+}
+
+static int
+printer_descriptors(struct usb_device *dev, const char *serial)
+{
+    uint16_t mps = dev->speed == USB_SPEED_HIGH ? 512 : 64;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x000c),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 1,
+    };
+    struct printer_config c = {
+        .config = {
+            .bLength = sizeof(c.config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(c)),
+            .bNumInterfaces = 1,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+            .bMaxPower = 1,
+        },
+        .intf = {
+            .bLength = sizeof(c.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_PRINTER,
+            .bInterfaceSubClass = USB_PRINTER_SUBCLASS,
+            .bInterfaceProtocol = USB_PRINTER_PROTO_BIDIR,
+        },
+        .out = {
+            .bLength = sizeof(c.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = PRINTER_EP_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+        .in = {
+            .bLength = sizeof(c.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | PRINTER_EP_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = htole16(mps),
+        },
+    };
+    int r;
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu Printer");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+static int
+printer_create(struct usb_device *dev, char *opts)
+{
+    enum { OUTPUT, DIR_, IDLE, ID, SPEED, SERIAL };
+    char *const tokens[] = {
+        [OUTPUT] = "output", [DIR_] = "dir", [IDLE] = "idle", [ID] = "id",
+        [SPEED] = "speed", [SERIAL] = "serial", NULL
+    };
+    const char *output = NULL, *dir = NULL, *serial = NULL;
+    const char *id = "MFG:usbemu;MDL:Printer;CMD:PJL,PCL,POSTSCRIPT;CLS:PRINTER;";
+    unsigned long idle = 2000;
+    struct printer *p;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_HIGH;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case OUTPUT: output = value; break;
+        case DIR_:   dir = value; break;
+        case SERIAL: serial = value; break;
+
+        case ID:
+            if (!value)
+                return EINVAL;
+            id = value;
+            break;
+
+        case IDLE:
+            if (!value || (idle = strtoul(value, NULL, 0)) == 0)
+                return EINVAL;
+            break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed != USB_SPEED_FULL && dev->speed != USB_SPEED_HIGH)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    if (!output == !dir)
+        return EINVAL;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return ENOMEM;
+
+    p->idle.fd = -1;
+    p->full.fd = -1;
+    p->pipe[0] = p->pipe[1] = -1;
+    p->out = -1;
+    p->timeout = idle;
+    usb_device_function(dev, &p->func, &printer_ops);
+
+    p->path = output ? strdup(output) : NULL;
+    p->dir = dir ? strdup(dir) : NULL;
+    if (!p->path && !p->dir)
+        return ENOMEM;
+
+    r = printer_output(p);
+    if (r == 0)
+        r = printer_id(p, id);
+    if (r == 0)
+        r = printer_descriptors(dev, serial);
+    if (r != 0)
+        return r;
+
+    p->idle.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (p->idle.fd < 0)
+        return errno;
+
+    p->idle.func = printer_idle;
+    return loop_add(&p->idle, EPOLLIN);
+}
+
+const struct usb_model usb_model_printer = {
+    .name = "printer",
+    .create = printer_create,
+};
@@ -0,0 +1,181 @@
+#include "ring.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* "/name" lives at /dev/shm/name, so its doorbell is /dev/shm/name.bell. */
+static int
+ring_bell_path(const char *name, char *path, size_t size)
+{
+    if (name[0] != '/' || strchr(name + 1, '/'))
+        return EINVAL;
+
+    if ((size_t) snprintf(path, size, "/dev/shm%s.bell", name) >= size)
+        return ENAMETOOLONG;
+
+    return 0;
+}
+
+int
+ring_create(const char *name, uint32_t slot, uint32_t slots,
+            struct ring_reader **ring, int *bell)
+{
+    struct ring_reader *rd;
+    char path[256];
+    struct ring *r;
+    size_t size;
+    int fd;
+    int e;
+
+    if (slots == 0 || (slots & (slots - 1)) != 0 || slot == 0)
+        return EINVAL;
+
+    e = ring_bell_path(name, path, sizeof(path));
+    if (e != 0)
+        return e;
+
+    rd = calloc(1, sizeof(*rd));
+    if (!rd)
+        return ENOMEM;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        e = errno;
+        free(rd);
+        return e;
+    }
+
+    size = ring_size(slot, slots);
+    if (ftruncate(fd, size) != 0) {
+        e = errno;
+        close(fd);
+        shm_unlink(name);
+        free(rd);
+        return e;
+    }
+
+    r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    e = errno;
+    close(fd);
+    if (r == MAP_FAILED) {
+        shm_unlink(name);
+        free(rd);
+        return e;
+    }
+
+    r->slot = slot;
+    r->mask = slots - 1;
+
+    unlink(path);
+    if (mkfifo(path, 0600) != 0) {
+        e = errno;
+        munmap(r, size);
+        shm_unlink(name);
+        free(rd);
+        return e;
+    }
+
+    /* Opened read-write so the FIFO never reports a hangup. */
+    *bell = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (*bell < 0) {
+        e = errno;
+        unlink(path);
+        munmap(r, size);
+        shm_unlink(name);
+        free(rd);
+        return e;
+    }
+
+    atomic_thread_fence(memory_order_release);
+    r->magic = RING_MAGIC;
+
+    rd->shm = r;
+    rd->slot = slot;
+    rd->mask = slots - 1;
+    rd->size = size;
+    *ring = rd;
+    return 0;
+}
+
+int
+ring_attach(const char *name, struct ring **ring, int *bell)
+{
+    char path[256];
+    struct stat st;
+    struct ring *r;
+    int fd;
+    int e;
+
+    e = ring_bell_path(name, path, sizeof(path));
+    if (e != 0)
+        return e;
+
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return errno;
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*r)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    e = errno;
+    close(fd);
+    if (r == MAP_FAILED)
+        return e;
+
+    if (r->magic != RING_MAGIC ||
+        ring_size(r->slot, r->mask + 1) > (size_t) st.st_size) {
+        munmap(r, st.st_size);
+        return EINVAL;
+    }
+
+    *bell = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (*bell < 0) {
+        e = errno;
+        munmap(r, st.st_size);
+        return e;
+    }
+
+    *ring = r;
+    return 0;
+}
+
+void
+ring_detach(struct ring *ring, int bell)
+{
+    if (!ring)
+        return;
+
+    if (bell >= 0)
+        close(bell);
+
+    munmap(ring, ring_size(ring->slot, ring->mask + 1));
+}
+
+void
+ring_destroy(const char *name, struct ring_reader *ring, int bell)
+{
+    char path[256];
+
+    if (!ring)
+        return;
+
+    if (name && ring_bell_path(name, path, sizeof(path)) == 0) {
+        unlink(path);
+        shm_unlink(name);
+    }
+
+    if (bell >= 0)
+        close(bell);
+
+    munmap(ring->shm, ring->size);
+    free(ring);
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A lock-free single-producer single-consumer ring of fixed size slots in
+ * POSIX shared memory. The emulator creates the ring with ring_create() and
+ * an external process feeds it between ring_attach() and ring_detach():
+ *
+ *     if (ring_push(ring, report, len) && ring_waiting(ring))
+ *         write(bell, "", 1);
+ *
+ * The doorbell is a FIFO next to the shared memory object. The consumer
+ * only asks for it while it has work waiting on the ring, so a busy
+ * producer costs no system calls beyond its own writes to memory.
+ *
+ * The producer can write anywhere in the shared header, so the emulator
+ * reads the ring through a struct ring_reader that keeps its own copy of
+ * the geometry ring_create() set up.
+ */
+
+#define RING_MAGIC 0x676e6972 /* "ring" */
+
+struct ring {
+    uint32_t magic;
+    uint32_t slot;                       /* payload bytes per slot */
+    uint32_t mask;                       /* number of slots - 1 */
+    uint32_t reserved;
+
+    _Alignas(64) _Atomic uint32_t head;  /* written by the producer */
+    _Alignas(64) _Atomic uint32_t tail;  /* written by the consumer */
+    _Atomic uint32_t waiting;            /* consumer wants the doorbell */
+
+    _Alignas(64) uint8_t slots[];        /* uint32_t length + payload */
+};
+
+struct ring_reader {
+    struct ring *shm;
+    uint32_t slot;
+    uint32_t mask;
+    size_t size;                         /* of the mapping */
+};
+
+static inline size_t
+ring_stride(uint32_t slot)
+{
+    return (sizeof(uint32_t) + slot + 7) & ~(size_t) 7;
+}
+
+static inline size_t
+ring_size(uint32_t slot, uint32_t slots)
+{
+    return sizeof(struct ring) + slots * ring_stride(slot);
+}
+
+static inline uint8_t *
+ring_at(struct ring *r, uint32_t slot, uint32_t mask, uint32_t i)
+{
+    return r->slots + (i & mask) * ring_stride(slot);
+}
+
+static inline uint8_t *
+ring_slot(struct ring *r, uint32_t i)
+{
+    return ring_at(r, r->slot, r->mask, i);
+}
+
+/*
+ * Producer side without the copy: fill the slot ring_reserve() returns, up
+ * to r->slot bytes, then publish it with ring_commit().
+ */
+static inline uint8_t *
+ring_reserve(struct ring *r)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head - tail > r->mask)
+        return NULL;
+
+    return ring_slot(r, head) + sizeof(uint32_t);
+}
+
+static inline void
+ring_commit(struct ring *r, uint32_t len)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    memcpy(ring_slot(r, head), &len, sizeof(len));
+
+    /* Sequentially consistent so it cannot pass the load of waiting. */
+    atomic_store(&r->head, head + 1);
+}
+
+static inline bool
+ring_push(struct ring *r, const void *buf, uint32_t len)
+{
+    uint8_t *s;
+
+    if (len > r->slot || !(s = ring_reserve(r)))
+        return false;
+
+    memcpy(s, buf, len);
+    ring_commit(r, len);
+    return true;
+}
+
+static inline bool
+ring_waiting(struct ring *r)
+{
+    return atomic_load(&r->waiting) != 0;
+}
+
+static inline const uint8_t *
+ring_peek(struct ring_reader *rd, uint32_t *len)
+{
+    struct ring *r = rd->shm;
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    const uint8_t *s;
+
+    if (head == tail)
+        return NULL;
+
+    s = ring_at(r, rd->slot, rd->mask, tail);
+    memcpy(len, s, sizeof(*len));
+    if (*len > rd->slot)
+        *len = rd->slot;
+
+    return s + sizeof(*len);
+}
+
+/* Slots published and not yet popped. */
+static inline uint32_t
+ring_count(struct ring_reader *rd)
+{
+    return atomic_load_explicit(&rd->shm->head, memory_order_acquire) -
+           atomic_load_explicit(&rd->shm->tail, memory_order_relaxed);
+}
+
+static inline uint32_t
+ring_tail(struct ring_reader *rd)
+{
+    return atomic_load_explicit(&rd->shm->tail, memory_order_relaxed);
+}
+
+static inline void
+ring_pop(struct ring_reader *rd)
+{
+    uint32_t tail = atomic_load_explicit(&rd->shm->tail, memory_order_relaxed);
+    atomic_store_explicit(&rd->shm->tail, tail + 1, memory_order_release);
+}
+
+/* Arms the doorbell. Returns true if data raced in and it is not needed. */
+static inline bool
+ring_wait(struct ring_reader *rd)
+{
+    uint32_t len;
+
+    atomic_store(&rd->shm->waiting, 1);
+    if (!ring_peek(rd, &len))
+        return false;
+
+    atomic_store(&rd->shm->waiting, 0);
+    return true;
+}
+
+static inline void
+ring_unwait(struct ring_reader *rd)
+{
+    atomic_store_explicit(&rd->shm->waiting, 0, memory_order_relaxed);
+}
+
+int
+ring_create(const char *name, uint32_t slot, uint32_t slots,
+            struct ring_reader **ring, int *bell);
+
+int
+ring_attach(const char *name, struct ring **ring, int *bell);
+
+void
+ring_detach(struct ring *ring, int bell);
+
+void
+ring_destroy(const char *name, struct ring_reader *ring, int bell);
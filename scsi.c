@@ -0,0 +1,1084 @@
+#include "scsi.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    SCSI_TEST_UNIT_READY = 0x00,
+    SCSI_REQUEST_SENSE = 0x03,
+    SCSI_READ_6 = 0x08,
+    SCSI_WRITE_6 = 0x0a,
+    SCSI_INQUIRY = 0x12,
+    SCSI_MODE_SENSE_6 = 0x1a,
+    SCSI_START_STOP_UNIT = 0x1b,
+    SCSI_PREVENT_ALLOW = 0x1e,
+    SCSI_READ_FORMAT_CAPACITIES = 0x23,
+    SCSI_READ_CAPACITY_10 = 0x25,
+    SCSI_READ_10 = 0x28,
+    SCSI_WRITE_10 = 0x2a,
+    SCSI_VERIFY_10 = 0x2f,
+    SCSI_SYNCHRONIZE_CACHE_10 = 0x35,
+    SCSI_WRITE_SAME_10 = 0x41,
+    SCSI_UNMAP = 0x42,
+    SCSI_READ_TOC = 0x43,
+    SCSI_GET_CONFIGURATION = 0x46,
+    SCSI_GET_EVENT_STATUS = 0x4a,
+    SCSI_READ_DISC_INFORMATION = 0x51,
+    SCSI_MODE_SENSE_10 = 0x5a,
+    SCSI_READ_16 = 0x88,
+    SCSI_WRITE_16 = 0x8a,
+    SCSI_VERIFY_16 = 0x8f,
+    SCSI_SYNCHRONIZE_CACHE_16 = 0x91,
+    SCSI_WRITE_SAME_16 = 0x93,
+    SCSI_SERVICE_ACTION_IN_16 = 0x9e,
+    SCSI_REPORT_LUNS = 0xa0,
+    SCSI_READ_12 = 0xa8,
+    SCSI_WRITE_12 = 0xaa,
+};
+
+#define SCSI_SAI_READ_CAPACITY_16 0x10
+
+/*
+ * What UNMAP and WRITE SAME take at once, as the Block Limits page says.
+ * On a thin image each run UNMAP names is one hole, whatever its size.
+ * Writing blocks or zeros costs by the byte, so WRITE SAME, and UNMAP
+ * where the image has no holes, cover no more than SCSI_FILL_MAX bytes.
+ */
+#define SCSI_UNMAP_BLOCKS 0xffffffffu
+#define SCSI_FILL_MAX (1024 * 1024)
+#define SCSI_UNMAP_GRANULARITY 4096      /* bytes; a page of the image file */
+#define SCSI_FILL_SIZE (64 * 1024)
+
+/* Additional sense codes, as asc << 8 | ascq. */
+enum {
+    SCSI_ASC_WRITE_ERROR = 0x0c00,
+    SCSI_ASC_READ_ERROR = 0x1100,
+    SCSI_ASC_INVALID_OPCODE = 0x2000,
+    SCSI_ASC_LBA_OUT_OF_RANGE = 0x2100,
+    SCSI_ASC_INVALID_FIELD_IN_CDB = 0x2400,
+    SCSI_ASC_LUN_NOT_SUPPORTED = 0x2500,
+    SCSI_ASC_INVALID_FIELD_IN_PARAMETERS = 0x2600,
+    SCSI_ASC_WRITE_PROTECTED = 0x2700,
+};
+
+#define SCSI_MODE_PAGE_CACHING 0x08
+#define SCSI_MODE_PAGE_MMC_CAPS 0x2a
+#define SCSI_MODE_PAGE_ALL 0x3f
+
+/* Blocks on an 80 minute CD; a larger image is a DVD. */
+#define SCSI_CD_BLOCKS 360000
+#define SCSI_MMC_SPEED (48 * 176)        /* KB/s, as a 48x CD drive */
+
+enum {
+    SCSI_PROFILE_CD_ROM = 0x0008,
+    SCSI_PROFILE_DVD_ROM = 0x0010,
+};
+
+static uint16_t
+get_be16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t
+get_be64(const uint8_t *p)
+{
+    return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static void
+put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void
+put_be32(uint8_t *p, uint32_t v)
+{
+    put_be16(p, v >> 16);
+    put_be16(p + 2, v);
+}
+
+static void
+put_be64(uint8_t *p, uint64_t v)
+{
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+}
+
+/* Minutes, seconds and frames of a CD address, after the 2 second pregap. */
+static void
+put_msf(uint8_t *p, uint64_t lba)
+{
+    lba += 150;
+
+    p[0] = 0;
+    p[1] = lba / (60 * 75) < 0xff ? lba / (60 * 75) : 0xff;
+    p[2] = lba / 75 % 60;
+    p[3] = lba % 75;
+}
+
+/* Space padded, not terminated, as INQUIRY wants its strings. */
+static void
+put_str(uint8_t *p, const char *s, size_t len)
+{
+    size_t n = strlen(s);
+
+    memset(p, ' ', len);
+    memcpy(p, s, n < len ? n : len);
+}
+
+static void
+scsi_sense(struct scsi_lun *lun, struct scsi_cmd *cmd, uint8_t key,
+           uint16_t asc)
+{
+    cmd->key = lun->key = key;
+    cmd->asc = lun->asc = asc >> 8;
+    cmd->ascq = lun->ascq = asc;
+
+    cmd->status = SCSI_CHECK_CONDITION;
+}
+
+static void
+scsi_sense_fixed(uint8_t *b, uint8_t key, uint8_t asc, uint8_t ascq)
+{
+    memset(b, 0, SCSI_SENSE_SIZE);
+    b[0] = 0x70;                         /* current, fixed format */
+    b[2] = key;
+    b[7] = SCSI_SENSE_SIZE - 8;
+    b[12] = asc;
+    b[13] = ascq;
+}
+
+static void
+scsi_reply(struct scsi_cmd *cmd, uint32_t alloc, uint32_t len)
+{
+    cmd->dir = SCSI_DIR_IN;
+    cmd->length = alloc < len ? alloc : len;
+}
+
+static void
+scsi_request_sense(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    scsi_sense_fixed(cmd->buf, lun->key, lun->asc, lun->ascq);
+    lun->key = lun->asc = lun->ascq = 0;
+    scsi_reply(cmd, cmd->cdb[4], SCSI_SENSE_SIZE);
+}
+
+static uint32_t
+scsi_fill_blocks(const struct scsi_lun *lun)
+{
+    return lun->block_size < SCSI_FILL_MAX ? SCSI_FILL_MAX / lun->block_size : 1;
+}
+
+static uint32_t
+scsi_unmap_blocks(const struct scsi_lun *lun)
+{
+    return blk_thin(lun->blk) ? SCSI_UNMAP_BLOCKS : scsi_fill_blocks(lun);
+}
+
+static void
+scsi_inquiry(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint16_t alloc = get_be16(cmd->cdb + 3);
+    uint8_t *b = cmd->buf;
+    uint32_t granularity;
+    size_t n;
+
+    memset(b, 0, 64);
+
+    if (!(cmd->cdb[1] & 0x01)) {
+        if (cmd->cdb[2] != 0) {
+            scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                       SCSI_ASC_INVALID_FIELD_IN_CDB);
+            return;
+        }
+
+        b[0] = lun->mmc ? 0x05 : 0x00;   /* CD/DVD or direct access */
+        b[1] = lun->removable ? 0x80 : 0;
+        b[2] = 0x06;                     /* SPC-4 */
+        b[3] = 0x02;
+        b[4] = 36 - 5;
+        put_str(b + 8, lun->vendor, 8);
+        put_str(b + 16, lun->product, 16);
+        put_str(b + 32, lun->revision, 4);
+        scsi_reply(cmd, alloc, 36);
+        return;
+    }
+
+    b[1] = cmd->cdb[2];
+
+    switch (cmd->cdb[2]) {
+    case 0x00:                           /* supported pages */
+        b[3] = 4;
+        b[4] = 0x00;
+        b[5] = 0x80;
+        b[6] = 0xb0;
+        b[7] = 0xb2;
+        scsi_reply(cmd, alloc, 4 + b[3]);
+        break;
+
+    case 0x80:                           /* unit serial number */
+        n = strlen(lun->serial);
+        b[3] = n;
+        memcpy(b + 4, lun->serial, n);
+        scsi_reply(cmd, alloc, 4 + n);
+        break;
+
+    case 0xb0:                           /* block limits */
+        granularity = lun->block_size < SCSI_UNMAP_GRANULARITY ?
+                      SCSI_UNMAP_GRANULARITY / lun->block_size : 1;
+        b[3] = 0x3c;
+        b[4] = 0x01;                     /* WSNZ */
+        if (blk_thin(lun->blk)) {
+            put_be32(b + 20, scsi_unmap_blocks(lun));
+            put_be32(b + 24, SCSI_UNMAP_DESCRIPTORS);
+            put_be32(b + 28, granularity);
+        }
+        put_be64(b + 36, scsi_fill_blocks(lun));
+        scsi_reply(cmd, alloc, 4 + b[3]);
+        break;
+
+    case 0xb2:                           /* logical block provisioning */
+        b[3] = 4;
+        if (blk_thin(lun->blk)) {
+            b[5] = 0xe4;                 /* LBPU, LBPWS, LBPWS10, LBPRZ */
+            b[6] = 0x02;                 /* thin */
+        }
+        scsi_reply(cmd, alloc, 4 + b[3]);
+        break;
+
+    default:
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+    }
+}
+
+/*
+ * Writes sit in the page cache, or the write-back cache, until flushed, so
+ * the caching page reports a write-back cache and the host follows up with
+ * SYNCHRONIZE CACHE. An optical drive has the capabilities page instead: a
+ * DVD reader with a tray that locks and ejects.
+ */
+static void
+scsi_mode_sense(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    bool ten = cmd->cdb[0] == SCSI_MODE_SENSE_10;
+    uint8_t page = cmd->cdb[2] & 0x3f;
+    uint8_t control = cmd->cdb[2] >> 6;
+    uint32_t alloc = ten ? get_be16(cmd->cdb + 7) : cmd->cdb[4];
+    size_t hdr = ten ? 8 : 4;
+    uint8_t *b = cmd->buf;
+    size_t len = hdr;
+
+    memset(b, 0, 64);
+
+    if (lun->mmc && (page == SCSI_MODE_PAGE_MMC_CAPS || page == SCSI_MODE_PAGE_ALL)) {
+        b[len] = SCSI_MODE_PAGE_MMC_CAPS;
+        b[len + 1] = 0x14;
+        if (control != 1) {
+            b[len + 2] = 0x08;           /* DVD-ROM read */
+            b[len + 6] = 0x29;           /* tray, eject, lock */
+            put_be16(b + len + 8, SCSI_MMC_SPEED);
+            put_be16(b + len + 14, SCSI_MMC_SPEED);
+        }
+        len += 2 + 0x14;
+    } else if (!lun->mmc &&
+               (page == SCSI_MODE_PAGE_CACHING || page == SCSI_MODE_PAGE_ALL)) {
+        b[len] = SCSI_MODE_PAGE_CACHING;
+        b[len + 1] = 0x12;
+        if (control != 1)                /* changeable values: none */
+            b[len + 2] = 0x04;           /* WCE */
+        len += 2 + 0x12;
+    } else {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    if (ten) {
+        put_be16(b, len - 2);
+        b[3] = lun->blk->readonly ? 0x80 : 0;
+    } else {
+        b[0] = len - 1;
+        b[2] = lun->blk->readonly ? 0x80 : 0;
+    }
+
+    scsi_reply(cmd, alloc, len);
+}
+
+static void
+scsi_read_capacity(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint64_t last = lun->blocks - 1;
+    uint8_t *b = cmd->buf;
+
+    if (cmd->cdb[0] == SCSI_READ_CAPACITY_10) {
+        put_be32(b, last > UINT32_MAX ? UINT32_MAX : last);
+        put_be32(b + 4, lun->block_size);
+        scsi_reply(cmd, 8, 8);
+        return;
+    }
+
+    memset(b, 0, 32);
+    put_be64(b, last);
+    put_be32(b + 8, lun->block_size);
+    if (blk_thin(lun->blk))
+        b[14] = 0xc0;                    /* LBPME, LBPRZ */
+    scsi_reply(cmd, get_be32(cmd->cdb + 10), 32);
+}
+
+static void
+scsi_read_format_capacities(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint8_t *b = cmd->buf;
+
+    memset(b, 0, 12);
+    b[3] = 8;
+    put_be32(b + 4, lun->blocks > UINT32_MAX ? UINT32_MAX : lun->blocks);
+    put_be32(b + 8, lun->block_size);
+    b[8] = 0x02;                         /* formatted media */
+    scsi_reply(cmd, get_be16(cmd->cdb + 7), 12);
+}
+
+static void
+scsi_report_luns(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint32_t len = 8 + 8 * lun->nluns;
+    uint8_t *b = cmd->buf;
+
+    memset(b, 0, len);
+    put_be32(b, len - 8);
+    for (uint8_t i = 0; i < lun->nluns; i++)
+        b[8 + 8 * i + 1] = i;            /* peripheral device addressing */
+
+    scsi_reply(cmd, get_be32(cmd->cdb + 6), len);
+}
+
+static uint16_t
+scsi_profile(const struct scsi_lun *lun)
+{
+    return lun->blocks > SCSI_CD_BLOCKS ? SCSI_PROFILE_DVD_ROM : SCSI_PROFILE_CD_ROM;
+}
+
+static void
+scsi_toc_addr(uint8_t *p, uint64_t lba, bool msf)
+{
+    if (msf)
+        put_msf(p, lba);
+    else
+        put_be32(p, lba);
+}
+
+/*
+ * The TOC of a single session disc: track 1 from LBA 0, then the lead-out.
+ * The raw TOC has the points A0 to A2 and the track, always in MSF.
+ */
+static void
+scsi_read_toc(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    static const uint8_t points[] = { 0xa0, 0xa1, 0xa2, 0x01 };
+    const uint8_t *c = cmd->cdb;
+    bool msf = c[1] & 0x02;
+    uint8_t format = c[2] & 0x0f;
+    uint8_t *b = cmd->buf;
+    uint32_t len = 4;
+
+    /* Older hosts give the format in the control byte. */
+    if (format == 0)
+        format = c[9] >> 6;
+
+    if (format > 2 || (format == 0 && c[6] > 1 && c[6] != 0xaa)) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    memset(b, 0, 64);
+    b[2] = b[3] = 1;                     /* first and last track, or session */
+
+    if (format == 2) {                   /* raw */
+        for (size_t i = 0; i < sizeof(points); i++, len += 11) {
+            b[len] = 1;
+            b[len + 1] = 0x14;
+            b[len + 3] = points[i];
+            if (points[i] == 0xa0 || points[i] == 0xa1)
+                b[len + 8] = 1;          /* first and last track, CD-ROM */
+            else
+                put_msf(b + len + 7, points[i] == 0xa2 ? lun->blocks : 0);
+        }
+    } else {
+        /* The session information is the first track of the last one. */
+        if (format == 1 || c[6] <= 1) {
+            b[len + 1] = 0x14;           /* data track */
+            b[len + 2] = 1;
+            scsi_toc_addr(b + len + 4, 0, msf);
+            len += 8;
+        }
+        if (format == 0) {
+            b[len + 1] = 0x14;
+            b[len + 2] = 0xaa;
+            scsi_toc_addr(b + len + 4, lun->blocks, msf);
+            len += 8;
+        }
+    }
+
+    put_be16(b, len - 2);
+    scsi_reply(cmd, get_be16(c + 7), len);
+}
+
+/*
+ * Appends a feature descriptor if the request wants it: from the starting
+ * feature on, all of them or those current, or that one alone.
+ */
+static void
+scsi_feature(struct scsi_cmd *cmd, uint32_t *len, uint16_t code,
+             uint8_t flags, const uint8_t *data, uint8_t n)
+{
+    uint8_t rt = cmd->cdb[1] & 0x03;
+    uint16_t start = get_be16(cmd->cdb + 2);
+    uint8_t *b = cmd->buf + *len;
+
+    if (code < start || (rt == 1 && !(flags & 0x01)) || (rt == 2 && code != start))
+        return;
+
+    put_be16(b, code);
+    b[2] = flags;                        /* version, persistent, current */
+    b[3] = n;
+    memcpy(b + 4, data, n);
+    *len += 4 + n;
+}
+
+static void
+scsi_get_configuration(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint16_t profile = scsi_profile(lun);
+    bool dvd = profile == SCSI_PROFILE_DVD_ROM;
+    const uint8_t profiles[] = {
+        SCSI_PROFILE_DVD_ROM >> 8, SCSI_PROFILE_DVD_ROM & 0xff, dvd, 0,
+        SCSI_PROFILE_CD_ROM >> 8, SCSI_PROFILE_CD_ROM & 0xff, !dvd, 0,
+    };
+    const uint8_t core[8] = { 0, 0, 0, 0x08, 0x01 };        /* USB, DBE */
+    const uint8_t morphing[4] = { 0x02 };                   /* OCEvent */
+    const uint8_t removable[4] = { 0x29 };                  /* tray, eject, lock */
+    const uint8_t random[8] = { 0, 0, 0x08, 0, 0, dvd ? 16 : 1 };
+    const uint8_t none[4] = { 0 };
+    uint8_t *b = cmd->buf;
+    uint32_t len = 8;
+
+    if ((cmd->cdb[1] & 0x03) == 3) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    memset(b, 0, len);
+    put_be16(b + 6, profile);
+
+    scsi_feature(cmd, &len, 0x0000, 0x03, profiles, sizeof(profiles));
+    scsi_feature(cmd, &len, 0x0001, 0x0b, core, sizeof(core));
+    scsi_feature(cmd, &len, 0x0002, 0x07, morphing, sizeof(morphing));
+    scsi_feature(cmd, &len, 0x0003, 0x03, removable, sizeof(removable));
+    scsi_feature(cmd, &len, 0x0010, 0x01, random, sizeof(random));
+    scsi_feature(cmd, &len, 0x001e, 0x08 | !dvd, none, sizeof(none));  /* CD read */
+    scsi_feature(cmd, &len, 0x001f, 0x04 | dvd, none, sizeof(none));   /* DVD read */
+
+    put_be32(b, len - 4);
+    scsi_reply(cmd, get_be16(cmd->cdb + 7), len);
+}
+
+/* Polled only, and the medium never changes: it is always there. */
+static void
+scsi_get_event_status(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint8_t *b = cmd->buf;
+    uint32_t len = 4;
+
+    if (!(cmd->cdb[1] & 0x01)) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    memset(b, 0, 8);
+    b[3] = 0x10;                         /* media events supported */
+    if (cmd->cdb[4] & 0x10) {
+        b[2] = 0x04;                     /* media class */
+        b[5] = 0x02;                     /* medium present */
+        len = 8;
+    } else {
+        b[2] = 0x80;                     /* no event available */
+    }
+
+    put_be16(b, len - 2);
+    scsi_reply(cmd, get_be16(cmd->cdb + 7), len);
+}
+
+static void
+scsi_read_disc_information(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    uint8_t *b = cmd->buf;
+
+    if (cmd->cdb[1] & 0x07) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    memset(b, 0, 34);
+    put_be16(b, 34 - 2);
+    b[2] = 0x0e;                         /* complete session, finalized */
+    b[3] = 1;                            /* first track */
+    b[4] = 1;                            /* sessions */
+    b[5] = b[6] = 1;                     /* tracks of the last session */
+    b[7] = 0x20;                         /* unrestricted use */
+    put_be32(b + 16, UINT32_MAX);        /* no lead-in to come */
+    put_be32(b + 20, UINT32_MAX);
+
+    scsi_reply(cmd, get_be16(cmd->cdb + 7), 34);
+}
+
+static void
+scsi_readahead(struct scsi_lun *lun, uint64_t off, uint64_t len)
+{
+    uint64_t size = lun->blocks * lun->block_size;
+    uint64_t end = off + len;
+    bool stream = off == lun->ra_next;
+    uint64_t n;
+
+    lun->ra_next = end;
+    if (!stream || lun->ra_end < end)
+        lun->ra_end = end;
+
+    if (!stream || lun->readahead == 0)
+        return;
+
+    while (lun->ra_end < size && lun->ra_end - end < lun->readahead) {
+        n = size - lun->ra_end < lun->readahead ? size - lun->ra_end : lun->readahead;
+        blk_readahead(lun->blk, lun->ra_end, n);
+        lun->ra_end += n;
+    }
+}
+
+/* Writes into the stream's windows drop them. */
+static void
+scsi_written(struct scsi_lun *lun, uint64_t off, uint64_t len)
+{
+    if (off < lun->ra_end && off + len > lun->ra_next)
+        lun->ra_end = lun->ra_next;
+}
+
+static void
+scsi_rw(struct scsi_lun *lun, struct scsi_cmd *cmd, bool write)
+{
+    const uint8_t *c = cmd->cdb;
+    uint64_t lba;
+    uint32_t count;
+
+    switch (c[0]) {
+    case SCSI_READ_6:
+    case SCSI_WRITE_6:
+        lba = (c[1] & 0x1f) << 16 | c[2] << 8 | c[3];
+        count = c[4] ? c[4] : 256;
+        break;
+
+    case SCSI_READ_10:
+    case SCSI_WRITE_10:
+        lba = get_be32(c + 2);
+        count = get_be16(c + 7);
+        break;
+
+    case SCSI_READ_12:
+    case SCSI_WRITE_12:
+        lba = get_be32(c + 2);
+        count = get_be32(c + 6);
+        break;
+
+    default:
+        lba = get_be64(c + 2);
+        count = get_be32(c + 10);
+        break;
+    }
+
+    if (lba > lun->blocks || count > lun->blocks - lba) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_LBA_OUT_OF_RANGE);
+        return;
+    }
+
+    if ((uint64_t) count * lun->block_size > UINT32_MAX) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    if (write && lun->blk->readonly) {
+        scsi_sense(lun, cmd, SCSI_SENSE_DATA_PROTECT,
+                   SCSI_ASC_WRITE_PROTECTED);
+        return;
+    }
+
+    if (count == 0)
+        return;
+
+    cmd->dir = write ? SCSI_DIR_OUT : SCSI_DIR_IN;
+    cmd->length = count * lun->block_size;
+    cmd->block = true;
+    cmd->fua = c[0] != SCSI_READ_6 && c[0] != SCSI_WRITE_6 && (c[1] & 0x08);
+    cmd->offset = lba * lun->block_size;
+
+    if (write)
+        scsi_written(lun, cmd->offset, cmd->length);
+    else
+        scsi_readahead(lun, cmd->offset, cmd->length);
+}
+
+/* UNMAP and WRITE SAME: the parameters come first, into buf. */
+static void
+scsi_provision(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    const uint8_t *c = cmd->cdb;
+    uint64_t lba;
+    uint32_t count;
+
+    if (c[0] == SCSI_UNMAP) {
+        if (get_be16(c + 7) > SCSI_BUF_SIZE) {
+            scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                       SCSI_ASC_INVALID_FIELD_IN_CDB);
+            return;
+        }
+    } else if (c[0] == SCSI_WRITE_SAME_10) {
+        lba = get_be32(c + 2);
+        count = get_be16(c + 7);
+    } else {
+        lba = get_be64(c + 2);
+        count = get_be32(c + 10);
+    }
+
+    if (c[0] != SCSI_UNMAP && (lba > lun->blocks || count > lun->blocks - lba)) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_LBA_OUT_OF_RANGE);
+        return;
+    }
+
+    /*
+     * No anchoring, no LBDATA or PBDATA, no NDOB (the block always comes
+     * from the host) and never the whole medium.
+     */
+    if (c[0] != SCSI_UNMAP &&
+        ((c[1] & 0x17) || count == 0 || count > scsi_fill_blocks(lun) ||
+         lun->block_size > SCSI_BUF_SIZE)) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    if (lun->blk->readonly) {
+        scsi_sense(lun, cmd, SCSI_SENSE_DATA_PROTECT,
+                   SCSI_ASC_WRITE_PROTECTED);
+        return;
+    }
+
+    cmd->dir = SCSI_DIR_OUT;
+    if (c[0] == SCSI_UNMAP) {
+        cmd->length = get_be16(c + 7);
+    } else {
+        cmd->length = lun->block_size;
+        cmd->offset = lba * lun->block_size;
+        cmd->span = (uint64_t) count * lun->block_size;
+    }
+}
+
+/* Writes block over len bytes at off. */
+static int
+scsi_fill(struct scsi_lun *lun, const uint8_t *block, uint64_t off,
+          uint64_t len)
+{
+    size_t size = SCSI_FILL_SIZE / lun->block_size * lun->block_size;
+    uint8_t *buf;
+    size_t n;
+    int e = 0;
+
+    buf = malloc(size);
+    if (!buf)
+        return ENOMEM;
+
+    for (size_t i = 0; i < size; i += lun->block_size)
+        memcpy(buf + i, block, lun->block_size);
+
+    for (; e == 0 && len > 0; off += n, len -= n) {
+        n = len < size ? len : size;
+        e = blk_write(lun->blk, buf, off, n);
+    }
+
+    free(buf);
+    return e;
+}
+
+/* Leaves op on len bytes at off to the transport, for an async image. */
+static void
+scsi_defer(struct scsi_cmd *cmd, uint8_t op, uint64_t off, uint64_t len)
+{
+    cmd->reqs[cmd->nreqs++] = (struct scsi_req) {
+        .op = op,
+        .off = off,
+        .len = len,
+    };
+}
+
+/* A hole if the image can make one, zeros written if not. */
+static int
+scsi_discard(struct scsi_lun *lun, struct scsi_cmd *cmd, uint64_t off,
+             uint64_t len)
+{
+    scsi_written(lun, off, len);
+
+    if (blk_async(lun->blk)) {
+        scsi_defer(cmd, BLK_DISCARD, off, len);
+        return 0;
+    }
+
+    return blk_zero(lun->blk, off, len);
+}
+
+struct scsi_extent {
+    uint64_t lba;
+    uint64_t count;
+};
+
+static int
+scsi_extent_cmp(const void *a, const void *b)
+{
+    const struct scsi_extent *x = a, *y = b;
+
+    return x->lba < y->lba ? -1 : x->lba > y->lba;
+}
+
+/*
+ * Descriptors are sorted and those that touch merged, so each run of them
+ * becomes a single hole in the image.
+ */
+static void
+scsi_unmap(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    struct scsi_extent ext[SCSI_UNMAP_DESCRIPTORS], t;
+    uint32_t len = cmd->length < 8 ? 0 : get_be16(cmd->buf + 2);
+    uint64_t total = 0;
+    size_t n = 0, m = 0;
+
+    if (len > cmd->length - 8 || len % 16 != 0) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_PARAMETERS);
+        return;
+    }
+
+    for (const uint8_t *p = cmd->buf + 8; p < cmd->buf + 8 + len; p += 16) {
+        t.lba = get_be64(p);
+        t.count = get_be32(p + 8);
+
+        if (t.lba > lun->blocks || t.count > lun->blocks - t.lba) {
+            scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                       SCSI_ASC_LBA_OUT_OF_RANGE);
+            return;
+        }
+
+        total += t.count;
+        if (total > scsi_unmap_blocks(lun)) {
+            scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                       SCSI_ASC_INVALID_FIELD_IN_PARAMETERS);
+            return;
+        }
+
+        if (t.count > 0)
+            ext[n++] = t;
+    }
+
+    qsort(ext, n, sizeof(ext[0]), scsi_extent_cmp);
+    for (size_t i = 0; i < n; i++) {
+        if (m > 0 && ext[i].lba <= ext[m - 1].lba + ext[m - 1].count) {
+            if (ext[i].lba + ext[i].count > ext[m - 1].lba + ext[m - 1].count)
+                ext[m - 1].count = ext[i].lba + ext[i].count - ext[m - 1].lba;
+        } else {
+            ext[m++] = ext[i];
+        }
+    }
+
+    for (size_t i = 0; i < m; i++) {
+        if (scsi_discard(lun, cmd, ext[i].lba * lun->block_size,
+                         ext[i].count * lun->block_size) != 0) {
+            scsi_sense(lun, cmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+            return;
+        }
+    }
+}
+
+/* A block of zeros with UNMAP set is as good as a hole. */
+static void
+scsi_write_same(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    const uint8_t *b = cmd->buf;
+    int e;
+
+    /* The host cut the data phase short of the block. */
+    if (cmd->length != lun->block_size) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    if ((cmd->cdb[1] & 0x08) && b[0] == 0 &&
+        memcmp(b, b + 1, lun->block_size - 1) == 0) {
+        e = scsi_discard(lun, cmd, cmd->offset, cmd->span);
+    } else if (blk_async(lun->blk)) {
+        scsi_written(lun, cmd->offset, cmd->span);
+        scsi_defer(cmd, BLK_WRITE, cmd->offset, cmd->span);
+        e = 0;
+    } else {
+        scsi_written(lun, cmd->offset, cmd->span);
+        e = scsi_fill(lun, b, cmd->offset, cmd->span);
+    }
+
+    if (e != 0)
+        scsi_sense(lun, cmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+}
+
+/* Commands only an optical drive has. */
+static void
+scsi_mmc(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    if (!lun->mmc) {
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_OPCODE);
+        return;
+    }
+
+    switch (cmd->cdb[0]) {
+    case SCSI_READ_TOC:
+        scsi_read_toc(lun, cmd);
+        break;
+
+    case SCSI_GET_CONFIGURATION:
+        scsi_get_configuration(lun, cmd);
+        break;
+
+    case SCSI_GET_EVENT_STATUS:
+        scsi_get_event_status(lun, cmd);
+        break;
+
+    default:
+        scsi_read_disc_information(lun, cmd);
+    }
+}
+
+void
+scsi_exec(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    cmd->dir = SCSI_DIR_NONE;
+    cmd->status = SCSI_GOOD;
+    cmd->length = 0;
+    cmd->block = false;
+    cmd->fua = false;
+    cmd->sync = false;
+    cmd->nreqs = 0;
+    cmd->key = cmd->asc = cmd->ascq = 0;
+
+    switch (cmd->cdb[0]) {
+    case SCSI_TEST_UNIT_READY:
+    case SCSI_START_STOP_UNIT:
+    case SCSI_PREVENT_ALLOW:
+    case SCSI_VERIFY_10:
+    case SCSI_VERIFY_16:
+        break;
+
+    case SCSI_REQUEST_SENSE:
+        scsi_request_sense(lun, cmd);
+        break;
+
+    case SCSI_INQUIRY:
+        scsi_inquiry(lun, cmd);
+        break;
+
+    case SCSI_MODE_SENSE_6:
+    case SCSI_MODE_SENSE_10:
+        scsi_mode_sense(lun, cmd);
+        break;
+
+    case SCSI_READ_FORMAT_CAPACITIES:
+        scsi_read_format_capacities(lun, cmd);
+        break;
+
+    case SCSI_READ_CAPACITY_10:
+        scsi_read_capacity(lun, cmd);
+        break;
+
+    case SCSI_REPORT_LUNS:
+        scsi_report_luns(lun, cmd);
+        break;
+
+    case SCSI_SERVICE_ACTION_IN_16:
+        if ((cmd->cdb[1] & 0x1f) == SCSI_SAI_READ_CAPACITY_16)
+            scsi_read_capacity(lun, cmd);
+        else
+            scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                       SCSI_ASC_INVALID_FIELD_IN_CDB);
+        break;
+
+    case SCSI_READ_6:
+    case SCSI_READ_10:
+    case SCSI_READ_12:
+    case SCSI_READ_16:
+        scsi_rw(lun, cmd, false);
+        break;
+
+    case SCSI_WRITE_6:
+    case SCSI_WRITE_10:
+    case SCSI_WRITE_12:
+    case SCSI_WRITE_16:
+        scsi_rw(lun, cmd, true);
+        break;
+
+    case SCSI_SYNCHRONIZE_CACHE_10:
+    case SCSI_SYNCHRONIZE_CACHE_16:
+        cmd->sync = true;
+        break;
+
+    case SCSI_UNMAP:
+    case SCSI_WRITE_SAME_10:
+    case SCSI_WRITE_SAME_16:
+        scsi_provision(lun, cmd);
+        break;
+
+    case SCSI_READ_TOC:
+    case SCSI_GET_CONFIGURATION:
+    case SCSI_GET_EVENT_STATUS:
+    case SCSI_READ_DISC_INFORMATION:
+        scsi_mmc(lun, cmd);
+        break;
+
+    default:
+        scsi_sense(lun, cmd, SCSI_SENSE_ILLEGAL_REQUEST,
+                   SCSI_ASC_INVALID_OPCODE);
+    }
+}
+
+void
+scsi_no_lun(struct scsi_cmd *cmd)
+{
+    cmd->dir = SCSI_DIR_NONE;
+    cmd->status = SCSI_CHECK_CONDITION;
+    cmd->length = 0;
+    cmd->block = false;
+    cmd->sync = false;
+    cmd->nreqs = 0;
+    cmd->key = SCSI_SENSE_ILLEGAL_REQUEST;
+    cmd->asc = SCSI_ASC_LUN_NOT_SUPPORTED >> 8;
+    cmd->ascq = 0;
+}
+
+void
+scsi_sense_data(const struct scsi_cmd *cmd, uint8_t *buf)
+{
+    scsi_sense_fixed(buf, cmd->key, cmd->asc, cmd->ascq);
+}
+
+uint8_t *
+scsi_data_map(struct scsi_lun *lun, struct scsi_cmd *cmd, uint32_t pos,
+              uint32_t len)
+{
+    if (!cmd->block)
+        return cmd->buf + pos;
+
+    return blk_map(lun->blk, cmd->offset + pos, len);
+}
+
+int
+scsi_data_file(struct scsi_lun *lun, const struct scsi_cmd *cmd, uint32_t pos,
+               uint32_t len, uint64_t *off)
+{
+    if (!cmd->block)
+        return -1;
+
+    return blk_file(lun->blk, cmd->offset + pos, len, off);
+}
+
+void
+scsi_data_read(struct scsi_lun *lun, struct scsi_cmd *cmd, uint32_t pos,
+               void *buf, uint32_t len)
+{
+    if (!cmd->block) {
+        memcpy(buf, cmd->buf + pos, len);
+        return;
+    }
+
+    if (blk_read(lun->blk, buf, cmd->offset + pos, len) != 0)
+        scsi_sense(lun, cmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_READ_ERROR);
+}
+
+void
+scsi_data_write(struct scsi_lun *lun, struct scsi_cmd *cmd, uint32_t pos,
+                const void *buf, uint32_t len)
+{
+    if (!cmd->block) {
+        memcpy(cmd->buf + pos, buf, len);
+        return;
+    }
+
+    if (blk_write(lun->blk, buf, cmd->offset + pos, len) != 0)
+        scsi_sense(lun, cmd, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+}
+
+void
+scsi_io_error(struct scsi_lun *lun, struct scsi_cmd *cmd, uint8_t op)
+{
+    scsi_sense(lun, cmd, SCSI_SENSE_MEDIUM_ERROR,
+               op == BLK_READ ? SCSI_ASC_READ_ERROR : SCSI_ASC_WRITE_ERROR);
+}
+
+void
+scsi_done(struct scsi_lun *lun, struct scsi_cmd *cmd)
+{
+    if (cmd->dir != SCSI_DIR_OUT || cmd->status != SCSI_GOOD)
+        return;
+
+    switch (cmd->cdb[0]) {
+    case SCSI_UNMAP:
+        scsi_unmap(lun, cmd);
+        break;
+
+    case SCSI_WRITE_SAME_10:
+    case SCSI_WRITE_SAME_16:
+        scsi_write_same(lun, cmd);
+        break;
+
+    default:
+        if (cmd->fua)
+            cmd->sync = true;
+    }
+}
+
+int
+scsi_lun_init(struct scsi_lun *lun, struct blk *blk, uint32_t block_size)
+{
+    if (blk->size < block_size)
+        return EINVAL;
+
+    memset(lun, 0, sizeof(*lun));
+    lun->blk = blk;
+    lun->block_size = block_size;
+    lun->nluns = 1;
+    lun->blocks = blk->size / block_size;
+    lun->readahead = SCSI_READAHEAD;
+    snprintf(lun->vendor, sizeof(lun->vendor), "usbemu");
+    snprintf(lun->product, sizeof(lun->product), "Disk");
+    snprintf(lun->revision, sizeof(lun->revision), "0100");
+    return 0;
+}
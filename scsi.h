@@ -0,0 +1,139 @@
+#pragma once
+
+#include "blk.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+    SCSI_DIR_NONE,
+    SCSI_DIR_IN,                         /* device to host */
+    SCSI_DIR_OUT,
+};
+
+enum {
+    SCSI_GOOD = 0x00,
+    SCSI_CHECK_CONDITION = 0x02,
+};
+
+enum {
+    SCSI_SENSE_NONE = 0x0,
+    SCSI_SENSE_NOT_READY = 0x2,
+    SCSI_SENSE_MEDIUM_ERROR = 0x3,
+    SCSI_SENSE_ILLEGAL_REQUEST = 0x5,
+    SCSI_SENSE_UNIT_ATTENTION = 0x6,
+    SCSI_SENSE_DATA_PROTECT = 0x7,
+};
+
+#define SCSI_BUF_SIZE 512                /* a WRITE SAME block, at most */
+#define SCSI_UNMAP_DESCRIPTORS ((SCSI_BUF_SIZE - 8) / 16)
+
+/* Bytes read ahead of a sequential stream, by default. */
+#define SCSI_READAHEAD (512 * 1024)
+
+/*
+ * A logical unit: one image and the sense data of its last failure. A READ
+ * that starts where the previous one ended marks a stream, which is kept
+ * between one and two readahead windows ahead of the host.
+ *
+ * With mmc set the unit is an optical drive, for 2048 byte blocks: the
+ * image is a single session disc with one data track, always loaded.
+ */
+struct scsi_lun {
+    struct blk *blk;
+    uint32_t block_size;
+    uint64_t blocks;
+    bool removable;
+    bool mmc;
+    uint8_t nluns;                       /* on this target, for REPORT LUNS */
+
+    uint32_t readahead;                  /* window bytes, 0 for none */
+    uint64_t ra_next;                    /* where the stream goes on */
+    uint64_t ra_end;                     /* read ahead up to */
+
+    char vendor[9];
+    char product[17];
+    char revision[5];
+    char serial[33];
+
+    uint8_t key, asc, ascq;
+};
+
+/*
+ * One command as seen by a transport. scsi_exec() decodes the CDB and
+ * leaves the data phase in dir and length. Block commands move image bytes
+ * from offset, everything else moves buf. With sync set, the transport
+ * flushes the image before it sends status.
+ *
+ * UNMAP and WRITE SAME take their parameters into buf and do their work in
+ * scsi_done(); WRITE SAME covers span bytes from offset. On an asynchronous
+ * image the work is left in reqs[] for the transport to issue, each as a
+ * blk_io, a BLK_WRITE filling its range with the block in buf.
+ */
+struct scsi_req {
+    uint8_t op;                          /* BLK_DISCARD or BLK_WRITE */
+    uint64_t off;
+    uint64_t len;
+};
+
+struct scsi_cmd {
+    uint8_t cdb[16];
+    uint8_t dir;                         /* SCSI_DIR_* */
+    uint8_t status;                      /* SCSI_GOOD or CHECK CONDITION */
+    uint32_t length;                     /* data phase bytes */
+    bool block;
+    bool fua;
+    bool sync;
+    uint64_t offset;
+    uint64_t span;
+    uint8_t key, asc, ascq;              /* sense, for autosense */
+    uint8_t buf[SCSI_BUF_SIZE];
+    uint8_t nreqs;
+    struct scsi_req reqs[SCSI_UNMAP_DESCRIPTORS];
+};
+
+#define SCSI_SENSE_SIZE 18
+
+int
+scsi_lun_init(struct scsi_lun *lun, struct blk *blk, uint32_t block_size);
+
+void
+scsi_exec(struct scsi_lun *lun, struct scsi_cmd *cmd);
+
+/* Fails a command addressed to a LUN the target does not have. */
+void
+scsi_no_lun(struct scsi_cmd *cmd);
+
+/* Fixed format sense data for cmd, SCSI_SENSE_SIZE bytes. */
+void
+scsi_sense_data(const struct scsi_cmd *cmd, uint8_t *buf);
+
+/*
+ * Data phase helpers, for len bytes at pos within the data phase.
+ * scsi_data_map() returns them in place, or NULL when the backend cannot
+ * map; scsi_data_file() names the file holding them, or returns -1; the
+ * copying variants record a failure in the command's status.
+ */
+uint8_t *
+scsi_data_map(struct scsi_lun *lun, struct scsi_cmd *cmd, uint32_t pos,
+              uint32_t len);
+
+int
+scsi_data_file(struct scsi_lun *lun, const struct scsi_cmd *cmd, uint32_t pos,
+               uint32_t len, uint64_t *off);
+
+void
+scsi_data_read(struct scsi_lun *lun, struct scsi_cmd *cmd, uint32_t pos,
+               void *buf, uint32_t len);
+
+void
+scsi_data_write(struct scsi_lun *lun, struct scsi_cmd *cmd, uint32_t pos,
+                const void *buf, uint32_t len);
+
+/* Records a failed transfer or flush, op BLK_*, done for cmd by a transport. */
+void
+scsi_io_error(struct scsi_lun *lun, struct scsi_cmd *cmd, uint8_t op);
+
+/* Called once the data phase is over, before status goes to the host. */
+void
+scsi_done(struct scsi_lun *lun, struct scsi_cmd *cmd);
@@ -0,0 +1,362 @@
+#include "usb.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USB_DT_HID_REPORT 0x22
+
+/*
+ * Clones a device from its sysfs directory (/sys/bus/usb/devices/1-2) or a
+ * copy of one. The "descriptors" attribute holds the device descriptor
+ * followed by every configuration exactly as the device sent them, so they
+ * are stored as-is and served without ever being parsed again.
+ */
+struct clone {
+    struct usb_function func;
+    struct usb_desc report[USB_MAX_INTERFACES];
+};
+
+static int
+clone_read(int dir, const char *name, uint8_t **buf, size_t *len)
+{
+    size_t size = 0;
+    uint8_t *b = NULL;
+    int fd;
+
+    *len = 0;
+
+    fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    for (;;) {
+        ssize_t n;
+
+        if (*len == size) {
+            uint8_t *tmp = realloc(b, size = size ? size * 2 : 4096);
+            if (!tmp) {
+                free(b);
+                close(fd);
+                return ENOMEM;
+            }
+            b = tmp;
+        }
+
+        n = read(fd, b + *len, size - *len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(b);
+            close(fd);
+            return errno;
+        }
+
+        if (n == 0)
+            break;
+
+        *len += n;
+    }
+
+    close(fd);
+    *buf = b;
+    return 0;
+}
+
+/* Reads a text attribute, dropping the trailing newline. */
+static int
+clone_attr(int dir, const char *name, char *str, size_t size)
+{
+    ssize_t n;
+    int fd;
+
+    fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    n = read(fd, str, size - 1);
+    close(fd);
+    if (n < 0)
+        return errno;
+
+    while (n > 0 && (str[n - 1] == '\n' || str[n - 1] == '\0'))
+        n--;
+
+    str[n] = '\0';
+    return 0;
+}
+
+static int
+clone_string(struct usb_device *dev, int dir, const char *name, uint8_t index)
+{
+    char str[512];
+
+    if (index == 0 || clone_attr(dir, name, str, sizeof(str)) != 0)
+        return 0;
+
+    return usb_device_string(dev, index, str);
+}
+
+static const struct usb_config_descriptor *
+clone_config(struct usb_device *dev, int dir)
+{
+    unsigned value;
+    char str[16];
+
+    if (clone_attr(dir, "bConfigurationValue", str, sizeof(str)) != 0)
+        return NULL;
+
+    if (sscanf(str, "%u", &value) != 1)
+        return NULL;
+
+    for (size_t i = 0; i < USB_MAX_CONFIGS; i++) {
+        const struct usb_config_descriptor *cfg = (const void *) dev->config[i].buf;
+
+        if (cfg && cfg->bConfigurationValue == value)
+            return cfg;
+    }
+
+    return NULL;
+}
+
+/* HID report descriptors live in the child device of each interface. */
+static int
+clone_report(struct clone *c, int dir, uint8_t intf)
+{
+    struct dirent *de;
+    DIR *d;
+
+    d = fdopendir(dup(dir));
+    if (!d)
+        return errno;
+
+    while ((de = readdir(d))) {
+        char path[sizeof(de->d_name) + 32];
+        uint8_t *buf;
+        size_t len;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/report_descriptor", de->d_name);
+        if (clone_read(dir, path, &buf, &len) != 0)
+            continue;
+
+        free(c->report[intf].buf);
+        c->report[intf] = (struct usb_desc) { buf, len };
+        break;
+    }
+
+    closedir(d);
+    return 0;
+}
+
+/* Interface directories are named "<device>:<config>.<interface>". */
+static int
+clone_interfaces(struct clone *c, struct usb_device *dev, int dir)
+{
+    const struct usb_config_descriptor *cfg = clone_config(dev, dir);
+    struct dirent *de;
+    DIR *d;
+    int r = 0;
+
+    d = fdopendir(dup(dir));
+    if (!d)
+        return errno;
+
+    while (r == 0 && (de = readdir(d))) {
+        const struct usb_interface_descriptor *id;
+        unsigned intf, alt;
+        char str[16];
+        int idir;
+
+        if (!strchr(de->d_name, ':'))
+            continue;
+
+        idir = openat(dir, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (idir < 0)
+            continue;
+
+        if (clone_attr(idir, "bInterfaceNumber", str, sizeof(str)) != 0 ||
+            sscanf(str, "%x", &intf) != 1 || intf >= USB_MAX_INTERFACES ||
+            clone_attr(idir, "bAlternateSetting", str, sizeof(str)) != 0 ||
+            sscanf(str, "%u", &alt) != 1) {
+            close(idir);
+            continue;
+        }
+
+        id = cfg ? usb_config_interface(cfg, intf, alt) : NULL;
+        if (id)
+            r = clone_string(dev, idir, "interface", id->iInterface);
+
+        if (r == 0)
+            r = clone_report(c, idir, intf);
+
+        close(idir);
+    }
+
+    closedir(d);
+
+    if (r == 0 && cfg)
+        r = clone_string(dev, dir, "configuration", cfg->iConfiguration);
+
+    return r;
+}
+
+static int
+clone_descriptors(struct usb_device *dev, int dir)
+{
+    const struct usb_device_descriptor *dd;
+    size_t len, off;
+    uint8_t *buf;
+    int r;
+
+    r = clone_read(dir, "descriptors", &buf, &len);
+    if (r != 0)
+        return r;
+
+    dd = (const void *) buf;
+    if (len < sizeof(*dd) || dd->bLength != sizeof(*dd)) {
+        free(buf);
+        return EINVAL;
+    }
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, buf, sizeof(*dd));
+    off = sizeof(*dd);
+
+    for (size_t i = 0; r == 0 && i < dd->bNumConfigurations; i++) {
+        const struct usb_config_descriptor *cfg = (const void *) &buf[off];
+        size_t total;
+
+        if (i >= USB_MAX_CONFIGS || len - off < sizeof(*cfg)) {
+            r = EINVAL;
+            break;
+        }
+
+        total = le16toh(cfg->wTotalLength);
+        if (total > len - off) {
+            r = EINVAL;
+            break;
+        }
+
+        r = usb_device_desc(dev, USB_DT_CONFIG, i, cfg, total);
+        off += total;
+    }
+
+    if (r == 0)
+        r = clone_string(dev, dir, "manufacturer", dd->iManufacturer);
+    if (r == 0)
+        r = clone_string(dev, dir, "product", dd->iProduct);
+    if (r == 0)
+        r = clone_string(dev, dir, "serial", dd->iSerialNumber);
+
+    free(buf);
+    return r;
+}
+
+static int
+clone_setup(struct usb_function *f, struct urb *urb)
+{
+    struct clone *c = (struct clone *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+    uint8_t intf = s->wIndex & 0xff;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_STANDARD ||
+        SETUP_RCP(s->bmRequestType) != USB_RECIP_INTERFACE ||
+        s->bRequest != USB_REQ_GET_DESCRIPTOR ||
+        s->wValue >> 8 != USB_DT_HID_REPORT ||
+        intf >= USB_MAX_INTERFACES)
+        return EPIPE;
+
+    return usb_urb_blob(urb, &c->report[intf]);
+}
+
+/* The clone has no function behind it: IN endpoints NAK, OUT data sinks. */
+static void
+clone_submit(struct usb_function *f, struct urb *urb)
+{
+    (void) f;
+
+    if (urb->dir == USBIP_DIR_IN) {
+        usb_ep_queue(urb);
+        return;
+    }
+
+    urb->actual = urb->length;
+    usb_urb_done(urb, 0);
+}
+
+static void
+clone_destroy(struct usb_function *f)
+{
+    struct clone *c = (struct clone *) f;
+
+    for (size_t i = 0; i < USB_MAX_INTERFACES; i++)
+        free(c->report[i].buf);
+
+    free(c);
+}
+
+static const struct usb_function_ops clone_ops = {
+    .setup = clone_setup,
+    .submit = clone_submit,
+    .destroy = clone_destroy,
+};
+
+static int
+clone_create(struct usb_device *dev, char *opts)
+{
+    char *const tokens[] = { "path", NULL };
+    const char *path = NULL;
+    struct clone *c;
+    char *value;
+    char str[16];
+    int dir;
+    int r;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case 0:
+            path = value;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    if (!path)
+        return EINVAL;
+
+    dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0)
+        return errno;
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(dir);
+        return ENOMEM;
+    }
+
+    usb_device_function(dev, &c->func, &clone_ops);
+
+    if (clone_attr(dir, "speed", str, sizeof(str)) == 0)
+        usb_speed_parse(str, &dev->speed);
+
+    r = clone_descriptors(dev, dir);
+    if (r == 0)
+        r = clone_interfaces(c, dev, dir);
+
+    close(dir);
+    return r;
+}
+
+const struct usb_model usb_model_clone = {
+    .name = "clone",
+    .create = clone_create,
+};
@@ -0,0 +1,274 @@
+#include "blk.h"
+#include "loop.h"
+
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * A synchronous image behind a thread of its own, so that its page faults
+ * and msync() hold up only its own requests, never the event loop and the
+ * images of other LUNs. Requests run one at a time in the order they were
+ * submitted; the thread hands them back through an eventfd, each with its
+ * result in io->moved until done() is called.
+ *
+ * Calls the loop makes on the spot wait for the request the thread is on,
+ * if any, except readahead(), which passes rather than wait. The image is
+ * neither mapped nor offered for sendfile(): a page cache miss there would
+ * stall the loop, so all data goes through the thread.
+ */
+struct thread {
+    struct blk blk;
+    struct blk *lower;
+    struct loop_watch watch;             /* eventfd, for completions */
+    pthread_t thread;
+
+    pthread_mutex_t busy;                /* held around calls into lower */
+    pthread_mutex_t lock;                /* the lists and closing */
+    pthread_cond_t cond;
+    struct blk_io *queue, **queue_tail;
+    struct blk_io *done, **done_tail;
+    bool closing;
+    bool stopped;                        /* requests now run on the spot */
+};
+
+static void *
+thread_run(void *arg)
+{
+    struct thread *t = arg;
+    struct blk_io *io;
+    bool wake;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (!t->queue && !t->closing)
+            pthread_cond_wait(&t->cond, &t->lock);
+
+        io = t->queue;
+        if (!io)
+            break;
+
+        t->queue = io->next;
+        if (!t->queue)
+            t->queue_tail = &t->queue;
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_mutex_lock(&t->busy);
+        io->moved = blk_submit(t->lower, io);
+        pthread_mutex_unlock(&t->busy);
+
+        pthread_mutex_lock(&t->lock);
+        io->next = NULL;
+        wake = !t->done;
+        *t->done_tail = io;
+        t->done_tail = &io->next;
+        if (wake)
+            eventfd_write(t->watch.fd, 1);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+static void
+thread_reap(struct thread *t)
+{
+    struct blk_io *io, *next;
+
+    pthread_mutex_lock(&t->lock);
+    io = t->done;
+    t->done = NULL;
+    t->done_tail = &t->done;
+    pthread_mutex_unlock(&t->lock);
+
+    for (; io; io = next) {
+        next = io->next;
+        io->done(io, (int) io->moved);
+    }
+}
+
+static void
+thread_event(struct loop_watch *w, uint32_t events)
+{
+    struct thread *t = (struct thread *) ((char *) w - offsetof(struct thread, watch));
+    eventfd_t n;
+
+    (void) events;
+
+    if (eventfd_read(w->fd, &n) == 0)
+        thread_reap(t);
+}
+
+static int
+thread_submit(struct blk *b, struct blk_io *io)
+{
+    struct thread *t = (struct thread *) b;
+
+    if (t->stopped)
+        return blk_submit(t->lower, io);
+
+    io->next = NULL;
+
+    pthread_mutex_lock(&t->lock);
+    *t->queue_tail = io;
+    t->queue_tail = &io->next;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    return EINPROGRESS;
+}
+
+static int
+thread_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    struct thread *t = (struct thread *) b;
+    int err;
+
+    pthread_mutex_lock(&t->busy);
+    err = blk_read(t->lower, buf, off, len);
+    pthread_mutex_unlock(&t->busy);
+
+    return err;
+}
+
+static int
+thread_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    struct thread *t = (struct thread *) b;
+    int err;
+
+    pthread_mutex_lock(&t->busy);
+    err = blk_write(t->lower, buf, off, len);
+    pthread_mutex_unlock(&t->busy);
+
+    return err;
+}
+
+static int
+thread_flush(struct blk *b)
+{
+    struct thread *t = (struct thread *) b;
+    int err;
+
+    pthread_mutex_lock(&t->busy);
+    err = blk_flush(t->lower);
+    pthread_mutex_unlock(&t->busy);
+
+    return err;
+}
+
+static int
+thread_discard(struct blk *b, uint64_t off, uint64_t len)
+{
+    struct thread *t = (struct thread *) b;
+    int err;
+
+    pthread_mutex_lock(&t->busy);
+    err = blk_discard(t->lower, off, len);
+    pthread_mutex_unlock(&t->busy);
+
+    return err;
+}
+
+static void
+thread_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    struct thread *t = (struct thread *) b;
+
+    if (pthread_mutex_trylock(&t->busy) != 0)
+        return;
+
+    blk_readahead(t->lower, off, len);
+    pthread_mutex_unlock(&t->busy);
+}
+
+/*
+ * The thread drains the queue before it exits; what the completions
+ * submit after that is carried out here.
+ */
+static void
+thread_close(struct blk *b)
+{
+    struct thread *t = (struct thread *) b;
+
+    pthread_mutex_lock(&t->lock);
+    t->closing = true;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    pthread_join(t->thread, NULL);
+    t->stopped = true;
+    thread_reap(t);
+
+    loop_del(&t->watch);
+    close(t->watch.fd);
+    blk_close(t->lower);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    pthread_mutex_destroy(&t->busy);
+    free(t);
+}
+
+static const struct blk_ops thread_ops = {
+    .read = thread_read,
+    .write = thread_write,
+    .flush = thread_flush,
+    .discard = thread_discard,
+    .submit = thread_submit,
+    .readahead = thread_readahead,
+    .close = thread_close,
+};
+
+int
+blk_thread_open(struct blk *lower, struct blk **blk)
+{
+    struct thread *t;
+    int e;
+
+    if (blk_async(lower))
+        return EINVAL;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return ENOMEM;
+
+    t->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->watch.fd < 0) {
+        e = errno;
+        free(t);
+        return e;
+    }
+
+    t->watch.func = thread_event;
+    e = loop_add(&t->watch, EPOLLIN);
+    if (e != 0) {
+        close(t->watch.fd);
+        free(t);
+        return e;
+    }
+
+    t->lower = lower;
+    t->queue_tail = &t->queue;
+    t->done_tail = &t->done;
+    pthread_mutex_init(&t->busy, NULL);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+
+    e = pthread_create(&t->thread, NULL, thread_run, t);
+    if (e != 0) {
+        loop_del(&t->watch);
+        close(t->watch.fd);
+        free(t);
+        return e;
+    }
+
+    t->blk.ops = &thread_ops;
+    t->blk.size = lower->size;
+    t->blk.readonly = lower->readonly;
+    *blk = &t->blk;
+    return 0;
+}
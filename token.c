@@ -0,0 +1,417 @@
+#include "token.h"
+
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SW_OK 0x9000
+#define SW_EOF 0x6282                    /* end of file before Le bytes */
+#define SW_TRIES 0x63c0                  /* | tries left */
+#define SW_WRONG_LENGTH 0x6700
+#define SW_SECURITY 0x6982               /* not verified */
+#define SW_BLOCKED 0x6983
+#define SW_CONDITIONS 0x6985             /* nothing selected */
+#define SW_WRONG_DATA 0x6a80
+#define SW_NOT_FOUND 0x6a82
+#define SW_WRONG_P1P2 0x6b00
+#define SW_INS 0x6d00
+#define SW_CLA 0x6e00
+
+enum {
+    INS_VERIFY = 0x20,
+    INS_GET_CHALLENGE = 0x84,
+    INS_INTERNAL_AUTH = 0x88,
+    INS_SELECT = 0xa4,
+    INS_READ_BINARY = 0xb0,
+};
+
+static const uint8_t token_aid[] = { 0xf0, 'u', 's', 'b', 'e', 'm', 'u' };
+
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t block[64];
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t
+ror(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static void
+sha256_block(struct sha256 *s, const uint8_t *p)
+{
+    uint32_t w[64], v[8];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t) p[i * 4] << 24 | p[i * 4 + 1] << 16 |
+               p[i * 4 + 2] << 8 | p[i * 4 + 3];
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ w[i - 2] >> 10;
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(v, s->h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = v[7] + (ror(v[4], 6) ^ ror(v[4], 11) ^ ror(v[4], 25)) +
+                      ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ror(v[0], 2) ^ ror(v[0], 13) ^ ror(v[0], 22)) +
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+        memmove(v + 1, v, 7 * sizeof(*v));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+
+    for (int i = 0; i < 8; i++)
+        s->h[i] += v[i];
+}
+
+static void
+sha256_init(struct sha256 *s)
+{
+    static const uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(s->h, h, sizeof(h));
+    s->len = 0;
+}
+
+static void
+sha256_update(struct sha256 *s, const uint8_t *p, size_t len)
+{
+    size_t fill = s->len % 64;
+
+    s->len += len;
+    if (fill) {
+        size_t n = 64 - fill < len ? 64 - fill : len;
+
+        memcpy(s->block + fill, p, n);
+        p += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        sha256_block(s, s->block);
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(s, p);
+
+    memcpy(s->block, p, len);
+}
+
+static void
+sha256_final(struct sha256 *s, uint8_t out[32])
+{
+    uint64_t bits = s->len * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t n = (s->len % 64 < 56 ? 56 : 120) - s->len % 64;
+
+    for (int i = 0; i < 8; i++)
+        pad[n + i] = bits >> (56 - i * 8);
+    sha256_update(s, pad, n + 8);
+
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = s->h[i] >> 24;
+        out[i * 4 + 1] = s->h[i] >> 16;
+        out[i * 4 + 2] = s->h[i] >> 8;
+        out[i * 4 + 3] = s->h[i];
+    }
+}
+
+/* Keys are at most one block, so they are never hashed first. */
+static void
+token_hmac(const struct token *t, const uint8_t *msg, size_t len,
+           uint8_t out[32])
+{
+    uint8_t pad[64];
+    struct sha256 s;
+
+    for (int i = 0; i < 64; i++)
+        pad[i] = (i < t->keylen ? t->key[i] : 0) ^ 0x36;
+    sha256_init(&s);
+    sha256_update(&s, pad, 64);
+    sha256_update(&s, msg, len);
+    sha256_final(&s, out);
+
+    for (int i = 0; i < 64; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&s);
+    sha256_update(&s, pad, 64);
+    sha256_update(&s, out, 32);
+    sha256_final(&s, out);
+}
+
+static bool
+token_pin_equal(const struct token *t, const uint8_t *pin, uint32_t len)
+{
+    uint8_t diff = len != t->pinlen;
+
+    for (uint32_t i = 0; i < len && i < TOKEN_MAX_PIN; i++)
+        diff |= pin[i] ^ (i < t->pinlen ? (uint8_t) t->pin[i] : 0);
+
+    return diff == 0;
+}
+
+static void
+token_verify(struct token *t, const uint8_t *pin, uint32_t len,
+             struct token_resp *resp)
+{
+    if (t->tries == 0) {
+        resp->sw = SW_BLOCKED;
+    } else if (len == 0) {
+        resp->sw = t->verified ? SW_OK : SW_TRIES | t->tries;
+    } else if (!token_pin_equal(t, pin, len)) {
+        t->verified = false;
+        t->tries--;
+        resp->sw = t->tries ? SW_TRIES | t->tries : SW_BLOCKED;
+    } else {
+        t->verified = true;
+        t->tries = TOKEN_TRIES;
+    }
+}
+
+static void
+token_read(struct token *t, uint32_t off, uint32_t le, struct token_resp *resp)
+{
+    if (off > t->filelen) {
+        resp->sw = SW_WRONG_P1P2;
+        return;
+    }
+
+    resp->data = t->file + off;
+    resp->len = t->filelen - off < le ? t->filelen - off : le;
+    if (resp->len < le)
+        resp->sw = SW_EOF;
+}
+
+/*
+ * Splits the body after the four byte header into Lc, the data and Le
+ * (0 when absent), going by ISO 7816-3 cases 1 to 4, short or extended.
+ */
+static bool
+token_parse(const uint8_t *apdu, uint32_t len, const uint8_t **data,
+            uint32_t *lc, uint32_t *le)
+{
+    const uint8_t *b = apdu + 4;
+    uint32_t n = len - 4;
+
+    *data = NULL;
+    *lc = *le = 0;
+
+    if (n == 0)
+        return true;
+
+    if (n == 1) {
+        *le = b[0] ? b[0] : 256;
+        return true;
+    }
+
+    if (b[0] != 0) {
+        *lc = b[0];
+        *data = b + 1;
+        if (n == 1 + *lc)
+            return true;
+        if (n == 2 + *lc) {
+            *le = b[n - 1] ? b[n - 1] : 256;
+            return true;
+        }
+        return false;
+    }
+
+    if (n < 3)
+        return false;
+
+    if (n == 3) {
+        *le = (b[1] << 8 | b[2]) ? (uint32_t) (b[1] << 8 | b[2]) : 65536;
+        return true;
+    }
+
+    *lc = b[1] << 8 | b[2];
+    *data = b + 3;
+    if (*lc == 0 || (n != 3 + *lc && n != 5 + *lc))
+        return false;
+
+    if (n == 5 + *lc)
+        *le = (b[n - 2] << 8 | b[n - 1]) ? (uint32_t) (b[n - 2] << 8 | b[n - 1])
+                                         : 65536;
+    return true;
+}
+
+void
+token_apdu(struct token *t, const uint8_t *apdu, uint32_t len,
+           struct token_resp *resp)
+{
+    const uint8_t *data;
+    uint32_t lc, le;
+
+    *resp = (struct token_resp) { .sw = SW_OK };
+
+    if (len < 4 || !token_parse(apdu, len, &data, &lc, &le)) {
+        resp->sw = SW_WRONG_LENGTH;
+        return;
+    }
+
+    if (apdu[0] != 0x00) {
+        resp->sw = SW_CLA;
+        return;
+    }
+
+    if (apdu[1] != INS_SELECT && !t->selected) {
+        resp->sw = SW_CONDITIONS;
+        return;
+    }
+
+    switch (apdu[1]) {
+    case INS_SELECT:
+        t->selected = apdu[2] == 0x04 && lc >= 1 && lc <= sizeof(token_aid) &&
+                      memcmp(data, token_aid, lc) == 0;
+        t->verified = false;
+        if (!t->selected)
+            resp->sw = SW_NOT_FOUND;
+        break;
+
+    case INS_VERIFY:
+        token_verify(t, data, lc, resp);
+        break;
+
+    case INS_GET_CHALLENGE:
+        if (le == 0 || le > TOKEN_SCRATCH ||
+            getrandom(t->scratch, le, 0) != (ssize_t) le) {
+            resp->sw = SW_WRONG_LENGTH;
+            break;
+        }
+        resp->data = t->scratch;
+        resp->len = le;
+        break;
+
+    case INS_INTERNAL_AUTH:
+        if (!t->verified) {
+            resp->sw = SW_SECURITY;
+        } else if (lc == 0) {
+            resp->sw = SW_WRONG_DATA;
+        } else {
+            token_hmac(t, data, lc, t->scratch);
+            resp->data = t->scratch;
+            resp->len = 32;
+        }
+        break;
+
+    case INS_READ_BINARY:
+        if (apdu[2] & 0x80)
+            resp->sw = SW_WRONG_P1P2;
+        else
+            token_read(t, apdu[2] << 8 | apdu[3], le, resp);
+        break;
+
+    default:
+        resp->sw = SW_INS;
+        break;
+    }
+}
+
+void
+token_reset(struct token *t)
+{
+    t->selected = false;
+    t->verified = false;
+}
+
+static int
+token_hex(struct token *t, const char *hex)
+{
+    size_t n = strlen(hex);
+
+    if (n == 0 || n % 2 != 0 || n / 2 > TOKEN_MAX_KEY ||
+        strspn(hex, "0123456789abcdefABCDEF") != n)
+        return EINVAL;
+
+    for (size_t i = 0; i < n / 2; i++) {
+        char byte[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+
+        t->key[i] = strtoul(byte, NULL, 16);
+    }
+
+    t->keylen = n / 2;
+    return 0;
+}
+
+int
+token_init(struct token *t, const char *key, const char *pin,
+           const char *file)
+{
+    struct stat st;
+    void *p;
+    int fd;
+    int r;
+
+    *t = (struct token) { .tries = TOKEN_TRIES };
+
+    if (strlen(pin) == 0 || strlen(pin) > TOKEN_MAX_PIN)
+        return EINVAL;
+    memcpy(t->pin, pin, strlen(pin));
+    t->pinlen = strlen(pin);
+
+    r = token_hex(t, key);
+    if (r != 0 || !file)
+        return r;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    if (fstat(fd, &st) != 0) {
+        r = errno;
+        close(fd);
+        return r;
+    }
+
+    /* READ BINARY offsets are 15 bits; beyond that is unreachable. */
+    t->filelen = st.st_size < 0x7fff + 65536 ? st.st_size : 0x7fff + 65536;
+    if (t->filelen == 0) {
+        close(fd);
+        return 0;
+    }
+
+    p = mmap(NULL, t->filelen, PROT_READ, MAP_SHARED, fd, 0);
+    r = errno;
+    close(fd);
+    if (p == MAP_FAILED)
+        return r;
+
+    t->file = p;
+    return 0;
+}
+
+void
+token_destroy(struct token *t)
+{
+    if (t->file)
+        munmap((void *) t->file, t->filelen);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A software smart card speaking ISO 7816-4 APDUs, for the CCID reader.
+ * One application holds a PIN, an HMAC-SHA256 key and a read-only data
+ * file (a certificate, say):
+ *
+ *     SELECT             00 A4 04 00  with the application ID
+ *     VERIFY             00 20 00 80  PIN; empty asks for the tries left
+ *     GET CHALLENGE      00 84 00 00  up to TOKEN_SCRATCH random bytes
+ *     INTERNAL AUTH      00 88 00 00  HMAC-SHA256 of the data, after VERIFY
+ *     READ BINARY        00 B0        the data file, P1-P2 the offset
+ *
+ * Short and extended length APDUs are accepted. A response points into the
+ * token, either its scratch space or the data file, and is not copied; it
+ * stays valid until the next APDU. The data file is mapped, so any number
+ * of tokens serving the same one share its pages.
+ */
+
+#define TOKEN_SCRATCH 64
+#define TOKEN_MAX_KEY 64
+#define TOKEN_MAX_PIN 16
+#define TOKEN_TRIES 3
+
+struct token {
+    uint8_t key[TOKEN_MAX_KEY];
+    uint8_t keylen;
+    uint8_t pinlen;
+    uint8_t tries;                       /* left before the PIN blocks */
+    bool selected;
+    bool verified;
+    char pin[TOKEN_MAX_PIN];
+
+    const uint8_t *file;
+    size_t filelen;
+
+    uint8_t scratch[TOKEN_SCRATCH];
+};
+
+struct token_resp {
+    const uint8_t *data;
+    uint32_t len;
+    uint16_t sw;
+};
+
+/* key is hex, up to TOKEN_MAX_KEY bytes; file may be NULL. */
+int
+token_init(struct token *t, const char *key, const char *pin,
+           const char *file);
+
+/* The card was powered up or reset: back to nothing selected. */
+void
+token_reset(struct token *t);
+
+void
+token_apdu(struct token *t, const uint8_t *apdu, uint32_t len,
+           struct token_resp *resp);
+
+void
+token_destroy(struct token *t);
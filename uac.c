@@ -0,0 +1,964 @@
+#include "pcm.h"
+#include "usb.h"
+
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USB_CLASS_MISC 0xef
+#define USB_CLASS_AUDIO 0x01
+#define UAC_SUBCLASS_AUDIOCONTROL 0x01
+#define UAC_SUBCLASS_AUDIOSTREAMING 0x02
+#define UAC_VERSION_2 0x20
+#define USB_DT_CS_INTERFACE 0x24
+#define USB_DT_CS_ENDPOINT 0x25
+
+#define USB_ENDPOINT_SYNC_ASYNC (1 << 2)
+#define USB_ENDPOINT_USAGE_FEEDBACK (1 << 4)
+
+#define UAC_INTF_CONTROL 0
+#define UAC_INTF_PLAY 1
+#define UAC_INTF_CAPTURE 2
+
+#define UAC_EP_PLAY 1                    /* OUT */
+#define UAC_EP_FEEDBACK 1                /* IN */
+#define UAC_EP_CAPTURE 2                 /* IN */
+
+#define UAC_PLAY_CHANNELS 2
+#define UAC_CAPTURE_CHANNELS 1
+
+/* Unit and terminal IDs of the topology below. */
+enum {
+    UAC_ID_CLOCK = 1,
+    UAC_ID_PLAY_IT,
+    UAC_ID_PLAY_FU,
+    UAC_ID_PLAY_OT,
+    UAC_ID_CAPTURE_IT,
+    UAC_ID_CAPTURE_FU,
+    UAC_ID_CAPTURE_OT,
+};
+
+enum {
+    UAC2_REQ_CUR = 0x01,
+    UAC2_REQ_RANGE = 0x02,
+};
+
+enum {
+    UAC2_CS_SAM_FREQ = 0x01,
+    UAC2_CS_CLOCK_VALID = 0x02,
+    UAC2_FU_MUTE = 0x01,
+    UAC2_FU_VOLUME = 0x02,
+};
+
+/* Volume in 1/256 dB, as the host sees it. */
+#define UAC_VOLUME_MIN (-100 * 256)
+#define UAC_VOLUME_MAX 0
+#define UAC_VOLUME_RES 256
+
+struct uac2_ac_header {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint16_t bcdADC;
+    uint8_t bCategory;
+    uint16_t wTotalLength;
+    uint8_t bmControls;
+} __attribute__((packed));
+
+struct uac2_clock_source {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bClockID;
+    uint8_t bmAttributes;
+    uint8_t bmControls;
+    uint8_t bAssocTerminal;
+    uint8_t iClockSource;
+} __attribute__((packed));
+
+struct uac2_input_terminal {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalID;
+    uint16_t wTerminalType;
+    uint8_t bAssocTerminal;
+    uint8_t bCSourceID;
+    uint8_t bNrChannels;
+    uint32_t bmChannelConfig;
+    uint8_t iChannelNames;
+    uint16_t bmControls;
+    uint8_t iTerminal;
+} __attribute__((packed));
+
+struct uac2_output_terminal {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalID;
+    uint16_t wTerminalType;
+    uint8_t bAssocTerminal;
+    uint8_t bSourceID;
+    uint8_t bCSourceID;
+    uint16_t bmControls;
+    uint8_t iTerminal;
+} __attribute__((packed));
+
+#define UAC2_FEATURE_UNIT(ch)                                   \
+    struct {                                                    \
+        uint8_t bLength;                                        \
+        uint8_t bDescriptorType;                                \
+        uint8_t bDescriptorSubtype;                             \
+        uint8_t bUnitID;                                        \
+        uint8_t bSourceID;                                      \
+        uint32_t bmaControls[(ch) + 1];                         \
+        uint8_t iFeature;                                       \
+    } __attribute__((packed))
+
+struct uac2_as_header {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalLink;
+    uint8_t bmControls;
+    uint8_t bFormatType;
+    uint32_t bmFormats;
+    uint8_t bNrChannels;
+    uint32_t bmChannelConfig;
+    uint8_t iChannelNames;
+} __attribute__((packed));
+
+struct uac2_format_type_i {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bFormatType;
+    uint8_t bSubslotSize;
+    uint8_t bBitResolution;
+} __attribute__((packed));
+
+struct uac2_iso_endpoint {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bmAttributes;
+    uint8_t bmControls;
+    uint8_t bLockDelayUnits;
+    uint16_t wLockDelay;
+} __attribute__((packed));
+
+struct uac_control {
+    struct uac2_ac_header header;
+    struct uac2_clock_source clock;
+    struct uac2_input_terminal play_it;
+    UAC2_FEATURE_UNIT(UAC_PLAY_CHANNELS) play_fu;
+    struct uac2_output_terminal play_ot;
+    struct uac2_input_terminal capture_it;
+    UAC2_FEATURE_UNIT(UAC_CAPTURE_CHANNELS) capture_fu;
+    struct uac2_output_terminal capture_ot;
+} __attribute__((packed));
+
+struct uac_config {
+    struct usb_config_descriptor config;
+    struct usb_interface_assoc_descriptor iad;
+    struct usb_interface_descriptor control;
+    struct uac_control ac;
+
+    struct usb_interface_descriptor play0;
+    struct usb_interface_descriptor play1;
+    struct uac2_as_header play_as;
+    struct uac2_format_type_i play_format;
+    struct usb_endpoint_descriptor play;
+    struct uac2_iso_endpoint play_iso;
+    struct usb_endpoint_descriptor feedback;
+
+    struct usb_interface_descriptor capture0;
+    struct usb_interface_descriptor capture1;
+    struct uac2_as_header capture_as;
+    struct uac2_format_type_i capture_format;
+    struct usb_endpoint_descriptor capture;
+    struct uac2_iso_endpoint capture_iso;
+} __attribute__((packed));
+
+enum uac_kind {
+    UAC_PLAY,
+    UAC_FEEDBACK,
+    UAC_CAPTURE,
+};
+
+struct uac_stream {
+    enum uac_kind kind;
+    uint8_t dir;
+    uint8_t num;
+    uint16_t channels;
+
+    char *name;
+    struct pcm *pcm;
+    struct pcm_stats *stats;             /* in the ring, or own */
+    struct pcm_stats own;
+
+    uint64_t clock;                      /* ns, end of the last packet served */
+    uint64_t frac;                       /* capture: sample remainder, ns */
+    uint8_t mute;
+    int16_t volume;
+};
+
+/*
+ * A UAC2 headset: an asynchronous speaker with an explicit feedback
+ * endpoint and a microphone, both running off one fixed internal clock.
+ *
+ * Isochronous URBs are parked on their endpoint and completed in real time,
+ * one timerfd deadline per URB: each stream keeps the end of the last
+ * (micro)frame it served and a URB is due when all its packets would have
+ * crossed the bus. Speaker packets are written to a PCM ring at that point,
+ * microphone packets are read from another; either ring may be absent, in
+ * which case audio is dropped or silence sent.
+ *
+ * The feedback endpoint reports the nominal rate, steered by how far the
+ * speaker ring is from half full. That makes the external consumer's clock
+ * the one the host follows. The microphone is steered the same way, by one
+ * sample per packet.
+ */
+struct uac {
+    struct usb_function func;
+    struct uac_stream streams[3];        /* by enum uac_kind */
+    struct loop_watch timer;
+
+    uint32_t rate;
+    uint8_t width;
+};
+
+static uint64_t
+uac_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* urb->interval is in (micro)frames, as the host computed it. */
+static uint64_t
+uac_period(struct uac *u, const struct urb *urb)
+{
+    uint64_t unit = u->func.dev->speed >= USB_SPEED_HIGH ? 125000 : 1000000;
+    return (urb->interval ? urb->interval : 1) * unit;
+}
+
+static struct usb_ep *
+uac_ep(struct uac *u, struct uac_stream *s)
+{
+    return usb_function_ep(&u->func, s->dir, s->num);
+}
+
+static void
+uac_active(struct uac *u, enum uac_kind kind, bool active)
+{
+    struct uac_stream *s = &u->streams[kind];
+
+    s->clock = 0;
+    s->frac = 0;
+    if (s->pcm)
+        atomic_store(&s->pcm->active, active);
+}
+
+/* 16.16 samples per ms, steered by the fill of the speaker ring. */
+static uint64_t
+uac_feedback(struct uac *u)
+{
+    struct pcm *pcm = u->streams[UAC_PLAY].pcm;
+    uint64_t nominal = ((uint64_t) u->rate << 16) / 1000;
+    int64_t half, err;
+
+    if (!pcm)
+        return nominal;
+
+    half = pcm->size / 2;
+    err = half - (int64_t) pcm_avail(pcm);
+    return nominal + (int64_t) nominal * err / (half * 200);
+}
+
+static void
+uac_stat(struct uac_stream *s, const struct urb *urb, uint64_t late,
+         uint32_t xruns)
+{
+    struct pcm_stats *st = s->stats;
+
+    atomic_fetch_add_explicit(&st->urbs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->packets, urb->packets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->xruns, xruns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->late_sum, late, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->late_sq, late * late, memory_order_relaxed);
+    if (late > atomic_load_explicit(&st->late_max, memory_order_relaxed))
+        atomic_store_explicit(&st->late_max, late, memory_order_relaxed);
+}
+
+/* Serves the packets of a URB whose time has come. Returns xruns. */
+static uint32_t
+uac_serve(struct uac *u, struct uac_stream *s, struct urb *urb)
+{
+    uint32_t frame = s->channels * u->width;
+    uint64_t period = uac_period(u, urb);
+    uint32_t xruns = 0;
+
+    for (uint32_t i = 0; i < urb->packets; i++) {
+        struct usbip_iso_packet_descriptor *p = &urb->iso[i];
+        uint8_t *data = urb->buf + p->offset;
+        uint64_t fb;
+        uint32_t n, got;
+
+        switch (s->kind) {
+        case UAC_PLAY:
+            if (s->pcm) {
+                /* On overrun keep whole frames, or the reader loses step. */
+                uint32_t room = s->pcm->size - pcm_avail(s->pcm);
+                n = p->length < room ? p->length : room - room % frame;
+                if (pcm_write(s->pcm, data, n) < p->length)
+                    xruns++;
+            }
+            p->actual_length = p->length;
+            break;
+
+        case UAC_FEEDBACK:
+            /* 10.14 per frame at full speed, 16.16 per microframe at high. */
+            fb = uac_feedback(u);
+            if (s->pcm)
+                atomic_store(&s->pcm->feedback, fb);
+            if (u->func.dev->speed >= USB_SPEED_HIGH)
+                fb = htole32(fb / 8);
+            else
+                fb = htole32(fb >> 2);
+
+            n = u->func.dev->speed >= USB_SPEED_HIGH ? 4 : 3;
+            p->actual_length = p->length < n ? p->length : n;
+            memcpy(data, &fb, p->actual_length);
+            break;
+
+        case UAC_CAPTURE:
+            s->frac += u->rate * period;
+            n = s->frac / 1000000000;
+            s->frac %= 1000000000;
+
+            if (s->pcm) {
+                uint32_t avail = pcm_avail(s->pcm);
+
+                if (avail > s->pcm->size / 4 * 3)
+                    n++;
+                else if (avail < s->pcm->size / 4 && n > 0)
+                    n--;
+            }
+
+            n *= frame;
+            if (n > p->length)
+                n = p->length - p->length % frame;
+
+            got = 0;
+            if (s->pcm) {
+                got = pcm_avail(s->pcm);
+                got = pcm_read(s->pcm, data, got < n ? got - got % frame : n);
+                if (got < n)
+                    xruns++;
+            }
+            if (s->mute)
+                got = 0;
+
+            memset(data + got, 0, n - got);
+            p->actual_length = n;
+            break;
+        }
+    }
+
+    return xruns;
+}
+
+static void
+uac_pump(struct uac *u)
+{
+    struct itimerspec its = { 0 };
+    uint64_t now = uac_now(), next = UINT64_MAX;
+
+    for (size_t k = 0; k < sizeof(u->streams) / sizeof(*u->streams); k++) {
+        struct uac_stream *s = &u->streams[k];
+        struct usb_ep *ep = uac_ep(u, s);
+        struct urb *urb;
+
+        while ((urb = TAILQ_FIRST(&ep->queue))) {
+            uint64_t due = s->clock + urb->packets * uac_period(u, urb);
+
+            if (due > now) {
+                if (due < next)
+                    next = due;
+                break;
+            }
+
+            urb->start_frame = (s->clock / 1000000) & 0x7ff;
+            s->clock = due;
+            uac_stat(s, urb, now - due, uac_serve(u, s, urb));
+            usb_urb_done(urb, 0);
+        }
+    }
+
+    if (next != UINT64_MAX) {
+        its.it_value.tv_sec = next / 1000000000;
+        its.it_value.tv_nsec = next % 1000000000;
+    }
+
+    timerfd_settime(u->timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+uac_timer(struct loop_watch *w, uint32_t events)
+{
+    struct uac *u = container_of(w, struct uac, timer);
+    uint64_t expirations;
+
+    (void) events;
+
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    uac_pump(u);
+}
+
+static int
+uac_control(struct uac *u, struct urb *urb)
+{
+    const struct usbip_submit_setup *s = &urb->setup;
+    uint8_t id = s->wIndex >> 8, cs = s->wValue >> 8, cn = s->wValue & 0xff;
+    bool in = SETUP_DIR(s->bmRequestType), range = s->bRequest == UAC2_REQ_RANGE;
+    struct uac_stream *st;
+    uint8_t buf[14];
+    uint32_t len = 0;
+    int16_t v;
+
+    if (range && !in)
+        return EPIPE;
+
+    switch (id) {
+    case UAC_ID_CLOCK:
+        if (cs == UAC2_CS_CLOCK_VALID && !range && in) {
+            buf[0] = 1;
+            len = 1;
+        } else if (cs == UAC2_CS_SAM_FREQ && range) {
+            uint32_t rate = htole32(u->rate);
+            uint16_t one = htole16(1);
+
+            memcpy(buf, &one, 2);
+            for (int i = 0; i < 3; i++)
+                memcpy(buf + 2 + i * 4, &rate, 4);
+            memset(buf + 10, 0, 4);
+            len = 14;
+        } else if (cs == UAC2_CS_SAM_FREQ && in) {
+            uint32_t rate = htole32(u->rate);
+
+            memcpy(buf, &rate, 4);
+            len = 4;
+        } else if (cs == UAC2_CS_SAM_FREQ) {
+            uint32_t rate;
+
+            /* A fixed clock: only its own rate may be set. */
+            if (urb->length < 4)
+                return EPIPE;
+            memcpy(&rate, urb->buf, 4);
+            if (le32toh(rate) != u->rate)
+                return EPIPE;
+        } else {
+            return EPIPE;
+        }
+        break;
+
+    case UAC_ID_PLAY_FU:
+    case UAC_ID_CAPTURE_FU:
+        st = &u->streams[id == UAC_ID_PLAY_FU ? UAC_PLAY : UAC_CAPTURE];
+        if (cn != 0)
+            return EPIPE;
+
+        if (cs == UAC2_FU_MUTE && !range) {
+            if (in) {
+                buf[0] = st->mute;
+                len = 1;
+            } else {
+                if (urb->length < 1)
+                    return EPIPE;
+                st->mute = urb->buf[0] & 1;
+                if (st->pcm)
+                    atomic_store(&st->pcm->mute, st->mute);
+            }
+        } else if (cs == UAC2_FU_VOLUME && range) {
+            int16_t r[4] = {
+                htole16(1), htole16(UAC_VOLUME_MIN),
+                htole16(UAC_VOLUME_MAX), htole16(UAC_VOLUME_RES)
+            };
+
+            memcpy(buf, r, sizeof(r));
+            len = sizeof(r);
+        } else if (cs == UAC2_FU_VOLUME && in) {
+            v = htole16(st->volume);
+            memcpy(buf, &v, 2);
+            len = 2;
+        } else if (cs == UAC2_FU_VOLUME) {
+            if (urb->length < 2)
+                return EPIPE;
+            memcpy(&v, urb->buf, 2);
+            v = le16toh(v);
+            st->volume = v < UAC_VOLUME_MIN ? UAC_VOLUME_MIN
+                       : v > UAC_VOLUME_MAX ? UAC_VOLUME_MAX : v;
+            if (st->pcm)
+                atomic_store(&st->pcm->volume, st->volume);
+        } else {
+            return EPIPE;
+        }
+        break;
+
+    default:
+        return EPIPE;
+    }
+
+    if (!in) {
+        urb->actual = urb->length;
+        return 0;
+    }
+
+    urb->actual = len < urb->length ? len : urb->length;
+    memcpy(urb->buf, buf, urb->actual);
+    return 0;
+}
+
+static int
+uac_setup(struct usb_function *f, struct urb *urb)
+{
+    struct uac *u = (struct uac *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS ||
+        SETUP_RCP(s->bmRequestType) != USB_RECIP_INTERFACE ||
+        (s->wIndex & 0xff) != UAC_INTF_CONTROL)
+        return EPIPE;
+
+    if (s->bRequest != UAC2_REQ_CUR && s->bRequest != UAC2_REQ_RANGE)
+        return EPIPE;
+
+    return uac_control(u, urb);
+}
+
+static void
+uac_submit(struct usb_function *f, struct urb *urb)
+{
+    struct uac *u = (struct uac *) f;
+    struct uac_stream *s = NULL;
+    uint64_t now;
+
+    for (size_t k = 0; k < sizeof(u->streams) / sizeof(*u->streams); k++) {
+        if (urb->ep == uac_ep(u, &u->streams[k]))
+            s = &u->streams[k];
+    }
+
+    if (!s || urb->packets == 0) {
+        usb_urb_done(urb, EINVAL);
+        return;
+    }
+
+    /* With nothing queued the schedule restarts now, or the host fell behind. */
+    if (TAILQ_EMPTY(&urb->ep->queue)) {
+        now = uac_now();
+        if (s->clock < now) {
+            if (s->clock != 0)
+                atomic_fetch_add_explicit(&s->stats->gaps, 1, memory_order_relaxed);
+            s->clock = now;
+        }
+    }
+
+    usb_ep_queue(urb);
+    uac_pump(u);
+}
+
+static void
+uac_set_alt(struct usb_function *f, uint8_t intf, uint8_t alt)
+{
+    struct uac *u = (struct uac *) f;
+
+    if (intf == UAC_INTF_PLAY) {
+        uac_active(u, UAC_PLAY, alt == 1);
+        uac_active(u, UAC_FEEDBACK, alt == 1);
+    } else if (intf == UAC_INTF_CAPTURE) {
+        uac_active(u, UAC_CAPTURE, alt == 1);
+    }
+}
+
+static void
+uac_disable(struct usb_function *f)
+{
+    struct uac *u = (struct uac *) f;
+
+    for (size_t k = 0; k < sizeof(u->streams) / sizeof(*u->streams); k++)
+        uac_active(u, k, false);
+
+    uac_pump(u);
+}
+
+static uint64_t
+uac_isqrt(uint64_t x)
+{
+    uint64_t r = x, y = (x + 1) / 2;
+
+    while (y < r) {
+        r = y;
+        y = (r + x / r) / 2;
+    }
+
+    return r;
+}
+
+static void
+uac_report(const char *what, const struct pcm_stats *st)
+{
+    uint64_t urbs = st->urbs ? st->urbs : 1;
+
+    fprintf(stderr, "uac: %s: %llu urbs, %llu packets, %llu xruns, %llu gaps, "
+            "late mean %llu us rms %llu us max %llu us\n", what,
+            (unsigned long long) st->urbs, (unsigned long long) st->packets,
+            (unsigned long long) st->xruns, (unsigned long long) st->gaps,
+            (unsigned long long) (st->late_sum / urbs / 1000),
+            (unsigned long long) (uac_isqrt(st->late_sq / urbs) / 1000),
+            (unsigned long long) (st->late_max / 1000));
+}
+
+static void
+uac_destroy(struct usb_function *f)
+{
+    struct uac *u = (struct uac *) f;
+
+    if (u->streams[UAC_PLAY].stats->urbs > 0)
+        uac_report("playback", u->streams[UAC_PLAY].stats);
+    if (u->streams[UAC_CAPTURE].stats->urbs > 0)
+        uac_report("capture", u->streams[UAC_CAPTURE].stats);
+
+    if (u->timer.fd >= 0) {
+        loop_del(&u->timer);
+        close(u->timer.fd);
+    }
+
+    for (size_t k = 0; k < sizeof(u->streams) / sizeof(*u->streams); k++) {
+        struct uac_stream *s = &u->streams[k];
+
+        if (k != UAC_FEEDBACK)
+            pcm_destroy(s->name, s->pcm);
+        free(s->name);
+    }
+
+    free(u);
+}
+
+static const struct usb_function_ops uac_ops = {
+    .setup = uac_setup,
+    .submit = uac_submit,
+    .set_alt = uac_set_alt,
+    .disable = uac_disable,
+    .destroy = uac_destroy,
+};
+
+static void
+uac_as(struct usb_interface_descriptor *alt0,
+       struct usb_interface_descriptor *alt1, struct uac2_as_header *as,
+       struct uac2_format_type_i *format, uint8_t intf, uint8_t eps,
+       uint8_t link, uint8_t channels, uint8_t width)
+{
+    *alt0 = (struct usb_interface_descriptor) {
+        .bLength = sizeof(*alt0),
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = intf,
+        .bInterfaceClass = USB_CLASS_AUDIO,
+        .bInterfaceSubClass = UAC_SUBCLASS_AUDIOSTREAMING,
+        .bInterfaceProtocol = UAC_VERSION_2,
+    };
+    *alt1 = *alt0;
+    alt1->bAlternateSetting = 1;
+    alt1->bNumEndpoints = eps;
+
+    *as = (struct uac2_as_header) {
+        sizeof(*as), USB_DT_CS_INTERFACE, 0x01, link, 0, 1, htole32(1),
+        channels, htole32((1u << channels) - 1), 0
+    };
+    *format = (struct uac2_format_type_i) {
+        sizeof(*format), USB_DT_CS_INTERFACE, 0x02, 1, width, width * 8
+    };
+}
+
+static void
+uac_iso(struct usb_endpoint_descriptor *ep, struct uac2_iso_endpoint *iso,
+        uint8_t addr, uint16_t mps, uint8_t interval)
+{
+    *ep = (struct usb_endpoint_descriptor) {
+        .bLength = sizeof(*ep),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = addr,
+        .bmAttributes = USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_ASYNC,
+        .wMaxPacketSize = htole16(mps),
+        .bInterval = interval,
+    };
+    *iso = (struct uac2_iso_endpoint) {
+        sizeof(*iso), USB_DT_CS_ENDPOINT, 0x01, 0, 0, 0, 0
+    };
+}
+
+static int
+uac_descriptors(struct uac *u, struct usb_device *dev, const char *serial)
+{
+    bool hs = dev->speed == USB_SPEED_HIGH;
+    uint8_t interval = hs ? 4 : 1;       /* 1 ms either way */
+    uint16_t samples = u->rate / 1000 + 1;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bDeviceClass = USB_CLASS_MISC,
+        .bDeviceSubClass = 0x02,
+        .bDeviceProtocol = 0x01,         /* interface association */
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x0009),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 1,
+    };
+    struct uac_config c = {
+        .config = {
+            .bLength = sizeof(c.config),
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = htole16(sizeof(c)),
+            .bNumInterfaces = 3,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE,
+            .bMaxPower = 50,
+        },
+        .iad = {
+            .bLength = sizeof(c.iad),
+            .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+            .bFirstInterface = UAC_INTF_CONTROL,
+            .bInterfaceCount = 3,
+            .bFunctionClass = USB_CLASS_AUDIO,
+            .bFunctionProtocol = UAC_VERSION_2,
+        },
+        .control = {
+            .bLength = sizeof(c.control),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = UAC_INTF_CONTROL,
+            .bInterfaceClass = USB_CLASS_AUDIO,
+            .bInterfaceSubClass = UAC_SUBCLASS_AUDIOCONTROL,
+            .bInterfaceProtocol = UAC_VERSION_2,
+        },
+        .ac = {
+            /* bCategory: headset */
+            .header = {
+                sizeof(c.ac.header), USB_DT_CS_INTERFACE, 0x01,
+                htole16(0x0200), 0x04, htole16(sizeof(c.ac)), 0
+            },
+            /* Internal fixed clock, frequency and validity read-only. */
+            .clock = {
+                sizeof(c.ac.clock), USB_DT_CS_INTERFACE, 0x0a, UAC_ID_CLOCK,
+                0x01, 0x05, 0, 0
+            },
+            .play_it = {
+                sizeof(c.ac.play_it), USB_DT_CS_INTERFACE, 0x02,
+                UAC_ID_PLAY_IT, htole16(0x0101), 0, UAC_ID_CLOCK,
+                UAC_PLAY_CHANNELS, htole32(0x3), 0, 0, 0
+            },
+            .play_fu = {
+                sizeof(c.ac.play_fu), USB_DT_CS_INTERFACE, 0x06,
+                UAC_ID_PLAY_FU, UAC_ID_PLAY_IT, { htole32(0x0f) }, 0
+            },
+            .play_ot = {
+                sizeof(c.ac.play_ot), USB_DT_CS_INTERFACE, 0x03,
+                UAC_ID_PLAY_OT, htole16(0x0402), 0, UAC_ID_PLAY_FU,
+                UAC_ID_CLOCK, 0, 0
+            },
+            .capture_it = {
+                sizeof(c.ac.capture_it), USB_DT_CS_INTERFACE, 0x02,
+                UAC_ID_CAPTURE_IT, htole16(0x0402), 0, UAC_ID_CLOCK,
+                UAC_CAPTURE_CHANNELS, htole32(0x1), 0, 0, 0
+            },
+            .capture_fu = {
+                sizeof(c.ac.capture_fu), USB_DT_CS_INTERFACE, 0x06,
+                UAC_ID_CAPTURE_FU, UAC_ID_CAPTURE_IT, { htole32(0x0f) }, 0
+            },
+            .capture_ot = {
+                sizeof(c.ac.capture_ot), USB_DT_CS_INTERFACE, 0x03,
+                UAC_ID_CAPTURE_OT, htole16(0x0101), 0, UAC_ID_CAPTURE_FU,
+                UAC_ID_CLOCK, 0, 0
+            },
+        },
+        .feedback = {
+            .bLength = sizeof(c.feedback),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_ENDPOINT_DIR_IN | UAC_EP_FEEDBACK,
+            .bmAttributes = USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_USAGE_FEEDBACK,
+            .wMaxPacketSize = htole16(hs ? 4 : 3),
+            .bInterval = interval,
+        },
+    };
+    int r;
+
+    uac_as(&c.play0, &c.play1, &c.play_as, &c.play_format, UAC_INTF_PLAY, 2,
+           UAC_ID_PLAY_IT, UAC_PLAY_CHANNELS, u->width);
+    uac_iso(&c.play, &c.play_iso, UAC_EP_PLAY,
+            samples * UAC_PLAY_CHANNELS * u->width, interval);
+
+    uac_as(&c.capture0, &c.capture1, &c.capture_as, &c.capture_format,
+           UAC_INTF_CAPTURE, 1, UAC_ID_CAPTURE_OT, UAC_CAPTURE_CHANNELS, u->width);
+    uac_iso(&c.capture, &c.capture_iso, USB_ENDPOINT_DIR_IN | UAC_EP_CAPTURE,
+            samples * UAC_CAPTURE_CHANNELS * u->width, interval);
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu Headset");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+static void
+uac_stream(struct uac *u, enum uac_kind kind, uint8_t dir, uint8_t num,
+           uint16_t channels)
+{
+    struct uac_stream *s = &u->streams[kind];
+
+    s->kind = kind;
+    s->dir = dir;
+    s->num = num;
+    s->channels = channels;
+    s->stats = &s->own;
+}
+
+static int
+uac_ring(struct uac *u, enum uac_kind kind, const char *name, unsigned long ms)
+{
+    struct uac_stream *s = &u->streams[kind];
+    uint32_t frame = s->channels * u->width;
+
+    if (!name)
+        return 0;
+
+    s->name = strdup(name);
+    if (!s->name)
+        return ENOMEM;
+
+    return pcm_create(name, u->rate, s->channels, u->width,
+                      u->rate / 1000 * ms * frame, &s->pcm);
+}
+
+static int
+uac_create(struct usb_device *dev, char *opts)
+{
+    enum { PLAY, CAPTURE, RATE, BITS, BUFFER, SPEED, SERIAL };
+    char *const tokens[] = {
+        [PLAY] = "play", [CAPTURE] = "capture", [RATE] = "rate",
+        [BITS] = "bits", [BUFFER] = "buffer", [SPEED] = "speed",
+        [SERIAL] = "serial", NULL
+    };
+    const char *play = NULL, *capture = NULL, *serial = NULL;
+    unsigned long rate = 48000, bits = 16, ms = 64;
+    struct uac *u;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_HIGH;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case PLAY:    play = value; break;
+        case CAPTURE: capture = value; break;
+        case SERIAL:  serial = value; break;
+
+        case RATE:
+            if (!value || (rate = strtoul(value, NULL, 0)) < 8000 || rate > 192000)
+                return EINVAL;
+            break;
+
+        case BITS:
+            if (!value || ((bits = strtoul(value, NULL, 0)) != 16 &&
+                           bits != 24 && bits != 32))
+                return EINVAL;
+            break;
+
+        case BUFFER:
+            if (!value || (ms = strtoul(value, NULL, 0)) < 4 || ms > 1000)
+                return EINVAL;
+            break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed != USB_SPEED_FULL && dev->speed != USB_SPEED_HIGH)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    /* One packet per ms, with room for a sample of drift. */
+    if ((rate / 1000 + 1) * UAC_PLAY_CHANNELS * (bits / 8) > 1023)
+        return EINVAL;
+
+    u = calloc(1, sizeof(*u));
+    if (!u)
+        return ENOMEM;
+
+    u->timer.fd = -1;
+    u->rate = rate;
+    u->width = bits / 8;
+    uac_stream(u, UAC_PLAY, USBIP_DIR_OUT, UAC_EP_PLAY, UAC_PLAY_CHANNELS);
+    uac_stream(u, UAC_FEEDBACK, USBIP_DIR_IN, UAC_EP_FEEDBACK, 0);
+    uac_stream(u, UAC_CAPTURE, USBIP_DIR_IN, UAC_EP_CAPTURE, UAC_CAPTURE_CHANNELS);
+    usb_device_function(dev, &u->func, &uac_ops);
+
+    r = uac_ring(u, UAC_PLAY, play, ms);
+    if (r == 0)
+        r = uac_ring(u, UAC_CAPTURE, capture, ms);
+    if (r != 0)
+        return r;
+
+    /* The feedback stream reports into the speaker ring. */
+    for (size_t k = 0; k < sizeof(u->streams) / sizeof(*u->streams); k++) {
+        struct uac_stream *s = &u->streams[k];
+
+        if (k == UAC_FEEDBACK)
+            s->pcm = u->streams[UAC_PLAY].pcm;
+        else if (s->pcm)
+            s->stats = &s->pcm->stats;
+    }
+
+    r = uac_descriptors(u, dev, serial);
+    if (r != 0)
+        return r;
+
+    /* Timer slack would show up as jitter on every packet. */
+    prctl(PR_SET_TIMERSLACK, 1);
+
+    u->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (u->timer.fd < 0)
+        return errno;
+
+    u->timer.func = uac_timer;
+    return loop_add(&u->timer, EPOLLIN);
+}
+
+const struct usb_model usb_model_uac = {
+    .name = "uac",
+    .create = uac_create,
+};
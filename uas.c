@@ -0,0 +1,743 @@
+#include "msc.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSC_PROTO_UAS 0x62
+#define USB_DT_PIPE_USAGE 0x24
+
+#define UAS_EP_CMD 1
+#define UAS_EP_STATUS 2
+#define UAS_EP_DATA_IN 3
+#define UAS_EP_DATA_OUT 4
+
+/* Linux queues up to 30 commands without streams, plus task management. */
+#define UAS_MAX_CMDS 64
+
+enum {
+    UAS_PIPE_CMD = 1,
+    UAS_PIPE_STATUS = 2,
+    UAS_PIPE_DATA_IN = 3,
+    UAS_PIPE_DATA_OUT = 4,
+};
+
+enum {
+    UAS_IU_COMMAND = 0x01,
+    UAS_IU_SENSE = 0x03,
+    UAS_IU_RESPONSE = 0x04,
+    UAS_IU_TASK_MGMT = 0x05,
+    UAS_IU_READ_READY = 0x06,
+    UAS_IU_WRITE_READY = 0x07,
+};
+
+enum {
+    UAS_TMF_ABORT_TASK = 0x01,
+    UAS_TMF_ABORT_TASK_SET = 0x02,
+    UAS_TMF_CLEAR_TASK_SET = 0x04,
+    UAS_TMF_LU_RESET = 0x08,
+    UAS_TMF_IT_NEXUS_RESET = 0x10,
+    UAS_TMF_QUERY_TASK = 0x80,
+};
+
+enum {
+    UAS_RC_COMPLETE = 0x00,
+    UAS_RC_INVALID_IU = 0x02,
+    UAS_RC_NOT_SUPPORTED = 0x04,
+    UAS_RC_SUCCEEDED = 0x08,
+    UAS_RC_INCORRECT_LUN = 0x09,
+    UAS_RC_OVERLAPPED_TAG = 0x0a,
+};
+
+/* Tags stay big endian throughout, as they are only compared and echoed. */
+struct uas_command_iu {
+    uint8_t id;
+    uint8_t rsvd1;
+    uint16_t tag;
+    uint8_t attribute;
+    uint8_t rsvd5;
+    uint8_t len;                         /* additional CDB length */
+    uint8_t rsvd7;
+    uint8_t lun[8];
+    uint8_t cdb[16];
+} __attribute__((packed));
+
+struct uas_task_iu {
+    uint8_t id;
+    uint8_t rsvd1;
+    uint16_t tag;
+    uint8_t function;
+    uint8_t rsvd5;
+    uint16_t task_tag;
+    uint8_t lun[8];
+} __attribute__((packed));
+
+struct uas_sense_iu {
+    uint8_t id;
+    uint8_t rsvd1;
+    uint16_t tag;
+    uint16_t qualifier;
+    uint8_t status;
+    uint8_t rsvd7[7];
+    uint16_t len;
+    uint8_t sense[SCSI_SENSE_SIZE];
+} __attribute__((packed));
+
+struct uas_response_iu {
+    uint8_t id;
+    uint8_t rsvd1;
+    uint16_t tag;
+    uint8_t info[3];
+    uint8_t code;
+} __attribute__((packed));
+
+struct uas_ready_iu {
+    uint8_t id;
+    uint8_t rsvd1;
+    uint16_t tag;
+} __attribute__((packed));
+
+struct uas_endpoint {
+    struct usb_endpoint_descriptor ep;
+    struct {
+        uint8_t bLength;
+        uint8_t bDescriptorType;
+        uint8_t bPipeID;
+        uint8_t bReserved;
+    } __attribute__((packed)) pipe;
+} __attribute__((packed));
+
+struct uas_config {
+    struct msc_config bot;
+    struct usb_interface_descriptor intf;
+    struct uas_endpoint cmd;
+    struct uas_endpoint status;
+    struct uas_endpoint in;
+    struct uas_endpoint out;
+} __attribute__((packed));
+
+enum uas_state {
+    UAS_FREE,
+    UAS_WAIT,                            /* for its data pipe */
+    UAS_READY,                           /* Read/Write Ready IU queued */
+    UAS_DATA,
+    UAS_SETTLE,                          /* for the image, before status */
+    UAS_STATUS,                          /* Sense or Response IU queued */
+};
+
+struct uas_cmd {
+    TAILQ_ENTRY(uas_cmd) entry;          /* pipe wait list or status queue */
+    enum uas_state state;
+    uint16_t tag;
+    uint8_t iu;                          /* next IU for the status pipe */
+    uint8_t response;
+    uint32_t pos;
+    uint32_t pending;                    /* image requests in flight */
+    struct msc_lun *lun;                 /* NULL if there is none */
+    uint64_t start;                      /* ns, the Command IU arrived */
+    struct scsi_cmd scsi;
+};
+
+TAILQ_HEAD(uas_list, uas_cmd);
+
+struct uas_pipe {
+    struct uas_cmd *active;
+    struct uas_list wait;
+    struct msc_pipe io;
+};
+
+/*
+ * UAS without streams: the host has many tagged commands outstanding and
+ * every IU for them goes over the one status pipe, but each data pipe
+ * serves one command at a time, announced with a Read or Write Ready IU.
+ * Reads and writes still overlap, as do data phases and command decoding,
+ * and on an asynchronous image a command's status waits only for its own
+ * requests. Flushes and the image work of UNMAP and WRITE SAME queue per
+ * LUN, behind none of another LUN's requests.
+ */
+struct uas {
+    struct uas_cmd cmds[UAS_MAX_CMDS];
+    struct uas_list status;
+    struct uas_pipe pipe[2];             /* [USBIP_DIR_*] */
+    struct msc_pipe sync[MSC_MAX_LUNS];
+};
+
+static uint8_t
+uas_dir(const struct uas_cmd *c)
+{
+    return c->scsi.dir == SCSI_DIR_IN ? USBIP_DIR_IN : USBIP_DIR_OUT;
+}
+
+static struct uas_cmd *
+uas_alloc(struct uas *u, uint16_t tag)
+{
+    for (size_t i = 0; i < UAS_MAX_CMDS; i++) {
+        struct uas_cmd *c = &u->cmds[i];
+
+        if (c->state == UAS_FREE) {
+            c->tag = tag;
+            c->pos = 0;
+            c->pending = 0;
+            c->lun = NULL;
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+static struct uas_cmd *
+uas_find(struct uas *u, uint16_t tag, const struct uas_cmd *skip)
+{
+    for (size_t i = 0; i < UAS_MAX_CMDS; i++) {
+        struct uas_cmd *c = &u->cmds[i];
+
+        if (c != skip && c->state != UAS_FREE && c->tag == tag)
+            return c;
+    }
+
+    return NULL;
+}
+
+static void
+uas_post(struct uas *u, struct uas_cmd *c, uint8_t iu)
+{
+    c->iu = iu;
+    c->state = iu == UAS_IU_READ_READY || iu == UAS_IU_WRITE_READY ?
+               UAS_READY : UAS_STATUS;
+    TAILQ_INSERT_TAIL(&u->status, c, entry);
+}
+
+static void
+uas_abort(struct msc *m, struct uas_cmd *c)
+{
+    struct uas *u = m->uas;
+
+    switch (c->state) {
+    case UAS_WAIT:
+        TAILQ_REMOVE(&u->pipe[uas_dir(c)].wait, c, entry);
+        break;
+
+    case UAS_READY:
+    case UAS_STATUS:
+        TAILQ_REMOVE(&u->status, c, entry);
+        break;
+
+    case UAS_DATA:
+        u->pipe[uas_dir(c)].active = NULL;
+        break;
+
+    default:
+        break;
+    }
+
+    for (size_t d = 0; d < 2; d++)
+        msc_io_orphan(&u->pipe[d].io, c);
+    if (c->lun)
+        msc_io_orphan(&u->sync[c->lun - m->luns], c);
+
+    c->state = UAS_FREE;
+}
+
+/* Posts a command's status once the image has caught up with it. */
+static void
+uas_settle(struct msc *m, struct uas_cmd *c)
+{
+    c->state = UAS_SETTLE;
+    if (c->pending > 0)
+        return;
+
+    if (c->scsi.nreqs > 0) {
+        msc_provision(m, &m->uas->sync[c->lun - m->luns], c->lun, c, &c->scsi,
+                      &c->pending);
+        return;
+    }
+
+    if (c->scsi.sync) {
+        c->scsi.sync = false;
+        c->pending++;
+        msc_io(m, &m->uas->sync[c->lun - m->luns], c->lun, c, NULL, BLK_FLUSH, 0, 0);
+        return;
+    }
+
+    if (c->lun)
+        msc_account(c->lun, c->start);
+    uas_post(m->uas, c, UAS_IU_SENSE);
+}
+
+/* Ends a command's data phase; its status follows. */
+static void
+uas_finish(struct msc *m, struct uas_cmd *c)
+{
+    m->uas->pipe[uas_dir(c)].active = NULL;
+
+    if (c->lun && c->scsi.dir == SCSI_DIR_OUT)
+        scsi_done(&c->lun->scsi, &c->scsi);
+
+    uas_settle(m, c);
+}
+
+/*
+ * Completes a data URB, or hands it to the image, as in BOT: it is off
+ * the queue before the command can finish.
+ */
+static void
+uas_data_urb(struct msc *m, struct uas_cmd *c, struct urb *urb, bool async,
+             uint8_t op, uint64_t off, uint32_t n, bool last)
+{
+    if (async)
+        c->pending++;
+    else
+        usb_urb_done(urb, 0);
+
+    if (last)
+        uas_finish(m, c);
+
+    if (async)
+        msc_io(m, &m->uas->pipe[uas_dir(c)].io, c->lun, c, urb, op, off, n);
+}
+
+static uint32_t
+uas_data_len(const struct uas_cmd *c, uint32_t len)
+{
+    uint32_t left = c->pos < c->scsi.length ? c->scsi.length - c->pos : 0;
+
+    return len < left ? len : left;
+}
+
+static bool
+uas_async(const struct uas_cmd *c, const struct urb *urb)
+{
+    return c->scsi.block && urb->buf == urb->data && blk_async(c->lun->blk);
+}
+
+static bool
+uas_schedule(struct uas *u, uint8_t dir)
+{
+    struct uas_pipe *p = &u->pipe[dir];
+    struct uas_cmd *c = TAILQ_FIRST(&p->wait);
+
+    if (p->active || !c)
+        return false;
+
+    TAILQ_REMOVE(&p->wait, c, entry);
+    p->active = c;
+    uas_post(u, c, dir == USBIP_DIR_IN ? UAS_IU_READ_READY : UAS_IU_WRITE_READY);
+    return true;
+}
+
+static size_t
+uas_iu(const struct uas_cmd *c, uint8_t *buf)
+{
+    struct uas_sense_iu *sense = (void *) buf;
+    struct uas_response_iu *resp = (void *) buf;
+    struct uas_ready_iu *ready = (void *) buf;
+
+    switch (c->iu) {
+    case UAS_IU_SENSE:
+        memset(sense, 0, sizeof(*sense));
+        sense->id = UAS_IU_SENSE;
+        sense->tag = c->tag;
+        sense->status = c->scsi.status;
+        if (c->scsi.status == SCSI_GOOD)
+            return offsetof(struct uas_sense_iu, sense);
+
+        sense->len = htobe16(SCSI_SENSE_SIZE);
+        scsi_sense_data(&c->scsi, sense->sense);
+        return sizeof(*sense);
+
+    case UAS_IU_RESPONSE:
+        memset(resp, 0, sizeof(*resp));
+        resp->id = UAS_IU_RESPONSE;
+        resp->tag = c->tag;
+        resp->code = c->response;
+        return sizeof(*resp);
+
+    default:
+        ready->id = c->iu;
+        ready->rsvd1 = 0;
+        ready->tag = c->tag;
+        return sizeof(*ready);
+    }
+}
+
+static bool
+uas_status_pump(struct msc *m)
+{
+    struct usb_ep *ep = usb_function_ep(&m->func, USBIP_DIR_IN, UAS_EP_STATUS);
+    uint8_t iu[sizeof(struct uas_sense_iu)];
+    struct uas_cmd *c;
+    struct urb *urb;
+    bool progress = false;
+    size_t len;
+
+    while ((urb = TAILQ_FIRST(&ep->queue)) && (c = TAILQ_FIRST(&m->uas->status))) {
+        TAILQ_REMOVE(&m->uas->status, c, entry);
+
+        len = uas_iu(c, iu);
+        urb->actual = len < urb->length ? len : urb->length;
+        memcpy(urb->buf, iu, urb->actual);
+
+        c->state = c->state == UAS_READY ? UAS_DATA : UAS_FREE;
+        usb_urb_done(urb, 0);
+        progress = true;
+    }
+
+    return progress;
+}
+
+static bool
+uas_data_pump(struct msc *m)
+{
+    struct usb_ep *ep = usb_function_ep(&m->func, USBIP_DIR_IN, UAS_EP_DATA_IN);
+    struct uas_cmd *c;
+    struct urb *urb;
+    bool progress = false;
+    uint64_t off;
+    uint32_t n;
+    bool async, file;
+
+    while ((c = m->uas->pipe[USBIP_DIR_IN].active) && c->state == UAS_DATA &&
+           (urb = TAILQ_FIRST(&ep->queue))) {
+        n = uas_data_len(c, urb->length);
+        file = msc_file(c->lun, &m->uas->pipe[USBIP_DIR_IN].io, &c->scsi, c->pos, urb, n);
+        async = n > 0 && !file && uas_async(c, urb);
+        if (n > 0 && urb->buf == urb->data && !async && !file)
+            scsi_data_read(&c->lun->scsi, &c->scsi, c->pos, urb->buf, n);
+
+        off = c->scsi.offset + c->pos;
+        urb->actual = n;
+        c->pos += n;
+
+        usb_ep_dequeue(ep);
+        uas_data_urb(m, c, urb, async, BLK_READ, off, n,
+                     n < urb->length || c->pos >= c->scsi.length);
+        progress = true;
+    }
+
+    return progress;
+}
+
+static void
+uas_pump(struct msc *m)
+{
+    bool progress;
+
+    do {
+        progress = uas_schedule(m->uas, USBIP_DIR_IN);
+        progress |= uas_schedule(m->uas, USBIP_DIR_OUT);
+        progress |= uas_status_pump(m);
+        progress |= uas_data_pump(m);
+    } while (progress);
+}
+
+static void
+uas_io_done(struct msc *m, void *owner, struct urb *urb, uint8_t op, int err)
+{
+    struct uas_cmd *c = owner;
+
+    c->pending--;
+    if (err != 0)
+        scsi_io_error(&c->lun->scsi, &c->scsi, op);
+
+    if (urb)
+        usb_urb_done(urb, 0);
+
+    if (c->state == UAS_SETTLE)
+        uas_settle(m, c);
+
+    uas_pump(m);
+}
+
+static void
+uas_data_out(struct msc *m, struct urb *urb)
+{
+    struct uas_cmd *c = m->uas->pipe[USBIP_DIR_OUT].active;
+    uint64_t off;
+    uint32_t n;
+    bool async;
+
+    if (!c || c->state != UAS_DATA) {
+        usb_urb_done(urb, EPIPE);
+        return;
+    }
+
+    /* Mapped buffers already hold the data in the image. */
+    n = uas_data_len(c, urb->length);
+    async = n > 0 && uas_async(c, urb);
+    if (n > 0 && urb->buf == urb->data && !async)
+        scsi_data_write(&c->lun->scsi, &c->scsi, c->pos, urb->buf, n);
+
+    off = c->scsi.offset + c->pos;
+    urb->actual = urb->length;
+    c->pos += n;
+
+    uas_data_urb(m, c, urb, async, BLK_WRITE, off, n, c->pos >= c->scsi.length);
+}
+
+/* Single level LUNs with peripheral device addressing, as REPORT LUNS has them. */
+static struct msc_lun *
+uas_lun(struct msc *m, const uint8_t *lun)
+{
+    static const uint8_t zero[6];
+
+    if (lun[0] != 0 || lun[1] >= m->nluns || memcmp(lun + 2, zero, sizeof(zero)) != 0)
+        return NULL;
+
+    return &m->luns[lun[1]];
+}
+
+static int
+uas_command(struct msc *m, const struct uas_command_iu *iu)
+{
+    struct uas *u = m->uas;
+    struct uas_cmd *c, *t;
+
+    /* An overlapped tag ends the command already holding it, as ABORT TASK would. */
+    t = uas_find(u, iu->tag, NULL);
+    if (t)
+        uas_abort(m, t);
+
+    c = uas_alloc(u, iu->tag);
+    if (!c)
+        return EPIPE;
+
+    if (t) {
+        c->response = UAS_RC_OVERLAPPED_TAG;
+        uas_post(u, c, UAS_IU_RESPONSE);
+        return 0;
+    }
+
+    memcpy(c->scsi.cdb, iu->cdb, sizeof(c->scsi.cdb));
+    c->start = msc_now();
+    c->lun = uas_lun(m, iu->lun);
+    if (c->lun)
+        scsi_exec(&c->lun->scsi, &c->scsi);
+    else
+        scsi_no_lun(&c->scsi);
+
+    if (c->scsi.length == 0) {
+        uas_settle(m, c);
+    } else {
+        c->state = UAS_WAIT;
+        TAILQ_INSERT_TAIL(&u->pipe[uas_dir(c)].wait, c, entry);
+    }
+
+    return 0;
+}
+
+static int
+uas_task(struct msc *m, const struct uas_task_iu *iu)
+{
+    struct uas *u = m->uas;
+    struct msc_lun *l = uas_lun(m, iu->lun);
+    struct uas_cmd *c, *t;
+
+    c = uas_alloc(u, iu->tag);
+    if (!c)
+        return EPIPE;
+
+    /* Claimed before looking up the task, so it is never its own target. */
+    c->state = UAS_STATUS;
+    t = uas_find(u, iu->task_tag, c);
+    c->response = UAS_RC_COMPLETE;
+
+    if (!l && iu->function != UAS_TMF_IT_NEXUS_RESET) {
+        c->response = UAS_RC_INCORRECT_LUN;
+    } else switch (iu->function) {
+    case UAS_TMF_ABORT_TASK:
+        if (t)
+            uas_abort(m, t);
+        break;
+
+    /* The nexus reset takes every LUN's commands, the others their own. */
+    case UAS_TMF_ABORT_TASK_SET:
+    case UAS_TMF_CLEAR_TASK_SET:
+    case UAS_TMF_LU_RESET:
+    case UAS_TMF_IT_NEXUS_RESET:
+        for (size_t i = 0; i < UAS_MAX_CMDS; i++) {
+            t = &u->cmds[i];
+            if (t != c && t->state != UAS_FREE &&
+                (iu->function == UAS_TMF_IT_NEXUS_RESET || t->lun == l))
+                uas_abort(m, t);
+        }
+        break;
+
+    case UAS_TMF_QUERY_TASK:
+        if (t)
+            c->response = UAS_RC_SUCCEEDED;
+        break;
+
+    default:
+        c->response = UAS_RC_NOT_SUPPORTED;
+    }
+
+    uas_post(u, c, UAS_IU_RESPONSE);
+    return 0;
+}
+
+static int
+uas_iu_in(struct msc *m, struct urb *urb)
+{
+    struct uas_cmd *c;
+    uint16_t tag;
+
+    urb->actual = urb->length;
+
+    if (urb->length >= sizeof(struct uas_command_iu) && urb->buf[0] == UAS_IU_COMMAND)
+        return uas_command(m, (const void *) urb->buf);
+
+    if (urb->length >= sizeof(struct uas_task_iu) && urb->buf[0] == UAS_IU_TASK_MGMT)
+        return uas_task(m, (const void *) urb->buf);
+
+    if (urb->length < 4)
+        return EPIPE;
+
+    memcpy(&tag, urb->buf + 2, sizeof(tag));
+    c = uas_alloc(m->uas, tag);
+    if (!c)
+        return EPIPE;
+
+    c->response = UAS_RC_INVALID_IU;
+    uas_post(m->uas, c, UAS_IU_RESPONSE);
+    return 0;
+}
+
+void
+uas_submit(struct msc *m, struct urb *urb)
+{
+    switch (urb->ep->num) {
+    case UAS_EP_CMD:
+        usb_urb_done(urb, uas_iu_in(m, urb));
+        break;
+
+    case UAS_EP_DATA_OUT:
+        uas_data_out(m, urb);
+        break;
+
+    default:                             /* status and data-in */
+        usb_ep_queue(urb);
+        break;
+    }
+
+    uas_pump(m);
+}
+
+/*
+ * As with BOT, only a data-in URB that is served on arrival gets the map,
+ * and only if the image file cannot be spliced instead.
+ */
+void *
+uas_buffer(struct msc *m, struct usb_ep *ep, uint32_t len)
+{
+    uint8_t num = ep->num;
+    uint8_t dir = num == UAS_EP_DATA_IN ? USBIP_DIR_IN : USBIP_DIR_OUT;
+    struct uas_cmd *c = m->uas->pipe[dir].active;
+    uint64_t off;
+
+    if (num != UAS_EP_DATA_IN && num != UAS_EP_DATA_OUT)
+        return NULL;
+
+    if (!c || c->state != UAS_DATA || !c->scsi.block)
+        return NULL;
+
+    if (dir == USBIP_DIR_IN) {
+        if (!TAILQ_EMPTY(&ep->queue) || uas_data_len(c, len) == 0 ||
+            scsi_data_file(&c->lun->scsi, &c->scsi, c->pos, uas_data_len(c, len), &off) >= 0)
+            return NULL;
+        return scsi_data_map(&c->lun->scsi, &c->scsi, c->pos, uas_data_len(c, len));
+    }
+
+    if (uas_data_len(c, len) != len)
+        return NULL;
+    return scsi_data_map(&c->lun->scsi, &c->scsi, c->pos, len);
+}
+
+static void
+uas_clear(struct uas *u)
+{
+    for (size_t i = 0; i < UAS_MAX_CMDS; i++)
+        u->cmds[i].state = UAS_FREE;
+
+    TAILQ_INIT(&u->status);
+    for (size_t d = 0; d < 2; d++) {
+        u->pipe[d].active = NULL;
+        TAILQ_INIT(&u->pipe[d].wait);
+        msc_io_orphan(&u->pipe[d].io, NULL);
+    }
+    for (size_t i = 0; i < MSC_MAX_LUNS; i++)
+        msc_io_orphan(&u->sync[i], NULL);
+}
+
+void
+uas_reset(struct msc *m)
+{
+    uas_clear(m->uas);
+}
+
+static void
+uas_endpoint(struct uas_endpoint *e, uint8_t addr, uint8_t pipe, uint16_t mps)
+{
+    e->ep = (struct usb_endpoint_descriptor) {
+        .bLength = sizeof(e->ep),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = addr,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = mps,
+    };
+    e->pipe.bLength = sizeof(e->pipe);
+    e->pipe.bDescriptorType = USB_DT_PIPE_USAGE;
+    e->pipe.bPipeID = pipe;
+    e->pipe.bReserved = 0;
+}
+
+/* BOT stays alternate setting 0 for hosts without a UAS driver. */
+int
+uas_descriptors(struct usb_device *dev, struct msc_config *bot)
+{
+    uint16_t mps = bot->in.wMaxPacketSize;
+    struct uas_config c = {
+        .bot = *bot,
+        .intf = {
+            .bLength = sizeof(c.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bAlternateSetting = 1,
+            .bNumEndpoints = 4,
+            .bInterfaceClass = USB_CLASS_MASS_STORAGE,
+            .bInterfaceSubClass = MSC_SUBCLASS_SCSI,
+            .bInterfaceProtocol = MSC_PROTO_UAS,
+        },
+    };
+
+    c.bot.config.wTotalLength = htole16(sizeof(c));
+    uas_endpoint(&c.cmd, UAS_EP_CMD, UAS_PIPE_CMD, mps);
+    uas_endpoint(&c.status, USB_ENDPOINT_DIR_IN | UAS_EP_STATUS, UAS_PIPE_STATUS, mps);
+    uas_endpoint(&c.in, USB_ENDPOINT_DIR_IN | UAS_EP_DATA_IN, UAS_PIPE_DATA_IN, mps);
+    uas_endpoint(&c.out, UAS_EP_DATA_OUT, UAS_PIPE_DATA_OUT, mps);
+
+    return usb_device_desc(dev, USB_DT_CONFIG, 0, &c, sizeof(c));
+}
+
+struct uas *
+uas_new(void)
+{
+    struct uas *u = calloc(1, sizeof(*u));
+
+    if (!u)
+        return NULL;
+
+    for (size_t d = 0; d < 2; d++)
+        msc_pipe_init(&u->pipe[d].io, uas_io_done);
+    for (size_t i = 0; i < MSC_MAX_LUNS; i++)
+        msc_pipe_init(&u->sync[i], uas_io_done);
+
+    uas_clear(u);
+    return u;
+}
+
+void
+uas_free(struct uas *u)
+{
+    free(u);
+}
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+
+#include "blk.h"
+#include "loop.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 128
+#define URING_WINDOWS 4
+
+struct uring;
+
+/* Image bytes read ahead of the host, at io.off for io.len. */
+struct uring_window {
+    struct blk_io io;                    /* its own read */
+    struct uring *u;
+    uint8_t *buf;
+    size_t size;                         /* of buf */
+    uint64_t age;
+    bool busy;                           /* being read */
+    bool stale;                          /* written to meanwhile */
+    struct blk_io *waiters;              /* reads it will serve */
+};
+
+/*
+ * The image behind an io_uring of its own, with the image registered as
+ * fixed file 0. Requests go to the kernel as soon as they are queued and
+ * are reaped when the ring polls readable, so a slow disk only holds up
+ * the URBs waiting on it. Requests beyond what the completion ring can
+ * hold wait on a backlog.
+ *
+ * Readahead fills a few windows of memory. Reads they cover are copied
+ * out of them, or wait for them if they are still on their way; writes
+ * drop the windows they touch.
+ */
+struct uring {
+    struct blk blk;
+    int fd;                              /* the image */
+    struct loop_watch watch;             /* the ring */
+
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_entries;
+
+    _Atomic unsigned int *sq_head, *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+
+    _Atomic unsigned int *cq_head, *cq_tail;
+    struct io_uring_cqe *cqes;
+    unsigned int cq_mask;
+    unsigned int cq_entries;
+
+    unsigned int inflight;
+    struct blk_io *backlog;
+    struct blk_io **backlog_tail;
+
+    struct uring_window windows[URING_WINDOWS];
+    uint64_t age;
+};
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int ring, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+static int
+uring_register(int ring, unsigned int op, const void *arg, unsigned int n)
+{
+    return syscall(__NR_io_uring_register, ring, op, arg, n);
+}
+
+/* Hands queued entries to the kernel, waiting for wait completions. */
+static void
+uring_kick(struct uring *u, unsigned int wait)
+{
+    unsigned int tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(u->sq_head, memory_order_acquire);
+
+    if (tail == head && wait == 0)
+        return;
+
+    /* Whatever the kernel could not take now stays on the ring. */
+    while (uring_enter(u->watch.fd, tail - head, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0) < 0 && errno == EINTR)
+        ;
+}
+
+static bool
+uring_push(struct uring *u, struct blk_io *io)
+{
+    unsigned int tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(u->sq_head, memory_order_acquire);
+    struct io_uring_sqe *sqe;
+
+    if (tail - head == u->sq_entries || u->inflight == u->cq_entries)
+        return false;
+
+    sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = (uintptr_t) io;
+
+    switch (io->op) {
+    case BLK_READ:
+    case BLK_WRITE:
+        sqe->opcode = io->op == BLK_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->addr = (uintptr_t) io->buf + io->moved;
+        sqe->len = io->len - io->moved;
+        sqe->off = io->off + io->moved;
+        break;
+
+    default:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    }
+
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+    u->inflight++;
+    return true;
+}
+
+static void
+uring_queue(struct uring *u, struct blk_io *io)
+{
+    if (!u->backlog && uring_push(u, io))
+        return;
+
+    io->next = NULL;
+    *u->backlog_tail = io;
+    u->backlog_tail = &io->next;
+}
+
+static void
+uring_backlog(struct uring *u)
+{
+    struct blk_io *io;
+
+    while ((io = u->backlog) && uring_push(u, io)) {
+        u->backlog = io->next;
+        if (!u->backlog)
+            u->backlog_tail = &u->backlog;
+    }
+}
+
+static void
+uring_window_drop(struct uring *u, uint64_t off, size_t len)
+{
+    for (size_t i = 0; i < URING_WINDOWS; i++) {
+        struct uring_window *w = &u->windows[i];
+
+        if (w->io.len == 0 || off >= w->io.off + w->io.len ||
+            w->io.off >= off + len)
+            continue;
+
+        if (w->busy)
+            w->stale = true;
+        else
+            w->io.len = 0;
+    }
+}
+
+/*
+ * Short transfers are carried on from where they stopped. A window read
+ * while a write was in flight may hold either version: the write drops
+ * those it touches again as it ends.
+ */
+static void
+uring_complete(struct uring *u, struct blk_io *io, int res)
+{
+    if (res == -EINTR || res == -EAGAIN) {
+        uring_queue(u, io);
+        return;
+    }
+
+    if (io->op == BLK_WRITE)
+        uring_window_drop(u, io->off, io->len);
+
+    if (res < 0) {
+        io->done(io, -res);
+        return;
+    }
+
+    if (io->op == BLK_FLUSH) {
+        io->done(io, 0);
+        return;
+    }
+
+    if (res == 0) {
+        io->done(io, EIO);
+        return;
+    }
+
+    io->moved += res;
+    if (io->moved < io->len)
+        uring_queue(u, io);
+    else
+        io->done(io, 0);
+}
+
+static void
+uring_reap(struct uring *u)
+{
+    unsigned int head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+
+    while (head != atomic_load_explicit(u->cq_tail, memory_order_acquire)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        struct blk_io *io = (struct blk_io *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+
+        /* Released before done(), which may well queue more. */
+        atomic_store_explicit(u->cq_head, ++head, memory_order_release);
+        u->inflight--;
+        uring_complete(u, io, res);
+    }
+
+    uring_backlog(u);
+    uring_kick(u, 0);
+}
+
+static struct uring_window *
+uring_window_find(struct uring *u, uint64_t off)
+{
+    for (size_t i = 0; i < URING_WINDOWS; i++) {
+        struct uring_window *w = &u->windows[i];
+
+        if (w->io.len > 0 && !w->stale && off >= w->io.off &&
+            off - w->io.off < w->io.len)
+            return w;
+    }
+
+    return NULL;
+}
+
+/*
+ * Serves a read from the windows: 0 once it is copied, EINPROGRESS when it
+ * waits on a window still being read, ENOENT when they do not cover it.
+ */
+static int
+uring_window_read(struct uring *u, struct blk_io *io)
+{
+    uint64_t end = io->off + io->len;
+    struct uring_window *w;
+    uint64_t pos, n;
+
+    for (pos = io->off; pos < end; pos = w->io.off + w->io.len) {
+        w = uring_window_find(u, pos);
+        if (!w)
+            return ENOENT;
+
+        if (w->busy) {
+            io->next = w->waiters;
+            w->waiters = io;
+            return EINPROGRESS;
+        }
+    }
+
+    for (pos = io->off; pos < end; pos += n) {
+        w = uring_window_find(u, pos);
+        n = (end < w->io.off + w->io.len ? end : w->io.off + w->io.len) - pos;
+        memcpy((uint8_t *) io->buf + (pos - io->off), w->buf + (pos - w->io.off), n);
+    }
+
+    return 0;
+}
+
+static void
+uring_read_start(struct uring *u, struct blk_io *io)
+{
+    switch (uring_window_read(u, io)) {
+    case 0:
+        io->done(io, 0);
+        break;
+
+    case ENOENT:
+        uring_queue(u, io);
+        break;
+    }
+}
+
+static void
+uring_window_done(struct blk_io *io, int err)
+{
+    struct uring_window *w = (struct uring_window *) io;
+    struct blk_io *waiters = w->waiters;
+
+    if (err != 0 || w->stale)
+        w->io.len = 0;
+
+    w->busy = false;
+    w->stale = false;
+    w->waiters = NULL;
+
+    while ((io = waiters)) {
+        waiters = io->next;
+        uring_read_start(w->u, io);
+    }
+}
+
+/* Takes the oldest idle window; reads waiting on the others stay put. */
+static void
+uring_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    struct uring *u = (struct uring *) b;
+    struct uring_window *w = NULL;
+    uint8_t *buf;
+
+    if (uring_window_find(u, off))
+        return;
+
+    for (size_t i = 0; i < URING_WINDOWS; i++) {
+        struct uring_window *c = &u->windows[i];
+
+        if (!c->busy && (!w || c->io.len == 0 || (w->io.len > 0 && c->age < w->age)))
+            w = c;
+    }
+
+    if (!w)
+        return;
+
+    if (w->size < len) {
+        buf = realloc(w->buf, len);
+        if (!buf)
+            return;
+        w->buf = buf;
+        w->size = len;
+    }
+
+    w->io = (struct blk_io) {
+        .op = BLK_READ,
+        .buf = w->buf,
+        .off = off,
+        .len = len,
+        .done = uring_window_done,
+    };
+    w->u = u;
+    w->age = ++u->age;
+    w->busy = true;
+    w->stale = false;
+    w->waiters = NULL;
+
+    uring_queue(u, &w->io);
+    uring_kick(u, 0);
+}
+
+static void
+uring_event(struct loop_watch *w, uint32_t events)
+{
+    (void) events;
+
+    uring_reap((struct uring *) ((char *) w - offsetof(struct uring, watch)));
+}
+
+static int
+uring_submit(struct blk *b, struct blk_io *io)
+{
+    struct uring *u = (struct uring *) b;
+    int r;
+
+    io->moved = 0;
+
+    if (io->op == BLK_READ) {
+        r = uring_window_read(u, io);
+        if (r != ENOENT)
+            return r;
+    } else if (io->op == BLK_WRITE) {
+        uring_window_drop(u, io->off, io->len);
+    } else if (io->op == BLK_DISCARD) {
+        return blk_zero(b, io->off, io->len);
+    }
+
+    uring_queue(u, io);
+    uring_kick(u, 0);
+    return EINPROGRESS;
+}
+
+static int
+uring_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    struct uring *u = (struct uring *) b;
+
+    while (len > 0) {
+        ssize_t n = pread(u->fd, buf, len, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? errno : EIO;
+
+        buf = (uint8_t *) buf + n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+uring_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    struct uring *u = (struct uring *) b;
+
+    uring_window_drop(u, off, len);
+
+    while (len > 0) {
+        ssize_t n = pwrite(u->fd, buf, len, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? errno : EIO;
+
+        buf = (const uint8_t *) buf + n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+uring_flush(struct blk *b)
+{
+    struct uring *u = (struct uring *) b;
+
+    return fdatasync(u->fd) == 0 ? 0 : errno;
+}
+
+/* Done on the spot, like write(); the windows over the hole go. */
+static int
+uring_discard(struct blk *b, uint64_t off, uint64_t len)
+{
+    struct uring *u = (struct uring *) b;
+
+    uring_window_drop(u, off, len);
+
+    if (fallocate(u->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) != 0)
+        return errno;
+
+    return 0;
+}
+
+static void
+uring_free(struct uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sq_entries * sizeof(*u->sqes));
+    if (u->cq_map && u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_len);
+    if (u->sq_map)
+        munmap(u->sq_map, u->sq_len);
+    if (u->watch.fd >= 0)
+        close(u->watch.fd);
+    for (size_t i = 0; i < URING_WINDOWS; i++)
+        free(u->windows[i].buf);
+    free(u);
+}
+
+static void
+uring_close(struct blk *b)
+{
+    struct uring *u = (struct uring *) b;
+
+    while (u->inflight > 0 || u->backlog) {
+        uring_kick(u, u->inflight > 0);
+        uring_reap(u);
+    }
+
+    loop_del(&u->watch);
+    close(u->fd);
+    uring_free(u);
+}
+
+static const struct blk_ops uring_ops = {
+    .read = uring_read,
+    .write = uring_write,
+    .flush = uring_flush,
+    .discard = uring_discard,
+    .submit = uring_submit,
+    .readahead = uring_readahead,
+    .close = uring_close,
+};
+
+static int
+uring_map(struct uring *u, int ring, const struct io_uring_params *p)
+{
+    uint8_t *sq, *cq;
+
+    u->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    u->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+
+    u->sq_map = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        u->sq_map = NULL;
+        return errno;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) {
+            u->cq_map = NULL;
+            return errno;
+        }
+    }
+
+    u->sqes = mmap(NULL, p->sq_entries * sizeof(*u->sqes),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return errno;
+    }
+
+    sq = u->sq_map;
+    u->sq_head = (void *) (sq + p->sq_off.head);
+    u->sq_tail = (void *) (sq + p->sq_off.tail);
+    u->sq_array = (void *) (sq + p->sq_off.array);
+    u->sq_mask = *(unsigned int *) (sq + p->sq_off.ring_mask);
+    u->sq_entries = p->sq_entries;
+
+    cq = u->cq_map;
+    u->cq_head = (void *) (cq + p->cq_off.head);
+    u->cq_tail = (void *) (cq + p->cq_off.tail);
+    u->cqes = (void *) (cq + p->cq_off.cqes);
+    u->cq_mask = *(unsigned int *) (cq + p->cq_off.ring_mask);
+    u->cq_entries = p->cq_entries;
+    return 0;
+}
+
+int
+blk_uring_open(int fd, uint64_t size, bool readonly, struct blk **blk)
+{
+    struct io_uring_params p;
+    struct uring *u;
+    int e;
+
+    u = calloc(1, sizeof(*u));
+    if (!u)
+        return ENOMEM;
+
+    memset(&p, 0, sizeof(p));
+    u->watch.fd = uring_setup(URING_ENTRIES, &p);
+    if (u->watch.fd < 0) {
+        e = errno;
+        free(u);
+        return e;
+    }
+
+    e = uring_map(u, u->watch.fd, &p);
+    if (e == 0 && uring_register(u->watch.fd, IORING_REGISTER_FILES, &fd, 1) != 0)
+        e = errno;
+
+    u->watch.func = uring_event;
+    if (e == 0)
+        e = loop_add(&u->watch, EPOLLIN);
+
+    if (e != 0) {
+        uring_free(u);
+        return e;
+    }
+
+    u->fd = fd;
+    u->backlog_tail = &u->backlog;
+    u->blk.ops = &uring_ops;
+    u->blk.size = size;
+    u->blk.readonly = readonly;
+    *blk = &u->blk;
+    return 0;
+}
@@ -1,290 +1,1270 @@
-#include <endian.h>
+#define _GNU_SOURCE
+
+#include "usb.h"
 
-#include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 
+#include <endian.h>
 #include <errno.h>
-#include <stdint.h>
-#include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-enum usb_device_speed {
-    USB_SPEED_UNKNOWN = 0,               /* enumerating */
-    USB_SPEED_LOW, USB_SPEED_FULL,       /* usb 1.1 */
-    USB_SPEED_HIGH,                      /* usb 2.0 */
-    USB_SPEED_WIRELESS,                  /* wireless (usb 2.5) */
-    USB_SPEED_SUPER,                     /* usb 3.0 */
-    USB_SPEED_SUPER_PLUS,                /* usb 3.1 */
-};
-
-enum {
-    USBIP_DIR_IN = 0,
-    USBIP_DIR_OUT = 1,
-};
-
-enum {
-    USBIP_CMD_SUBMIT = 1,
-    USBIP_CMD_UNLINK = 2,
-    USBIP_RET_SUBMIT = 3,
-    USBIP_RET_UNLINK = 4
-};
-
-enum {
-    USBIP_URB_NONE                = 0,
-    USBIP_URB_SHORT_NOT_OK        = 1 << 0,
-    USBIP_URB_ISO_ASAP            = 1 << 1,
-    USBIP_URB_NO_TRANSFER_DMA_MAP = 1 << 2,
-    USBIP_URB_NO_FSBR             = 1 << 5,
-    USBIP_URB_ZERO_PACKET         = 1 << 6,
-    USBIP_URB_NO_INTERRUPT        = 1 << 7,
-    USBIP_URB_FREE_BUFFER         = 1 << 8,
-    USBIP_URB_DIR_MASK            = 1 << 9,
-};
-
-struct usbip_submit_setup {
-    uint8_t bmRequestType;
-    uint8_t bRequest;
-    uint16_t wValue;
-    uint16_t wIndex;
-    uint16_t wLength;
-} __attribute__((packed));
-
-struct usbip_submit_cmd {
-    uint32_t transfer_flags;
-    uint32_t transfer_buffer_length;
-    uint32_t start_frame;
-    uint32_t number_of_packets;
-    uint32_t interval;
-    struct usbip_submit_setup setup;
-    uint8_t data[];
-} __attribute__((packed));
-
-struct usbip_submit_ret {
-    uint32_t status;
-    uint32_t actual_length;
-    uint32_t start_frame;
-    uint32_t number_of_packets;
-    uint32_t error_count;
-    struct usbip_submit_setup setup;
-    uint8_t data[];
-} __attribute__((packed));
-
-struct usbip_unlink_cmd {
-    uint32_t seqnum;
-} __attribute__((packed));
-
-struct usbip_unlink_ret {
-    uint32_t status;
-} __attribute__((packed));
-
-struct usbip {
-    uint32_t command;
-    uint32_t seqnum;
-    uint32_t devid;
-    uint32_t direction;
-    uint32_t endpoint;
-
-    union {
-        union {
-            struct usbip_submit_cmd submit;
-            struct usbip_unlink_cmd unlink;
-        } cmd;
-
-        union {
-            struct usbip_submit_ret submit;
-            struct usbip_unlink_ret unlink;
-        } ret;
+bool usb_verbose;
+
+static const uint8_t usb_langids[] = { 4, USB_DT_STRING, 0x09, 0x04 };
+
+struct usb_device *
+usb_device_new(void)
+{
+    struct usb_device *dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+
+    dev->speed = USB_SPEED_FULL;
+    dev->port = -1;
+    dev->fd = -1;
+    TAILQ_INIT(&dev->inflight);
+
+    for (size_t d = 0; d < 2; d++) {
+        for (size_t i = 0; i < USB_MAX_ENDPOINTS; i++)
+            TAILQ_INIT(&dev->ep[d][i].queue);
+    }
+
+    return dev;
+}
+
+static int
+usb_desc_set(struct usb_desc *desc, const void *buf, size_t len)
+{
+    uint8_t *copy = malloc(len);
+    if (!copy)
+        return ENOMEM;
+
+    memcpy(copy, buf, len);
+    free(desc->buf);
+    desc->buf = copy;
+    desc->len = len;
+    return 0;
+}
+
+static int
+usb_config_check(const uint8_t *buf, size_t len)
+{
+    const struct usb_config_descriptor *cfg = (const void *) buf;
+
+    if (len < sizeof(*cfg) || cfg->bLength < sizeof(*cfg))
+        return EINVAL;
+
+    if (cfg->bDescriptorType != USB_DT_CONFIG)
+        return EINVAL;
+
+    if (le16toh(cfg->wTotalLength) != len)
+        return EINVAL;
+
+    for (size_t off = 0; off < len; off += buf[off]) {
+        if (len - off < 2 || buf[off] < 2 || buf[off] > len - off)
+            return EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Gives each endpoint of a configuration laid out for high speed the
+ * companion SuperSpeed requires. Bulk endpoints move to 1024 byte packets
+ * in bursts of up to USB_SS_MAX_BURST; periodic ones reserve what they
+ * moved per high speed interval, bursting when that is more than a packet.
+ * Power goes from 2 to 8 mA units. A configuration that already has
+ * companions is taken as it is.
+ */
+static int
+usb_config_ss(struct usb_desc *desc, const uint8_t *buf, size_t len)
+{
+    struct usb_ss_ep_comp_descriptor comp = {
+        .bLength = sizeof(comp),
+        .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+    };
+    struct usb_config_descriptor *cfg;
+    size_t eps = 0, n = 0;
+    uint8_t *out;
+    int r;
+
+    for (size_t off = 0; off < len; off += buf[off]) {
+        if (buf[off + 1] == USB_DT_SS_ENDPOINT_COMP)
+            return usb_desc_set(desc, buf, len);
+        if (buf[off + 1] == USB_DT_ENDPOINT && buf[off] >= 7)
+            eps++;
+    }
+
+    if (len + eps * sizeof(comp) > UINT16_MAX)
+        return EINVAL;
+
+    out = malloc(len + eps * sizeof(comp));
+    if (!out)
+        return ENOMEM;
+
+    for (size_t off = 0; off < len; off += buf[off]) {
+        struct usb_endpoint_descriptor *ed = (void *) (out + n);
+        uint16_t mps, bytes;
+
+        memcpy(out + n, buf + off, buf[off]);
+        n += buf[off];
+
+        if (ed->bDescriptorType != USB_DT_ENDPOINT || ed->bLength < 7)
+            continue;
+
+        mps = le16toh(ed->wMaxPacketSize) & 0x7ff;
+        bytes = mps * ((le16toh(ed->wMaxPacketSize) >> 11 & 3) + 1);
+        comp.bMaxBurst = 0;
+        comp.wBytesPerInterval = 0;
+
+        switch (ed->bmAttributes & 3) {
+        case USB_ENDPOINT_XFER_BULK:
+            mps = 1024;
+            comp.bMaxBurst = USB_SS_MAX_BURST - 1;
+            break;
+
+        case USB_ENDPOINT_XFER_INT:
+        case USB_ENDPOINT_XFER_ISOC:
+            if (bytes > 1024) {
+                mps = 1024;
+                comp.bMaxBurst = (bytes - 1) / 1024;
+            }
+            comp.wBytesPerInterval = htole16(bytes);
+            break;
+        }
+
+        ed->wMaxPacketSize = htole16(mps);
+        memcpy(out + n, &comp, sizeof(comp));
+        n += sizeof(comp);
+    }
+
+    cfg = (struct usb_config_descriptor *) out;
+    cfg->wTotalLength = htole16(n);
+    cfg->bMaxPower = (cfg->bMaxPower + 3) / 4;
+    r = usb_desc_set(desc, out, n);
+    free(out);
+    return r;
+}
+
+/*
+ * The device capabilities a SuperSpeed device must report: USB 2.0 LPM,
+ * the SuperSpeed link and, for SuperSpeedPlus, one Gen 2 lane each way.
+ */
+static int
+usb_device_bos(struct usb_device *dev)
+{
+    bool plus = dev->speed >= USB_SPEED_SUPER_PLUS;
+    struct {
+        struct usb_bos_descriptor bos;
+        uint8_t ext[7];
+        uint8_t ss[10];
+        uint8_t ssp[20];
+    } __attribute__((packed)) b = {
+        .bos = {
+            .bLength = sizeof(b.bos),
+            .bDescriptorType = USB_DT_BOS,
+            .wTotalLength = htole16(plus ? sizeof(b) : sizeof(b) - sizeof(b.ssp)),
+            .bNumDeviceCaps = plus ? 3 : 2,
+        },
+        /* USB 2.0 extension: link power management */
+        .ext = { 7, USB_DT_DEVICE_CAPABILITY, 0x02, 0x02, 0, 0, 0 },
+        /* SuperSpeed: full, high and SuperSpeed; all functions at full
+         * speed; U1 and U2 exit latencies of 10 and 32 us */
+        .ss = { 10, USB_DT_DEVICE_CAPABILITY, 0x03, 0, 0x0e, 0, 1, 10, 32, 0 },
+        /* SuperSpeedPlus: two sublink attributes, 10 Gb/s receive and
+         * transmit, one lane minimum */
+        .ssp = {
+            20, USB_DT_DEVICE_CAPABILITY, 0x0a, 0, 0x01, 0, 0, 0, 0x00, 0x11,
+            0, 0, 0x30, 0x40, 0x0a, 0x00, 0xb0, 0x40, 0x0a, 0x00,
+        },
     };
 
-    uint8_t padding[65488];
-} __attribute__((packed));
+    return usb_desc_set(&dev->bos, &b, le16toh(b.bos.wTotalLength));
+}
+
+/* SuperSpeed devices announce USB 3 and a 512 byte control endpoint. */
+static int
+usb_device_ss(struct usb_device *dev, const struct usb_device_descriptor *buf)
+{
+    struct usb_device_descriptor dd = *buf;
+    uint16_t bcd = dev->speed >= USB_SPEED_SUPER_PLUS ? 0x0310 : 0x0300;
+    int r;
+
+    if (le16toh(dd.bcdUSB) < bcd)
+        dd.bcdUSB = htole16(bcd);
+    dd.bMaxPacketSize0 = 9;
+
+    r = usb_desc_set(&dev->device, &dd, sizeof(dd));
+    if (r == 0 && !dev->bos.buf)
+        r = usb_device_bos(dev);
 
-#define SETUP_DIR(rt) ((rt) & 0b10000000 >> 7)
-#define SETUP_TYP(rt) ((rt) & 0b01100000 >> 5)
-#define SETUP_RCP(rt) ((rt) & 0b00011111 >> 0)
+    return r;
+}
 
-static const char *
-usbip_setup_dir_str(uint8_t rt)
+int
+usb_device_desc(struct usb_device *dev, uint8_t type, uint8_t index,
+                const void *buf, size_t len)
 {
-    return SETUP_DIR(rt) ? "D2H" : "H2D";
+    const uint8_t *b = buf;
+
+    if (len < 2 || b[0] > len || b[1] != type)
+        return EINVAL;
+
+    switch (type) {
+    case USB_DT_DEVICE:
+        if (len != sizeof(struct usb_device_descriptor))
+            return EINVAL;
+        if (dev->speed >= USB_SPEED_SUPER)
+            return usb_device_ss(dev, buf);
+        return usb_desc_set(&dev->device, buf, len);
+
+    case USB_DT_CONFIG:
+        if (index >= USB_MAX_CONFIGS || usb_config_check(buf, len) != 0)
+            return EINVAL;
+        if (dev->speed >= USB_SPEED_SUPER)
+            return usb_config_ss(&dev->config[index], buf, len);
+        return usb_desc_set(&dev->config[index], buf, len);
+
+    case USB_DT_DEVICE_QUALIFIER:
+        return usb_desc_set(&dev->qualifier, buf, len);
+
+    case USB_DT_BOS:
+        return usb_desc_set(&dev->bos, buf, len);
+
+    case USB_DT_STRING:
+        if (!dev->strings[index]) {
+            dev->strings[index] = calloc(1, sizeof(struct usb_desc));
+            if (!dev->strings[index])
+                return ENOMEM;
+        }
+
+        if (index != 0 && !dev->strings[0]) {
+            int r = usb_device_desc(dev, USB_DT_STRING, 0,
+                                    usb_langids, sizeof(usb_langids));
+            if (r != 0)
+                return r;
+        }
+
+        return usb_desc_set(dev->strings[index], buf, len);
+
+    default:
+        return EINVAL;
+    }
 }
 
-static const char *
-usbip_setup_typ_str(uint8_t rt)
+/* Serializes a UTF-8 string as a UTF-16LE string descriptor. */
+int
+usb_device_string(struct usb_device *dev, uint8_t index, const char *utf8)
 {
-    switch (SETUP_TYP(rt)) {
-    case 0:  return "standard";
-    case 1:  return "class";
-    case 2:  return "vendor";
-    default: return "<reserved>";
+    const uint8_t *s = (const uint8_t *) utf8;
+    uint8_t buf[254] = { 0, USB_DT_STRING };
+    size_t len = 2;
+
+    if (index == 0)
+        return EINVAL;
+
+    while (*s) {
+        uint32_t cp;
+        size_t n;
+
+        if (*s < 0x80) {
+            cp = *s;
+            n = 1;
+        } else if ((*s & 0xe0) == 0xc0) {
+            cp = *s & 0x1f;
+            n = 2;
+        } else if ((*s & 0xf0) == 0xe0) {
+            cp = *s & 0x0f;
+            n = 3;
+        } else if ((*s & 0xf8) == 0xf0) {
+            cp = *s & 0x07;
+            n = 4;
+        } else {
+            return EINVAL;
+        }
+
+        for (size_t i = 1; i < n; i++) {
+            if ((s[i] & 0xc0) != 0x80)
+                return EINVAL;
+            cp = cp << 6 | (s[i] & 0x3f);
+        }
+        s += n;
+
+        if (cp >= 0x10000) {
+            if (len + 4 > sizeof(buf))
+                break;
+
+            cp -= 0x10000;
+            uint16_t hi = 0xd800 | cp >> 10;
+            uint16_t lo = 0xdc00 | (cp & 0x3ff);
+            buf[len++] = hi;
+            buf[len++] = hi >> 8;
+            buf[len++] = lo;
+            buf[len++] = lo >> 8;
+        } else {
+            if (len + 2 > sizeof(buf))
+                break;
+
+            buf[len++] = cp;
+            buf[len++] = cp >> 8;
+        }
     }
+
+    buf[0] = len;
+    return usb_device_desc(dev, USB_DT_STRING, index, buf, len);
+}
+
+void
+usb_device_function(struct usb_device *dev, struct usb_function *f,
+                    const struct usb_function_ops *ops)
+{
+    f->ops = ops;
+    f->dev = dev;
+    f->next = NULL;
+    f->intf = 0;
+    f->intfs = USB_MAX_INTERFACES;
+
+    for (size_t i = 0; i < USB_MAX_ENDPOINTS; i++)
+        f->ep[USBIP_DIR_OUT][i] = f->ep[USBIP_DIR_IN][i] = i;
+
+    dev->func = f;
 }
 
-static const char *
-usbip_setup_rcp_str(uint8_t rt)
+int
+usb_speed_parse(const char *str, enum usb_device_speed *speed)
 {
-    switch (SETUP_RCP(rt)) {
-    case 0:  return "device";
-    case 1:  return "interface";
-    case 2:  return "endpoint";
-    case 3:  return "other";
-    default: return "<reserved>";
+    static const struct {
+        const char *name;
+        const char *mbps;
+        enum usb_device_speed speed;
+    } speeds[] = {
+        { "low",    "1.5",   USB_SPEED_LOW },
+        { "full",   "12",    USB_SPEED_FULL },
+        { "high",   "480",   USB_SPEED_HIGH },
+        { "wireless", "wusb", USB_SPEED_WIRELESS },
+        { "super",  "5000",  USB_SPEED_SUPER },
+        { "super+", "10000", USB_SPEED_SUPER_PLUS },
+        { "super+", "20000", USB_SPEED_SUPER_PLUS },
+    };
+
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(*speeds); i++) {
+        if (strcmp(str, speeds[i].name) == 0 ||
+            strcmp(str, speeds[i].mbps) == 0) {
+            *speed = speeds[i].speed;
+            return 0;
+        }
     }
+
+    return EINVAL;
 }
 
-static const char *
-usbip_setup_req_str(uint8_t req)
+const struct usb_interface_descriptor *
+usb_config_interface(const struct usb_config_descriptor *cfg,
+                     uint8_t intf, uint8_t alt)
 {
-    switch (req) {
-    case 0:  return "GET_STATUS";
-    case 1:  return "CLEAR_FEATURE";
-    case 3:  return "SET_FEATURE";
-    case 5:  return "SET_ADDRESS";
-    case 6:  return "GET_DESCRIPTOR";
-    case 7:  return "SET_DESCRIPTOR";
-    case 8:  return "GET_CONFIGURATION";
-    case 9:  return "SET_CONFIGURATION";
-    case 10: return "GET_INTERFACE";
-    case 11: return "SET_INTERFACE";
-    case 12: return "SYNCH_FRAME";
-    default: return "<reserved>";
+    const uint8_t *buf = (const uint8_t *) cfg;
+    size_t len = le16toh(cfg->wTotalLength);
+
+    for (size_t off = 0; off < len; off += buf[off]) {
+        const struct usb_interface_descriptor *id = (const void *) &buf[off];
+
+        if (id->bDescriptorType != USB_DT_INTERFACE || id->bLength < sizeof(*id))
+            continue;
+
+        if (id->bInterfaceNumber == intf && id->bAlternateSetting == alt)
+            return id;
     }
+
+    return NULL;
+}
+
+static struct usb_ep *
+usb_ep_addr(struct usb_device *dev, uint8_t addr)
+{
+    uint8_t dir = addr & USB_ENDPOINT_DIR_IN ? USBIP_DIR_IN : USBIP_DIR_OUT;
+    uint8_t num = addr & 0x0f;
+
+    if (num == 0)
+        return &dev->ep[dir][0];
+
+    return dev->ep[dir][num].desc ? &dev->ep[dir][num] : NULL;
+}
+
+void
+usb_ep_queue(struct urb *urb)
+{
+    TAILQ_INSERT_TAIL(&urb->ep->queue, urb, entry);
+    urb->queued = true;
+}
+
+struct urb *
+usb_ep_dequeue(struct usb_ep *ep)
+{
+    struct urb *urb = TAILQ_FIRST(&ep->queue);
+
+    if (urb) {
+        TAILQ_REMOVE(&ep->queue, urb, entry);
+        urb->queued = false;
+    }
+
+    return urb;
+}
+
+void
+usb_ep_flush(struct usb_ep *ep, int err)
+{
+    struct urb *urb;
+
+    while ((urb = usb_ep_dequeue(ep)))
+        usb_urb_done(urb, err);
+}
+
+/*
+ * Signals, and the task work of an io_uring backend, can cut a blocking
+ * MSG_WAITALL receive short, so the rest is asked for again.
+ */
+static bool
+usb_recv(int fd, void *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, MSG_WAITALL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        buf = (uint8_t *) buf + n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/*
+ * more says the data of the message follows from usb_sendfile(). An iso
+ * URB may gather more than IOV_MAX pieces; they go IOV_MAX at a time.
+ */
+static int
+usb_send(struct usb_device *dev, struct iovec *iov, int iovcnt, bool more)
+{
+    while (iovcnt > 0) {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+        };
+        ssize_t n = sendmsg(dev->fd, &msg, MSG_NOSIGNAL |
+                            (more || iovcnt > IOV_MAX ? MSG_MORE : 0));
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* Let the receive path notice the dead socket and clean up. */
+            shutdown(dev->fd, SHUT_RDWR);
+            return errno;
+        }
+
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int
+usb_sendfile(struct usb_device *dev, int fd, uint64_t off, size_t len)
+{
+    off_t pos = off;
+
+    while (len > 0) {
+        ssize_t n = sendfile(dev->fd, fd, &pos, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        /* A short image would leave the stream out of step; end it. */
+        if (n <= 0) {
+            shutdown(dev->fd, SHUT_RDWR);
+            return n < 0 ? errno : EIO;
+        }
+
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Settles the packets of an isochronous URB in a single pass: clamps each
+ * to its slot, totals actual and error_count and, unless the function gave
+ * its own iov, gathers the IN data of each packet back to back as the host
+ * expects it. Packets contiguous in buf share an iovec.
+ */
+static int
+usb_urb_iso(struct urb *urb, struct iovec *iov)
+{
+    int iovcnt = 0;
+
+    urb->actual = 0;
+    urb->error_count = 0;
+
+    for (uint32_t i = 0; i < urb->packets; i++) {
+        struct usbip_iso_packet_descriptor *p = &urb->iso[i];
+        uint32_t room = p->offset < urb->length ? urb->length - p->offset : 0;
+
+        if (p->actual_length > p->length)
+            p->actual_length = p->length;
+        if (p->actual_length > room)
+            p->actual_length = room;
+
+        urb->actual += p->actual_length;
+        if (p->status != 0)
+            urb->error_count++;
+
+        if (urb->dir != USBIP_DIR_IN || urb->iovcnt > 0 ||
+            p->actual_length == 0)
+            continue;
+
+        if (iovcnt > 0 && (uint8_t *) iov[iovcnt - 1].iov_base +
+            iov[iovcnt - 1].iov_len == urb->buf + p->offset)
+            iov[iovcnt - 1].iov_len += p->actual_length;
+        else
+            iov[iovcnt++] = (struct iovec) { urb->buf + p->offset,
+                                             p->actual_length };
+    }
+
+    return iovcnt;
 }
 
 static void
-usbip_dump(const struct usbip *u, FILE *f)
+usb_urb_send(struct urb *urb, int err)
 {
-    fprintf(f, "{\n");
-    fprintf(f, "  .command = %u\n",   u->command);
-    fprintf(f, "  .seqnum = %u\n",    u->seqnum);
-    fprintf(f, "  .devid = %u\n",     u->devid);
-    fprintf(f, "  .direction = %u\n", u->direction);
-    fprintf(f, "  .endpoint = %u\n",  u->endpoint);
+    struct usb_device *dev = urb->dev;
+    struct iovec iov[2 + (urb->packets > 4 ? urb->packets : 4)];
+    struct usbip hdr = {
+        .command = USBIP_RET_SUBMIT,
+        .seqnum = urb->seqnum,
+        .ret.submit.status = -err,
+        .ret.submit.start_frame = urb->start_frame,
+    };
+    bool file = urb->dir == USBIP_DIR_IN && urb->actual > 0 &&
+                urb->file >= 0 && urb->packets == 0;
+    int iovcnt = 1;
 
-    switch (u->command) {
-    case USBIP_CMD_SUBMIT:
-        fprintf(f, "  .cmd.submit.transfer_flags = 0x%08X\n",     u->cmd.submit.transfer_flags);
-        fprintf(f, "  .cmd.submit.transfer_buffer_length = %u\n", u->cmd.submit.transfer_buffer_length);
-        fprintf(f, "  .cmd.submit.start_frame = %u\n",            u->cmd.submit.start_frame);
-        fprintf(f, "  .cmd.submit.number_of_packets = %u\n",      u->cmd.submit.number_of_packets);
-        fprintf(f, "  .cmd.submit.interval = %u\n",               u->cmd.submit.interval);
-        fprintf(f, "  .cmd.submit.setup.direction = %s\n",        usbip_setup_dir_str(u->cmd.submit.setup.bmRequestType));
-        fprintf(f, "  .cmd.submit.setup.type = %s\n",             usbip_setup_typ_str(u->cmd.submit.setup.bmRequestType));
-        fprintf(f, "  .cmd.submit.setup.recipient = %s\n",        usbip_setup_rcp_str(u->cmd.submit.setup.bmRequestType));
-        fprintf(f, "  .cmd.submit.setup.bRequest = %s\n",         usbip_setup_req_str(u->cmd.submit.setup.bRequest));
-        fprintf(f, "  .cmd.submit.setup.wValue = %hu\n",          u->cmd.submit.setup.wValue);
-        fprintf(f, "  .cmd.submit.setup.wIndex = %hu\n",          u->cmd.submit.setup.wIndex);
-        fprintf(f, "  .cmd.submit.setup.wLength = %hu\n",         u->cmd.submit.setup.wLength);
-
-        fprintf(f, "  .cmd.submit.data[] = {");
-        for (size_t i = 0; i < u->cmd.submit.transfer_buffer_length; i++)
-            fprintf(f, "%s%02x", i % 32 == 0 ? "\n    " : "", u->cmd.submit.data[i]);
-        fprintf(f, "\n  }\n");
+    iov[0] = (struct iovec) { &hdr, sizeof(hdr) };
 
-        break;
+    if (urb->packets > 0)
+        iovcnt += usb_urb_iso(urb, iov + 1);
 
-    case USBIP_CMD_UNLINK:
-        fprintf(f, "  .cmd.unlink.seqnum = %u\n",                 u->cmd.unlink.seqnum);
-        break;
+    if (urb->dir == USBIP_DIR_IN && urb->actual > 0 && iovcnt == 1 && !file) {
+        if (urb->iovcnt > 0) {
+            for (int i = 0; i < urb->iovcnt; i++)
+                iov[iovcnt++] = urb->iov[i];
+        } else {
+            iov[iovcnt++] = (struct iovec) { urb->buf, urb->actual };
+        }
+    }
+
+    hdr.ret.submit.actual_length = urb->actual;
+    if (urb->packets > 0) {
+        hdr.ret.submit.number_of_packets = urb->packets;
+        hdr.ret.submit.error_count = urb->error_count;
+    }
+
+    if (usb_verbose) {
+        usbip_dump(&hdr, stderr);
+        for (int i = 1; i < iovcnt; i++)
+            usbip_dump_data(iov[i].iov_base, iov[i].iov_len, stderr);
+        if (urb->packets > 0)
+            usbip_dump_iso(urb->iso, urb->packets, stderr);
+    }
+
+    if (urb->packets > 0) {
+        usbip_iso_hton(urb->iso, urb->packets);
+        iov[iovcnt++] = (struct iovec) {
+            urb->iso, urb->packets * sizeof(*urb->iso)
+        };
+    }
+
+    usbip_hton(&hdr);
+    if (usb_send(dev, iov, iovcnt, file) == 0 && file)
+        usb_sendfile(dev, urb->file, urb->file_off, urb->actual);
+}
+
+void
+usb_urb_done(struct urb *urb, int err)
+{
+    struct usb_device *dev = urb->dev;
+
+    if (urb->queued) {
+        TAILQ_REMOVE(&urb->ep->queue, urb, entry);
+        urb->queued = false;
+    }
+
+    if (urb->actual > urb->length)
+        urb->actual = urb->length;
+
+    if (!urb->unlinked && dev->fd >= 0)
+        usb_urb_send(urb, err);
+
+    TAILQ_REMOVE(&dev->inflight, urb, inflight);
+    free(urb);
+}
+
+/* Serves a pre-serialized descriptor straight from its blob. */
+int
+usb_urb_blob(struct urb *urb, const struct usb_desc *desc)
+{
+    if (!desc || !desc->buf)
+        return EPIPE;
+
+    urb->actual = desc->len < urb->length ? desc->len : urb->length;
+    urb->iov[0] = (struct iovec) { desc->buf, urb->actual };
+    urb->iovcnt = 1;
+    return 0;
+}
+
+static void
+usb_intf_disable(struct usb_device *dev, uint8_t intf)
+{
+    for (size_t d = 0; d < 2; d++) {
+        for (size_t i = 1; i < USB_MAX_ENDPOINTS; i++) {
+            struct usb_ep *ep = &dev->ep[d][i];
+
+            if (!ep->desc || ep->intf != intf)
+                continue;
+
+            usb_ep_flush(ep, ESHUTDOWN);
+            ep->desc = NULL;
+            ep->func = NULL;
+            ep->halted = false;
+        }
+    }
+}
 
-    case USBIP_RET_SUBMIT:
-        fprintf(f, "  .ret.submit.status = %u\n",                 u->ret.submit.status);
-        fprintf(f, "  .ret.submit.actual_length = %u\n",          u->ret.submit.actual_length);
-        fprintf(f, "  .ret.submit.start_frame = %u\n",            u->ret.submit.start_frame);
-        fprintf(f, "  .ret.submit.number_of_packets = %u\n",      u->ret.submit.number_of_packets);
-        fprintf(f, "  .ret.submit.error_count = %u\n",            u->ret.submit.error_count);
-        fprintf(f, "  .ret.submit.setup.bmRequestType = %hhu\n",  u->ret.submit.setup.bmRequestType);
-        fprintf(f, "  .ret.submit.setup.bRequest = %hhu\n",       u->ret.submit.setup.bRequest);
-        fprintf(f, "  .ret.submit.setup.wValue = %hu\n",          u->ret.submit.setup.wValue);
-        fprintf(f, "  .ret.submit.setup.wIndex = %hu\n",          u->ret.submit.setup.wIndex);
-        fprintf(f, "  .ret.submit.setup.wLength = %hu\n",         u->ret.submit.setup.wLength);
-
-        fprintf(f, "  .ret.submit.data[] = {");
-        for (size_t i = 0; i < u->ret.submit.actual_length; i++)
-            fprintf(f, "%s%02x", i % 32 == 0 ? "\n    " : "", u->ret.submit.data[i]);
-        fprintf(f, "\n  }\n");
+static void
+usb_intf_enable(struct usb_device *dev, uint8_t intf, uint8_t alt)
+{
+    struct usb_function *f = dev->intf[intf];
+    const struct usb_interface_descriptor *id;
+    const uint8_t *end;
+    uint8_t dir, num;
+
+    id = usb_config_interface(dev->active, intf, alt);
+    if (!id || !f)
+        return;
+
+    dev->alt[intf] = alt;
+    end = (const uint8_t *) dev->active + le16toh(dev->active->wTotalLength);
+
+    for (const uint8_t *p = (const uint8_t *) id + id->bLength; p < end; p += p[0]) {
+        const struct usb_endpoint_descriptor *ed = (const void *) p;
+        struct usb_ep *ep;
+
+        if (p[1] == USB_DT_INTERFACE)
+            break;
+
+        if (p[1] != USB_DT_ENDPOINT || p[0] < 7)
+            continue;
+
+        dir = ed->bEndpointAddress & USB_ENDPOINT_DIR_IN ? 1 : 0;
+        num = ed->bEndpointAddress & 0x0f;
+        ep = &dev->ep[dir][num];
+        ep->desc = ed;
+        ep->func = f;
+        ep->intf = intf;
+        ep->num = num;
+        ep->halted = false;
+
+        for (size_t i = 0; i < USB_MAX_ENDPOINTS; i++) {
+            if (f->ep[dir][i] == num)
+                ep->num = i;
+        }
+    }
+}
+
+static struct usb_function *
+usb_intf_owner(struct usb_device *dev, uint8_t intf)
+{
+    for (struct usb_function *f = dev->func; f; f = f->next) {
+        if (intf >= f->intf && intf - f->intf < f->intfs)
+            return f;
+    }
+
+    return NULL;
+}
+
+static void
+usb_unconfigure(struct usb_device *dev)
+{
+    if (!dev->active)
+        return;
+
+    for (size_t i = 0; i < USB_MAX_INTERFACES; i++) {
+        if (dev->intf[i])
+            usb_intf_disable(dev, i);
+        dev->intf[i] = NULL;
+        dev->alt[i] = 0;
+    }
+
+    for (struct usb_function *f = dev->func; f; f = f->next) {
+        if (f->ops->disable)
+            f->ops->disable(f);
+    }
+
+    dev->active = NULL;
+}
+
+static int
+usb_configure(struct usb_device *dev, uint8_t value)
+{
+    const struct usb_config_descriptor *cfg = NULL;
+
+    for (size_t i = 0; i < USB_MAX_CONFIGS && value != 0; i++) {
+        const struct usb_config_descriptor *c = (const void *) dev->config[i].buf;
+
+        if (c && c->bConfigurationValue == value) {
+            cfg = c;
+            break;
+        }
+    }
+
+    if (value != 0 && !cfg)
+        return EPIPE;
+
+    usb_unconfigure(dev);
+    if (!cfg)
+        return 0;
+
+    dev->active = cfg;
+    for (size_t i = 0; i < USB_MAX_INTERFACES; i++) {
+        if (!usb_config_interface(cfg, i, 0))
+            continue;
+
+        /* An interface no function claims is left without endpoints. */
+        dev->intf[i] = usb_intf_owner(dev, i);
+        if (dev->intf[i])
+            usb_intf_enable(dev, i, 0);
+    }
+
+    for (size_t i = 0; i < USB_MAX_INTERFACES; i++) {
+        struct usb_function *f = dev->intf[i];
+
+        if (f && f->ops->set_alt)
+            f->ops->set_alt(f, i - f->intf, 0);
+    }
+
+    return 0;
+}
+
+static int
+usb_get_descriptor(struct usb_device *dev, struct urb *urb)
+{
+    uint8_t type = urb->setup.wValue >> 8;
+    uint8_t index = urb->setup.wValue & 0xff;
 
+    switch (type) {
+    case USB_DT_DEVICE:
+        return usb_urb_blob(urb, &dev->device);
+
+    case USB_DT_CONFIG:
+        return index < USB_MAX_CONFIGS ? usb_urb_blob(urb, &dev->config[index]) : EPIPE;
+
+    case USB_DT_STRING:
+        return usb_urb_blob(urb, dev->strings[index]);
+
+    case USB_DT_DEVICE_QUALIFIER:
+        return usb_urb_blob(urb, &dev->qualifier);
+
+    case USB_DT_BOS:
+        return usb_urb_blob(urb, &dev->bos);
+
+    default:
+        return EPIPE;
+    }
+}
+
+static int
+usb_feature(struct usb_device *dev, struct urb *urb, bool set)
+{
+    const struct usbip_submit_setup *s = &urb->setup;
+    bool ss = dev->speed >= USB_SPEED_SUPER;
+    struct usb_ep *ep;
+
+    switch (SETUP_RCP(s->bmRequestType)) {
+    case USB_RECIP_DEVICE:
+        switch (s->wValue) {
+        case USB_FEATURE_REMOTE_WAKEUP:
+            dev->remote_wakeup = set;
+            return 0;
+
+        /* The link is virtual: its power states are only remembered. */
+        case USB_FEATURE_U1_ENABLE:
+            if (!ss)
+                return EPIPE;
+            dev->u1_enable = set;
+            return 0;
+
+        case USB_FEATURE_U2_ENABLE:
+            if (!ss)
+                return EPIPE;
+            dev->u2_enable = set;
+            return 0;
+
+        case USB_FEATURE_LTM_ENABLE:
+            if (!ss)
+                return EPIPE;
+            dev->ltm_enable = set;
+            return 0;
+
+        default:
+            return EPIPE;
+        }
+
+    case USB_RECIP_INTERFACE:
+        if (ss && s->wValue == USB_FEATURE_FUNCTION_SUSPEND)
+            return 0;
+        return ENOSYS;
+
+    case USB_RECIP_ENDPOINT:
+        ep = usb_ep_addr(dev, s->wIndex);
+        if (!ep || s->wValue != USB_FEATURE_ENDPOINT_HALT)
+            return EPIPE;
+
+        if (ep->desc) {
+            ep->halted = set;
+            if (set)
+                usb_ep_flush(ep, EPIPE);
+            else if (ep->func && ep->func->ops->clear_halt)
+                ep->func->ops->clear_halt(ep->func, ep);
+        }
+        return 0;
+
+    default:
+        return ENOSYS;
+    }
+}
+
+static int
+usb_get_status(struct usb_device *dev, struct urb *urb)
+{
+    const struct usbip_submit_setup *s = &urb->setup;
+    const struct usb_config_descriptor *cfg = dev->active;
+    struct usb_ep *ep;
+    uint16_t status = 0;
+
+    if (!cfg)
+        cfg = (const void *) dev->config[0].buf;
+
+    switch (SETUP_RCP(s->bmRequestType)) {
+    case USB_RECIP_DEVICE:
+        if (cfg && cfg->bmAttributes & USB_CONFIG_ATT_SELFPOWER)
+            status |= 1 << 0;
+        if (dev->remote_wakeup)
+            status |= 1 << 1;
+        if (dev->u1_enable)
+            status |= 1 << 2;
+        if (dev->u2_enable)
+            status |= 1 << 3;
+        if (dev->ltm_enable)
+            status |= 1 << 4;
         break;
 
-    case USBIP_RET_UNLINK:
-        fprintf(f, "  .ret.unlink.status = %u\n", u->ret.unlink.status);
+    case USB_RECIP_INTERFACE:
         break;
+
+    case USB_RECIP_ENDPOINT:
+        ep = usb_ep_addr(dev, s->wIndex);
+        if (!ep)
+            return EPIPE;
+        if (ep->halted)
+            status |= 1 << 0;
+        break;
+
+    default:
+        return EPIPE;
     }
 
-    fprintf(f, "}\n");
+    urb->buf[0] = status;
+    urb->buf[1] = status >> 8;
+    urb->actual = 2;
+    return 0;
 }
 
+/* Handles the chapter 9 requests every device answers the same way. */
 static int
-usbip_ntoh(struct usbip *u)
+usb_standard(struct usb_device *dev, struct urb *urb)
 {
-    u->command = be32toh(u->command);
-    u->seqnum = be32toh(u->seqnum);
-    u->devid = be32toh(u->devid);
-    u->direction = be32toh(u->direction);
-    u->endpoint = be32toh(u->endpoint);
+    const struct usbip_submit_setup *s = &urb->setup;
+    uint8_t rcp = SETUP_RCP(s->bmRequestType);
+    uint8_t intf = s->wIndex & 0xff;
+    struct usb_function *f;
 
-    switch (u->command) {
-    case USBIP_CMD_SUBMIT:
-        u->cmd.submit.transfer_flags = be32toh(u->cmd.submit.transfer_flags);
-        u->cmd.submit.transfer_buffer_length = be32toh(u->cmd.submit.transfer_buffer_length);
-        u->cmd.submit.start_frame = be32toh(u->cmd.submit.start_frame);
-        u->cmd.submit.number_of_packets = be32toh(u->cmd.submit.number_of_packets);
-        u->cmd.submit.interval = be32toh(u->cmd.submit.interval);    
-        u->cmd.submit.setup.wValue = le16toh(u->cmd.submit.setup.wValue);
-        u->cmd.submit.setup.wIndex = le16toh(u->cmd.submit.setup.wIndex);
-        u->cmd.submit.setup.wLength = le16toh(u->cmd.submit.setup.wLength);
+    switch (s->bRequest) {
+    case USB_REQ_GET_STATUS:
+        return urb->length < 2 ? EPIPE : usb_get_status(dev, urb);
+
+    case USB_REQ_CLEAR_FEATURE:
+        return usb_feature(dev, urb, false);
+
+    case USB_REQ_SET_FEATURE:
+        return usb_feature(dev, urb, true);
+
+    case USB_REQ_SET_ADDRESS:
+        return rcp == USB_RECIP_DEVICE ? 0 : EPIPE;
+
+    case USB_REQ_GET_DESCRIPTOR:
+        return rcp == USB_RECIP_DEVICE ? usb_get_descriptor(dev, urb) : ENOSYS;
+
+    case USB_REQ_GET_CONFIGURATION:
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = dev->active ? dev->active->bConfigurationValue : 0;
+        urb->actual = 1;
         return 0;
 
-    case USBIP_CMD_UNLINK:
-        u->cmd.unlink.seqnum = be32toh(u->cmd.unlink.seqnum);
+    case USB_REQ_SET_CONFIGURATION:
+        return usb_configure(dev, s->wValue & 0xff);
+
+    case USB_REQ_SET_SEL:
+        if (rcp != USB_RECIP_DEVICE || dev->speed < USB_SPEED_SUPER ||
+            urb->dir != USBIP_DIR_OUT || urb->length != 6)
+            return EPIPE;
+        dev->u1_sel = urb->buf[0];
+        dev->u1_pel = urb->buf[1];
+        dev->u2_sel = urb->buf[2] | urb->buf[3] << 8;
+        dev->u2_pel = urb->buf[4] | urb->buf[5] << 8;
+        urb->actual = 6;
         return 0;
 
-    case USBIP_RET_SUBMIT:
-        u->ret.submit.status = be32toh(u->ret.submit.status);
-        u->ret.submit.actual_length = be32toh(u->ret.submit.actual_length);
-        u->ret.submit.start_frame = be32toh(u->ret.submit.start_frame);
-        u->ret.submit.number_of_packets = be32toh(u->ret.submit.number_of_packets);
-        u->ret.submit.error_count = be32toh(u->ret.submit.error_count);    
-        u->ret.submit.setup.wValue = le16toh(u->ret.submit.setup.wValue);
-        u->ret.submit.setup.wIndex = le16toh(u->ret.submit.setup.wIndex);
-        u->ret.submit.setup.wLength = le16toh(u->ret.submit.setup.wLength);
+    case USB_REQ_SET_ISOCH_DELAY:
+        if (rcp != USB_RECIP_DEVICE || dev->speed < USB_SPEED_SUPER)
+            return EPIPE;
+        dev->isoch_delay = s->wValue;
         return 0;
 
-    case USBIP_RET_UNLINK:
-        u->ret.unlink.status = be32toh(u->ret.unlink.status);
+    case USB_REQ_GET_INTERFACE:
+        if (!dev->active || intf >= USB_MAX_INTERFACES || !dev->intf[intf])
+            return EPIPE;
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = dev->alt[intf];
+        urb->actual = 1;
+        return 0;
+
+    case USB_REQ_SET_INTERFACE:
+        if (!dev->active || intf >= USB_MAX_INTERFACES || !dev->intf[intf])
+            return EPIPE;
+        if (!usb_config_interface(dev->active, intf, s->wValue))
+            return EPIPE;
+
+        f = dev->intf[intf];
+        usb_intf_disable(dev, intf);
+        usb_intf_enable(dev, intf, s->wValue);
+        if (f->ops->set_alt)
+            f->ops->set_alt(f, intf - f->intf, s->wValue);
         return 0;
 
     default:
-        return ENOTSUP;
+        return ENOSYS;
     }
 }
 
-int
-main()
+/* Finds the function a request is for, in its own numbering. */
+static struct usb_function *
+usb_control_route(struct usb_device *dev, struct usbip_submit_setup *s)
 {
-    struct usbip usbip = {};
-    int socks[2] = { -1, -1 };
-    FILE *file = NULL;
-    int r = 0;
+    uint8_t intf = s->wIndex & 0xff;
+    struct usb_function *f;
+    struct usb_ep *ep;
+
+    switch (SETUP_RCP(s->bmRequestType)) {
+    case USB_RECIP_INTERFACE:
+        f = intf < USB_MAX_INTERFACES ? dev->intf[intf] : NULL;
+        if (f)
+            s->wIndex = (s->wIndex & 0xff00) | (intf - f->intf);
+        return f;
+
+    case USB_RECIP_ENDPOINT:
+        ep = usb_ep_addr(dev, s->wIndex);
+        if (!ep)
+            return NULL;
+        if (ep->desc)
+            s->wIndex = (s->wIndex & 0xff80) | ep->num;
+        return ep->func;
+
+    default:
+        return dev->func;
+    }
+}
+
+static void
+usb_control(struct usb_device *dev, struct urb *urb)
+{
+    struct usb_function *f;
+    int r = ENOSYS;
+
+    if (SETUP_TYP(urb->setup.bmRequestType) == USB_TYPE_STANDARD)
+        r = usb_standard(dev, urb);
+
+    if (r == ENOSYS) {
+        f = usb_control_route(dev, &urb->setup);
+        urb->func = f;
+        r = f && f->ops->setup ? f->ops->setup(f, urb) : EPIPE;
+    }
+
+    if (r != EINPROGRESS)
+        usb_urb_done(urb, r == ENOSYS ? EPIPE : r);
+}
+
+static int
+usb_submit(struct usb_device *dev, const struct usbip *hdr)
+{
+    uint32_t len = hdr->cmd.submit.transfer_buffer_length;
+    uint32_t packets = hdr->cmd.submit.number_of_packets;
+    size_t room;
+    uint8_t *buf = NULL;
+    bool take = false;
+    struct usb_ep *ep;
+    struct urb *urb;
+
+    if (hdr->endpoint >= USB_MAX_ENDPOINTS || hdr->direction > USBIP_DIR_IN)
+        return EPROTO;
+
+    if (packets == USBIP_NO_ISO_PACKETS)
+        packets = 0;
+    if (packets > USBIP_MAX_ISO_PACKETS)
+        return EPROTO;
+
+    ep = &dev->ep[hdr->direction][hdr->endpoint];
+    if (hdr->endpoint != 0 && ep->desc && ep->func && !ep->halted) {
+        take = ep->func->ops->recv && hdr->direction == USBIP_DIR_OUT &&
+               len > 0 && packets == 0;
+        if (!take && ep->func->ops->buffer)
+            buf = ep->func->ops->buffer(ep->func, ep, len);
+    }
+
+    /* The packet descriptors live after the inline data, if any. */
+    room = buf || take ? 0 : (len + 3) & ~(size_t) 3;
+    urb = malloc(sizeof(*urb) + room + packets * sizeof(*urb->iso));
+    if (!urb)
+        return ENOMEM;
+
+    memset(urb, 0, sizeof(*urb));
+    urb->file = -1;
+    urb->dev = dev;
+    urb->ep = ep;
+    urb->buf = buf ? buf : urb->data;
+    urb->iso = (struct usbip_iso_packet_descriptor *) (urb->data + room);
+    urb->packets = packets;
+    urb->dir = hdr->direction;
+    urb->seqnum = hdr->seqnum;
+    urb->flags = hdr->cmd.submit.transfer_flags;
+    urb->interval = hdr->cmd.submit.interval;
+    urb->start_frame = hdr->cmd.submit.start_frame;
+    urb->setup = hdr->cmd.submit.setup;
+    urb->length = len;
+
+    if (take) {
+        urb->buf = NULL;
+        if (ep->func->ops->recv(ep->func, urb, dev->fd) != 0) {
+            free(urb);
+            return EPROTO;
+        }
+    } else if (urb->dir == USBIP_DIR_OUT && len > 0) {
+        if (!usb_recv(dev->fd, urb->buf, len)) {
+            free(urb);
+            return EPROTO;
+        }
+
+        if (usb_verbose)
+            usbip_dump_data(urb->buf, len, stderr);
+    }
+
+    if (packets > 0) {
+        size_t n = packets * sizeof(*urb->iso);
+
+        if (!usb_recv(dev->fd, urb->iso, n)) {
+            free(urb);
+            return EPROTO;
+        }
+
+        usbip_iso_ntoh(urb->iso, packets);
+        for (uint32_t i = 0; i < packets; i++) {
+            struct usbip_iso_packet_descriptor *p = &urb->iso[i];
+
+            /* Models fill and read packets in place: each must fit. */
+            if (p->offset > len || p->length > len - p->offset) {
+                free(urb);
+                return EPROTO;
+            }
+
+            p->actual_length = 0;
+            p->status = 0;
+        }
+
+        if (usb_verbose)
+            usbip_dump_iso(urb->iso, packets, stderr);
+    }
+
+    TAILQ_INSERT_TAIL(&dev->inflight, urb, inflight);
+
+    if (hdr->endpoint == 0) {
+        usb_control(dev, urb);
+    } else if (!ep->desc || !ep->func || ep->halted) {
+        usb_urb_done(urb, EPIPE);
+    } else {
+        urb->func = ep->func;
+        ep->func->ops->submit(ep->func, urb);
+    }
+
+    return 0;
+}
+
+static int
+usb_unlink(struct usb_device *dev, const struct usbip *hdr)
+{
+    struct usbip ret = {
+        .command = USBIP_RET_UNLINK,
+        .seqnum = hdr->seqnum,
+    };
+    struct iovec iov = { &ret, sizeof(ret) };
+    struct urb *urb;
+
+    TAILQ_FOREACH(urb, &dev->inflight, inflight) {
+        if (urb->seqnum == hdr->cmd.unlink.seqnum && !urb->unlinked)
+            break;
+    }
+
+    if (urb) {
+        ret.ret.unlink.status = -ECONNRESET;
+        urb->unlinked = true;
+
+        if (urb->queued)
+            usb_urb_done(urb, ECONNRESET);
+        else if (urb->func && urb->func->ops->cancel)
+            urb->func->ops->cancel(urb->func, urb);
+    }
+
+    if (usb_verbose)
+        usbip_dump(&ret, stderr);
+
+    usbip_hton(&ret);
+    return usb_send(dev, &iov, 1, false);
+}
+
+static void
+usb_device_stop(struct usb_device *dev)
+{
+    struct urb *urb;
+
+    loop_del(&dev->watch);
+    close(dev->fd);
+    dev->fd = -1;
+
+    TAILQ_FOREACH(urb, &dev->inflight, inflight)
+        urb->unlinked = true;
+
+    usb_unconfigure(dev);
+}
+
+static void
+usb_device_close(struct usb_device *dev)
+{
+    usb_device_stop(dev);
+
+    if (dev->closed)
+        dev->closed(dev);
+}
+
+static void
+usb_device_rx(struct loop_watch *w, uint32_t events)
+{
+    struct usb_device *dev = container_of(w, struct usb_device, watch);
+    struct usbip hdr;
+    int r = EPROTO;
+
+    (void) events;
+
+    if (!usb_recv(dev->fd, &hdr, sizeof(hdr)) ||
+        usbip_ntoh(&hdr) != 0) {
+        usb_device_close(dev);
+        return;
+    }
+
+    if (usb_verbose)
+        usbip_dump(&hdr, stderr);
+
+    switch (hdr.command) {
+    case USBIP_CMD_SUBMIT:
+        r = usb_submit(dev, &hdr);
+        break;
+
+    case USBIP_CMD_UNLINK:
+        r = usb_unlink(dev, &hdr);
+        break;
+    }
 
-    r = socketpair(AF_UNIX, SOCK_DGRAM, 0, socks);
     if (r != 0)
-        return EXIT_FAILURE;
+        usb_device_close(dev);
+}
+
+int
+usb_device_start(struct usb_device *dev, int fd)
+{
+    dev->fd = fd;
+    dev->watch.fd = fd;
+    dev->watch.func = usb_device_rx;
+    return loop_add(&dev->watch, EPOLLIN);
+}
 
-    file = fopen("/sys/devices/platform/vhci_hcd/attach", "w");
-    if (!file)
-        return EXIT_FAILURE;
+void
+usb_device_free(struct usb_device *dev)
+{
+    struct urb *urb;
+
+    if (!dev)
+        return;
 
-    fprintf(file, "%u %d %u %u", 0, socks[0], 2, USB_SPEED_FULL);
-    fclose(file);
+    if (dev->fd >= 0)
+        usb_device_stop(dev);
 
-    close(socks[0]);
+    for (struct usb_function *f = dev->func, *next; f; f = next) {
+        next = f->next;
+        if (f->ops->destroy)
+            f->ops->destroy(f);
+    }
 
-    recv(socks[1], &usbip, sizeof(usbip), 0);
-    usbip_ntoh(&usbip);
-    usbip_dump(&usbip, stderr);
+    while ((urb = TAILQ_FIRST(&dev->inflight))) {
+        TAILQ_REMOVE(&dev->inflight, urb, inflight);
+        free(urb);
+    }
+
+    free(dev->device.buf);
+    free(dev->qualifier.buf);
+    free(dev->bos.buf);
+
+    for (size_t i = 0; i < USB_MAX_CONFIGS; i++)
+        free(dev->config[i].buf);
+
+    for (size_t i = 0; i < USB_MAX_STRINGS; i++) {
+        if (dev->strings[i])
+            free(dev->strings[i]->buf);
+        free(dev->strings[i]);
+    }
 
-    close(socks[1]);
-    return EXIT_SUCCESS;
+    free(dev);
 }
@@ -0,0 +1,391 @@
+#pragma once
+
+#include "loop.h"
+#include "usbip.h"
+
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum usb_device_speed {
+    USB_SPEED_UNKNOWN = 0,               /* enumerating */
+    USB_SPEED_LOW, USB_SPEED_FULL,       /* usb 1.1 */
+    USB_SPEED_HIGH,                      /* usb 2.0 */
+    USB_SPEED_WIRELESS,                  /* wireless (usb 2.5) */
+    USB_SPEED_SUPER,                     /* usb 3.0 */
+    USB_SPEED_SUPER_PLUS,                /* usb 3.1 */
+};
+
+enum {
+    USB_TYPE_STANDARD = 0,
+    USB_TYPE_CLASS = 1,
+    USB_TYPE_VENDOR = 2,
+};
+
+enum {
+    USB_RECIP_DEVICE = 0,
+    USB_RECIP_INTERFACE = 1,
+    USB_RECIP_ENDPOINT = 2,
+    USB_RECIP_OTHER = 3,
+};
+
+enum {
+    USB_REQ_GET_STATUS = 0,
+    USB_REQ_CLEAR_FEATURE = 1,
+    USB_REQ_SET_FEATURE = 3,
+    USB_REQ_SET_ADDRESS = 5,
+    USB_REQ_GET_DESCRIPTOR = 6,
+    USB_REQ_SET_DESCRIPTOR = 7,
+    USB_REQ_GET_CONFIGURATION = 8,
+    USB_REQ_SET_CONFIGURATION = 9,
+    USB_REQ_GET_INTERFACE = 10,
+    USB_REQ_SET_INTERFACE = 11,
+    USB_REQ_SYNCH_FRAME = 12,
+    USB_REQ_SET_SEL = 48,
+    USB_REQ_SET_ISOCH_DELAY = 49,
+};
+
+enum {
+    USB_FEATURE_ENDPOINT_HALT = 0,
+    USB_FEATURE_FUNCTION_SUSPEND = 0,    /* interface */
+    USB_FEATURE_REMOTE_WAKEUP = 1,
+    USB_FEATURE_U1_ENABLE = 48,
+    USB_FEATURE_U2_ENABLE = 49,
+    USB_FEATURE_LTM_ENABLE = 50,
+};
+
+enum {
+    USB_DT_DEVICE = 1,
+    USB_DT_CONFIG = 2,
+    USB_DT_STRING = 3,
+    USB_DT_INTERFACE = 4,
+    USB_DT_ENDPOINT = 5,
+    USB_DT_DEVICE_QUALIFIER = 6,
+    USB_DT_OTHER_SPEED_CONFIG = 7,
+    USB_DT_INTERFACE_ASSOCIATION = 11,
+    USB_DT_BOS = 15,
+    USB_DT_DEVICE_CAPABILITY = 16,
+    USB_DT_SS_ENDPOINT_COMP = 48,
+};
+
+enum {
+    USB_ENDPOINT_XFER_CONTROL = 0,
+    USB_ENDPOINT_XFER_ISOC = 1,
+    USB_ENDPOINT_XFER_BULK = 2,
+    USB_ENDPOINT_XFER_INT = 3,
+};
+
+#define USB_ENDPOINT_DIR_IN 0x80
+
+/* pid.codes test vendor ID, used by all built-in models. */
+#define USBEMU_VID 0x1209
+
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define USB_CONFIG_ATT_ONE 0x80
+#define USB_CONFIG_ATT_SELFPOWER 0x40
+#define USB_CONFIG_ATT_WAKEUP 0x20
+
+#define USB_MAX_CONFIGS 8
+#define USB_MAX_INTERFACES 32
+#define USB_MAX_ENDPOINTS 16
+#define USB_MAX_STRINGS 256
+
+/* The largest burst a SuperSpeed endpoint may announce, in packets. */
+#define USB_SS_MAX_BURST 16
+
+struct usb_device_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} __attribute__((packed));
+
+struct usb_config_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+} __attribute__((packed));
+
+struct usb_interface_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} __attribute__((packed));
+
+struct usb_endpoint_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} __attribute__((packed));
+
+struct usb_ss_ep_comp_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bMaxBurst;                   /* packets per burst, less one */
+    uint8_t bmAttributes;
+    uint16_t wBytesPerInterval;
+} __attribute__((packed));
+
+struct usb_bos_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t bNumDeviceCaps;
+} __attribute__((packed));
+
+struct usb_interface_assoc_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bFirstInterface;
+    uint8_t bInterfaceCount;
+    uint8_t bFunctionClass;
+    uint8_t bFunctionSubClass;
+    uint8_t bFunctionProtocol;
+    uint8_t iFunction;
+} __attribute__((packed));
+
+/* A pre-serialized descriptor, served to the host verbatim. */
+struct usb_desc {
+    uint8_t *buf;
+    size_t len;
+};
+
+struct urb;
+struct usb_device;
+struct usb_function;
+
+TAILQ_HEAD(urb_queue, urb);
+
+struct urb {
+    TAILQ_ENTRY(urb) entry;              /* endpoint or function queue */
+    TAILQ_ENTRY(urb) inflight;           /* device in-flight list */
+    struct usb_device *dev;
+    struct usb_ep *ep;
+    struct usb_function *func;           /* owner, once dispatched */
+    void *priv;                          /* owned by the function */
+
+    uint32_t seqnum;
+    uint8_t dir;                         /* USBIP_DIR_* */
+    uint32_t flags;
+    uint32_t interval;
+    uint32_t start_frame;
+    struct usbip_submit_setup setup;
+
+    uint32_t length;                     /* transfer_buffer_length */
+    uint32_t actual;                     /* bytes transferred */
+    bool queued;                         /* on ep->queue */
+    bool unlinked;                       /* cancelled by the host */
+
+    /*
+     * IN data is sent from iov when iovcnt > 0, otherwise from buf. A file
+     * other than -1 overrides both: the data is then spliced to the socket
+     * from file_off on, never passing through memory of ours.
+     */
+    struct iovec iov[4];
+    int iovcnt;
+    int file;
+    uint64_t file_off;
+
+    /*
+     * Isochronous packets, as the host laid them out in buf. The function
+     * fills in actual_length and status of each; the core derives actual
+     * and error_count from them and packs IN data on the way out. An iov
+     * supplied for an isochronous IN URB must already be packed.
+     */
+    struct usbip_iso_packet_descriptor *iso;
+    uint32_t packets;
+    uint32_t error_count;
+
+    uint8_t *buf;                        /* data[], or the function's own */
+    uint8_t data[];
+};
+
+struct usb_ep {
+    struct urb_queue queue;              /* URBs parked by the function */
+    struct usb_function *func;
+    const struct usb_endpoint_descriptor *desc;
+    uint8_t intf;
+    uint8_t num;                         /* as the function numbers it */
+    bool halted;
+};
+
+/*
+ * A device model. All callbacks are optional except submit.
+ *
+ * setup() handles ep0 requests the core does not: class and vendor requests
+ * and standard requests addressed to an interface. It returns 0 after
+ * setting urb->actual, EINPROGRESS if it will call usb_urb_done() later or
+ * an errno to stall.
+ *
+ * submit() takes ownership of a non-control URB. The function completes it
+ * with usb_urb_done(), possibly after parking it with usb_ep_queue().
+ *
+ * cancel() is called when the host unlinks a URB the function holds outside
+ * of an endpoint queue. The function must still call usb_urb_done().
+ *
+ * buffer() may supply the memory backing the payload of a len byte URB
+ * about to arrive on a non-control endpoint, so OUT data is received and IN
+ * data sent in place. It must stay valid until the URB completes. NULL
+ * gives the URB its own buffer.
+ *
+ * set_alt() and setup() see interface and endpoint numbers as the function
+ * laid them out in its own descriptors, whatever they became in a composite
+ * device; the function's endpoints are found with usb_function_ep().
+ *
+ * recv() takes the payload of a non-isochronous OUT URB off the device
+ * socket fd itself, before submit(), for functions that move it elsewhere
+ * without looking at it. It must consume exactly urb->length bytes and set
+ * urb->actual; an error drops the connection. urb->buf is NULL.
+ */
+struct usb_function_ops {
+    int (*setup)(struct usb_function *f, struct urb *urb);
+    void (*submit)(struct usb_function *f, struct urb *urb);
+    void (*cancel)(struct usb_function *f, struct urb *urb);
+    void *(*buffer)(struct usb_function *f, struct usb_ep *ep, uint32_t len);
+    int (*recv)(struct usb_function *f, struct urb *urb, int fd);
+    void (*set_alt)(struct usb_function *f, uint8_t intf, uint8_t alt);
+    void (*clear_halt)(struct usb_function *f, struct usb_ep *ep);
+    void (*disable)(struct usb_function *f);
+    void (*destroy)(struct usb_function *f);
+};
+
+struct usb_function {
+    const struct usb_function_ops *ops;
+    struct usb_device *dev;
+    struct usb_function *next;           /* in a composite device */
+
+    /* Where its interfaces and endpoints landed in the device. */
+    uint8_t intf;                        /* first interface */
+    uint8_t intfs;
+    uint8_t ep[2][USB_MAX_ENDPOINTS];    /* [USBIP_DIR_*][own number] */
+};
+
+struct usb_device {
+    enum usb_device_speed speed;
+    uint32_t devid;
+    int port;
+    int fd;
+    struct loop_watch watch;
+
+    struct usb_desc device;
+    struct usb_desc config[USB_MAX_CONFIGS];
+    struct usb_desc qualifier;
+    struct usb_desc bos;
+    struct usb_desc *strings[USB_MAX_STRINGS];
+
+    const struct usb_config_descriptor *active;
+    uint8_t alt[USB_MAX_INTERFACES];
+    struct usb_function *intf[USB_MAX_INTERFACES];
+    struct usb_ep ep[2][USB_MAX_ENDPOINTS];   /* [USBIP_DIR_*][number] */
+    bool remote_wakeup;
+
+    /* SuperSpeed link power management, as the host last set it. */
+    bool u1_enable;
+    bool u2_enable;
+    bool ltm_enable;
+    uint8_t u1_sel, u1_pel;              /* us */
+    uint16_t u2_sel, u2_pel;             /* us */
+    uint16_t isoch_delay;                /* ns */
+
+    struct usb_function *func;           /* the first, if composite */
+    struct urb_queue inflight;
+    void (*closed)(struct usb_device *dev);
+};
+
+struct usb_model {
+    const char *name;
+    int (*create)(struct usb_device *dev, char *opts);
+};
+
+extern bool usb_verbose;
+
+struct usb_device *
+usb_device_new(void);
+
+void
+usb_device_free(struct usb_device *dev);
+
+int
+usb_device_desc(struct usb_device *dev, uint8_t type, uint8_t index,
+                const void *buf, size_t len);
+
+int
+usb_device_string(struct usb_device *dev, uint8_t index, const char *utf8);
+
+void
+usb_device_function(struct usb_device *dev, struct usb_function *f,
+                    const struct usb_function_ops *ops);
+
+int
+usb_device_start(struct usb_device *dev, int fd);
+
+/* A function's endpoint, by the number in its own descriptors. */
+static inline struct usb_ep *
+usb_function_ep(struct usb_function *f, uint8_t dir, uint8_t num)
+{
+    return &f->dev->ep[dir][f->ep[dir][num]];
+}
+
+void
+usb_ep_queue(struct urb *urb);
+
+struct urb *
+usb_ep_dequeue(struct usb_ep *ep);
+
+void
+usb_ep_flush(struct usb_ep *ep, int err);
+
+void
+usb_urb_done(struct urb *urb, int err);
+
+int
+usb_urb_blob(struct urb *urb, const struct usb_desc *desc);
+
+int
+usb_speed_parse(const char *str, enum usb_device_speed *speed);
+
+const struct usb_interface_descriptor *
+usb_config_interface(const struct usb_config_descriptor *cfg,
+                     uint8_t intf, uint8_t alt);
+
+extern const struct usb_model usb_model_clone;
+extern const struct usb_model usb_model_hid;
+extern const struct usb_model usb_model_acm;
+extern const struct usb_model usb_model_msc;
+extern const struct usb_model usb_model_uas;
+extern const struct usb_model usb_model_cdrom;
+extern const struct usb_model usb_model_ncm;
+extern const struct usb_model usb_model_uac;
+extern const struct usb_model usb_model_uvc;
+extern const struct usb_model usb_model_ccid;
+extern const struct usb_model usb_model_printer;
+extern const struct usb_model usb_model_zero;
@@ -0,0 +1,239 @@
+#include "usbip.h"
+
+#include <endian.h>
+#include <errno.h>
+
+static const char *
+usbip_setup_dir_str(uint8_t rt)
+{
+    return SETUP_DIR(rt) ? "D2H" : "H2D";
+}
+
+static const char *
+usbip_setup_typ_str(uint8_t rt)
+{
+    switch (SETUP_TYP(rt)) {
+    case 0:  return "standard";
+    case 1:  return "class";
+    case 2:  return "vendor";
+    default: return "<reserved>";
+    }
+}
+
+static const char *
+usbip_setup_rcp_str(uint8_t rt)
+{
+    switch (SETUP_RCP(rt)) {
+    case 0:  return "device";
+    case 1:  return "interface";
+    case 2:  return "endpoint";
+    case 3:  return "other";
+    default: return "<reserved>";
+    }
+}
+
+static const char *
+usbip_setup_req_str(uint8_t req)
+{
+    switch (req) {
+    case 0:  return "GET_STATUS";
+    case 1:  return "CLEAR_FEATURE";
+    case 3:  return "SET_FEATURE";
+    case 5:  return "SET_ADDRESS";
+    case 6:  return "GET_DESCRIPTOR";
+    case 7:  return "SET_DESCRIPTOR";
+    case 8:  return "GET_CONFIGURATION";
+    case 9:  return "SET_CONFIGURATION";
+    case 10: return "GET_INTERFACE";
+    case 11: return "SET_INTERFACE";
+    case 12: return "SYNCH_FRAME";
+    default: return "<reserved>";
+    }
+}
+
+void
+usbip_dump(const struct usbip *u, FILE *f)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  .command = %u\n",   u->command);
+    fprintf(f, "  .seqnum = %u\n",    u->seqnum);
+    fprintf(f, "  .devid = %u\n",     u->devid);
+    fprintf(f, "  .direction = %u\n", u->direction);
+    fprintf(f, "  .endpoint = %u\n",  u->endpoint);
+
+    switch (u->command) {
+    case USBIP_CMD_SUBMIT:
+        fprintf(f, "  .cmd.submit.transfer_flags = 0x%08X\n",     u->cmd.submit.transfer_flags);
+        fprintf(f, "  .cmd.submit.transfer_buffer_length = %u\n", u->cmd.submit.transfer_buffer_length);
+        fprintf(f, "  .cmd.submit.start_frame = %u\n",            u->cmd.submit.start_frame);
+        fprintf(f, "  .cmd.submit.number_of_packets = %u\n",      u->cmd.submit.number_of_packets);
+        fprintf(f, "  .cmd.submit.interval = %u\n",               u->cmd.submit.interval);
+        fprintf(f, "  .cmd.submit.setup.direction = %s\n",        usbip_setup_dir_str(u->cmd.submit.setup.bmRequestType));
+        fprintf(f, "  .cmd.submit.setup.type = %s\n",             usbip_setup_typ_str(u->cmd.submit.setup.bmRequestType));
+        fprintf(f, "  .cmd.submit.setup.recipient = %s\n",        usbip_setup_rcp_str(u->cmd.submit.setup.bmRequestType));
+        fprintf(f, "  .cmd.submit.setup.bRequest = %s\n",         usbip_setup_req_str(u->cmd.submit.setup.bRequest));
+        fprintf(f, "  .cmd.submit.setup.wValue = %hu\n",          u->cmd.submit.setup.wValue);
+        fprintf(f, "  .cmd.submit.setup.wIndex = %hu\n",          u->cmd.submit.setup.wIndex);
+        fprintf(f, "  .cmd.submit.setup.wLength = %hu\n",         u->cmd.submit.setup.wLength);
+        break;
+
+    case USBIP_CMD_UNLINK:
+        fprintf(f, "  .cmd.unlink.seqnum = %u\n",                 u->cmd.unlink.seqnum);
+        break;
+
+    case USBIP_RET_SUBMIT:
+        fprintf(f, "  .ret.submit.status = %d\n",                 u->ret.submit.status);
+        fprintf(f, "  .ret.submit.actual_length = %u\n",          u->ret.submit.actual_length);
+        fprintf(f, "  .ret.submit.start_frame = %u\n",            u->ret.submit.start_frame);
+        fprintf(f, "  .ret.submit.number_of_packets = %u\n",      u->ret.submit.number_of_packets);
+        fprintf(f, "  .ret.submit.error_count = %u\n",            u->ret.submit.error_count);
+        fprintf(f, "  .ret.submit.setup.bmRequestType = %hhu\n",  u->ret.submit.setup.bmRequestType);
+        fprintf(f, "  .ret.submit.setup.bRequest = %hhu\n",       u->ret.submit.setup.bRequest);
+        fprintf(f, "  .ret.submit.setup.wValue = %hu\n",          u->ret.submit.setup.wValue);
+        fprintf(f, "  .ret.submit.setup.wIndex = %hu\n",          u->ret.submit.setup.wIndex);
+        fprintf(f, "  .ret.submit.setup.wLength = %hu\n",         u->ret.submit.setup.wLength);
+        break;
+
+    case USBIP_RET_UNLINK:
+        fprintf(f, "  .ret.unlink.status = %d\n", u->ret.unlink.status);
+        break;
+    }
+
+    fprintf(f, "}\n");
+}
+
+void
+usbip_dump_data(const void *data, size_t len, FILE *f)
+{
+    const uint8_t *d = data;
+
+    fprintf(f, "data[%zu] = {", len);
+    for (size_t i = 0; i < len; i++)
+        fprintf(f, "%s%02x", i % 32 == 0 ? "\n  " : "", d[i]);
+    fprintf(f, "\n}\n");
+}
+
+void
+usbip_dump_iso(const struct usbip_iso_packet_descriptor *iso, uint32_t n,
+               FILE *f)
+{
+    fprintf(f, "iso[%u] = {\n", n);
+    for (uint32_t i = 0; i < n; i++)
+        fprintf(f, "  { .offset = %u, .length = %u, .actual_length = %u, .status = %d }\n",
+                iso[i].offset, iso[i].length, iso[i].actual_length, iso[i].status);
+    fprintf(f, "}\n");
+}
+
+int
+usbip_ntoh(struct usbip *u)
+{
+    u->command = be32toh(u->command);
+    u->seqnum = be32toh(u->seqnum);
+    u->devid = be32toh(u->devid);
+    u->direction = be32toh(u->direction);
+    u->endpoint = be32toh(u->endpoint);
+
+    switch (u->command) {
+    case USBIP_CMD_SUBMIT:
+        u->cmd.submit.transfer_flags = be32toh(u->cmd.submit.transfer_flags);
+        u->cmd.submit.transfer_buffer_length = be32toh(u->cmd.submit.transfer_buffer_length);
+        u->cmd.submit.start_frame = be32toh(u->cmd.submit.start_frame);
+        u->cmd.submit.number_of_packets = be32toh(u->cmd.submit.number_of_packets);
+        u->cmd.submit.interval = be32toh(u->cmd.submit.interval);
+        u->cmd.submit.setup.wValue = le16toh(u->cmd.submit.setup.wValue);
+        u->cmd.submit.setup.wIndex = le16toh(u->cmd.submit.setup.wIndex);
+        u->cmd.submit.setup.wLength = le16toh(u->cmd.submit.setup.wLength);
+        return 0;
+
+    case USBIP_CMD_UNLINK:
+        u->cmd.unlink.seqnum = be32toh(u->cmd.unlink.seqnum);
+        return 0;
+
+    case USBIP_RET_SUBMIT:
+        u->ret.submit.status = be32toh(u->ret.submit.status);
+        u->ret.submit.actual_length = be32toh(u->ret.submit.actual_length);
+        u->ret.submit.start_frame = be32toh(u->ret.submit.start_frame);
+        u->ret.submit.number_of_packets = be32toh(u->ret.submit.number_of_packets);
+        u->ret.submit.error_count = be32toh(u->ret.submit.error_count);
+        u->ret.submit.setup.wValue = le16toh(u->ret.submit.setup.wValue);
+        u->ret.submit.setup.wIndex = le16toh(u->ret.submit.setup.wIndex);
+        u->ret.submit.setup.wLength = le16toh(u->ret.submit.setup.wLength);
+        return 0;
+
+    case USBIP_RET_UNLINK:
+        u->ret.unlink.status = be32toh(u->ret.unlink.status);
+        return 0;
+
+    default:
+        return ENOTSUP;
+    }
+}
+
+int
+usbip_hton(struct usbip *u)
+{
+    uint32_t command = u->command;
+
+    u->command = htobe32(u->command);
+    u->seqnum = htobe32(u->seqnum);
+    u->devid = htobe32(u->devid);
+    u->direction = htobe32(u->direction);
+    u->endpoint = htobe32(u->endpoint);
+
+    switch (command) {
+    case USBIP_CMD_SUBMIT:
+        u->cmd.submit.transfer_flags = htobe32(u->cmd.submit.transfer_flags);
+        u->cmd.submit.transfer_buffer_length = htobe32(u->cmd.submit.transfer_buffer_length);
+        u->cmd.submit.start_frame = htobe32(u->cmd.submit.start_frame);
+        u->cmd.submit.number_of_packets = htobe32(u->cmd.submit.number_of_packets);
+        u->cmd.submit.interval = htobe32(u->cmd.submit.interval);
+        u->cmd.submit.setup.wValue = htole16(u->cmd.submit.setup.wValue);
+        u->cmd.submit.setup.wIndex = htole16(u->cmd.submit.setup.wIndex);
+        u->cmd.submit.setup.wLength = htole16(u->cmd.submit.setup.wLength);
+        return 0;
+
+    case USBIP_CMD_UNLINK:
+        u->cmd.unlink.seqnum = htobe32(u->cmd.unlink.seqnum);
+        return 0;
+
+    case USBIP_RET_SUBMIT:
+        u->ret.submit.status = htobe32(u->ret.submit.status);
+        u->ret.submit.actual_length = htobe32(u->ret.submit.actual_length);
+        u->ret.submit.start_frame = htobe32(u->ret.submit.start_frame);
+        u->ret.submit.number_of_packets = htobe32(u->ret.submit.number_of_packets);
+        u->ret.submit.error_count = htobe32(u->ret.submit.error_count);
+        u->ret.submit.setup.wValue = htole16(u->ret.submit.setup.wValue);
+        u->ret.submit.setup.wIndex = htole16(u->ret.submit.setup.wIndex);
+        u->ret.submit.setup.wLength = htole16(u->ret.submit.setup.wLength);
+        return 0;
+
+    case USBIP_RET_UNLINK:
+        u->ret.unlink.status = htobe32(u->ret.unlink.status);
+        return 0;
+
+    default:
+        return ENOTSUP;
+    }
+}
+
+void
+usbip_iso_ntoh(struct usbip_iso_packet_descriptor *iso, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        iso[i].offset = be32toh(iso[i].offset);
+        iso[i].length = be32toh(iso[i].length);
+        iso[i].actual_length = be32toh(iso[i].actual_length);
+        iso[i].status = be32toh(iso[i].status);
+    }
+}
+
+void
+usbip_iso_hton(struct usbip_iso_packet_descriptor *iso, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        iso[i].offset = htobe32(iso[i].offset);
+        iso[i].length = htobe32(iso[i].length);
+        iso[i].actual_length = htobe32(iso[i].actual_length);
+        iso[i].status = htobe32(iso[i].status);
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+    USBIP_DIR_OUT = 0,
+    USBIP_DIR_IN = 1,
+};
+
+enum {
+    USBIP_CMD_SUBMIT = 1,
+    USBIP_CMD_UNLINK = 2,
+    USBIP_RET_SUBMIT = 3,
+    USBIP_RET_UNLINK = 4
+};
+
+enum {
+    USBIP_URB_NONE                = 0,
+    USBIP_URB_SHORT_NOT_OK        = 1 << 0,
+    USBIP_URB_ISO_ASAP            = 1 << 1,
+    USBIP_URB_NO_TRANSFER_DMA_MAP = 1 << 2,
+    USBIP_URB_NO_FSBR             = 1 << 5,
+    USBIP_URB_ZERO_PACKET         = 1 << 6,
+    USBIP_URB_NO_INTERRUPT        = 1 << 7,
+    USBIP_URB_FREE_BUFFER         = 1 << 8,
+    USBIP_URB_DIR_MASK            = 1 << 9,
+};
+
+struct usbip_submit_setup {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} __attribute__((packed));
+
+struct usbip_submit_cmd {
+    uint32_t transfer_flags;
+    uint32_t transfer_buffer_length;
+    uint32_t start_frame;
+    uint32_t number_of_packets;
+    uint32_t interval;
+    struct usbip_submit_setup setup;
+} __attribute__((packed));
+
+struct usbip_submit_ret {
+    int32_t status;
+    uint32_t actual_length;
+    uint32_t start_frame;
+    uint32_t number_of_packets;
+    uint32_t error_count;
+    struct usbip_submit_setup setup;
+} __attribute__((packed));
+
+struct usbip_unlink_cmd {
+    uint32_t seqnum;
+} __attribute__((packed));
+
+struct usbip_unlink_ret {
+    int32_t status;
+} __attribute__((packed));
+
+/* The fixed 48 byte header. Transfer data follows it on the wire. */
+struct usbip {
+    uint32_t command;
+    uint32_t seqnum;
+    uint32_t devid;
+    uint32_t direction;
+    uint32_t endpoint;
+
+    union {
+        union {
+            struct usbip_submit_cmd submit;
+            struct usbip_unlink_cmd unlink;
+        } cmd;
+
+        union {
+            struct usbip_submit_ret submit;
+            struct usbip_unlink_ret unlink;
+        } ret;
+    };
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct usbip) == 48, "usbip header must be 48 bytes");
+
+/*
+ * Trails the transfer data of isochronous CMD_SUBMIT and RET_SUBMIT, one per
+ * packet. status is a negative errno, as in the header.
+ */
+struct usbip_iso_packet_descriptor {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t actual_length;
+    int32_t status;
+} __attribute__((packed));
+
+/* vhci_hcd never queues more packets than this in one URB. */
+#define USBIP_MAX_ISO_PACKETS 1024
+
+/* A non-isochronous URB may carry either value in number_of_packets. */
+#define USBIP_NO_ISO_PACKETS 0xffffffff
+
+#define SETUP_DIR(rt) (((rt) & 0b10000000) >> 7)
+#define SETUP_TYP(rt) (((rt) & 0b01100000) >> 5)
+#define SETUP_RCP(rt) (((rt) & 0b00011111) >> 0)
+
+void
+usbip_dump(const struct usbip *u, FILE *f);
+
+void
+usbip_dump_data(const void *data, size_t len, FILE *f);
+
+int
+usbip_ntoh(struct usbip *u);
+
+int
+usbip_hton(struct usbip *u);
+
+void
+usbip_dump_iso(const struct usbip_iso_packet_descriptor *iso, uint32_t n,
+               FILE *f);
+
+void
+usbip_iso_ntoh(struct usbip_iso_packet_descriptor *iso, uint32_t n);
+
+void
+usbip_iso_hton(struct usbip_iso_packet_descriptor *iso, uint32_t n);
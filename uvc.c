@@ -0,0 +1,1007 @@
+#include "conv.h"
+#include "ring.h"
+#include "usb.h"
+#include "work.h"
+
+#include <sys/timerfd.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USB_CLASS_MISC 0xef
+#define USB_CLASS_VIDEO 0x0e
+#define UVC_SUBCLASS_VIDEOCONTROL 0x01
+#define UVC_SUBCLASS_VIDEOSTREAMING 0x02
+#define UVC_SUBCLASS_COLLECTION 0x03
+#define USB_DT_CS_INTERFACE 0x24
+
+#define USB_ENDPOINT_SYNC_ASYNC (1 << 2)
+
+#define UVC_INTF_CONTROL 0
+#define UVC_INTF_STREAMING 1
+#define UVC_EP_IN 1
+
+#define UVC_ID_CAMERA 1
+#define UVC_ID_OUTPUT 2
+
+#define UVC_CLOCK 48000000
+#define UVC_BANDS 16
+
+enum {
+    UVC_SET_CUR = 0x01,
+    UVC_GET_CUR = 0x81,
+    UVC_GET_MIN = 0x82,
+    UVC_GET_MAX = 0x83,
+    UVC_GET_RES = 0x84,
+    UVC_GET_LEN = 0x85,
+    UVC_GET_INFO = 0x86,
+    UVC_GET_DEF = 0x87,
+};
+
+enum {
+    UVC_VS_PROBE_CONTROL = 0x01,
+    UVC_VS_COMMIT_CONTROL = 0x02,
+};
+
+/* Payload header bmHeaderInfo bits. */
+#define UVC_HDR_FID (1 << 0)
+#define UVC_HDR_EOF (1 << 1)
+#define UVC_HDR_EOH (1 << 7)
+#define UVC_HDR_SIZE 2
+
+enum uvc_format {
+    UVC_MJPEG,
+    UVC_YUY2,
+};
+
+struct uvc_vc_header {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint16_t bcdUVC;
+    uint16_t wTotalLength;
+    uint32_t dwClockFrequency;
+    uint8_t bInCollection;
+    uint8_t baInterfaceNr[1];
+} __attribute__((packed));
+
+struct uvc_camera_terminal {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalID;
+    uint16_t wTerminalType;
+    uint8_t bAssocTerminal;
+    uint8_t iTerminal;
+    uint16_t wObjectiveFocalLengthMin;
+    uint16_t wObjectiveFocalLengthMax;
+    uint16_t wOcularFocalLength;
+    uint8_t bControlSize;
+    uint8_t bmControls[3];
+} __attribute__((packed));
+
+struct uvc_output_terminal {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bTerminalID;
+    uint16_t wTerminalType;
+    uint8_t bAssocTerminal;
+    uint8_t bSourceID;
+    uint8_t iTerminal;
+} __attribute__((packed));
+
+struct uvc_input_header {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bNumFormats;
+    uint16_t wTotalLength;
+    uint8_t bEndpointAddress;
+    uint8_t bmInfo;
+    uint8_t bTerminalLink;
+    uint8_t bStillCaptureMethod;
+    uint8_t bTriggerSupport;
+    uint8_t bTriggerUsage;
+    uint8_t bControlSize;
+    uint8_t bmaControls[1];
+} __attribute__((packed));
+
+struct uvc_format_mjpeg {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bFormatIndex;
+    uint8_t bNumFrameDescriptors;
+    uint8_t bmFlags;
+    uint8_t bDefaultFrameIndex;
+    uint8_t bAspectRatioX;
+    uint8_t bAspectRatioY;
+    uint8_t bmInterlaceFlags;
+    uint8_t bCopyProtect;
+} __attribute__((packed));
+
+struct uvc_format_uncompressed {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bFormatIndex;
+    uint8_t bNumFrameDescriptors;
+    uint8_t guidFormat[16];
+    uint8_t bBitsPerPixel;
+    uint8_t bDefaultFrameIndex;
+    uint8_t bAspectRatioX;
+    uint8_t bAspectRatioY;
+    uint8_t bmInterlaceFlags;
+    uint8_t bCopyProtect;
+} __attribute__((packed));
+
+struct uvc_frame {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bFrameIndex;
+    uint8_t bmCapabilities;
+    uint16_t wWidth;
+    uint16_t wHeight;
+    uint32_t dwMinBitRate;
+    uint32_t dwMaxBitRate;
+    uint32_t dwMaxVideoFrameBufferSize;
+    uint32_t dwDefaultFrameInterval;
+    uint8_t bFrameIntervalType;
+    uint32_t dwFrameInterval[1];
+} __attribute__((packed));
+
+struct uvc_color_matching {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bDescriptorSubtype;
+    uint8_t bColorPrimaries;
+    uint8_t bTransferCharacteristics;
+    uint8_t bMatrixCoefficients;
+} __attribute__((packed));
+
+/* The UVC 1.1 probe and commit control. */
+struct uvc_streaming_control {
+    uint16_t bmHint;
+    uint8_t bFormatIndex;
+    uint8_t bFrameIndex;
+    uint32_t dwFrameInterval;
+    uint16_t wKeyFrameRate;
+    uint16_t wPFrameRate;
+    uint16_t wCompQuality;
+    uint16_t wCompWindowSize;
+    uint16_t wDelay;
+    uint32_t dwMaxVideoFrameSize;
+    uint32_t dwMaxPayloadTransferSize;
+    uint32_t dwClockFrequency;
+    uint8_t bmFramingInfo;
+    uint8_t bPreferedVersion;
+    uint8_t bMinVersion;
+    uint8_t bMaxVersion;
+} __attribute__((packed));
+
+static const uint8_t uvc_guid_yuy2[16] = {
+    'Y', 'U', 'Y', '2', 0x00, 0x00, 0x10, 0x00,
+    0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71,
+};
+
+/*
+ * A camera with a single format and frame size. Frames come from a shared
+ * memory ring whose slots the producer fills in place (ring_reserve() and
+ * ring_commit()), so each frame crosses into the emulator without a copy.
+ *
+ * A frame starts every frame interval. The newest published frame wins;
+ * the one last sent stays on the ring until a newer one replaces it, so a
+ * producer that falls behind shows up as a repeated frame rather than a
+ * stall. Over bulk, a frame is a single payload: its header comes from
+ * hdr and the image is sent straight from the slot, a URB at a time, with
+ * a zero length URB when it ends on a URB boundary. Over isochronous, URBs
+ * complete in real time as in the audio model and every packet carries its
+ * own header followed by a slice of the frame.
+ *
+ * A source in another pixel format is converted to YUY2 by the worker
+ * pool before it is sent (see struct uvc_conv), so the loop thread only
+ * ever moves finished frames.
+ */
+struct uvc {
+    struct usb_function func;
+    struct uvc_streaming_control ctrl;
+
+    char *name;
+    struct ring_reader *ring;
+    struct loop_watch bell;
+    struct loop_watch timer;
+    struct uvc_conv *conv;               /* NULL if the source is YUY2 */
+    uint32_t fsize;                      /* bytes per frame sent */
+
+    bool iso;
+    uint64_t interval;                   /* ns per frame */
+
+    const uint8_t *frame;                /* being sent, in the ring */
+    uint32_t flen;
+    uint32_t pos;
+    bool started;                        /* header sent */
+    bool zlp;                            /* ended on a URB boundary */
+    uint8_t fid;
+    uint8_t hdr[UVC_HDR_SIZE];
+
+    uint64_t next;                       /* ns, the next frame is due */
+    uint64_t clock;                      /* ns, end of the last packet served */
+};
+
+/*
+ * Conversion of the newest source frame into dst, split into bands run on
+ * the worker pool. Sending the same frame again costs nothing, and since
+ * dst keeps the last image, a band whose source bytes hash the same as
+ * the last time it was converted is skipped: a static scene or overlay is
+ * converted once. The source slot stays on the ring until the job is done.
+ */
+struct uvc_conv {
+    struct work work;
+    struct uvc *v;                       /* NULL once the camera is gone */
+
+    enum conv_format format;
+    uint32_t width;
+    uint32_t height;
+    const uint8_t *src;
+    uint8_t *dst;
+    uint32_t tail;                       /* ring position of src */
+    bool busy;
+    bool ready;                          /* dst holds the frame at tail */
+
+    uint64_t hash[UVC_BANDS];
+    bool known[UVC_BANDS];
+};
+
+static void
+uvc_pump(struct uvc *v);
+
+static uint64_t
+uvc_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* urb->interval is in (micro)frames, as the host computed it. */
+static uint64_t
+uvc_period(struct uvc *v, const struct urb *urb)
+{
+    uint64_t unit = v->func.dev->speed >= USB_SPEED_HIGH ? 125000 : 1000000;
+    return (urb->interval ? urb->interval : 1) * unit;
+}
+
+static void
+uvc_stop(struct uvc *v)
+{
+    v->frame = NULL;
+    v->zlp = false;
+    v->next = 0;
+    v->clock = 0;
+}
+
+/* Rows of band i; even, so NV12 bands do not split a chroma row. */
+static void
+uvc_band_rows(const struct uvc_conv *c, unsigned int i, uint32_t *y0,
+              uint32_t *y1)
+{
+    *y0 = (uint32_t) ((uint64_t) c->height * i / UVC_BANDS) & ~1u;
+    *y1 = i + 1 == UVC_BANDS ? c->height
+        : (uint32_t) ((uint64_t) c->height * (i + 1) / UVC_BANDS) & ~1u;
+}
+
+static void
+uvc_band(struct work *w, unsigned int i)
+{
+    struct uvc_conv *c = container_of(w, struct uvc_conv, work);
+    uint32_t y0, y1;
+    uint64_t h;
+
+    uvc_band_rows(c, i, &y0, &y1);
+    h = conv_hash(c->format, c->src, c->width, c->height, y0, y1);
+    if (c->known[i] && c->hash[i] == h)
+        return;
+
+    conv_yuy2(c->format, c->src, c->dst, c->width, c->height, y0, y1);
+    c->hash[i] = h;
+    c->known[i] = true;
+}
+
+static void
+uvc_converted(struct work *w)
+{
+    struct uvc_conv *c = container_of(w, struct uvc_conv, work);
+
+    c->busy = false;
+    if (!c->v) {
+        free(c->dst);
+        free(c);
+        return;
+    }
+
+    c->ready = true;
+    uvc_pump(c->v);
+}
+
+/* The converted frame, or NULL while the workers are at it. */
+static const uint8_t *
+uvc_convert(struct uvc *v, const uint8_t *f, uint32_t len)
+{
+    struct uvc_conv *c = v->conv;
+    uint32_t tail = ring_tail(v->ring);
+
+    if (c->ready && c->tail == tail)
+        return c->dst;
+
+    c->tail = tail;
+    c->ready = true;
+
+    /* A short frame repeats the last image. */
+    if (len < conv_size(c->format, c->width, c->height))
+        return c->dst;
+
+    c->src = f;
+    if (work_queue(&c->work) != 0) {
+        for (unsigned int i = 0; i < UVC_BANDS; i++)
+            uvc_band(&c->work, i);
+        return c->dst;
+    }
+
+    c->busy = true;
+    c->ready = false;
+    return NULL;
+}
+
+/* Starts the next frame if one is due at now. */
+static bool
+uvc_frame(struct uvc *v, uint64_t now)
+{
+    const uint8_t *f;
+    uint32_t len;
+
+    if (now < v->next || (v->conv && v->conv->busy))
+        return false;
+
+    while (ring_count(v->ring) > 1)
+        ring_pop(v->ring);
+
+    f = ring_peek(v->ring, &len);
+    if (!f)
+        return false;
+
+    if (v->conv) {
+        f = uvc_convert(v, f, len);
+        if (!f)
+            return false;
+        len = v->fsize;
+    }
+
+    v->frame = f;
+    v->flen = len;
+    v->pos = 0;
+    v->started = false;
+    v->fid ^= UVC_HDR_FID;
+    v->next = v->next + v->interval > now ? v->next + v->interval
+                                          : now + v->interval;
+    return true;
+}
+
+/* One bulk URB of the current frame's payload, straight from the slot. */
+static void
+uvc_bulk(struct uvc *v, struct urb *urb)
+{
+    uint32_t room = urb->length, n;
+
+    urb->actual = 0;
+    if (v->zlp) {
+        v->zlp = false;
+        v->frame = NULL;
+        return;
+    }
+
+    if (!v->started) {
+        if (room < UVC_HDR_SIZE)
+            return;
+
+        v->hdr[0] = UVC_HDR_SIZE;
+        v->hdr[1] = UVC_HDR_EOH | UVC_HDR_EOF | v->fid;
+        urb->iov[urb->iovcnt++] = (struct iovec) { v->hdr, UVC_HDR_SIZE };
+        urb->actual = UVC_HDR_SIZE;
+        room -= UVC_HDR_SIZE;
+        v->started = true;
+    }
+
+    n = v->flen - v->pos < room ? v->flen - v->pos : room;
+    if (n > 0)
+        urb->iov[urb->iovcnt++] = (struct iovec) { (void *) (v->frame + v->pos), n };
+    urb->actual += n;
+    v->pos += n;
+
+    if (v->pos == v->flen) {
+        if (urb->actual == urb->length)
+            v->zlp = true;
+        else
+            v->frame = NULL;
+    }
+}
+
+/* Fills the packets of an isochronous URB that began at start. */
+static void
+uvc_iso(struct uvc *v, struct urb *urb, uint64_t start)
+{
+    uint64_t period = uvc_period(v, urb);
+
+    for (uint32_t i = 0; i < urb->packets; i++) {
+        struct usbip_iso_packet_descriptor *p = &urb->iso[i];
+        uint8_t *data = urb->buf + p->offset;
+        uint32_t n;
+
+        if ((!v->frame && !uvc_frame(v, start + i * period)) ||
+            p->length <= UVC_HDR_SIZE)
+            continue;
+
+        n = p->length - UVC_HDR_SIZE;
+        if (n > v->flen - v->pos)
+            n = v->flen - v->pos;
+
+        memcpy(data + UVC_HDR_SIZE, v->frame + v->pos, n);
+        v->pos += n;
+
+        data[0] = UVC_HDR_SIZE;
+        data[1] = UVC_HDR_EOH | v->fid;
+        if (v->pos == v->flen) {
+            data[1] |= UVC_HDR_EOF;
+            v->frame = NULL;
+        }
+
+        p->actual_length = UVC_HDR_SIZE + n;
+    }
+}
+
+static void
+uvc_arm(struct uvc *v, uint64_t when)
+{
+    struct itimerspec its = {
+        .it_value.tv_sec = when / 1000000000,
+        .it_value.tv_nsec = when % 1000000000,
+    };
+
+    timerfd_settime(v->timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+uvc_pump(struct uvc *v)
+{
+    struct usb_ep *ep = usb_function_ep(&v->func, USBIP_DIR_IN, UVC_EP_IN);
+    uint64_t now = uvc_now();
+    struct urb *urb;
+
+    while ((urb = TAILQ_FIRST(&ep->queue))) {
+        if (v->iso) {
+            uint64_t start = v->clock;
+            uint64_t due = start + uvc_period(v, urb) * urb->packets;
+
+            if (due > now) {
+                uvc_arm(v, due);
+                return;
+            }
+
+            v->clock = due;
+            urb->start_frame = (start / 1000000) & 0x7ff;
+            uvc_iso(v, urb, start);
+        } else {
+            if (!v->frame && !uvc_frame(v, now)) {
+                /* A finished conversion pumps again. */
+                if (now < v->next)
+                    uvc_arm(v, v->next);
+                else if (!(v->conv && v->conv->busy) && ring_wait(v->ring))
+                    continue;
+                return;
+            }
+
+            uvc_bulk(v, urb);
+        }
+
+        usb_urb_done(urb, 0);
+    }
+
+    ring_unwait(v->ring);
+    uvc_arm(v, 0);
+}
+
+static void
+uvc_bell(struct loop_watch *w, uint32_t events)
+{
+    struct uvc *v = container_of(w, struct uvc, bell);
+    uint8_t buf[64];
+
+    (void) events;
+
+    while (read(w->fd, buf, sizeof(buf)) > 0)
+        continue;
+
+    uvc_pump(v);
+}
+
+static void
+uvc_timer(struct loop_watch *w, uint32_t events)
+{
+    struct uvc *v = container_of(w, struct uvc, timer);
+    uint64_t expirations;
+
+    (void) events;
+
+    if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    uvc_pump(v);
+}
+
+/*
+ * Probe and commit. There is one format, one frame size and one interval,
+ * so whatever the host proposes, the answer is the same.
+ */
+static int
+uvc_setup(struct usb_function *f, struct urb *urb)
+{
+    struct uvc *v = (struct uvc *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+    uint8_t cs = s->wValue >> 8;
+    uint16_t len;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_CLASS ||
+        SETUP_RCP(s->bmRequestType) != USB_RECIP_INTERFACE ||
+        (s->wIndex & 0xff) != UVC_INTF_STREAMING ||
+        (cs != UVC_VS_PROBE_CONTROL && cs != UVC_VS_COMMIT_CONTROL))
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case UVC_SET_CUR:
+        urb->actual = urb->length;
+        return 0;
+
+    case UVC_GET_CUR:
+    case UVC_GET_MIN:
+    case UVC_GET_MAX:
+    case UVC_GET_DEF:
+        urb->actual = sizeof(v->ctrl) < urb->length ? sizeof(v->ctrl) : urb->length;
+        memcpy(urb->buf, &v->ctrl, urb->actual);
+        return 0;
+
+    case UVC_GET_LEN:
+        if (urb->length < 2)
+            return EPIPE;
+        len = htole16(sizeof(v->ctrl));
+        memcpy(urb->buf, &len, 2);
+        urb->actual = 2;
+        return 0;
+
+    case UVC_GET_INFO:
+        if (urb->length < 1)
+            return EPIPE;
+        urb->buf[0] = 0x03;              /* supports GET and SET */
+        urb->actual = 1;
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+uvc_submit(struct usb_function *f, struct urb *urb)
+{
+    struct uvc *v = (struct uvc *) f;
+
+    if (urb->dir != USBIP_DIR_IN || (v->iso && urb->packets == 0)) {
+        usb_urb_done(urb, EINVAL);
+        return;
+    }
+
+    /* With nothing queued the schedule restarts now. */
+    if (v->iso && TAILQ_EMPTY(&urb->ep->queue)) {
+        uint64_t now = uvc_now();
+
+        if (v->clock < now)
+            v->clock = now;
+    }
+
+    usb_ep_queue(urb);
+    uvc_pump(v);
+}
+
+static void
+uvc_set_alt(struct usb_function *f, uint8_t intf, uint8_t alt)
+{
+    (void) alt;
+
+    if (intf == UVC_INTF_STREAMING)
+        uvc_stop((struct uvc *) f);
+}
+
+/* uvcvideo stops a bulk stream by clearing the halt on its endpoint. */
+static void
+uvc_clear_halt(struct usb_function *f, struct usb_ep *ep)
+{
+    (void) ep;
+
+    uvc_stop((struct uvc *) f);
+}
+
+static void
+uvc_disable(struct usb_function *f)
+{
+    uvc_stop((struct uvc *) f);
+}
+
+static void
+uvc_destroy(struct usb_function *f)
+{
+    struct uvc *v = (struct uvc *) f;
+    struct uvc_conv *c = v->conv;
+
+    /* A job in flight still reads the ring; it frees c when it is done. */
+    if (c && c->busy) {
+        work_wait(&c->work);
+        c->v = NULL;
+    } else if (c) {
+        free(c->dst);
+        free(c);
+    }
+
+    if (v->timer.fd >= 0) {
+        loop_del(&v->timer);
+        close(v->timer.fd);
+    }
+
+    if (v->ring) {
+        loop_del(&v->bell);
+        ring_destroy(v->name, v->ring, v->bell.fd);
+    }
+
+    free(v->name);
+    free(v);
+}
+
+static const struct usb_function_ops uvc_ops = {
+    .setup = uvc_setup,
+    .submit = uvc_submit,
+    .set_alt = uvc_set_alt,
+    .clear_halt = uvc_clear_halt,
+    .disable = uvc_disable,
+    .destroy = uvc_destroy,
+};
+
+static void
+uvc_put(uint8_t *buf, size_t *len, const void *desc, size_t n)
+{
+    memcpy(buf + *len, desc, n);
+    *len += n;
+}
+
+static int
+uvc_descriptors(struct uvc *v, struct usb_device *dev, enum uvc_format format,
+                uint16_t width, uint16_t height, uint32_t fps,
+                const char *serial)
+{
+    bool hs = dev->speed == USB_SPEED_HIGH;
+    uint32_t interval = 10000000 / fps;  /* 100 ns units */
+    uint64_t bits = (uint64_t) v->fsize * 8 * fps;
+    uint32_t bitrate = bits > UINT32_MAX ? UINT32_MAX : bits;
+    uint8_t buf[512];
+    size_t len = 0, vs;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0200),
+        .bDeviceClass = USB_CLASS_MISC,
+        .bDeviceSubClass = 0x02,
+        .bDeviceProtocol = 0x01,         /* interface association */
+        .bMaxPacketSize0 = 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x000a),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 1,
+    };
+    struct usb_config_descriptor config = {
+        .bLength = sizeof(config),
+        .bDescriptorType = USB_DT_CONFIG,
+        .bNumInterfaces = 2,
+        .bConfigurationValue = 1,
+        .bmAttributes = USB_CONFIG_ATT_ONE,
+        .bMaxPower = 250,
+    };
+    struct usb_interface_assoc_descriptor iad = {
+        .bLength = sizeof(iad),
+        .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+        .bFirstInterface = UVC_INTF_CONTROL,
+        .bInterfaceCount = 2,
+        .bFunctionClass = USB_CLASS_VIDEO,
+        .bFunctionSubClass = UVC_SUBCLASS_COLLECTION,
+    };
+    struct usb_interface_descriptor vc = {
+        .bLength = sizeof(vc),
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = UVC_INTF_CONTROL,
+        .bInterfaceClass = USB_CLASS_VIDEO,
+        .bInterfaceSubClass = UVC_SUBCLASS_VIDEOCONTROL,
+    };
+    struct uvc_camera_terminal camera = {
+        sizeof(camera), USB_DT_CS_INTERFACE, 0x02, UVC_ID_CAMERA,
+        htole16(0x0201), 0, 0, 0, 0, 0, 3, { 0, 0, 0 }
+    };
+    struct uvc_output_terminal output = {
+        sizeof(output), USB_DT_CS_INTERFACE, 0x03, UVC_ID_OUTPUT,
+        htole16(0x0101), 0, UVC_ID_CAMERA, 0
+    };
+    struct uvc_vc_header header = {
+        sizeof(header), USB_DT_CS_INTERFACE, 0x01, htole16(0x0110),
+        htole16(sizeof(header) + sizeof(camera) + sizeof(output)),
+        htole32(UVC_CLOCK), 1, { UVC_INTF_STREAMING }
+    };
+    struct usb_interface_descriptor vs0 = {
+        .bLength = sizeof(vs0),
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = UVC_INTF_STREAMING,
+        .bNumEndpoints = v->iso ? 0 : 1,
+        .bInterfaceClass = USB_CLASS_VIDEO,
+        .bInterfaceSubClass = UVC_SUBCLASS_VIDEOSTREAMING,
+    };
+    struct usb_interface_descriptor vs1 = vs0;
+    struct uvc_input_header input = {
+        sizeof(input), USB_DT_CS_INTERFACE, 0x01, 1, 0,
+        USB_ENDPOINT_DIR_IN | UVC_EP_IN, 0, UVC_ID_OUTPUT, 0, 0, 0, 1, { 0 }
+    };
+    struct uvc_format_mjpeg mjpeg = {
+        sizeof(mjpeg), USB_DT_CS_INTERFACE, 0x06, 1, 1, 0, 1, 0, 0, 0, 0
+    };
+    struct uvc_format_uncompressed yuy2 = {
+        sizeof(yuy2), USB_DT_CS_INTERFACE, 0x04, 1, 1, { 0 }, 16, 1, 0, 0, 0, 0
+    };
+    struct uvc_frame frame = {
+        sizeof(frame), USB_DT_CS_INTERFACE, format == UVC_MJPEG ? 0x07 : 0x05,
+        1, 0, htole16(width), htole16(height), htole32(bitrate),
+        htole32(bitrate), htole32(v->fsize), htole32(interval), 1,
+        { htole32(interval) }
+    };
+    struct uvc_color_matching color = {
+        sizeof(color), USB_DT_CS_INTERFACE, 0x0d, 1, 1, 4
+    };
+    struct usb_endpoint_descriptor ep = {
+        .bLength = sizeof(ep),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_DIR_IN | UVC_EP_IN,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = htole16(hs ? 512 : 64),
+    };
+    int r;
+
+    memcpy(yuy2.guidFormat, uvc_guid_yuy2, sizeof(uvc_guid_yuy2));
+    vs = sizeof(input) + sizeof(frame) + sizeof(color) +
+         (format == UVC_MJPEG ? sizeof(mjpeg) : sizeof(yuy2));
+    input.wTotalLength = htole16(vs);
+
+    /* Three 1024 byte transactions per microframe, or one per frame. */
+    if (v->iso) {
+        vs1.bAlternateSetting = 1;
+        vs1.bNumEndpoints = 1;
+        ep.bmAttributes = USB_ENDPOINT_XFER_ISOC | USB_ENDPOINT_SYNC_ASYNC;
+        ep.wMaxPacketSize = htole16(hs ? 1024 | 2 << 11 : 1023);
+        ep.bInterval = 1;
+    }
+
+    v->ctrl = (struct uvc_streaming_control) {
+        .bFormatIndex = 1,
+        .bFrameIndex = 1,
+        .dwFrameInterval = htole32(interval),
+        .dwMaxVideoFrameSize = htole32(v->fsize),
+        .dwMaxPayloadTransferSize = htole32(v->iso ? (hs ? 3072 : 1023)
+                                            : UVC_HDR_SIZE + v->fsize),
+        .dwClockFrequency = htole32(UVC_CLOCK),
+        .bmFramingInfo = 0x03,
+        .bPreferedVersion = 1,
+        .bMinVersion = 1,
+        .bMaxVersion = 1,
+    };
+
+    uvc_put(buf, &len, &config, sizeof(config));
+    uvc_put(buf, &len, &iad, sizeof(iad));
+    uvc_put(buf, &len, &vc, sizeof(vc));
+    uvc_put(buf, &len, &header, sizeof(header));
+    uvc_put(buf, &len, &camera, sizeof(camera));
+    uvc_put(buf, &len, &output, sizeof(output));
+    uvc_put(buf, &len, &vs0, sizeof(vs0));
+    uvc_put(buf, &len, &input, sizeof(input));
+    if (format == UVC_MJPEG)
+        uvc_put(buf, &len, &mjpeg, sizeof(mjpeg));
+    else
+        uvc_put(buf, &len, &yuy2, sizeof(yuy2));
+    uvc_put(buf, &len, &frame, sizeof(frame));
+    uvc_put(buf, &len, &color, sizeof(color));
+    if (v->iso)
+        uvc_put(buf, &len, &vs1, sizeof(vs1));
+    uvc_put(buf, &len, &ep, sizeof(ep));
+    ((struct usb_config_descriptor *) buf)->wTotalLength = htole16(len);
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = usb_device_desc(dev, USB_DT_CONFIG, 0, buf, len);
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu Camera");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+
+    return r;
+}
+
+static int
+uvc_create(struct usb_device *dev, char *opts)
+{
+    enum {
+        RING, FORMAT, SOURCE, WIDTH, HEIGHT, FPS, TRANSPORT, SLOTS, SPEED,
+        SERIAL
+    };
+    char *const tokens[] = {
+        [RING] = "ring", [FORMAT] = "format", [SOURCE] = "source",
+        [WIDTH] = "width", [HEIGHT] = "height", [FPS] = "fps",
+        [TRANSPORT] = "transport", [SLOTS] = "slots", [SPEED] = "speed",
+        [SERIAL] = "serial", NULL
+    };
+    const char *ring = NULL, *serial = NULL;
+    unsigned long width = 1920, height = 1080, fps = 30, slots = 4;
+    enum uvc_format format = UVC_MJPEG;
+    enum conv_format source = CONV_YUY2;
+    bool iso = false;
+    struct uvc *v;
+    char *value;
+    int r;
+
+    dev->speed = USB_SPEED_HIGH;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case RING:   ring = value; break;
+        case SERIAL: serial = value; break;
+
+        case FORMAT:
+            if (value && strcmp(value, "mjpeg") == 0)
+                format = UVC_MJPEG;
+            else if (value && strcmp(value, "yuy2") == 0)
+                format = UVC_YUY2;
+            else
+                return EINVAL;
+            break;
+
+        case SOURCE:
+            if (value && strcmp(value, "yuy2") == 0)
+                source = CONV_YUY2;
+            else if (value && strcmp(value, "rgb24") == 0)
+                source = CONV_RGB24;
+            else if (value && strcmp(value, "nv12") == 0)
+                source = CONV_NV12;
+            else
+                return EINVAL;
+            break;
+
+        case TRANSPORT:
+            if (value && strcmp(value, "bulk") == 0)
+                iso = false;
+            else if (value && strcmp(value, "iso") == 0)
+                iso = true;
+            else
+                return EINVAL;
+            break;
+
+        case WIDTH:
+            if (!value || (width = strtoul(value, NULL, 0)) == 0 || width > 8192)
+                return EINVAL;
+            break;
+
+        case HEIGHT:
+            if (!value || (height = strtoul(value, NULL, 0)) == 0 || height > 8192)
+                return EINVAL;
+            break;
+
+        case FPS:
+            if (!value || (fps = strtoul(value, NULL, 0)) == 0 || fps > 240)
+                return EINVAL;
+            break;
+
+        case SLOTS:
+            if (!value || (slots = strtoul(value, NULL, 0)) < 2)
+                return EINVAL;
+            break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            if (dev->speed != USB_SPEED_FULL && dev->speed != USB_SPEED_HIGH)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    /* YUY2 is two bytes a pixel; a JPEG is assumed to be no larger. */
+    if (!ring || (width & 1) != 0)
+        return EINVAL;
+
+    /* Only raw frames are converted. */
+    if (source != CONV_YUY2 &&
+        (format != UVC_YUY2 || (source == CONV_NV12 && (height & 1) != 0)))
+        return EINVAL;
+
+    v = calloc(1, sizeof(*v));
+    if (!v)
+        return ENOMEM;
+
+    v->timer.fd = -1;
+    v->bell.fd = -1;
+    v->iso = iso;
+    v->interval = 1000000000 / fps;
+    v->fsize = width * height * 2;
+    usb_device_function(dev, &v->func, &uvc_ops);
+
+    v->name = strdup(ring);
+    if (!v->name)
+        return ENOMEM;
+
+    if (source != CONV_YUY2) {
+        v->conv = calloc(1, sizeof(*v->conv));
+        if (!v->conv)
+            return ENOMEM;
+
+        *v->conv = (struct uvc_conv) {
+            .work = { .func = uvc_band, .done = uvc_converted,
+                      .tasks = UVC_BANDS },
+            .v = v,
+            .format = source,
+            .width = width,
+            .height = height,
+            .dst = calloc(1, v->fsize),
+        };
+        if (!v->conv->dst)
+            return ENOMEM;
+    }
+
+    r = ring_create(ring, conv_size(source, width, height), slots, &v->ring,
+                    &v->bell.fd);
+    if (r != 0)
+        return r;
+
+    r = uvc_descriptors(v, dev, format, width, height, fps, serial);
+    if (r != 0)
+        return r;
+
+    v->bell.func = uvc_bell;
+    r = loop_add(&v->bell, EPOLLIN);
+    if (r != 0)
+        return r;
+
+    v->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (v->timer.fd < 0)
+        return errno;
+
+    v->timer.func = uvc_timer;
+    return loop_add(&v->timer, EPOLLIN);
+}
+
+const struct usb_model usb_model_uvc = {
+    .name = "uvc",
+    .create = uvc_create,
+};
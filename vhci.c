@@ -0,0 +1,125 @@
+#include "vhci.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#define VHCI_PATH "/sys/devices/platform/vhci_hcd.0"
+
+/* VDEV_ST_NULL from the usbip uapi: the port has no device attached. */
+#define VHCI_PORT_FREE 4
+
+/*
+ * Finds a free root port of the right kind. Each status line looks like
+ * "hs  0000 004 000 00000000 000000 0-0"; SuperSpeed devices must use the
+ * "ss" half of the controller's ports.
+ */
+static int
+vhci_port_in(FILE *file, const char *hub, unsigned *port)
+{
+    char line[256];
+
+    while (fgets(line, sizeof(line), file)) {
+        unsigned prt, sta;
+        char h[3];
+
+        if (sscanf(line, "%2s %u %u", h, &prt, &sta) != 3)
+            continue;
+
+        if (strcmp(h, hub) == 0 && sta == VHCI_PORT_FREE) {
+            *port = prt;
+            return 0;
+        }
+    }
+
+    return EBUSY;
+}
+
+/*
+ * With the module's nr_hcs above one there are several controllers, all
+ * driven through vhci_hcd.0: "status" lists the ports of the first,
+ * "status.N" those of the others, numbered on from the first. Devices fill
+ * them in order, so the search starts where the last one found room.
+ */
+static int
+vhci_port(enum usb_device_speed speed, unsigned *port)
+{
+    static unsigned next;
+    const char *hub = speed >= USB_SPEED_SUPER ? "ss" : "hs";
+    bool wrapped = next == 0;
+    unsigned hc = next;
+    char path[64];
+    FILE *file;
+
+    for (;;) {
+        if (hc == 0)
+            snprintf(path, sizeof(path), VHCI_PATH "/status");
+        else
+            snprintf(path, sizeof(path), VHCI_PATH "/status.%u", hc);
+
+        file = fopen(path, "r");
+        if (!file) {
+            if (hc == 0)
+                return errno;
+            if (wrapped)
+                return EBUSY;
+            hc = 0;
+            wrapped = true;
+            continue;
+        }
+
+        if (vhci_port_in(file, hub, port) == 0) {
+            fclose(file);
+            next = hc;
+            return 0;
+        }
+
+        fclose(file);
+        hc++;
+    }
+}
+
+int
+vhci_attach(struct usb_device *dev, int fd)
+{
+    unsigned port;
+    FILE *file;
+    int r;
+
+    r = vhci_port(dev->speed, &port);
+    if (r != 0)
+        return r;
+
+    file = fopen(VHCI_PATH "/attach", "w");
+    if (!file)
+        return errno;
+
+    dev->port = port;
+    dev->devid = (1 << 16) | (port + 2);
+
+    /* vhci_hcd stops at SuperSpeed; a Gen 2 device runs at Gen 1 there. */
+    fprintf(file, "%u %d %u %u", port, fd, dev->devid,
+            dev->speed > USB_SPEED_SUPER ? USB_SPEED_SUPER : dev->speed);
+    r = fclose(file) == 0 ? 0 : errno;
+    if (r != 0)
+        dev->port = -1;
+
+    return r;
+}
+
+void
+vhci_detach(struct usb_device *dev)
+{
+    FILE *file;
+
+    if (dev->port < 0)
+        return;
+
+    file = fopen(VHCI_PATH "/detach", "w");
+    if (!file)
+        return;
+
+    fprintf(file, "%d", dev->port);
+    fclose(file);
+    dev->port = -1;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "usb.h"
+
+int
+vhci_attach(struct usb_device *dev, int fd);
+
+void
+vhci_detach(struct usb_device *dev);
@@ -0,0 +1,122 @@
+#include "work.h"
+#include "loop.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#define WORK_MAX_THREADS 16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct work *queue;
+static struct work **tail = &queue;
+static bool started;
+
+static void
+work_done(void *arg)
+{
+    struct work *w = arg;
+
+    w->done(w);
+}
+
+/* Claims the next task; a job leaves the queue with its last one. */
+static struct work *
+work_next(unsigned int *task)
+{
+    struct work *w;
+
+    pthread_mutex_lock(&lock);
+    while (!queue)
+        pthread_cond_wait(&cond, &lock);
+
+    w = queue;
+    *task = w->claimed++;
+    if (w->claimed == w->tasks) {
+        queue = w->next;
+        if (!queue)
+            tail = &queue;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return w;
+}
+
+static void *
+work_thread(void *arg)
+{
+    (void) arg;
+
+    for (;;) {
+        unsigned int task;
+        struct work *w = work_next(&task);
+
+        w->func(w, task);
+
+        /* The last task to return hands the job back to the loop. */
+        if (atomic_fetch_add(&w->finished, 1) + 1 == w->tasks)
+            loop_defer(work_done, w);
+    }
+
+    return NULL;
+}
+
+static int
+work_start(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+    pthread_t t;
+    long n = 0;
+
+    if (cpus < 1)
+        cpus = 1;
+    if (cpus > WORK_MAX_THREADS)
+        cpus = WORK_MAX_THREADS;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (n < cpus && pthread_create(&t, &attr, work_thread, NULL) == 0)
+        n++;
+
+    pthread_attr_destroy(&attr);
+    return n > 0 ? 0 : EAGAIN;
+}
+
+int
+work_queue(struct work *w)
+{
+    int r = 0;
+
+    if (w->tasks == 0)
+        return EINVAL;
+
+    w->claimed = 0;
+    atomic_store(&w->finished, 0);
+    w->next = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (!started) {
+        r = work_start();
+        started = r == 0;
+    }
+    if (r == 0) {
+        *tail = w;
+        tail = &w->next;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return r;
+}
+
+void
+work_wait(struct work *w)
+{
+    while (atomic_load(&w->finished) < w->tasks)
+        sched_yield();
+}
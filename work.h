@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdatomic.h>
+
+/*
+ * A pool of worker threads for CPU bound jobs that must stay off the event
+ * loop. A job is split into tasks that run in parallel, func(w, i) for i
+ * in [0, tasks); once all of them have returned, done(w) is called on the
+ * loop thread. The pool is shared by every device and is started by the
+ * first job queued.
+ */
+struct work {
+    void (*func)(struct work *w, unsigned int task);
+    void (*done)(struct work *w);
+    unsigned int tasks;
+
+    struct work *next;                   /* pool queue */
+    unsigned int claimed;
+    _Atomic unsigned int finished;
+};
+
+int
+work_queue(struct work *w);
+
+/* Blocks until the tasks of w have returned; done(w) may still be pending. */
+void
+work_wait(struct work *w);
@@ -0,0 +1,583 @@
+#include "usb.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USB_CLASS_VENDOR_SPEC 0xff
+
+#define ZERO_CONFIG_SOURCESINK 1
+#define ZERO_CONFIG_LOOPBACK 2
+
+#define ZERO_EP_BULK 1
+#define ZERO_EP_ISO 2
+
+/* Past this, a source URB is filled in its own buffer. */
+#define ZERO_MAX_PATTERN (64u << 20)
+#define ZERO_MAX_CTRL 4096
+
+/* The vendor requests the usbtest driver's control tests use. */
+enum {
+    ZERO_REQ_WRITE = 0x5b,
+    ZERO_REQ_READ = 0x5c,
+};
+
+enum zero_pattern {
+    ZERO_ZEROS,
+    ZERO_MOD63,                          /* (offset % maxpacket) % 63 */
+    ZERO_NONE,                           /* zeros, unchecked */
+};
+
+/* A loopback payload, received in place by zero_buffer(). */
+struct zero_buf {
+    TAILQ_ENTRY(zero_buf) entry;
+    uint32_t len;
+    uint32_t pos;                        /* sent back so far */
+    uint8_t data[];
+};
+
+TAILQ_HEAD(zero_bufs, zero_buf);
+
+/*
+ * The Linux gadget zero: a vendor specific interface in one of two
+ * configurations, to measure what the USB/IP path itself carries.
+ *
+ * Source/sink: bulk IN returns a pattern, bulk OUT swallows (and checks)
+ * it; alternate setting 1 adds an isochronous pair that does the same.
+ * Loopback: what bulk OUT receives comes back on bulk IN, up to qlen
+ * payloads ahead before OUT is held off. Low speed has no bulk, so it uses
+ * interrupt endpoints and no isochronous setting.
+ *
+ * Source data is sent straight from one shared pattern buffer, the sink
+ * receives into one scratch buffer and loopback payloads are received
+ * into buffers that go back out as they are, so no data is copied.
+ * Isochronous URBs complete as they arrive: this is a measure of the
+ * path, not of a bus schedule.
+ */
+struct zero {
+    struct usb_function func;
+    enum zero_pattern pattern;
+    uint16_t mps;                        /* bulk max packet, for MOD63 */
+    uint32_t qlen;
+
+    uint8_t *pat;
+    uint32_t patlen;
+    uint8_t *sink;
+    uint32_t sinklen;
+
+    struct zero_bufs loop;
+    uint32_t queued;
+
+    uint8_t ctrl[ZERO_MAX_CTRL];
+    uint16_t ctrllen;
+
+    struct {
+        uint64_t source;
+        uint64_t sink;
+        uint64_t loop;
+        uint64_t errors;
+    } stats;
+};
+
+static uint8_t
+zero_config(struct zero *z)
+{
+    const struct usb_config_descriptor *c = z->func.dev->active;
+
+    return c ? c->bConfigurationValue : 0;
+}
+
+static uint8_t
+zero_byte(struct zero *z, uint32_t off)
+{
+    return z->pattern == ZERO_MOD63 ? off % z->mps % 63 : 0;
+}
+
+/* Grows the pattern to at least len; false if it would be too large. */
+static bool
+zero_pattern(struct zero *z, uint32_t len)
+{
+    uint32_t size = z->patlen ? z->patlen : 65536;
+    uint8_t *p;
+
+    if (len <= z->patlen)
+        return true;
+    if (len > ZERO_MAX_PATTERN)
+        return false;
+
+    while (size < len)
+        size *= 2;
+
+    p = realloc(z->pat, size);
+    if (!p)
+        return false;
+
+    z->pat = p;
+    for (uint32_t i = z->patlen; i < size; i++)
+        p[i] = zero_byte(z, i);
+
+    z->patlen = size;
+    return true;
+}
+
+/* Writes the pattern at off, computing what the shared copy lacks. */
+static void
+zero_fill(struct zero *z, uint8_t *buf, uint32_t off, uint32_t len)
+{
+    if (zero_pattern(z, off + len)) {
+        memcpy(buf, z->pat + off, len);
+        return;
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+        buf[i] = zero_byte(z, off + i);
+}
+
+static bool
+zero_check(struct zero *z, const uint8_t *buf, uint32_t off, uint32_t len)
+{
+    if (z->pattern == ZERO_NONE)
+        return true;
+    if (zero_pattern(z, off + len))
+        return memcmp(buf, z->pat + off, len) == 0;
+
+    for (uint32_t i = 0; i < len; i++)
+        if (buf[i] != zero_byte(z, off + i))
+            return false;
+    return true;
+}
+
+static void
+zero_free(struct zero *z)
+{
+    struct zero_buf *b;
+
+    while ((b = TAILQ_FIRST(&z->loop))) {
+        TAILQ_REMOVE(&z->loop, b, entry);
+        free(b);
+    }
+
+    z->queued = 0;
+}
+
+/* Fills the URB from the pattern, packet by packet when isochronous. */
+static void
+zero_source(struct zero *z, struct urb *urb)
+{
+    if (urb->packets > 0) {
+        for (uint32_t i = 0; i < urb->packets; i++) {
+            struct usbip_iso_packet_descriptor *p = &urb->iso[i];
+
+            zero_fill(z, urb->buf + p->offset, p->offset, p->length);
+            p->actual_length = p->length;
+        }
+    } else if (urb->buf != z->pat) {
+        zero_fill(z, urb->buf, 0, urb->length);
+    }
+
+    urb->actual = urb->length;
+    z->stats.source += urb->length;
+}
+
+static int
+zero_sink(struct zero *z, struct urb *urb)
+{
+    bool ok = true;
+
+    if (urb->packets > 0) {
+        for (uint32_t i = 0; i < urb->packets; i++) {
+            struct usbip_iso_packet_descriptor *p = &urb->iso[i];
+
+            if (!zero_check(z, urb->buf + p->offset, p->offset, p->length)) {
+                p->status = -EILSEQ;
+                ok = false;
+            }
+            p->actual_length = p->length;
+        }
+    } else {
+        ok = zero_check(z, urb->buf, 0, urb->length);
+    }
+
+    urb->actual = urb->length;
+    z->stats.sink += urb->length;
+    if (!ok)
+        z->stats.errors++;
+
+    return ok ? 0 : EILSEQ;
+}
+
+/* Pairs loopback payloads with the IN URBs waiting for them. */
+static void
+zero_loop(struct zero *z)
+{
+    struct usb_ep *in = usb_function_ep(&z->func, USBIP_DIR_IN, ZERO_EP_BULK);
+    struct usb_ep *out = usb_function_ep(&z->func, USBIP_DIR_OUT, ZERO_EP_BULK);
+    struct zero_buf *b;
+    struct urb *urb;
+
+    while ((b = TAILQ_FIRST(&z->loop)) && (urb = usb_ep_dequeue(in))) {
+        uint32_t n = b->len - b->pos < urb->length ? b->len - b->pos : urb->length;
+
+        urb->iov[urb->iovcnt++] = (struct iovec) { b->data + b->pos, n };
+        urb->actual = n;
+        b->pos += n;
+        z->stats.loop += n;
+        usb_urb_done(urb, 0);
+
+        if (b->pos < b->len)
+            continue;
+
+        TAILQ_REMOVE(&z->loop, b, entry);
+        free(b);
+
+        /* Room for one more: let the oldest held payload through. */
+        if (z->queued-- > z->qlen && (urb = usb_ep_dequeue(out))) {
+            urb->actual = urb->length;
+            usb_urb_done(urb, 0);
+        }
+    }
+}
+
+/* One scratch buffer for data nobody keeps. */
+static void *
+zero_scratch(struct zero *z, uint32_t len)
+{
+    uint8_t *p;
+
+    if (len > z->sinklen) {
+        p = realloc(z->sink, len);
+        if (!p)
+            return NULL;
+        z->sink = p;
+        z->sinklen = len;
+    }
+
+    return z->sink;
+}
+
+static void *
+zero_buffer(struct usb_function *f, struct usb_ep *ep, uint32_t len)
+{
+    struct zero *z = (struct zero *) f;
+    bool in = ep->desc->bEndpointAddress & USB_ENDPOINT_DIR_IN;
+    struct zero_buf *b;
+
+    if (len == 0)
+        return NULL;
+
+    if (zero_config(z) == ZERO_CONFIG_LOOPBACK) {
+        /* IN goes out from the loop buffers, its own is never used. */
+        if (in)
+            return zero_scratch(z, len);
+
+        b = malloc(sizeof(*b) + len);
+        if (!b)
+            return NULL;
+
+        b->len = len;
+        b->pos = 0;
+        return b->data;
+    }
+
+    /* Bulk IN goes out straight from the pattern. */
+    if (in) {
+        if ((ep->desc->bmAttributes & 3) == USB_ENDPOINT_XFER_ISOC)
+            return NULL;
+        return zero_pattern(z, len) ? z->pat : NULL;
+    }
+
+    return zero_scratch(z, len);
+}
+
+static void
+zero_submit(struct usb_function *f, struct urb *urb)
+{
+    struct zero *z = (struct zero *) f;
+    struct zero_buf *b;
+
+    if (zero_config(z) != ZERO_CONFIG_LOOPBACK) {
+        if (urb->dir == USBIP_DIR_IN) {
+            zero_source(z, urb);
+            usb_urb_done(urb, 0);
+        } else {
+            usb_urb_done(urb, zero_sink(z, urb));
+        }
+        return;
+    }
+
+    usb_ep_queue(urb);
+
+    if (urb->dir == USBIP_DIR_OUT) {
+        /* Not received in place: there was no memory for it. */
+        if (urb->length > 0 && urb->buf == urb->data) {
+            usb_urb_done(urb, ENOMEM);
+            return;
+        }
+
+        if (urb->length > 0) {
+            b = container_of((void *) urb->buf, struct zero_buf, data);
+            TAILQ_INSERT_TAIL(&z->loop, b, entry);
+        }
+
+        if (urb->length == 0 || ++z->queued <= z->qlen) {
+            urb->actual = urb->length;
+            usb_urb_done(urb, 0);
+        }
+    }
+
+    zero_loop(z);
+}
+
+static int
+zero_setup(struct usb_function *f, struct urb *urb)
+{
+    struct zero *z = (struct zero *) f;
+    const struct usbip_submit_setup *s = &urb->setup;
+
+    if (SETUP_TYP(s->bmRequestType) != USB_TYPE_VENDOR ||
+        SETUP_RCP(s->bmRequestType) != USB_RECIP_DEVICE)
+        return EPIPE;
+
+    switch (s->bRequest) {
+    case ZERO_REQ_WRITE:
+        if (urb->dir != USBIP_DIR_OUT || urb->length > sizeof(z->ctrl))
+            return EPIPE;
+        memcpy(z->ctrl, urb->buf, urb->length);
+        z->ctrllen = urb->length;
+        urb->actual = urb->length;
+        return 0;
+
+    case ZERO_REQ_READ:
+        if (urb->dir != USBIP_DIR_IN)
+            return EPIPE;
+        urb->actual = urb->length < z->ctrllen ? urb->length : z->ctrllen;
+        memcpy(urb->buf, z->ctrl, urb->actual);
+        return 0;
+
+    default:
+        return EPIPE;
+    }
+}
+
+static void
+zero_disable(struct usb_function *f)
+{
+    zero_free((struct zero *) f);
+}
+
+static void
+zero_destroy(struct usb_function *f)
+{
+    struct zero *z = (struct zero *) f;
+
+    if (z->stats.source || z->stats.sink || z->stats.loop)
+        fprintf(stderr, "zero: %llu bytes sourced, %llu sunk (%llu bad), "
+                "%llu looped back\n", (unsigned long long) z->stats.source,
+                (unsigned long long) z->stats.sink,
+                (unsigned long long) z->stats.errors,
+                (unsigned long long) z->stats.loop);
+
+    zero_free(z);
+    free(z->pat);
+    free(z->sink);
+    free(z);
+}
+
+static const struct usb_function_ops zero_ops = {
+    .setup = zero_setup,
+    .submit = zero_submit,
+    .buffer = zero_buffer,
+    .disable = zero_disable,
+    .destroy = zero_destroy,
+};
+
+static void
+zero_put(uint8_t *buf, size_t *len, const void *desc, size_t n)
+{
+    memcpy(buf + *len, desc, n);
+    *len += n;
+}
+
+/* An endpoint and, at SuperSpeed, its companion. */
+static void
+zero_ep(struct usb_device *dev, uint8_t *buf, size_t *len, uint8_t addr,
+        uint8_t type)
+{
+    bool ss = dev->speed >= USB_SPEED_SUPER;
+    bool hs = dev->speed == USB_SPEED_HIGH || dev->speed == USB_SPEED_WIRELESS;
+    struct usb_endpoint_descriptor ep = {
+        .bLength = sizeof(ep),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = addr,
+        .bmAttributes = type,
+    };
+    struct usb_ss_ep_comp_descriptor comp = {
+        .bLength = sizeof(comp),
+        .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+        .bMaxBurst = USB_SS_MAX_BURST - 1,
+    };
+
+    switch (type) {
+    case USB_ENDPOINT_XFER_INT:          /* low speed */
+        ep.wMaxPacketSize = htole16(8);
+        ep.bInterval = 10;
+        break;
+
+    case USB_ENDPOINT_XFER_BULK:
+        ep.wMaxPacketSize = htole16(ss ? 1024 : hs ? 512 : 64);
+        break;
+
+    case USB_ENDPOINT_XFER_ISOC:
+        ep.wMaxPacketSize = htole16(ss ? 1024 : hs ? 1024 | 2 << 11 : 1023);
+        ep.bInterval = 1;
+        comp.wBytesPerInterval = htole16(1024 * 16);
+        break;
+    }
+
+    zero_put(buf, len, &ep, sizeof(ep));
+    if (ss)
+        zero_put(buf, len, &comp, sizeof(comp));
+}
+
+static int
+zero_configuration(struct usb_device *dev, uint8_t value)
+{
+    bool low = dev->speed == USB_SPEED_LOW;
+    uint8_t xfer = low ? USB_ENDPOINT_XFER_INT : USB_ENDPOINT_XFER_BULK;
+    uint8_t buf[256];
+    size_t len = 0;
+    struct usb_config_descriptor config = {
+        .bLength = sizeof(config),
+        .bDescriptorType = USB_DT_CONFIG,
+        .bNumInterfaces = 1,
+        .bConfigurationValue = value,
+        .iConfiguration = 3 + value,
+        .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+        .bMaxPower = 1,
+    };
+    struct usb_interface_descriptor intf = {
+        .bLength = sizeof(intf),
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+    };
+
+    zero_put(buf, &len, &config, sizeof(config));
+    zero_put(buf, &len, &intf, sizeof(intf));
+    zero_ep(dev, buf, &len, USB_ENDPOINT_DIR_IN | ZERO_EP_BULK, xfer);
+    zero_ep(dev, buf, &len, ZERO_EP_BULK, xfer);
+
+    if (value == ZERO_CONFIG_SOURCESINK && !low) {
+        intf.bAlternateSetting = 1;
+        intf.bNumEndpoints = 4;
+        zero_put(buf, &len, &intf, sizeof(intf));
+        zero_ep(dev, buf, &len, USB_ENDPOINT_DIR_IN | ZERO_EP_BULK, xfer);
+        zero_ep(dev, buf, &len, ZERO_EP_BULK, xfer);
+        zero_ep(dev, buf, &len, USB_ENDPOINT_DIR_IN | ZERO_EP_ISO,
+                USB_ENDPOINT_XFER_ISOC);
+        zero_ep(dev, buf, &len, ZERO_EP_ISO, USB_ENDPOINT_XFER_ISOC);
+    }
+
+    ((struct usb_config_descriptor *) buf)->wTotalLength = htole16(len);
+    return usb_device_desc(dev, USB_DT_CONFIG, value - 1, buf, len);
+}
+
+static int
+zero_descriptors(struct usb_device *dev, const char *serial)
+{
+    bool ss = dev->speed >= USB_SPEED_SUPER;
+    struct usb_device_descriptor dd = {
+        .bLength = sizeof(dd),
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(ss ? 0x0300 : 0x0200),
+        .bDeviceClass = USB_CLASS_VENDOR_SPEC,
+        .bMaxPacketSize0 = ss ? 9 : dev->speed == USB_SPEED_LOW ? 8 : 64,
+        .idVendor = htole16(USBEMU_VID),
+        .idProduct = htole16(0x000d),
+        .bcdDevice = htole16(0x0100),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = serial ? 3 : 0,
+        .bNumConfigurations = 2,
+    };
+    int r;
+
+    r = usb_device_desc(dev, USB_DT_DEVICE, 0, &dd, sizeof(dd));
+    if (r == 0)
+        r = zero_configuration(dev, ZERO_CONFIG_SOURCESINK);
+    if (r == 0)
+        r = zero_configuration(dev, ZERO_CONFIG_LOOPBACK);
+    if (r == 0)
+        r = usb_device_string(dev, 1, "usbemu");
+    if (r == 0)
+        r = usb_device_string(dev, 2, "usbemu Gadget Zero");
+    if (r == 0 && serial)
+        r = usb_device_string(dev, 3, serial);
+    if (r == 0)
+        r = usb_device_string(dev, 3 + ZERO_CONFIG_SOURCESINK, "source/sink");
+    if (r == 0)
+        r = usb_device_string(dev, 3 + ZERO_CONFIG_LOOPBACK, "loopback");
+
+    return r;
+}
+
+static int
+zero_create(struct usb_device *dev, char *opts)
+{
+    enum { PATTERN, QLEN, SPEED, SERIAL };
+    char *const tokens[] = {
+        [PATTERN] = "pattern", [QLEN] = "qlen", [SPEED] = "speed",
+        [SERIAL] = "serial", NULL
+    };
+    const char *serial = NULL;
+    unsigned long pattern = ZERO_ZEROS, qlen = 32;
+    struct zero *z;
+    char *value;
+
+    dev->speed = USB_SPEED_HIGH;
+
+    while (*opts) {
+        switch (getsubopt(&opts, tokens, &value)) {
+        case SERIAL: serial = value; break;
+
+        case PATTERN:
+            if (!value || (pattern = strtoul(value, NULL, 0)) > ZERO_NONE)
+                return EINVAL;
+            break;
+
+        case QLEN:
+            if (!value || (qlen = strtoul(value, NULL, 0)) == 0)
+                return EINVAL;
+            break;
+
+        case SPEED:
+            if (!value || usb_speed_parse(value, &dev->speed) != 0)
+                return EINVAL;
+            break;
+
+        default:
+            return EINVAL;
+        }
+    }
+
+    z = calloc(1, sizeof(*z));
+    if (!z)
+        return ENOMEM;
+
+    z->pattern = pattern;
+    z->qlen = qlen;
+    z->mps = dev->speed >= USB_SPEED_SUPER ? 1024
+           : dev->speed >= USB_SPEED_HIGH ? 512
+           : dev->speed == USB_SPEED_LOW ? 8 : 64;
+    TAILQ_INIT(&z->loop);
+    usb_device_function(dev, &z->func, &zero_ops);
+
+    return zero_descriptors(dev, serial);
+}
+
+const struct usb_model usb_model_zero = {
+    .name = "zero",
+    .create = zero_create,
+};
@@ -0,0 +1,659 @@
+#include "blk.h"
+#include "work.h"
+
+#include <sys/queue.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zstd.h>
+
+#define ZIMG_MAGIC "usbemzst"
+#define ZIMG_VERSION 1
+#define ZIMG_CHUNK (64 * 1024)           /* when packing */
+#define ZIMG_LEVEL 9
+#define ZIMG_CACHE (64 * 1024 * 1024)    /* decompressed bytes, all images */
+#define ZIMG_BUCKETS 4096
+
+/*
+ * The start of a compressed image, little endian. index is the offset of
+ * chunks + 1 offsets, chunk i being the zstd frame between entries i and
+ * i + 1; an empty one is all zeros.
+ */
+struct zimg_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t size;
+    uint64_t index;
+} __attribute__((packed));
+
+struct zimg;
+struct zimg_job;
+
+/* A decompressed chunk, on the LRU once it is ready. */
+struct zimg_chunk {
+    LIST_ENTRY(zimg_chunk) hash;
+    TAILQ_ENTRY(zimg_chunk) lru;
+    struct zimg *z;
+    uint64_t index;
+    struct zimg_job *job;                /* while it is being filled */
+    int err;
+    uint8_t data[];
+};
+
+/* Chunks missing for a read, decompressed in parallel, one per task. */
+struct zimg_job {
+    struct work work;
+    LIST_ENTRY(zimg_job) entry;
+    struct zimg *z;                      /* NULL once it has been handled */
+    struct zimg_chunk *chunks[];
+};
+
+/*
+ * A read waiting for chunks, with a bit set for each, from first on, that
+ * it counted in io->moved. Chunks it copied from the cache are left clear:
+ * evicted and fetched again, they are not its to count down.
+ */
+struct zimg_wait {
+    struct zimg_wait *next;
+    struct blk_io *io;
+    uint64_t first;
+    uint8_t pending[];
+};
+
+/*
+ * A read-only image stored as fixed-size chunks compressed with zstd.
+ * Decompressed chunks are kept in a cache shared by every image, up to
+ * ZIMG_CACHE bytes, and evicted least recently used first. Reads copy
+ * what the cache has; the chunks it lacks are decompressed on the worker
+ * threads, and the read completes on the loop thread with the last of
+ * them, counting them down in io->moved.
+ */
+struct zimg {
+    struct blk blk;
+    int fd;
+    uint32_t chunk_size;
+    uint64_t chunks;
+    uint64_t *index;
+    struct zimg_wait *waiting;
+    LIST_HEAD(, zimg_job) jobs;
+};
+
+static LIST_HEAD(, zimg_chunk) zimg_hash[ZIMG_BUCKETS];
+static TAILQ_HEAD(, zimg_chunk) zimg_lru = TAILQ_HEAD_INITIALIZER(zimg_lru);
+static size_t zimg_cached;
+
+static _Thread_local ZSTD_DCtx *zimg_dctx;
+
+static size_t
+zimg_bucket(const struct zimg *z, uint64_t index)
+{
+    return ((uintptr_t) z / 64 + index * 0x9e3779b97f4a7c15ull) % ZIMG_BUCKETS;
+}
+
+static uint64_t
+zimg_chunk_len(const struct zimg *z, uint64_t index)
+{
+    uint64_t start = index * z->chunk_size;
+
+    return z->blk.size - start < z->chunk_size ? z->blk.size - start : z->chunk_size;
+}
+
+static bool
+zimg_zero(const struct zimg *z, uint64_t index)
+{
+    return z->index[index + 1] == z->index[index];
+}
+
+static struct zimg_chunk *
+zimg_lookup(const struct zimg *z, uint64_t index)
+{
+    struct zimg_chunk *c;
+
+    LIST_FOREACH(c, &zimg_hash[zimg_bucket(z, index)], hash) {
+        if (c->z == z && c->index == index)
+            return c;
+    }
+
+    return NULL;
+}
+
+static void
+zimg_drop(struct zimg_chunk *c)
+{
+    LIST_REMOVE(c, hash);
+    if (!c->job && c->err == 0)
+        TAILQ_REMOVE(&zimg_lru, c, lru);
+    zimg_cached -= c->z->chunk_size;
+    free(c);
+}
+
+static void
+zimg_evict(void)
+{
+    struct zimg_chunk *c;
+
+    while (zimg_cached > ZIMG_CACHE && (c = TAILQ_FIRST(&zimg_lru)))
+        zimg_drop(c);
+}
+
+static int
+zimg_read_all(int fd, void *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? errno : EIO;
+
+        buf = (uint8_t *) buf + n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Decompresses chunk index into dst, chunk_size bytes; any thread. */
+static int
+zimg_inflate(const struct zimg *z, uint64_t index, uint8_t *dst)
+{
+    uint64_t off = z->index[index];
+    size_t len = z->index[index + 1] - off;
+    uint8_t *src;
+    size_t n;
+    int e;
+
+    if (!zimg_dctx)
+        zimg_dctx = ZSTD_createDCtx();
+    if (!zimg_dctx)
+        return ENOMEM;
+
+    src = malloc(len);
+    if (!src)
+        return ENOMEM;
+
+    e = zimg_read_all(z->fd, src, len, off);
+    if (e == 0) {
+        n = ZSTD_decompressDCtx(zimg_dctx, dst, z->chunk_size, src, len);
+        if (ZSTD_isError(n) || n != zimg_chunk_len(z, index))
+            e = EIO;
+    }
+
+    free(src);
+    return e;
+}
+
+/* Copies what io wants of chunk index, whose bytes are data or zeros. */
+static void
+zimg_copy(const struct zimg *z, uint64_t index, const uint8_t *data,
+          struct blk_io *io)
+{
+    uint64_t start = index * z->chunk_size;
+    uint64_t end = start + zimg_chunk_len(z, index);
+    uint64_t from = io->off > start ? io->off : start;
+    uint64_t to = io->off + io->len < end ? io->off + io->len : end;
+    uint8_t *dst = (uint8_t *) io->buf + (from - io->off);
+
+    if (data)
+        memcpy(dst, data + (from - start), to - from);
+    else
+        memset(dst, 0, to - from);
+}
+
+/* Hands a finished chunk to the reads waiting on it. */
+static void
+zimg_ready(struct zimg *z, struct zimg_chunk *c)
+{
+    uint64_t start = c->index * z->chunk_size;
+    uint64_t end = start + zimg_chunk_len(z, c->index);
+    struct zimg_wait *w, *next, *keep = NULL, *done = NULL;
+    struct blk_io *io;
+    uint64_t bit;
+
+    c->job = NULL;
+    if (c->err == 0)
+        TAILQ_INSERT_TAIL(&zimg_lru, c, lru);
+
+    /* done() may submit more reads, so the list is off limits meanwhile. */
+    for (w = z->waiting; w; w = next) {
+        next = w->next;
+        io = w->io;
+        bit = c->index - w->first;
+        if (io->off < end && start < io->off + io->len &&
+            (w->pending[bit / 8] & 1 << bit % 8)) {
+            w->pending[bit / 8] &= ~(1 << bit % 8);
+            if (c->err == 0)
+                zimg_copy(z, c->index, c->data, io);
+            if (c->err != 0 || --io->moved == 0) {
+                w->next = done;
+                done = w;
+                continue;
+            }
+        }
+        w->next = keep;
+        keep = w;
+    }
+    z->waiting = keep;
+
+    for (w = done; w; w = next) {
+        next = w->next;
+        w->io->done(w->io, c->err);
+        free(w);
+    }
+
+    if (c->err != 0)
+        zimg_drop(c);
+}
+
+static void
+zimg_task(struct work *w, unsigned int i)
+{
+    struct zimg_job *j = (struct zimg_job *) w;
+    struct zimg_chunk *c = j->chunks[i];
+
+    c->err = zimg_inflate(j->z, c->index, c->data);
+}
+
+static void
+zimg_job_end(struct zimg_job *j)
+{
+    struct zimg *z = j->z;
+
+    LIST_REMOVE(j, entry);
+    j->z = NULL;
+    for (unsigned int i = 0; i < j->work.tasks; i++)
+        zimg_ready(z, j->chunks[i]);
+    zimg_evict();
+}
+
+static void
+zimg_job_done(struct work *w)
+{
+    struct zimg_job *j = (struct zimg_job *) w;
+
+    /* Closing the image may have seen to it already. */
+    if (j->z)
+        zimg_job_end(j);
+    free(j);
+}
+
+/*
+ * Starts decompressing the chunks of [off, off + len) that are neither
+ * cached nor on their way, as one job. Chunks left out for want of memory
+ * are the reader's to decompress.
+ */
+static void
+zimg_fetch(struct zimg *z, uint64_t off, uint64_t len)
+{
+    uint64_t first = off / z->chunk_size;
+    uint64_t last = (off + len - 1) / z->chunk_size;
+    struct zimg_chunk *c;
+    struct zimg_job *j;
+
+    j = calloc(1, sizeof(*j) + (last - first + 1) * sizeof(j->chunks[0]));
+    if (!j)
+        return;
+
+    for (uint64_t i = first; i <= last; i++) {
+        if (zimg_zero(z, i) || zimg_lookup(z, i))
+            continue;
+
+        c = malloc(sizeof(*c) + z->chunk_size);
+        if (!c)
+            break;
+
+        c->z = z;
+        c->index = i;
+        c->job = j;
+        c->err = 0;
+        LIST_INSERT_HEAD(&zimg_hash[zimg_bucket(z, i)], c, hash);
+        zimg_cached += z->chunk_size;
+        j->chunks[j->work.tasks++] = c;
+    }
+
+    if (j->work.tasks == 0) {
+        free(j);
+        return;
+    }
+
+    j->work.func = zimg_task;
+    j->work.done = zimg_job_done;
+    j->z = z;
+    LIST_INSERT_HEAD(&z->jobs, j, entry);
+
+    /* Without worker threads it is done right here. */
+    if (work_queue(&j->work) != 0) {
+        for (unsigned int i = 0; i < j->work.tasks; i++)
+            zimg_task(&j->work, i);
+        zimg_job_end(j);
+        free(j);
+    }
+}
+
+/* Copies chunk index into io, or marks it in w if it is on its way. */
+static int
+zimg_serve(struct zimg *z, uint64_t index, struct blk_io *io,
+           struct zimg_wait *w)
+{
+    struct zimg_chunk *c;
+    uint8_t *buf;
+    int e;
+
+    if (zimg_zero(z, index)) {
+        zimg_copy(z, index, NULL, io);
+        return 0;
+    }
+
+    c = zimg_lookup(z, index);
+    if (c && c->job && w) {
+        w->pending[(index - w->first) / 8] |= 1 << (index - w->first) % 8;
+        io->moved++;
+        return 0;
+    }
+
+    if (c && !c->job) {
+        TAILQ_REMOVE(&zimg_lru, c, lru);
+        TAILQ_INSERT_TAIL(&zimg_lru, c, lru);
+        zimg_copy(z, index, c->data, io);
+        return 0;
+    }
+
+    buf = malloc(z->chunk_size);
+    if (!buf)
+        return ENOMEM;
+
+    e = zimg_inflate(z, index, buf);
+    if (e == 0)
+        zimg_copy(z, index, buf, io);
+    free(buf);
+    return e;
+}
+
+static int
+zimg_submit(struct blk *b, struct blk_io *io)
+{
+    struct zimg *z = (struct zimg *) b;
+    uint64_t first, last;
+    struct zimg_wait *w;
+    int e = 0;
+
+    if (io->op != BLK_READ || io->len == 0)
+        return 0;
+
+    first = io->off / z->chunk_size;
+    last = (io->off + io->len - 1) / z->chunk_size;
+
+    w = calloc(1, sizeof(*w) + (last - first) / 8 + 1);
+    if (!w)
+        return ENOMEM;
+
+    w->io = io;
+    w->first = first;
+    io->moved = 0;
+
+    zimg_fetch(z, io->off, io->len);
+
+    for (uint64_t i = first; i <= last && e == 0; i++)
+        e = zimg_serve(z, i, io, w);
+
+    /* A failed read is no longer waited for, whatever it counted. */
+    if (e != 0 || io->moved == 0) {
+        free(w);
+        return e;
+    }
+
+    w->next = z->waiting;
+    z->waiting = w;
+    return EINPROGRESS;
+}
+
+static int
+zimg_read(struct blk *b, void *buf, uint64_t off, size_t len)
+{
+    struct zimg *z = (struct zimg *) b;
+    struct blk_io io = { .op = BLK_READ, .buf = buf, .off = off, .len = len };
+    int e;
+
+    for (uint64_t i = off / z->chunk_size; len > 0 && i <= (off + len - 1) / z->chunk_size; i++) {
+        e = zimg_serve(z, i, &io, NULL);
+        if (e != 0)
+            return e;
+    }
+
+    return 0;
+}
+
+static int
+zimg_write(struct blk *b, const void *buf, uint64_t off, size_t len)
+{
+    (void) b;
+    (void) buf;
+    (void) off;
+    (void) len;
+
+    return EROFS;
+}
+
+static void
+zimg_readahead(struct blk *b, uint64_t off, size_t len)
+{
+    struct zimg *z = (struct zimg *) b;
+
+    if (off < b->size && len > 0)
+        zimg_fetch(z, off, len < b->size - off ? len : b->size - off);
+}
+
+/* Jobs in flight are waited for and seen to here, not on the loop. */
+static void
+zimg_close(struct blk *b)
+{
+    struct zimg *z = (struct zimg *) b;
+    struct zimg_chunk *c, *next;
+    struct zimg_job *j;
+
+    while ((j = LIST_FIRST(&z->jobs))) {
+        work_wait(&j->work);
+        zimg_job_end(j);
+    }
+
+    for (size_t i = 0; i < ZIMG_BUCKETS; i++) {
+        for (c = LIST_FIRST(&zimg_hash[i]); c; c = next) {
+            next = LIST_NEXT(c, hash);
+            if (c->z == z)
+                zimg_drop(c);
+        }
+    }
+
+    close(z->fd);
+    free(z->index);
+    free(z);
+}
+
+static const struct blk_ops zimg_ops = {
+    .read = zimg_read,
+    .write = zimg_write,
+    .submit = zimg_submit,
+    .readahead = zimg_readahead,
+    .close = zimg_close,
+};
+
+bool
+blk_zimg_probe(int fd)
+{
+    char magic[8];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, ZIMG_MAGIC, sizeof(magic)) == 0;
+}
+
+int
+blk_zimg_open(int fd, uint64_t file, struct blk **blk)
+{
+    struct zimg_header h;
+    struct zimg *z;
+    uint64_t chunks, bytes;
+
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, ZIMG_MAGIC, sizeof(h.magic)) != 0 ||
+        le32toh(h.version) != ZIMG_VERSION)
+        return EINVAL;
+
+    if (le32toh(h.chunk_size) < 512 || le32toh(h.chunk_size) > 16 * 1024 * 1024 ||
+        le64toh(h.size) == 0)
+        return EINVAL;
+
+    chunks = (le64toh(h.size) + le32toh(h.chunk_size) - 1) / le32toh(h.chunk_size);
+    bytes = (chunks + 1) * sizeof(uint64_t);
+    if (le64toh(h.index) > file || bytes > file - le64toh(h.index))
+        return EINVAL;
+
+    z = calloc(1, sizeof(*z));
+    if (!z)
+        return ENOMEM;
+
+    z->index = malloc(bytes);
+    if (!z->index) {
+        free(z);
+        return ENOMEM;
+    }
+
+    if (pread(fd, z->index, bytes, le64toh(h.index)) != (ssize_t) bytes) {
+        free(z->index);
+        free(z);
+        return EIO;
+    }
+
+    for (uint64_t i = 0; i <= chunks; i++) {
+        z->index[i] = le64toh(z->index[i]);
+        if (z->index[i] > file || (i > 0 && z->index[i] < z->index[i - 1])) {
+            free(z->index);
+            free(z);
+            return EINVAL;
+        }
+    }
+
+    z->fd = fd;
+    z->chunk_size = le32toh(h.chunk_size);
+    z->chunks = chunks;
+    LIST_INIT(&z->jobs);
+    z->blk.ops = &zimg_ops;
+    z->blk.size = le64toh(h.size);
+    z->blk.readonly = true;
+    *blk = &z->blk;
+    return 0;
+}
+
+static int
+zimg_write_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? errno : EIO;
+
+        buf = (const uint8_t *) buf + n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Chunks of zeros are left empty; the rest are one zstd frame each. */
+static int
+zimg_pack_fd(int in, int out, uint64_t size)
+{
+    uint64_t chunks = (size + ZIMG_CHUNK - 1) / ZIMG_CHUNK;
+    size_t cap = ZSTD_compressBound(ZIMG_CHUNK);
+    struct zimg_header h = {
+        .magic = ZIMG_MAGIC,
+        .version = htole32(ZIMG_VERSION),
+        .chunk_size = htole32(ZIMG_CHUNK),
+        .size = htole64(size),
+        .index = htole64(sizeof(h)),
+    };
+    uint64_t *index = calloc(chunks + 1, sizeof(*index));
+    uint8_t *raw = malloc(ZIMG_CHUNK);
+    uint8_t *dst = malloc(cap);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    uint64_t pos = sizeof(h) + (chunks + 1) * sizeof(*index);
+    int e = 0;
+
+    if (!index || !raw || !dst || !cctx)
+        e = ENOMEM;
+
+    for (uint64_t i = 0; e == 0 && i < chunks; i++) {
+        size_t len = size - i * ZIMG_CHUNK < ZIMG_CHUNK ? size - i * ZIMG_CHUNK : ZIMG_CHUNK;
+        size_t n;
+
+        index[i] = htole64(pos);
+
+        e = zimg_read_all(in, raw, len, i * ZIMG_CHUNK);
+        if (e != 0)
+            break;
+
+        if (raw[0] == 0 && memcmp(raw, raw + 1, len - 1) == 0)
+            continue;
+
+        n = ZSTD_compressCCtx(cctx, dst, cap, raw, len, ZIMG_LEVEL);
+        if (ZSTD_isError(n)) {
+            e = EIO;
+            break;
+        }
+
+        e = zimg_write_all(out, dst, n, pos);
+        pos += n;
+    }
+
+    if (e == 0) {
+        index[chunks] = htole64(pos);
+        e = zimg_write_all(out, index, (chunks + 1) * sizeof(*index), sizeof(h));
+    }
+    if (e == 0)
+        e = zimg_write_all(out, &h, sizeof(h), 0);
+
+    ZSTD_freeCCtx(cctx);
+    free(dst);
+    free(raw);
+    free(index);
+    return e;
+}
+
+int
+blk_zimg_pack(const char *raw, const char *path)
+{
+    uint64_t size;
+    int in, out;
+    int e;
+
+    in = open(raw, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return errno;
+
+    e = blk_size(in, &size);
+    if (e == 0 && size == 0)
+        e = EINVAL;
+
+    out = e == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (e == 0 && out < 0)
+        e = errno;
+
+    if (e == 0)
+        e = zimg_pack_fd(in, out, size);
+
+    if (out >= 0 && close(out) != 0 && e == 0)
+        e = errno;
+    close(in);
+    return e;
+}